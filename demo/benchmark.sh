@@ -0,0 +1,324 @@
+#!/bin/bash
+
+# Benchmark cases for "sv-mbirct" on the demo data set.
+# Each case runs mbir_ct at verbose level 2 and prints the relevant
+# timing/memory lines from the output.
+#
+# Usage: ./benchmark.sh [case ...]     (no arguments runs all cases)
+#
+# Cases:
+#   matrixfree : stored system matrix vs. matrix-free (-M) reconstruction
+#   symmetry   : full vs. symmetry-compact (-S) matrix build, size and recon at
+#                8 and 16 bits, and a check that the two reconstructions are bit-identical
+#   bits       : 4/8/16-bit (-q) matrix size, recon time and error vs. 16 bits,
+#                and a check that each reconstruction is finite
+#   vieworder  : interleaved view angles with and without view sorting (-o)
+#   piecelength: pieceLength selection (-L auto/trial), and a prime view count
+#                with a ragged last piece vs. the old single-view pieces
+#   projector  : forward (-f) and back (-b) projection time, 1 and 8 slices,
+#                1 slice with 1 thread vs. all cores
+#   batch      : 4 sinograms as one batch (-B) vs. 4 separate runs
+#   daemon     : 4 jobs submitted to a daemon (-daemon/-client) vs. 4 separate runs
+#   sweep      : 4 SigmaX values as a warm-started sweep (-X) vs. 4 separate runs
+#   volume     : 64-slice back projection with per-slice files vs. volume files (-V),
+#                and -convert time
+#   freeze     : reconstruction with and without freezing of converged SVs (-F),
+#                time to StopThreshold and visits skipped
+#   multires   : single-level vs. coarse-to-fine (-G 1, -G 2) reconstruction,
+#                time and equivalent iterations per level
+
+cd "$(dirname $0)"
+
+execdir="../bin"
+dataDir="."
+dataName="shepp"
+
+parName="$dataDir/$dataName/par/$dataName"
+sinoName="$dataDir/$dataName/sino/$dataName"
+outDir="./benchmark_out"
+matDir="./sysmatrix"
+
+[[ ! -d "$outDir" ]] && mkdir "$outDir"
+[[ ! -d "$matDir" ]] && mkdir "$matDir"
+
+HASH="$(./genMatrixHash.sh $parName)"
+matName="$matDir/$HASH"
+
+# run a labelled mbir_ct call and print the summary lines
+run()
+{
+    local label="$1"
+    shift
+    echo "--- $label"
+    $execdir/mbir_ct "$@" -v 2 | grep -E "system matrix memory|[Pp]rojection time|Reconstruction time|Equivalent iterations|SV freezing|Done\. Total|Peak memory"
+}
+
+# relative RMS difference between two single-slice float files
+rmse()
+{
+    paste <(od -An -v -f -w4 "$1") <(od -An -v -f -w4 "$2") | \
+        awk '{d=$1-$2; e+=d*d; v+=$2*$2} END {printf "    relative RMSE = %.3g\n", sqrt(e/v)}'
+}
+
+# count of non-finite values in a single-slice float file
+nonfinite()
+{
+    local n=$(od -An -v -f -w4 "$1" | grep -ciE "nan|inf")
+    if [[ $n -ne 0 ]]; then
+        echo "    $n non-finite values in $1"
+    fi
+}
+
+need_matrix()
+{
+    if [[ ! -f "$matName.2Dsvmatrix" ]]; then
+        $execdir/mbir_ct -i $parName -j $parName -m $matName -v 0
+    fi
+}
+
+case_matrixfree()
+{
+    echo "=== matrixfree: stored vs. on-the-fly system matrix"
+    need_matrix
+    run "stored matrix" -i $parName -j $parName -k $parName -s $sinoName -r $outDir/stored -m $matName
+    run "matrix-free" -i $parName -j $parName -k $parName -s $sinoName -r $outDir/mfree -M
+}
+
+case_symmetry()
+{
+    echo "=== symmetry: full vs. symmetry-compact system matrix"
+    local b
+    for b in 8 16; do
+        echo "--- build full matrix, $b bits"
+        $execdir/mbir_ct -i $parName -j $parName -m $outDir/full$b -q $b -v 2 | grep -E "matrix time|memory"
+        echo "--- build symmetry-compact matrix, $b bits"
+        $execdir/mbir_ct -i $parName -j $parName -m $outDir/sym$b -q $b -S -v 2 | grep -E "symmetries|matrix time|memory"
+        ls -l $outDir/full$b.2Dsvmatrix $outDir/sym$b.2Dsvmatrix | awk '{print "    " $5 " bytes  " $NF}'
+        # one thread: with several, the atomic sinogram updates make any two runs differ
+        OMP_NUM_THREADS=1 run "full matrix, $b bits, 1 thread" -i $parName -j $parName -k $parName -s $sinoName -r $outDir/full$b -m $outDir/full$b
+        OMP_NUM_THREADS=1 run "symmetry-compact, $b bits, 1 thread" -i $parName -j $parName -k $parName -s $sinoName -r $outDir/sym$b -m $outDir/sym$b
+        nonfinite $outDir/full${b}_slice0001.2Dimgdata
+        echo "--- symmetry-compact vs. full matrix, $b bits"
+        if cmp -s $outDir/sym${b}_slice0001.2Dimgdata $outDir/full${b}_slice0001.2Dimgdata; then
+            echo "    bit-identical"
+        else
+            echo "    DIFFERENT"
+            rmse $outDir/sym${b}_slice0001.2Dimgdata $outDir/full${b}_slice0001.2Dimgdata
+        fi
+    done
+}
+
+case_bits()
+{
+    echo "=== bits: system matrix precision"
+    for b in 16 8 4; do
+        $execdir/mbir_ct -i $parName -j $parName -m $outDir/A$b -q $b -v 0
+        ls -l $outDir/A$b.2Dsvmatrix | awk '{print "    " $5 " bytes  " $NF}'
+        run "$b bits" -i $parName -j $parName -k $parName -s $sinoName -r $outDir/A$b -m $outDir/A$b
+        nonfinite $outDir/A${b}_slice0001.2Dimgdata
+    done
+    for b in 8 4; do
+        echo "--- $b bits vs. 16 bits"
+        rmse $outDir/A${b}_slice0001.2Dimgdata $outDir/A16_slice0001.2Dimgdata
+    done
+}
+
+case_vieworder()
+{
+    echo "=== vieworder: interleaved views, acquisition order vs. sorted (-o)"
+    local il="$outDir/il"
+    [[ ! -d "$il" ]] && mkdir "$il"
+    cp $parName.imgparams $il/il.imgparams
+    cp $parName.reconparams $il/il.reconparams
+    sed 's#ViewAngleList:.*#ViewAngleList: ./ViewAngleList.txt#' $parName.sinoparams > $il/il.sinoparams
+    # view i of the interleaved scan is view (89*i mod NViews) of the demo scan
+    awk '{a[NR-1]=$1} END {for(i=0;i<NR;i++) print a[(i*89)%NR]}' $dataDir/$dataName/par/ViewAngleList.txt > $il/ViewAngleList.txt
+    # interleaved sinogram from the projection of a reconstruction of the demo data
+    $execdir/mbir_ct -i $parName -j $parName -k $parName -s $sinoName -r $il/img -M -v 0
+    $execdir/mbir_ct -i $il/il -j $il/il -t $il/img -f $il/il -M -v 0
+    mv $il/il_slice0001.2Dprojection $il/il_slice0001.2Dsinodata
+
+    echo "--- build matrix, acquisition order"
+    $execdir/mbir_ct -i $il/il -j $il/il -m $il/Aacq -v 2 | grep -E "padding|matrix memory"
+    echo "--- build matrix, sorted views"
+    $execdir/mbir_ct -i $il/il -j $il/il -m $il/Asort -o -v 2 | grep -E "padding|matrix memory"
+    run "acquisition order" -i $il/il -j $il/il -k $il/il -s $il/il -r $il/acq -m $il/Aacq
+    run "sorted views" -i $il/il -j $il/il -k $il/il -s $il/il -r $il/sort -m $il/Asort
+    rmse $il/sort_slice0001.2Dimgdata $il/acq_slice0001.2Dimgdata
+}
+
+case_piecelength()
+{
+    echo "=== piecelength: views per matrix piece"
+    echo "--- candidates (-L trial)"
+    $execdir/mbir_ct -i $parName -j $parName -m $outDir/Atrial -L trial -v 2 | \
+        sed -n '/pieceLength selection/,/pieceLength =/p'
+    need_matrix
+    run "default pieceLength" -i $parName -j $parName -k $parName -s $sinoName -r $outDir/pldef -m $matName
+    run "selected pieceLength" -i $parName -j $parName -k $parName -s $sinoName -r $outDir/pltrial -m $outDir/Atrial
+
+    # 283 views (prime): first 283 views of the demo scan
+    local pr="$outDir/prime"
+    [[ ! -d "$pr" ]] && mkdir "$pr"
+    cp $parName.imgparams $pr/pr.imgparams
+    cp $parName.reconparams $pr/pr.reconparams
+    sed -e 's#NViews:.*#NViews: 283#' -e 's#ViewAngleList:.*#ViewAngleList: ./ViewAngleList.txt#' $parName.sinoparams > $pr/pr.sinoparams
+    head -283 $dataDir/$dataName/par/ViewAngleList.txt > $pr/ViewAngleList.txt
+    head -c $((283*512*4)) ${sinoName}_slice0001.2Dsinodata > $pr/pr_slice0001.2Dsinodata
+    for L in 1 17; do
+        echo "--- 283 views, build matrix with pieceLength $L"
+        $execdir/mbir_ct -i $pr/pr -j $pr/pr -m $pr/A$L -L $L -v 2 | grep -E "pieceLength =|padding|matrix memory"
+        run "283 views, pieceLength $L" -i $pr/pr -j $pr/pr -k $pr/pr -s $pr/pr -r $pr/r$L -m $pr/A$L
+    done
+    rmse $pr/r17_slice0001.2Dimgdata $pr/r1_slice0001.2Dimgdata
+}
+
+case_projector()
+{
+    echo "=== projector: forward and back projection"
+    need_matrix
+    local mz="$outDir/mz"
+    [[ ! -d "$mz" ]] && mkdir "$mz"
+    # 8-slice copy of the demo geometry
+    sed 's#Nz:.*#Nz: 8#' $parName.imgparams > $mz/mz.imgparams
+    sed -e 's#NSlices:.*#NSlices: 8#' -e 's#ViewAngleList:.*#ViewAngleList: ./ViewAngleList.txt#' $parName.sinoparams > $mz/mz.sinoparams
+    cp $dataDir/$dataName/par/ViewAngleList.txt $mz/
+    $execdir/mbir_ct -i $parName -j $parName -k $parName -s $sinoName -r $outDir/img -m $matName -v 0
+    for z in 1 2 3 4 5 6 7 8; do
+        cp $outDir/img_slice0001.2Dimgdata $mz/img_slice000$z.2Dimgdata
+        cp ${sinoName}_slice0001.2Dsinodata $mz/mz_slice000$z.2Dsinodata
+    done
+    # 1 slice: scaling over SV tiles
+    local th
+    for th in 1 $(nproc); do
+        OMP_NUM_THREADS=$th run "forward, 1 slice, $th threads" -i $parName -j $parName -t $outDir/img -f $outDir/proj -m $matName
+        OMP_NUM_THREADS=$th run "back, 1 slice, $th threads" -i $parName -j $parName -s $sinoName -r $outDir/back -b -m $matName
+    done
+    run "forward, 8 slices" -i $mz/mz -j $mz/mz -t $mz/img -f $mz/proj -m $matName
+    run "back, 8 slices" -i $mz/mz -j $mz/mz -s $mz/mz -r $mz/back -b -m $matName
+}
+
+case_batch()
+{
+    echo "=== batch: 4 reconstructions with one system matrix"
+    need_matrix
+    local bt="$outDir/batch"
+    [[ ! -d "$bt" ]] && mkdir "$bt"
+    : > $bt/jobs.txt
+    for k in 1 2 3 4; do
+        echo "$sinoName $bt/r$k" >> $bt/jobs.txt
+    done
+    local t0=$(date +%s%N)
+    for k in 1 2 3 4; do
+        $execdir/mbir_ct -i $parName -j $parName -k $parName -s $sinoName -r $bt/s$k -m $matName -v 0
+    done
+    echo "--- 4 separate runs: $(( ($(date +%s%N)-t0)/1000000 )) ms"
+    run "batch of 4" -i $parName -j $parName -k $parName -B $bt/jobs.txt -m $matName
+    rmse $bt/r1_slice0001.2Dimgdata $bt/s1_slice0001.2Dimgdata
+}
+
+case_daemon()
+{
+    echo "=== daemon: 4 jobs with a resident system matrix"
+    need_matrix
+    local sock="$outDir/mbir.sock"
+    local k t0
+    t0=$(date +%s%N)
+    for k in 1 2 3 4; do
+        $execdir/mbir_ct -i $parName -j $parName -k $parName -s $sinoName -r $outDir/sep$k -m $matName -v 0
+    done
+    echo "--- 4 separate runs: $(( ($(date +%s%N)-t0)/1000000 )) ms"
+    $execdir/mbir_ct -daemon $sock -v 0 &
+    sleep 1
+    t0=$(date +%s%N)
+    for k in 1 2 3 4; do
+        $execdir/mbir_ct -client $sock -i $parName -j $parName -k $parName -s $sinoName -r $outDir/dmn$k -m $matName -v 0
+    done
+    echo "--- 4 daemon jobs: $(( ($(date +%s%N)-t0)/1000000 )) ms"
+    $execdir/mbir_ct -client $sock -stats | sed 's/^/    /'
+    $execdir/mbir_ct -client $sock -shutdown
+    wait
+    rmse $outDir/dmn4_slice0001.2Dimgdata $outDir/sep4_slice0001.2Dimgdata
+}
+
+case_sweep()
+{
+    echo "=== sweep: 4 SigmaX values"
+    need_matrix
+    local sw="$outDir/sweep"
+    local sx t0
+    [[ ! -d "$sw" ]] && mkdir "$sw"
+    : > $sw/sweep.txt
+    t0=$(date +%s%N)
+    for sx in 0.3 0.5 0.7 1.0; do
+        echo "$sw/w$sx SigmaX=$sx" >> $sw/sweep.txt
+        sed "s/SigmaX:.*/SigmaX: $sx/" $parName.reconparams > $sw/c$sx.reconparams
+        $execdir/mbir_ct -i $parName -j $parName -k $sw/c$sx -s $sinoName -r $sw/c$sx -m $matName -v 0 > /dev/null
+    done
+    echo "--- 4 separate runs: $(( ($(date +%s%N)-t0)/1000000 )) ms"
+    run "sweep of 4" -i $parName -j $parName -k $parName -s $sinoName -X $sw/sweep.txt -m $matName
+    sed 's/^/    /' $sw/sweep.txt.results
+    rmse $sw/w1.0_slice0001.2Dimgdata $sw/c1.0_slice0001.2Dimgdata
+}
+
+case_volume()
+{
+    need_matrix
+    local vd="$outDir/volume"
+    local k t0
+    [[ ! -d "$vd" ]] && mkdir "$vd"
+    sed "s/^Nz:.*/Nz: 64/" $parName.imgparams > $vd/v.imgparams
+    sed "s/^NSlices:.*/NSlices: 64/" $parName.sinoparams > $vd/v.sinoparams
+    cp $(dirname $parName)/ViewAngleList.txt $vd/
+    for k in $(seq -w 1 64); do
+        cp ${sinoName}_slice0001.2Dsinodata $vd/s_slice00$k.2Dsinodata
+    done
+    echo "--- convert 64 slices"
+    $execdir/mbir_ct -convert sinodata $vd/v $vd/s $vd/vs | sed 's/^/    /'
+    t0=$(date +%s%N)
+    $execdir/mbir_ct -i $vd/v -j $vd/v -s $vd/s -r $vd/b -b -m $matName -v 0 > /dev/null
+    echo "--- per-slice files: $(( ($(date +%s%N)-t0)/1000000 )) ms"
+    t0=$(date +%s%N)
+    $execdir/mbir_ct -i $vd/v -j $vd/v -s $vd/vs -r $vd/vb -b -V -m $matName -v 0 > /dev/null
+    echo "--- volume files (-V): $(( ($(date +%s%N)-t0)/1000000 )) ms"
+}
+
+case_freeze()
+{
+    echo "=== freeze: parking converged SVs"
+    need_matrix
+    run "baseline" -i $parName -j $parName -k $parName -s $sinoName -r $outDir/nofreeze -m $matName
+    run "-F 1" -i $parName -j $parName -k $parName -s $sinoName -r $outDir/freeze -m $matName -F 1
+    run "-F 1:1:8" -i $parName -j $parName -k $parName -s $sinoName -r $outDir/freeze18 -m $matName -F 1:1:8
+    rmse $outDir/freeze_slice0001.2Dimgdata $outDir/nofreeze_slice0001.2Dimgdata
+}
+
+case_multires()
+{
+    echo "=== multires: coarse-to-fine reconstruction"
+    need_matrix
+    # first runs compute and cache the coarse matrices
+    $execdir/mbir_ct -i $parName -j $parName -k $parName -s $sinoName -r $outDir/multires -m $matName -G 2 -v 0 > /dev/null
+    run "single level" -i $parName -j $parName -k $parName -s $sinoName -r $outDir/single -m $matName
+    local g
+    for g in 1 2; do
+        echo "--- -G $g"
+        $execdir/mbir_ct -i $parName -j $parName -k $parName -s $sinoName -r $outDir/multires$g -m $matName -G $g | \
+            grep -E "^Level|Multi-resolution|Done\. Total" | sed 's/^/    /'
+        rmse $outDir/multires${g}_slice0001.2Dimgdata $outDir/single_slice0001.2Dimgdata
+    done
+}
+
+cases="$@"
+[[ -z "$cases" ]] && cases="matrixfree symmetry bits vieworder piecelength projector batch daemon sweep volume freeze multires"
+
+for c in $cases; do
+    if declare -f "case_$c" > /dev/null; then
+        case_$c
+    else
+        echo "Unknown case: $c"
+        exit 1
+    fi
+done
+
+exit 0
@@ -124,6 +124,60 @@ float PixProjLookup(float **pix_prof, float Deltaxy, float angle, float t)
 
 
 
+/* Detector position t_pix of the pixel center at (x,y) and the detector range */
+/* [t_min,t_max] of its profile for one view. theta, alpha, D and M are the     */
+/* fan-beam terms used for the footprint; t is in radians for curved fanbeam.  */
+void A_pixelDetectorRange(
+    struct SinoParams3DParallel *sinoparams,
+    float Deltaxy,
+    float x,
+    float y,
+    float view_angle,
+    float r_sd,
+    float r_si,
+    float *t_pix,
+    float *t_min,
+    float *t_max,
+    float *theta,
+    float *alpha,
+    float *D,
+    float *M)
+{
+    float x_s, y_s;
+
+    if(sinoparams->Geometry == 1)   // fanbeam, curved
+    {
+        x_s = r_si * cosf(view_angle);
+        y_s = r_si * sinf(view_angle);
+        *theta = atan2(y_s-y, x_s-x);
+        *alpha = angle_mod(*theta - view_angle,-PI,PI);
+        *D = sqrt((x_s-x)*(x_s-x) + (y_s-y)*(y_s-y));
+        *t_pix = *alpha;
+        *t_min = *t_pix - Deltaxy / *D;
+        *t_max = *t_pix + Deltaxy / *D;
+    }
+    else if(sinoparams->Geometry == 2)  // fanbeam, flat
+    {
+        x_s = r_si * cosf(view_angle);
+        y_s = r_si * sinf(view_angle);
+        *theta = atan2(y_s-y, x_s-x);
+        *alpha = angle_mod(*theta - view_angle,-PI,PI);
+        *D = sqrt((x_s-x)*(x_s-x) + (y_s-y)*(y_s-y));
+        *M = r_sd/cosf(*alpha) / *D;
+        *t_pix = r_sd*tanf(*alpha);
+        *t_min = *t_pix - Deltaxy * *M;
+        *t_max = *t_pix + Deltaxy * *M;
+    }
+    else    // parallel beam
+    {
+        /* t_min,t_max is range for pixel profile */
+        *t_pix = y*cosf(view_angle) - x*sinf(view_angle);
+        *t_min = *t_pix - Deltaxy;
+        *t_max = *t_pix + Deltaxy;
+    }
+}
+
+
 /* Compute the System Matrix column for a given pixel */
 
 void A_comp_ij(
@@ -140,7 +194,7 @@ void A_comp_ij(
     float t_0, x_0, y_0, x, y;
     float t, t_pix=0.0, t_min, t_max, t_start;
     float Aval, detSampleD;
-    float r_sd, r_si=1.0, x_s, y_s, theta=0.0, alpha=0.0, D=1.0, M=1.0;
+    float r_sd, r_si=1.0, theta=0.0, alpha=0.0, D=1.0, M=1.0;
 
     float Deltaxy = imgparams->Deltaxy;
     int NChannels = sinoparams->NChannels;
@@ -195,36 +249,7 @@ void A_comp_ij(
         int minCount=0;
         float view_angle = sinoparams->ViewAngles[pr];
 
-        if(sinoparams->Geometry == 1)   // fanbeam, curved
-        {
-            x_s = r_si * cosf(view_angle);
-            y_s = r_si * sinf(view_angle);
-            theta = atan2(y_s-y, x_s-x);
-            alpha = angle_mod(theta - view_angle,-PI,PI);
-            D = sqrt((x_s-x)*(x_s-x) + (y_s-y)*(y_s-y));
-            t_pix = alpha;
-            t_min = t_pix - Deltaxy/D;
-            t_max = t_pix + Deltaxy/D;
-        }
-        else if(sinoparams->Geometry == 2)  // fanbeam, flat
-        {
-            x_s = r_si * cosf(view_angle);
-            y_s = r_si * sinf(view_angle);
-            theta = atan2(y_s-y, x_s-x);
-            alpha = angle_mod(theta - view_angle,-PI,PI);
-            D = sqrt((x_s-x)*(x_s-x) + (y_s-y)*(y_s-y));
-            M = r_sd/cosf(alpha) / D;
-            t_pix = r_sd*tanf(alpha);
-            t_min = t_pix - Deltaxy*M;
-            t_max = t_pix + Deltaxy*M;
-        }
-        else    // parallel beam
-        {
-            /* t_min,t_max is range for pixel profile */
-            t_pix = y*cosf(view_angle) - x*sinf(view_angle);
-            t_min = t_pix - Deltaxy;
-            t_max = t_pix + Deltaxy;
-        }
+        A_pixelDetectorRange(sinoparams,Deltaxy,x,y,view_angle,r_sd,r_si,&t_pix,&t_min,&t_max,&theta,&alpha,&D,&M);
 
         /* Relevant detector indices */
         ind_min = ceil((t_min-t_0)/DeltaChannel - 0.5);
@@ -283,6 +308,376 @@ void A_comp_ij(
 }
 
 
+/* Quantize a matrix entry relative to the pixel's max value */
+unsigned short A_quantize(float Aval, float maxval, int Abits)
+{
+    int Amax = (1<<Abits)-1;
+    return (unsigned short)(Aval/maxval*Amax+0.5);
+}
+
+/* Storage size in bytes of "length" values */
+size_t A_valBytes(int length, int Abits)
+{
+    if(Abits == 4)
+        return ((size_t)length+1)/2;
+    return (size_t)length*A_KERNEL_BYTES(Abits);
+}
+
+/* Get/put value idx of a buffer encoded with Abits (4-bit values are packed low nibble first) */
+unsigned short A_getValue(unsigned char *buf, size_t idx, int Abits)
+{
+    if(Abits == 16)
+        return ((unsigned short *)buf)[idx];
+    else if(Abits == 4)
+        return (idx & 1) ? (buf[idx>>1] >> 4) : (buf[idx>>1] & 0x0F);
+    else
+        return buf[idx];
+}
+
+void A_putValue(unsigned char *buf, size_t idx, unsigned short v, int Abits)
+{
+    if(Abits == 16)
+        ((unsigned short *)buf)[idx] = v;
+    else if(Abits == 4)
+        buf[idx>>1] = (idx & 1) ? ((buf[idx>>1] & 0x0F) | (v << 4)) : ((buf[idx>>1] & 0xF0) | v);
+    else
+        buf[idx] = (unsigned char)v;
+}
+
+
+/* For views where the pixel has no footprint, carry over a neighboring */
+/* view's minIndex so the SV band isn't stretched back to channel 0     */
+void A_fillEmptyViews(struct ACol *A_col, int NViews)
+{
+    int p,t;
+
+    for(p=0; p<NViews; p++)
+    {
+        if(A_col->minIndex[p]==0 && A_col->countTheta[p]==0)
+        {
+            if(p!=0)
+                A_col->minIndex[p] = A_col->minIndex[p-1];
+            else
+            {
+                t=0;
+                while(A_col->minIndex[t] == 0 && t<NViews-1)
+                    t++;
+                A_col->minIndex[p] = A_col->minIndex[t];
+            }
+        }
+    }
+}
+
+
+/* Padded footprint entries of an SV if its views were taken in the sequence    */
+/* viewSeq[0..NViews-1]; same band/piece layout rules as A_piecewise_SV(), with */
+/* empty views re-filled along the sequence as A_fillEmptyViews() would do.     */
+/* If width!=NULL it gets the piece widths, width[i*NumPieces+p].               */
+long A_paddedLength(
+    int SVSize,
+    struct ACol **A_cols,
+    int *viewSeq,
+    int NViews,
+    int NChannels,
+    int pieceLength,
+    int *width)
+{
+    int i,k,t,p;
+    int NViewSets = A_NUM_PIECES(NViews,pieceLength);
+    long padded = 0;
+    int **minIndex = (int **)multialloc(sizeof(int),2,SVSize,NViews);
+    int *bandMin = (int *) mget_spc(NViews,sizeof(int));
+    int *bandWidth = (int *) mget_spc(NViews,sizeof(int));
+
+    for(i=0; i<SVSize; i++)
+    {
+        t = 0;
+        while(t<NViews-1 && A_cols[i]->countTheta[viewSeq[t]] == 0)
+            t++;
+        for(k=0; k<NViews; k++)
+        {
+            if(A_cols[i]->countTheta[viewSeq[k]] > 0)
+                minIndex[i][k] = A_cols[i]->minIndex[viewSeq[k]];
+            else
+                minIndex[i][k] = (k>0) ? minIndex[i][k-1] : A_cols[i]->minIndex[viewSeq[t]];
+        }
+    }
+
+    for(k=0; k<NViews; k++)
+    {
+        int v = viewSeq[k];
+        int bMin = NChannels, bMax;
+        for(i=0; i<SVSize; i++)
+            if(minIndex[i][k] < bMin)
+                bMin = minIndex[i][k];
+        bMax = bMin;
+        for(i=0; i<SVSize; i++)
+            if(minIndex[i][k] + A_cols[i]->countTheta[v] > bMax)
+                bMax = minIndex[i][k] + A_cols[i]->countTheta[v];
+        bandMin[k] = bMin;
+        bandWidth[k] = bMax-bMin;
+    }
+
+    /* band start is pulled in at the far detector edge */
+    for(p=0; p<NViewSets; p++)
+    {
+        int PL = A_PIECE_LENGTH(p,NViews,pieceLength);
+        int widthPW = 0;
+        for(t=0; t<PL; t++)
+            if(bandWidth[p*pieceLength+t] > widthPW)
+                widthPW = bandWidth[p*pieceLength+t];
+        for(t=0; t<PL; t++)
+            if(bandMin[p*pieceLength+t]+widthPW >= NChannels)
+                bandMin[p*pieceLength+t] = NChannels-widthPW;
+    }
+
+    for(p=0; p<NViewSets; p++)
+    for(i=0; i<SVSize; i++)
+    {
+        int PL = A_PIECE_LENGTH(p,NViews,pieceLength);
+        int pwMin = NChannels, pwMax = -NChannels;
+        for(t=0; t<PL; t++)
+        {
+            k = p*pieceLength+t;
+            int idx0 = minIndex[i][k] - bandMin[k];
+            int idx1 = idx0 + A_cols[i]->countTheta[viewSeq[k]];
+            if(idx0 < pwMin)
+                pwMin = idx0;
+            if(idx1 > pwMax)
+                pwMax = idx1;
+        }
+        padded += (long)(pwMax-pwMin)*PL;
+        if(width != NULL)
+            width[i*NViewSets+p] = pwMax-pwMin;
+    }
+
+    multifree(minIndex,2);
+    free((void *)bandMin);
+    free((void *)bandWidth);
+    return padded;
+}
+
+
+/* Compute the padded/transposed layout of one super-voxel from the columns of */
+/* its voxels. If AVal==NULL only the layout (bands, piece widths) is computed. */
+void A_piecewise_SV(
+    int jj,
+    int jy,
+    int jx,
+    int SVSize,
+    int *jy_list,
+    int *jx_list,
+    struct ACol **A_cols,
+    unsigned char **AVal,
+    struct AValues_char **A_Padded_Map,
+    struct SVParams svpar,
+    struct SinoParams3DParallel *sinoparams)
+{
+    int i,p,q,t;
+    int NViews = sinoparams->NViews;
+    int NChannels = sinoparams->NChannels;
+    int SVLength = svpar.SVLength;
+    int pieceLength = svpar.pieceLength;
+    int NViewSets = A_NUM_PIECES(NViews,pieceLength);
+    struct minStruct * bandMinMap = svpar.bandMinMap;
+    struct maxStruct * bandMaxMap = svpar.bandMaxMap;
+
+    channel_t *bandMin = (channel_t *) mget_spc(NViews,sizeof(channel_t));
+    channel_t *bandMax = (channel_t *) mget_spc(NViews,sizeof(channel_t));
+    channel_t *bandWidth=(channel_t *) mget_spc(NViews,sizeof(channel_t));
+    channel_t *bandWidthPW = (channel_t *) mget_spc(NViewSets,sizeof(channel_t));
+    channel_t **piecewiseMin = (channel_t **)multialloc(sizeof(channel_t),2,(SVSize>0)?SVSize:1,NViewSets);
+    channel_t **piecewiseMax = (channel_t **)multialloc(sizeof(channel_t),2,(SVSize>0)?SVSize:1,NViewSets);
+    channel_t **piecewiseWidth=(channel_t **)multialloc(sizeof(channel_t),2,(SVSize>0)?SVSize:1,NViewSets);
+    int *totalSum = (int *) mget_spc((SVSize>0)?SVSize:1,sizeof(int));
+
+    //channel_t bandMin[NViews]__attribute__((aligned(64)));
+    //channel_t bandMax[NViews]__attribute__((aligned(64)));
+    for(p=0; p< NViews; p++)
+        bandMin[p] = NChannels;
+
+    for(i=0; i<SVSize; i++)
+    {
+        for(p=0; p< NViews; p++)
+        {
+            if(A_cols[i]->minIndex[p] < bandMin[p])
+                bandMin[p] = A_cols[i]->minIndex[p];
+        }
+    }
+
+    for(p=0; p< NViews; p++)
+        bandMax[p]=bandMin[p];
+
+    for(i=0; i<SVSize; i++)
+    {
+        for(p=0; p< NViews; p++) {
+            if((A_cols[i]->minIndex[p] + A_cols[i]->countTheta[p]) > bandMax[p])
+                bandMax[p] = A_cols[i]->minIndex[p] + A_cols[i]->countTheta[p];
+        }
+    }
+
+    //channel_t bandWidth[NViews]__attribute__((aligned(64)));
+    //channel_t bandWidthPW[NViewSets]__attribute__((aligned(64)));
+    //#pragma vector aligned
+    for(p=0; p< NViews; p++)
+        bandWidth[p] = bandMax[p]-bandMin[p];
+
+    for (p=0; p < NViewSets; p++)
+    {
+        int bandWidthMax = bandWidth[p*pieceLength];
+        for(t=0; t<A_PIECE_LENGTH(p,NViews,pieceLength); t++) {
+            if(bandWidth[p*pieceLength+t] > bandWidthMax) {
+                bandWidthMax = bandWidth[p*pieceLength+t];
+            }
+        }
+        bandWidthPW[p] = bandWidthMax;
+    }
+
+    //#pragma vector aligned
+    for(p=0; p< NViews; p++) {
+        if((bandMin[p]+bandWidthPW[p/pieceLength]) >= NChannels)
+            bandMin[p] = NChannels - bandWidthPW[p/pieceLength];
+    }
+
+    memcpy(&bandMinMap[jj].bandMin[0],&bandMin[0],sizeof(channel_t)*NViews);
+    memcpy(&bandMaxMap[jj].bandMax[0],&bandMax[0],sizeof(channel_t)*NViews);
+
+    //int totalSum[SVSize]__attribute__((aligned(64)));
+    for(i=0; i<SVSize; i++)
+    {
+        for (p=0; p < NViewSets; p++)
+        {
+            int pwMin = (int)A_cols[i]->minIndex[p*pieceLength]-(int)bandMin[p*pieceLength];
+            int pwMax = pwMin + A_cols[i]->countTheta[p*pieceLength];
+            for(t=0; t<A_PIECE_LENGTH(p,NViews,pieceLength); t++)
+            {
+                int idx0 = (int)A_cols[i]->minIndex[p*pieceLength+t]-(int)bandMin[p*pieceLength+t];
+                int idx1 = idx0 + A_cols[i]->countTheta[p*pieceLength+t];
+                if(idx0 < pwMin)
+                    pwMin = idx0;
+                if(pwMax < idx1)
+                    pwMax = idx1;
+            }
+            piecewiseMin[i][p] = pwMin;
+            piecewiseMax[i][p] = pwMax;
+            piecewiseWidth[i][p] = (pwMax - pwMin);
+        }
+    }
+
+    for(i=0; i<SVSize; i++)
+    {
+        totalSum[i]=0;
+        //#pragma vector aligned
+        for (p = 0; p < NViewSets; p++)
+            totalSum[i] += piecewiseWidth[i][p] * A_PIECE_LENGTH(p,NViews,pieceLength);
+    }
+
+    if(svpar.padStats != NULL && SVSize > 0)
+    {
+        double nonzero=0, padded=0, paddedAcq;
+        for(i=0; i<SVSize; i++) {
+            for(p=0; p<NViews; p++)
+                nonzero += A_cols[i]->countTheta[p];
+            padded += totalSum[i];
+        }
+        paddedAcq = padded;
+        if(svpar.viewOrder != NULL)
+        {
+            /* acquisition view a sits at sorted position viewSeq[a] */
+            int *viewSeq = (int *) mget_spc(NViews,sizeof(int));
+            for(p=0; p<NViews; p++)
+                viewSeq[svpar.viewOrder[p]] = p;
+            paddedAcq = A_paddedLength(SVSize,A_cols,viewSeq,NViews,NChannels,pieceLength,NULL);
+            free((void *)viewSeq);
+        }
+        #pragma omp atomic
+        svpar.padStats[AMATRIX_PADSTATS_NONZERO] += nonzero;
+        #pragma omp atomic
+        svpar.padStats[AMATRIX_PADSTATS_PADDED] += padded;
+        #pragma omp atomic
+        svpar.padStats[AMATRIX_PADSTATS_PADDED_ACQ] += paddedAcq;
+    }
+
+    for(i=0;i<SVSize;i++)
+    {
+        int VoxelPosition = (jy_list[i]-jy)*(2*SVLength+1)+(jx_list[i]-jx);
+
+        A_Padded_Map[jj][VoxelPosition].val = NULL;
+        A_Padded_Map[jj][VoxelPosition].pieceWiseMin = (channel_t *)get_spc(NViewSets,sizeof(channel_t));
+        A_Padded_Map[jj][VoxelPosition].pieceWiseWidth = (channel_t *)get_spc(NViewSets,sizeof(channel_t));
+        A_Padded_Map[jj][VoxelPosition].length = totalSum[i];
+        memcpy(&A_Padded_Map[jj][VoxelPosition].pieceWiseMin[0],&piecewiseMin[i][0],sizeof(channel_t)*NViewSets);
+        memcpy(&A_Padded_Map[jj][VoxelPosition].pieceWiseWidth[0],&piecewiseWidth[i][0],sizeof(channel_t)*NViewSets);
+    }
+
+    /* matrix-free mode: layout only, footprints are generated when needed */
+    /* AVal holds the columns in kernel format; val gets the storage format */
+    if(AVal != NULL)
+    {
+        int Abits = svpar.Abits;
+        int inBits = (Abits==16) ? 16 : 8;
+        int maxSum = 1;
+        for(i=0; i<SVSize; i++)
+            maxSum = (totalSum[i]>maxSum) ? totalSum[i] : maxSum;
+        unsigned short *AMatrixPadded = (unsigned short *) mget_spc(maxSum,sizeof(unsigned short));
+
+        for(i=0; i<SVSize; i++)
+        {
+            unsigned short * A_padded_pointer = &AMatrixPadded[0];
+            size_t inIdx = 0;
+            for (p=0; p < NViews; p++)
+            {
+                int n_pad;
+                n_pad=(int)A_cols[i]->minIndex[p]-(int)piecewiseMin[i][p/pieceLength]-(int)bandMin[p];
+                for(t=0; t<n_pad; t++) {
+                    *A_padded_pointer = 0;
+                    A_padded_pointer++;
+                }
+                for(t=0; t<A_cols[i]->countTheta[p]; t++) {
+                    *A_padded_pointer = A_getValue(AVal[i],inIdx,inBits);
+                    A_padded_pointer++;
+                    inIdx++;
+                }
+                n_pad=(int)piecewiseMax[i][p/pieceLength]-(int)A_cols[i]->minIndex[p]-(int)A_cols[i]->countTheta[p]+(int)bandMin[p];
+                for(t=0; t<n_pad; t++) {
+                    *A_padded_pointer = 0;
+                    A_padded_pointer++;
+                }
+            }
+
+            int VoxelPosition = (jy_list[i]-jy)*(2*SVLength+1)+(jx_list[i]-jx);
+            unsigned char *val = (unsigned char *)get_spc(A_valBytes(totalSum[i],Abits), sizeof(unsigned char));
+            A_Padded_Map[jj][VoxelPosition].val = val;
+
+            A_padded_pointer = &AMatrixPadded[0];
+            size_t offset = 0;
+            for (p=0; p < NViewSets; p++)
+            {
+                int PL = A_PIECE_LENGTH(p,NViews,pieceLength);
+                for(q=0; q<piecewiseWidth[i][p]; q++) {
+                    for(t=0; t<PL; t++) {
+                        A_putValue(val,offset+q*PL+t,A_padded_pointer[t*piecewiseWidth[i][p]+q],Abits);
+                    }
+                }
+                A_padded_pointer += piecewiseWidth[i][p]*PL;
+                offset += piecewiseWidth[i][p]*PL;
+            }
+        }
+        free((void *)AMatrixPadded);
+    }
+
+    multifree(piecewiseMin,2);
+    multifree(piecewiseMax,2);
+    multifree(piecewiseWidth,2);
+    free((void *) bandMin);
+    free((void *) bandMax);
+    free((void *) bandWidth);
+    free((void *) bandWidthPW);
+    free((void *) totalSum);
+
+}  /*** END A_piecewise_SV() ***/
+
+
 void A_piecewise(
     struct ACol **ACol_ptr,
     struct AValues_char **AVal_ptr,
@@ -292,16 +687,11 @@ void A_piecewise(
     struct ImageParams3D *imgparams)
 {
 
-    int i,j,jj,p,t;
+    int i,j,jj,t;
     int Nx = imgparams->Nx;
     int Ny = imgparams->Ny;
     int NViews = sinoparams->NViews;
-    int NChannels = sinoparams->NChannels;
     int SVLength = svpar.SVLength;
-    int pieceLength = svpar.pieceLength;
-    int NViewSets = NViews/svpar.pieceLength;
-    struct minStruct * bandMinMap = svpar.bandMinMap;
-    struct maxStruct * bandMaxMap = svpar.bandMaxMap;
 
     int *order = (int *) mget_spc(svpar.Nsv,sizeof(int));
     t=0;
@@ -320,39 +710,18 @@ void A_piecewise(
     for(i=0; i<Ny; i++)
     for(j=0; j<Nx; j++)
     if(ACol_ptr[i][j].n_index > 0)
-    for(p=0; p<NViews; p++)
-    {
-        if(ACol_ptr[i][j].minIndex[p]==0 && ACol_ptr[i][j].countTheta[p]==0)
-        {
-            if(p!=0)
-                ACol_ptr[i][j].minIndex[p] = ACol_ptr[i][j].minIndex[p-1];
-            else
-            {
-                t=0;
-                while(ACol_ptr[i][j].minIndex[t] == 0 && t<NViews-1)
-                    t++;
-                ACol_ptr[i][j].minIndex[p] = ACol_ptr[i][j].minIndex[t];
-            }
-        }
-    }
+        A_fillEmptyViews(&ACol_ptr[i][j],NViews);
 
     /* Note this gets *slower* if running more than a few threads */
-    #pragma omp parallel private(i,j,p,t) num_threads(4)
+    #pragma omp parallel private(i) num_threads(4)
     {
-        int jx,jy,q,jx_new,jy_new;
-
-        channel_t *bandMin = (channel_t *) mget_spc(NViews,sizeof(channel_t));
-        channel_t *bandMax = (channel_t *) mget_spc(NViews,sizeof(channel_t));
-        channel_t *bandWidth=(channel_t *) mget_spc(NViews,sizeof(channel_t));
-        channel_t *bandWidthPW = (channel_t *) mget_spc(NViewSets,sizeof(channel_t));
+        int jx,jy,jx_new,jy_new,SVSize;
 
-        int SVSize = (2*SVLength+1)*(2*SVLength+1);
-        channel_t **piecewiseMin = (channel_t **)multialloc(sizeof(channel_t),2,SVSize,NViewSets);
-        channel_t **piecewiseMax = (channel_t **)multialloc(sizeof(channel_t),2,SVSize,NViewSets);
-        channel_t **piecewiseWidth=(channel_t **)multialloc(sizeof(channel_t),2,SVSize,NViewSets);
-        int *jx_list = (int *) mget_spc(SVSize,sizeof(int));
-        int *jy_list = (int *) mget_spc(SVSize,sizeof(int));
-        int *totalSum = (int *) mget_spc(SVSize,sizeof(int));
+        int SVSizeMax = (2*SVLength+1)*(2*SVLength+1);
+        int *jx_list = (int *) mget_spc(SVSizeMax,sizeof(int));
+        int *jy_list = (int *) mget_spc(SVSizeMax,sizeof(int));
+        struct ACol **A_cols = (struct ACol **) mget_spc(SVSizeMax,sizeof(struct ACol *));
+        unsigned char **AVal = (unsigned char **) mget_spc(SVSizeMax,sizeof(unsigned char *));
 
         #pragma omp for schedule(static)
         for(jj=0; jj<svpar.Nsv; jj++)
@@ -367,289 +736,1627 @@ void A_piecewise(
                 if(ACol_ptr[jy_new][jx_new].n_index >0) {
                     jy_list[SVSize] = jy_new;
                     jx_list[SVSize] = jx_new;
+                    A_cols[SVSize] = &ACol_ptr[jy_new][jx_new];
+                    AVal[SVSize] = AVal_ptr[jy_new][jx_new].val;
                     SVSize++;
                 }
             }
 
-            //channel_t bandMin[NViews]__attribute__((aligned(64)));
-            //channel_t bandMax[NViews]__attribute__((aligned(64)));
-            for(p=0; p< NViews; p++)
-                bandMin[p] = NChannels;
+            A_piecewise_SV(jj,jy,jx,SVSize,jy_list,jx_list,A_cols,AVal,A_Padded_Map,svpar,sinoparams);
 
-            for(i=0; i<SVSize; i++)
-            {
-                jy_new = jy_list[i];
-                jx_new = jx_list[i];
-                for(p=0; p< NViews; p++)
-                {
-                    if(ACol_ptr[jy_new][jx_new].minIndex[p] < bandMin[p])
-                        bandMin[p] = ACol_ptr[jy_new][jx_new].minIndex[p];
-                }
-            }
+        } //omp for block
 
-            for(p=0; p< NViews; p++)
-                bandMax[p]=bandMin[p];
+        free((void *) jx_list);
+        free((void *) jy_list);
+        free((void *) A_cols);
+        free((void *) AVal);
 
-            for(i=0; i<SVSize; i++)
-            {
-                jy_new = jy_list[i];
-                jx_new = jx_list[i];
-                for(p=0; p< NViews; p++) {
-                    if((ACol_ptr[jy_new][jx_new].minIndex[p] + ACol_ptr[jy_new][jx_new].countTheta[p]) > bandMax[p])
-                        bandMax[p] = ACol_ptr[jy_new][jx_new].minIndex[p] + ACol_ptr[jy_new][jx_new].countTheta[p];
-                }
-            }
+    }   //omp parallel block
 
-            //channel_t bandWidth[NViews]__attribute__((aligned(64)));
-            //channel_t bandWidthPW[NViewSets]__attribute__((aligned(64)));
-            //#pragma vector aligned
-            for(p=0; p< NViews; p++)
-                bandWidth[p] = bandMax[p]-bandMin[p];
+    free((void *) order);
 
-            for (p=0; p < NViewSets; p++)
-            {
-                int bandWidthMax = bandWidth[p*pieceLength];
-                for(t=0; t<pieceLength; t++) {
-                    if(bandWidth[p*pieceLength+t] > bandWidthMax) {
-                        bandWidthMax = bandWidth[p*pieceLength+t];
-                    }
-                }
-                bandWidthPW[p] = bandWidthMax;
-            }
+}  /*** END A_piecewise() ***/
 
-            //#pragma vector aligned
-            for(p=0; p< NViews; p++) {
-                if((bandMin[p]+bandWidthPW[p/pieceLength]) >= NChannels)
-                    bandMin[p] = NChannels - bandWidthPW[p/pieceLength];
-            }
 
-            memcpy(&bandMinMap[jj].bandMin[0],&bandMin[0],sizeof(channel_t)*NViews);
-            memcpy(&bandMaxMap[jj].bandMax[0],&bandMax[0],sizeof(channel_t)*NViews);
 
-            //int totalSum[SVSize]__attribute__((aligned(64)));
-            for(i=0; i<SVSize; i++)
-            {
-                jy_new = jy_list[i];
-                jx_new = jx_list[i];
-                for (p=0; p < NViewSets; p++)
-                {
-                    int pwMin = (int)ACol_ptr[jy_new][jx_new].minIndex[p*pieceLength]-(int)bandMin[p*pieceLength];
-                    int pwMax = pwMin + ACol_ptr[jy_new][jx_new].countTheta[p*pieceLength];
-                    for(t=0; t<pieceLength; t++)
-                    {
-                        int idx0 = (int)ACol_ptr[jy_new][jx_new].minIndex[p*pieceLength+t]-(int)bandMin[p*pieceLength+t];
-                        int idx1 = idx0 + ACol_ptr[jy_new][jx_new].countTheta[p*pieceLength+t];
-                        if(idx0 < pwMin)
-                            pwMin = idx0;
-                        if(pwMax < idx1)
-                            pwMax = idx1;
-                    }
-                    piecewiseMin[i][p] = pwMin;
-                    piecewiseMax[i][p] = pwMax;
-                    piecewiseWidth[i][p] = (pwMax - pwMin);
-                }
-            }
+/*************************************************************/
+/* Matrix-free (on-the-fly) system matrix, parallel beam.    */
+/* Per view, the detector-integrated pixel footprint only    */
+/* depends on the offset u between the detector cell and     */
+/* t_pix, so it's tabulated once and the padded/transposed   */
+/* footprint of a voxel is regenerated from the tables.      */
+/*************************************************************/
 
-            for(i=0; i<SVSize; i++)
-            {
-                totalSum[i]=0;
-                //#pragma vector aligned
-                for (p = 0; p < NViewSets; p++)
-                    totalSum[i] += piecewiseWidth[i][p] * pieceLength;
-            }
+struct AmatrixOTF *AmatrixOTFInit(
+    struct SinoParams3DParallel *sinoparams,
+    struct ImageParams3D *imgparams)
+{
+    int i,j,k;
+    float dprof[LEN_DET];
+    float detSampleD;
+    struct AmatrixOTF *otf;
 
-            unsigned char **AMatrixPadded= (unsigned char **) mget_spc(SVSize,sizeof(unsigned char *));
-            unsigned char **AMatrixPaddedTranspose=(unsigned char **) mget_spc(SVSize,sizeof(unsigned char *));
+    if(sinoparams->Geometry != 0) {
+        fprintf(stderr,"ERROR: matrix-free system matrix is only supported for parallel beam geometry\n");
+        exit(-1);
+    }
 
-            for(i=0;i<SVSize;i++) {
-                AMatrixPadded[i] = (unsigned char *) mget_spc(totalSum[i],sizeof(unsigned char));
-                AMatrixPaddedTranspose[i] = (unsigned char *) mget_spc(totalSum[i],sizeof(unsigned char));
-            }
+    otf = (struct AmatrixOTF *) get_spc(1,sizeof(struct AmatrixOTF));
+    otf->NViews = sinoparams->NViews;
+    otf->NChannels = sinoparams->NChannels;
+    otf->Deltaxy = imgparams->Deltaxy;
+    otf->DeltaChannel = sinoparams->DeltaChannel;
+    otf->t_0 = -(otf->NChannels-1)*otf->DeltaChannel/2.0 - sinoparams->CenterOffset * otf->DeltaChannel;
+    otf->x_0 = -(imgparams->Nx-1)*otf->Deltaxy/2.0;
+    otf->y_0 = -(imgparams->Ny-1)*otf->Deltaxy/2.0;
+
+    otf->cosTheta = (float *) mget_spc(otf->NViews,sizeof(float));
+    otf->sinTheta = (float *) mget_spc(otf->NViews,sizeof(float));
+    for(i=0; i<otf->NViews; i++) {
+        otf->cosTheta[i] = cosf(sinoparams->ViewAngles[i]);
+        otf->sinTheta[i] = sinf(sinoparams->ViewAngles[i]);
+    }
 
-            for(i=0; i<SVSize; i++)
-            {
-                jy_new = jy_list[i];
-                jx_new = jx_list[i];
-                unsigned char * A_padded_pointer = &AMatrixPadded[i][0];
-                unsigned char * newProjectionValueArrayPointer = &AVal_ptr[jy_new][jx_new].val[0];
-                for (p=0; p < NViews; p++)
-                {
-                    int n_pad;
-                    n_pad=(int)ACol_ptr[jy_new][jx_new].minIndex[p]-(int)piecewiseMin[i][p/pieceLength]-(int)bandMin[p];
-                    #pragma vector aligned
-                    for(t=0; t<n_pad; t++) {
-                        *A_padded_pointer = 0;
-                        A_padded_pointer++;
-                    }
-                    #pragma vector aligned
-                    for(t=0; t<ACol_ptr[jy_new][jx_new].countTheta[p]; t++) {
-                        *A_padded_pointer = *newProjectionValueArrayPointer;
-                        A_padded_pointer++;
-                        newProjectionValueArrayPointer++;
-                    }
-                    n_pad=(int)piecewiseMax[i][p/pieceLength]-(int)ACol_ptr[jy_new][jx_new].minIndex[p]-(int)ACol_ptr[jy_new][jx_new].countTheta[p]+(int)bandMin[p];
-                    #pragma vector aligned
-                    for(t=0; t<n_pad; t++) {
-                        *A_padded_pointer = 0;
-                        A_padded_pointer++;
-                    }
-                }
-            }
+    otf->t_start = (float *) mget_spc(otf->NChannels,sizeof(float));
+    for(i=0; i<otf->NChannels; i++)
+        otf->t_start[i] = otf->t_0 - otf->DeltaChannel/2.0 + i*otf->DeltaChannel;
 
-            for(i=0; i<SVSize; i++)
-            {
-                unsigned char * A_padded_pointer = &AMatrixPadded[i][0];
-                unsigned char * A_padd_Tranpose_pointer = &AMatrixPaddedTranspose[i][0];
-                for (p=0; p < NViewSets; p++)
-                {
-                    for(q=0; q<piecewiseWidth[i][p]; q++) {
-                        for(t=0; t<pieceLength; t++) {
-                            A_padd_Tranpose_pointer[q*pieceLength+t] = A_padded_pointer[t*piecewiseWidth[i][p]+q];
-                        }
-                    }
-                    A_padded_pointer += piecewiseWidth[i][p]*pieceLength;
-                    A_padd_Tranpose_pointer += piecewiseWidth[i][p]*pieceLength;
-                }
-            }
+    /* square detector profile, same as A_comp_ij() */
+    for (k = 0; k < LEN_DET; k++)
+        dprof[k] = 1.0/(LEN_DET);
+    if(LEN_DET > 1)
+        detSampleD = otf->DeltaChannel/(LEN_DET-1);
+    else
+        detSampleD = otf->DeltaChannel/2.0;
 
-            for(i=0;i<SVSize;i++)
-            {
-                jy_new = jy_list[i];
-                jx_new = jx_list[i];
-                int VoxelPosition = (jy_new-jy)*(2*SVLength+1)+(jx_new-jx);
+    /* footprint is nonzero for u in (-Deltaxy-DeltaChannel, Deltaxy); */
+    /* sample at the resolution of the pixel profile lookup table     */
+    otf->du = otf->Deltaxy/LEN_PIX;
+    otf->u_min = -otf->Deltaxy - otf->DeltaChannel;
+    otf->Nprof = (int)((2.0*otf->Deltaxy + otf->DeltaChannel)/otf->du) + 2;
 
-                A_Padded_Map[jj][VoxelPosition].val = (unsigned char *)get_spc(totalSum[i], sizeof(unsigned char));
-                A_Padded_Map[jj][VoxelPosition].pieceWiseMin = (channel_t *)get_spc(NViewSets,sizeof(channel_t));
-                A_Padded_Map[jj][VoxelPosition].pieceWiseWidth = (channel_t *)get_spc(NViewSets,sizeof(channel_t));
-                A_Padded_Map[jj][VoxelPosition].length = totalSum[i];
-                memcpy(&A_Padded_Map[jj][VoxelPosition].val[0],&AMatrixPaddedTranspose[i][0],sizeof(unsigned char)*totalSum[i]);
-                memcpy(&A_Padded_Map[jj][VoxelPosition].pieceWiseMin[0],&piecewiseMin[i][0],sizeof(channel_t)*NViewSets);
-                memcpy(&A_Padded_Map[jj][VoxelPosition].pieceWiseWidth[0],&piecewiseWidth[i][0],sizeof(channel_t)*NViewSets);
-            }
+    float **pix_prof = ComputePixelProfLookup(imgparams->Deltaxy);
+    otf->prof = (float **)multialloc(sizeof(float),2,otf->NViews,otf->Nprof);
 
-            for(i=0;i<SVSize;i++) {
-                free((void *)AMatrixPadded[i]);
-                free((void *)AMatrixPaddedTranspose[i]);
-            }
-            free((void *)AMatrixPadded);
-            free((void *)AMatrixPaddedTranspose);
-        } //omp for block
+    #pragma omp parallel for private(j,k)
+    for(i=0; i<otf->NViews; i++)
+    for(j=0; j<otf->Nprof; j++)
+    {
+        float u = otf->u_min + j*otf->du;
+        float Aval = 0;
+        for (k = 0; k < LEN_DET; k++)
+            Aval += dprof[k]*PixProjLookup(pix_prof, otf->Deltaxy, sinoparams->ViewAngles[i], u+k*detSampleD);
+        otf->prof[i][j] = Aval;
+    }
 
-        multifree(piecewiseMin,2);
-        multifree(piecewiseMax,2);
-        multifree(piecewiseWidth,2);
-        free((void *) bandMin);
-        free((void *) bandMax);
-        free((void *) bandWidth);
-        free((void *) bandWidthPW);
-        free((void *) jx_list);
-        free((void *) jy_list);
-        free((void *) totalSum);
+    free_img((void **)pix_prof);
+    return(otf);
+}
 
-    }   //omp parallel block
 
-    free((void *) order);
+void AmatrixOTFFree(struct AmatrixOTF *otf)
+{
+    if(otf == NULL)
+        return;
+    free((void *)otf->cosTheta);
+    free((void *)otf->sinTheta);
+    free((void *)otf->t_start);
+    multifree(otf->prof,2);
+    free((void *)otf);
+}
 
-}  /*** END A_piecewise() ***/
 
+/* Relevant detector index range for a pixel at t_pix. Mirrors A_comp_ij() */
+void A_OTFChannelRange(struct AmatrixOTF *otf, float t_pix, int *ind_min, int *ind_max)
+{
+    float t_min = t_pix - otf->Deltaxy;
+    float t_max = t_pix + otf->Deltaxy;
 
+    *ind_min = ceil((t_min-otf->t_0)/otf->DeltaChannel - 0.5);
+    *ind_max = floor((t_max-otf->t_0)/otf->DeltaChannel + 0.5);
+}
 
-/* Compute Entire System Matrix */
-/* The System matrix does not vary with slice for 3-D Parallel Geometry */
-/* So, the method of compuatation is same as that of 2-D Parallel Geometry */
 
-void A_comp(
-    struct AValues_char **A_Padded_Map,
-    float *Aval_max_ptr,
-    struct SVParams svpar,
-    struct SinoParams3DParallel *sinoparams,
-    char *recon_mask,
-    struct ImageParams3D *imgparams)
+/* Footprint lookup for detector cell i of the given view */
+float A_OTFLookup(struct AmatrixOTF *otf, int view, int i, float t_pix)
 {
-    int i,j,r;
-    struct ACol **ACol_arr;
-    struct AValues_char **AVal_arr;
-    int NViews = sinoparams->NViews;
-    int NChannels = sinoparams->NChannels;
-    int Nx = imgparams->Nx;
-    int Ny = imgparams->Ny;
+    int j = (int)((otf->t_start[i] - t_pix - otf->u_min)/otf->du + 0.5);
+    if(j<0 || j>=otf->Nprof)
+        return 0.0;
+    return otf->prof[view][j];
+}
 
-    ACol_arr = (struct ACol **)multialloc(sizeof(struct ACol), 2, Ny, Nx);
-    AVal_arr = (struct AValues_char **)multialloc(sizeof(struct AValues_char), 2, Ny, Nx);
 
-    float **pix_prof = ComputePixelProfLookup(imgparams->Deltaxy);
+/* Compute the System Matrix column for a given pixel from the footprint tables */
+void A_comp_ij_OTF(
+    int im_row,
+    int im_col,
+    struct AmatrixOTF *otf,
+    struct ACol *A_col,
+    float *A_Values)
+{
+    int i, pr, ind_min, ind_max, proj_count;
+    int NChannels = otf->NChannels;
+    float x, y, t_pix, Aval;
 
-    //struct timeval tm1,tm2;
-    //unsigned long long tdiff;
-    //gettimeofday(&tm1,NULL);
+    y = otf->y_0 + im_row*otf->Deltaxy;
+    x = otf->x_0 + im_col*otf->Deltaxy;
 
-    #pragma omp parallel private(j,r)
+    proj_count = 0;
+    for (pr = 0; pr < otf->NViews; pr++)
     {
-        struct ACol A_col_sgl;
+        int countTemp=proj_count;
+        int write=1;
+        int minCount=0;
+
+        t_pix = y*otf->cosTheta[pr] - x*otf->sinTheta[pr];
+        A_OTFChannelRange(otf,t_pix,&ind_min,&ind_max);
+
+        if(ind_max<0 || ind_min>NChannels-1)
+        {
+            A_col->countTheta[pr]=0;
+            A_col->minIndex[pr]=0;
+            continue;
+        }
+        ind_min = (ind_min<0) ? 0 : ind_min;
+        ind_max = (ind_max>=NChannels) ? NChannels-1 : ind_max;
+
+        for (i = ind_min; i <= ind_max; i++)
+        {
+            Aval = A_OTFLookup(otf,pr,i,t_pix);
+            if (Aval > 0.0)
+            {
+                if(write==1) {
+                    minCount=i;
+                    write=0;
+                }
+                A_Values[proj_count] = Aval;
+                proj_count++;
+            }
+        }
+        const int overflow_val = 1 << (8*sizeof(chanwidth_t));
+        if(proj_count-countTemp >= overflow_val) {
+            fprintf(stderr,"A_comp_ij_OTF() Error: overflow detected--check voxel/detector dimensions\n");
+            exit(-1);
+        }
+        A_col->countTheta[pr] = proj_count-countTemp;
+        A_col->minIndex[pr] = minCount;
+    }
+
+    A_col->n_index = proj_count;
+}
+
+
+/* Regenerate the padded, transposed footprint of voxel (im_row,im_col) into A_dst, */
+/* in the same layout A_piecewise_SV() would have stored in A_padded->val.         */
+void A_genFootprintOTF(
+    unsigned char *A_dst,
+    struct AValues_char *A_padded,
+    channel_t *bandMin,
+    int im_row,
+    int im_col,
+    float Aval_max,
+    struct SVParams svpar)
+{
+    int p,q,t,pr,i,ind_min,ind_max;
+    struct AmatrixOTF *otf = svpar.otf;
+    int pieceLength = svpar.pieceLength;
+    int NViewSets = A_NUM_PIECES(otf->NViews,pieceLength);
+    int kBits = (svpar.Abits==16) ? 16 : 8;
+    float x, y, t_pix, Aval;
+
+    y = otf->y_0 + im_row*otf->Deltaxy;
+    x = otf->x_0 + im_col*otf->Deltaxy;
+
+    for(p=0; p<NViewSets; p++)
+    {
+        int myCount = A_padded->pieceWiseWidth[p];
+        int pieceMin = A_padded->pieceWiseMin[p];
+        int PL = A_PIECE_LENGTH(p,otf->NViews,pieceLength);
+
+        for(t=0; t<PL; t++)
+        {
+            pr = p*pieceLength+t;
+            t_pix = y*otf->cosTheta[pr] - x*otf->sinTheta[pr];
+            A_OTFChannelRange(otf,t_pix,&ind_min,&ind_max);
+
+            for(q=0; q<myCount; q++)
+            {
+                i = bandMin[pr] + pieceMin + q;
+                Aval = 0.0;
+                if(i>=ind_min && i<=ind_max)
+                    Aval = A_OTFLookup(otf,pr,i,t_pix);
+                A_putValue(A_dst,q*PL+t,(Aval > 0.0) ? A_quantize(Aval,Aval_max,svpar.Abits) : 0,kBits);
+            }
+        }
+        A_dst += myCount*PL*A_KERNEL_BYTES(svpar.Abits);
+    }
+}
+
+
+/* Compute the SV layout and per-pixel scaling for the matrix-free mode.    */
+/* Columns are built one super-voxel at a time so the full set of columns */
+/* (about the size of the stored matrix) is never resident.              */
+void A_comp_OTF(
+    struct AValues_char **A_Padded_Map,
+    float *Aval_max_ptr,
+    struct SVParams svpar,
+    struct SinoParams3DParallel *sinoparams,
+    char *recon_mask,
+    struct ImageParams3D *imgparams)
+{
+    int i,j,jj,t;
+    int NViews = sinoparams->NViews;
+    int NChannels = sinoparams->NChannels;
+    int Nx = imgparams->Nx;
+    int Ny = imgparams->Ny;
+    int SVLength = svpar.SVLength;
+    int SVSizeMax = (2*SVLength+1)*(2*SVLength+1);
+    struct AmatrixOTF *otf = svpar.otf;
+
+    /* per-pixel quantization scale */
+    #pragma omp parallel private(j)
+    {
+        int r;
+        struct ACol A_col;
+        A_col.countTheta = (chanwidth_t *)get_spc(NViews,sizeof(chanwidth_t));
+        A_col.minIndex = (channel_t *)get_spc(NViews,sizeof(channel_t));
+        float *A_val_sgl = (float *)get_spc(NViews*NChannels, sizeof(float));
+
+        #pragma omp for schedule(static)
+        for (i=0; i<Ny; i++)
+        for (j=0; j<Nx; j++)
+        if(recon_mask[i*Nx+j])
+        {
+            A_comp_ij_OTF(i,j,otf,&A_col,A_val_sgl);
+            float maxval = A_val_sgl[0];
+            for (r = 0; r < A_col.n_index; r++) {
+                if(A_val_sgl[r]>maxval)
+                    maxval = A_val_sgl[r];
+            }
+            Aval_max_ptr[i*Nx+j] = maxval;
+        }
+        else
+            Aval_max_ptr[i*Nx+j] = 0;
+
+        free((void *)A_val_sgl);
+        free((void *)A_col.countTheta);
+        free((void *)A_col.minIndex);
+    }
+
+    int *order = (int *) mget_spc(svpar.Nsv,sizeof(int));
+    t=0;
+    for(i=0; i<Ny; i+=(SVLength*2-svpar.overlap))
+    for(j=0; j<Nx; j+=(SVLength*2-svpar.overlap)) {
+        order[t]=i*Nx+j;
+        t++;
+    }
+
+    for(jj=0; jj<svpar.Nsv; jj++)
+    for(i=0; i<SVSizeMax; i++) {
+        A_Padded_Map[jj][i].val=NULL;
+        A_Padded_Map[jj][i].length=0;
+    }
+
+    /* SV layout from columns computed locally for each SV */
+    #pragma omp parallel private(i)
+    {
+        int jx,jy,jx_new,jy_new,SVSize;
+        int *jx_list = (int *) mget_spc(SVSizeMax,sizeof(int));
+        int *jy_list = (int *) mget_spc(SVSizeMax,sizeof(int));
+        struct ACol *A_col = (struct ACol *) mget_spc(SVSizeMax,sizeof(struct ACol));
+        struct ACol **A_cols = (struct ACol **) mget_spc(SVSizeMax,sizeof(struct ACol *));
+        float *A_val_sgl = (float *)get_spc(NViews*NChannels, sizeof(float));
+        for(i=0; i<SVSizeMax; i++) {
+            A_col[i].countTheta = (chanwidth_t *)get_spc(NViews,sizeof(chanwidth_t));
+            A_col[i].minIndex = (channel_t *)get_spc(NViews,sizeof(channel_t));
+        }
+
+        #pragma omp for schedule(static)
+        for(jj=0; jj<svpar.Nsv; jj++)
+        {
+            jy = order[jj] / Nx;
+            jx = order[jj] % Nx;
+            SVSize = 0;
+
+            for(jy_new=jy; jy_new<=(jy+2*SVLength); jy_new++)
+            for(jx_new=jx; jx_new<=(jx+2*SVLength); jx_new++)
+            if(jy_new<Ny && jx_new<Nx && recon_mask[jy_new*Nx+jx_new])
+            {
+                A_comp_ij_OTF(jy_new,jx_new,otf,&A_col[SVSize],A_val_sgl);
+                if(A_col[SVSize].n_index > 0) {
+                    A_fillEmptyViews(&A_col[SVSize],NViews);
+                    jy_list[SVSize] = jy_new;
+                    jx_list[SVSize] = jx_new;
+                    A_cols[SVSize] = &A_col[SVSize];
+                    SVSize++;
+                }
+            }
+
+            A_piecewise_SV(jj,jy,jx,SVSize,jy_list,jx_list,A_cols,NULL,A_Padded_Map,svpar,sinoparams);
+        }
+
+        for(i=0; i<SVSizeMax; i++) {
+            free((void *)A_col[i].countTheta);
+            free((void *)A_col[i].minIndex);
+        }
+        free((void *) A_col);
+        free((void *) A_cols);
+        free((void *) A_val_sgl);
+        free((void *) jx_list);
+        free((void *) jy_list);
+    }
+
+    free((void *) order);
+
+}  /*** END A_comp_OTF() ***/
+
+
+/*************************************************************/
+/* Symmetry-compact system matrix, parallel beam.            */
+/* For view angles closed under some of the symmetries of    */
+/* the square pixel grid, only one pixel per orbit stores    */
+/* its column; the others are remapped (view permutation and */
+/* channel mirror) when the footprint is needed.             */
+/*************************************************************/
+
+#define SYM_ANGLE_TOL 1e-4  /* tolerance (rad) for matching view angles */
+
+/* Map pixel (row,col) by op code; bit0: swap x/y, bit1: negate x, bit2: negate y */
+void A_symPixel(unsigned char code, int Nx, int Ny, int row, int col, int *row_out, int *col_out)
+{
+    int r=row, c=col, tmp;
+    if(code & 1) {
+        tmp = r; r = c; c = tmp;
+    }
+    if(code & 2)
+        c = Nx-1-c;
+    if(code & 4)
+        r = Ny-1-r;
+    *row_out = r;
+    *col_out = c;
+}
+
+
+struct AmatrixSym *AmatrixSymInit(
+    struct SinoParams3DParallel *sinoparams,
+    struct ImageParams3D *imgparams,
+    char verboseLevel)
+{
+    int g,k,kk;
+    int NViews = sinoparams->NViews;
+    unsigned char codes[8];
+    int Nop=0;
+    struct AmatrixSym *sym;
+
+    if(sinoparams->Geometry != 0) {
+        if(verboseLevel)
+            fprintf(stdout,"Note: view-angle symmetry only applies to parallel beam, using full matrix\n");
+        return(NULL);
+    }
+
+    /* channel mirror t -> -t is a channel permutation only if 2*CenterOffset is an integer */
+    float twoOffset = 2.0*sinoparams->CenterOffset;
+    int mirrorOK = (fabs(twoOffset-floor(twoOffset+0.5)) < 1e-3);
+    int mirrorSum = (sinoparams->NChannels-1) + (int)floor(twoOffset+0.5);
+
+    /* candidate view maps */
+    int *mapTmp = (int *) get_spc(8*NViews,sizeof(int));
+    char *flipTmp = (char *) get_spc(8*NViews,sizeof(char));
+
+    for(g=0; g<8; g++)
+    {
+        int ok = 1;
+        if((g & 1) && imgparams->Nx != imgparams->Ny)
+            continue;
+
+        for(k=0; k<NViews && ok; k++)
+        {
+            /* normal of view k is n=(-sin,cos); the op maps it to v=M*n */
+            double nx = -sin(sinoparams->ViewAngles[k]);
+            double ny = cos(sinoparams->ViewAngles[k]);
+            double vx,vy,tmp;
+            if(g & 1) {
+                tmp = nx; nx = ny; ny = tmp;
+            }
+            vx = (g & 2) ? -nx : nx;
+            vy = (g & 4) ? -ny : ny;
+            double phi = atan2(-vx,vy);
+
+            /* find the view with the same angle mod pi; odd multiples of pi flip t */
+            ok = 0;
+            for(kk=0; kk<NViews; kk++)
+            {
+                double d = sinoparams->ViewAngles[kk] - phi;
+                double m = floor(d/PI+0.5);
+                if(fabs(d-m*PI) < SYM_ANGLE_TOL)
+                {
+                    char flip = ((long)m % 2 != 0);
+                    if(flip && !mirrorOK)
+                        continue;
+                    mapTmp[Nop*NViews+k] = kk;
+                    flipTmp[Nop*NViews+k] = flip;
+                    ok = 1;
+                    break;
+                }
+            }
+        }
+        if(ok)
+            codes[Nop++] = g;
+    }
+
+    if(Nop < 2) {
+        if(verboseLevel)
+            fprintf(stdout,"Note: no view-angle symmetry found, using full matrix\n");
+        free((void *)mapTmp);
+        free((void *)flipTmp);
+        return(NULL);
+    }
+
+    sym = (struct AmatrixSym *) get_spc(1,sizeof(struct AmatrixSym));
+    sym->Nop = Nop;
+    sym->NViews = NViews;
+    sym->NChannels = sinoparams->NChannels;
+    sym->Nx = imgparams->Nx;
+    sym->Nxy = imgparams->Nx*imgparams->Ny;
+    sym->mirrorSum = mirrorSum;
+    memcpy(sym->opCode,codes,Nop);
+    sym->viewMap = (int **)multialloc(sizeof(int),2,Nop,NViews);
+    sym->viewFlip = (char **)multialloc(sizeof(char),2,Nop,NViews);
+    memcpy(&sym->viewMap[0][0],mapTmp,sizeof(int)*Nop*NViews);
+    memcpy(&sym->viewFlip[0][0],flipTmp,sizeof(char)*Nop*NViews);
+    free((void *)mapTmp);
+    free((void *)flipTmp);
+    sym->rep = (int *) get_spc(sym->Nxy,sizeof(int));
+    sym->op = (unsigned char *) get_spc(sym->Nxy,sizeof(unsigned char));
+    sym->Nrep = 0;
+    sym->stride = 0;
+    sym->minIndex = NULL;
+    sym->count = NULL;
+    sym->val = NULL;
+
+    if(verboseLevel>1)
+        fprintf(stdout,"\tview-angle symmetry: %d of 8 grid symmetries apply\n",Nop);
+
+    return(sym);
+}
+
+
+void AmatrixSymFree(struct AmatrixSym *sym)
+{
+    if(sym == NULL)
+        return;
+    multifree(sym->viewMap,2);
+    multifree(sym->viewFlip,2);
+    free((void *)sym->rep);
+    free((void *)sym->op);
+    if(sym->Nrep > 0) {
+        multifree(sym->minIndex,2);
+        multifree(sym->count,2);
+        multifree(sym->val,2);
+    }
+    free((void *)sym);
+}
+
+
+/* Column of a canonical pixel, parallel beam. Same computation as A_comp_ij() but */
+/* not clipped to the detector, since a mirrored pixel may see the other end.     */
+/* Values for view pr are stored in A_Values[pr*stride...]                         */
+void A_comp_ij_sym(
+    int im_row,
+    int im_col,
+    struct SinoParams3DParallel *sinoparams,
+    struct ImageParams3D *imgparams,
+    float **pix_prof,
+    int stride,
+    int *minIndex,
+    chanwidth_t *count,
+    float *A_Values)
+{
+    int i, k, pr, ind_min, ind_max;
+    float dprof[LEN_DET];
+    float t_0, x_0, y_0, x, y;
+    float t, t_pix, t_min, t_max, t_start;
+    float Aval, detSampleD;
+
+    float Deltaxy = imgparams->Deltaxy;
+    int NChannels = sinoparams->NChannels;
+    float DeltaChannel = sinoparams->DeltaChannel;
+
+    for (k = 0; k < LEN_DET; k++)
+        dprof[k] = 1.0/(LEN_DET);
+
+    if(LEN_DET > 1)
+        detSampleD = DeltaChannel/(LEN_DET-1);
+    else
+        detSampleD = DeltaChannel/2.0;
+
+    t_0 = -(NChannels-1)*DeltaChannel/2.0 - sinoparams->CenterOffset * DeltaChannel;
+    x_0 = -(imgparams->Nx-1)*Deltaxy/2.0;
+    y_0 = -(imgparams->Ny-1)*Deltaxy/2.0;
+
+    y = y_0 + im_row*Deltaxy;
+    x = x_0 + im_col*Deltaxy;
+
+    for (pr = 0; pr < sinoparams->NViews; pr++)
+    {
+        int n=0;
+        float view_angle = sinoparams->ViewAngles[pr];
+
+        t_pix = y*cosf(view_angle) - x*sinf(view_angle);
+        t_min = t_pix - Deltaxy;
+        t_max = t_pix + Deltaxy;
+
+        ind_min = ceil((t_min-t_0)/DeltaChannel - 0.5);
+        ind_max= floor((t_max-t_0)/DeltaChannel + 0.5);
+
+        minIndex[pr] = 0;
+        for (i = ind_min; i <= ind_max; i++)
+        {
+            Aval = 0;
+            t_start = t_0 - DeltaChannel/2.0 + i*DeltaChannel;
+            for (k = 0; k < LEN_DET; k++)
+            {
+                t = t_start + k*detSampleD;
+                Aval += dprof[k]*PixProjLookup(pix_prof, Deltaxy, view_angle, t-t_pix);
+            }
+            if (Aval > 0.0)
+            {
+                if(n==0)
+                    minIndex[pr] = i;
+                if(n >= stride) {
+                    fprintf(stderr,"A_comp_ij_sym() Error: footprint wider than expected\n");
+                    exit(-1);
+                }
+                A_Values[pr*stride+n] = Aval;
+                n++;
+            }
+        }
+        count[pr] = n;
+    }
+}
+
+
+/* Clipped column (start/count per view) of a pixel, remapped from its canonical column */
+void A_symColumn(struct AmatrixSym *sym, int pixel, struct ACol *A_col)
+{
+    int k;
+    int r = sym->rep[pixel];
+    int g = sym->op[pixel];
+    int NChannels = sym->NChannels;
+
+    A_col->n_index = 0;
+    for(k=0; k<sym->NViews; k++)
+    {
+        int kk = sym->viewMap[g][k];
+        int n = sym->count[r][kk];
+        int lo = sym->minIndex[r][kk];
+        int hi = lo + n - 1;
+        if(sym->viewFlip[g][k]) {
+            lo = sym->mirrorSum - hi;
+            hi = sym->mirrorSum - sym->minIndex[r][kk];
+        }
+        lo = (lo<0) ? 0 : lo;
+        hi = (hi>=NChannels) ? NChannels-1 : hi;
+
+        if(n==0 || hi<lo) {
+            A_col->countTheta[k] = 0;
+            A_col->minIndex[k] = 0;
+        }
+        else {
+            A_col->countTheta[k] = hi-lo+1;
+            A_col->minIndex[k] = lo;
+            A_col->n_index += hi-lo+1;
+        }
+    }
+}
+
+
+/* Values of the column from A_symColumn(), in column order and kernel format */
+void A_symValues(struct AmatrixSym *sym, int pixel, struct ACol *A_col, unsigned char *val, int Abits)
+{
+    int k,c;
+    int r = sym->rep[pixel];
+    int g = sym->op[pixel];
+    int kBits = (Abits==16) ? 16 : 8;
+    size_t n=0;
+
+    for(k=0; k<sym->NViews; k++)
+    {
+        int kk = sym->viewMap[g][k];
+        size_t v0 = (size_t)kk*sym->stride;
+        for(c=A_col->minIndex[k]; c<A_col->minIndex[k]+A_col->countTheta[k]; c++)
+        {
+            int idx = sym->viewFlip[g][k] ? sym->mirrorSum-c-sym->minIndex[r][kk] : c-sym->minIndex[r][kk];
+            A_putValue(val,n++,A_getValue(sym->val[r],v0+idx,kBits),kBits);
+        }
+    }
+}
+
+
+/* Padded, transposed footprint of a voxel from its canonical column (see A_genFootprintOTF). */
+/* Entry q of view k is entry idx0+step*q of the canonical view viewMap[k], step=-1 if the   */
+/* view is mirrored, so only the run of q where that index is in range has to be copied.    */
+void A_genFootprintSym(
+    unsigned char *A_dst,
+    struct AValues_char *A_padded,
+    channel_t *bandMin,
+    int pixel,
+    struct SVParams svpar)
+{
+    int p,q,t;
+    struct AmatrixSym *sym = svpar.sym;
+    int pieceLength = svpar.pieceLength;
+    int NViewSets = A_NUM_PIECES(sym->NViews,pieceLength);
+    int r = sym->rep[pixel];
+    int *viewMap = sym->viewMap[sym->op[pixel]];
+    char *viewFlip = sym->viewFlip[sym->op[pixel]];
+    int *minIndex = sym->minIndex[r];
+    chanwidth_t *count = sym->count[r];
+    unsigned char *v8 = sym->val[r];
+    unsigned short *v16 = (unsigned short *)sym->val[r];
+    int Abytes = A_KERNEL_BYTES(svpar.Abits);
+
+    memset(A_dst,0,(size_t)A_padded->length*Abytes);
+
+    for(p=0; p<NViewSets; p++)
+    {
+        int myCount = A_padded->pieceWiseWidth[p];
+        int pieceMin = A_padded->pieceWiseMin[p];
+        int PL = A_PIECE_LENGTH(p,sym->NViews,pieceLength);
+        unsigned short *d16 = (unsigned short *)A_dst;
+
+        for(t=0; t<PL; t++)
+        {
+            int k = p*pieceLength+t;
+            int kk = viewMap[k];
+            int c0 = bandMin[k] + pieceMin;
+            int idx0,step,q0,q1;
+
+            if(viewFlip[k]) {
+                idx0 = sym->mirrorSum - c0 - minIndex[kk];
+                step = -1;
+                q0 = idx0 - count[kk] + 1;
+                q1 = idx0 + 1;
+            }
+            else {
+                idx0 = c0 - minIndex[kk];
+                step = 1;
+                q0 = -idx0;
+                q1 = count[kk] - idx0;
+            }
+            idx0 += kk*sym->stride;
+            q0 = (q0 > 0) ? q0 : 0;
+            q1 = (q1 < myCount) ? q1 : myCount;
+            q1 = (q1 < sym->NChannels-c0) ? q1 : sym->NChannels-c0;
+
+            if(Abytes == 2)
+                for(q=q0; q<q1; q++)
+                    d16[q*PL+t] = v16[idx0+step*q];
+            else
+                for(q=q0; q<q1; q++)
+                    A_dst[q*PL+t] = v8[idx0+step*q];
+        }
+        A_dst += myCount*PL*Abytes;
+    }
+}
+
+
+/* Padded, transposed footprint of voxel (im_row,im_col) in kernel format (see A_KERNEL_BYTES). */
+/* Returns the stored values directly, or regenerates/unpacks them into A_scratch when the      */
+/* matrix is matrix-free, symmetry-compact or 4-bit packed.                                     */
+unsigned char *A_getFootprint(
+    unsigned char *A_scratch,
+    struct AValues_char *A_padded,
+    channel_t *bandMin,
+    int im_row,
+    int im_col,
+    float Aval_max,
+    struct SVParams svpar)
+{
+    int i;
+
+    if(A_padded->val == NULL)
+    {
+        if(svpar.sym != NULL)
+            A_genFootprintSym(A_scratch,A_padded,bandMin,im_row*svpar.sym->Nx+im_col,svpar);
+        else
+            A_genFootprintOTF(A_scratch,A_padded,bandMin,im_row,im_col,Aval_max,svpar);
+        return(A_scratch);
+    }
+    if(svpar.Abits == 4)
+    {
+        unsigned char *val = A_padded->val;
+        for(i=0; i+1<A_padded->length; i+=2) {
+            A_scratch[i] = val[i>>1] & 0x0F;
+            A_scratch[i+1] = val[i>>1] >> 4;
+        }
+        if(i < A_padded->length)
+            A_scratch[i] = val[i>>1] & 0x0F;
+        return(A_scratch);
+    }
+    return(A_padded->val);
+}
+
+
+/* Canonical columns of the pixels in recon_mask. The unclipped column of each orbit is */
+/* computed once and quantized once per distinct scale among the orbit's pixels, the    */
+/* scale of a pixel being the max of its own column clipped to the detector as in       */
+/* A_comp(). So every pixel keeps its own Aval_max, and rep[] points it at the column  */
+/* of its scale. A_comp() expands the full matrix of a symmetric view set from the same */
+/* columns, so both storage modes hold exactly the same matrix.                        */
+void A_symCanonical(
+    struct AmatrixSym *sym,
+    float *Aval_max_ptr,
+    int Abits,
+    struct SinoParams3DParallel *sinoparams,
+    char *recon_mask,
+    struct ImageParams3D *imgparams)
+{
+    int i,j,o,g;
+    int NViews = sinoparams->NViews;
+    int NChannels = sinoparams->NChannels;
+    int Nx = imgparams->Nx;
+    int Ny = imgparams->Ny;
+    int Abytes = A_KERNEL_BYTES(Abits);
+    int kBits = (Abits==16) ? 16 : 8;
+    int Norbit = 0;
+
+    /* canonical pixel of each orbit is the one with the smallest index */
+    int *orbitPixel = (int *) get_spc(Nx*Ny,sizeof(int));
+    int *orbitId = (int *) get_spc(Nx*Ny,sizeof(int));
+    int *pixOrbit = (int *) get_spc(Nx*Ny,sizeof(int));
+    for(i=0; i<Nx*Ny; i++)
+        orbitId[i] = -1;
+
+    for(i=0; i<Ny; i++)
+    for(j=0; j<Nx; j++)
+    {
+        int best=i*Nx+j, bestOp=0;
+        for(g=1; g<sym->Nop; g++)
+        {
+            int r,c;
+            A_symPixel(sym->opCode[g],Nx,Ny,i,j,&r,&c);
+            if(r*Nx+c < best) {
+                best = r*Nx+c;
+                bestOp = g;
+            }
+        }
+        sym->op[i*Nx+j] = bestOp;
+        sym->rep[i*Nx+j] = -1;
+        pixOrbit[i*Nx+j] = -1;
+        Aval_max_ptr[i*Nx+j] = 0;
+        if(recon_mask[i*Nx+j])
+        {
+            if(orbitId[best] < 0) {
+                orbitId[best] = Norbit;
+                orbitPixel[Norbit] = best;
+                Norbit++;
+            }
+            pixOrbit[i*Nx+j] = orbitId[best];
+        }
+    }
+
+    /* masked pixels of each orbit */
+    int *memberStart = (int *) get_spc(Norbit+1,sizeof(int));
+    int *member = (int *) get_spc(Nx*Ny,sizeof(int));
+    int *memberClass = (int *) get_spc(Nx*Ny,sizeof(int));
+    for(i=0; i<Nx*Ny; i++)
+    if(pixOrbit[i] >= 0)
+        memberStart[pixOrbit[i]+1]++;
+    for(o=0; o<Norbit; o++)
+        memberStart[o+1] += memberStart[o];
+    for(i=0; i<Nx*Ny; i++)
+    if(pixOrbit[i] >= 0)
+        member[memberStart[pixOrbit[i]]++] = i;
+    for(o=Norbit; o>0; o--)
+        memberStart[o] = memberStart[o-1];
+    memberStart[0] = 0;
+
+    /* footprint can't be wider than 2*Deltaxy/DeltaChannel+2 channels */
+    sym->stride = (int)(2.0*imgparams->Deltaxy/sinoparams->DeltaChannel) + 3;
+
+    /* columns of each orbit, one value block per scale; packed below */
+    int **orbitMin = (int **) get_spc((Norbit>0)?Norbit:1,sizeof(int *));
+    chanwidth_t **orbitCount = (chanwidth_t **) get_spc((Norbit>0)?Norbit:1,sizeof(chanwidth_t *));
+    unsigned char **orbitVal = (unsigned char **) get_spc((Norbit>0)?Norbit:1,sizeof(unsigned char *));
+    int *orbitStart = (int *) get_spc(Norbit+1,sizeof(int));
+    float **pix_prof = ComputePixelProfLookup(imgparams->Deltaxy);
+
+    #pragma omp parallel private(j)
+    {
+        int k,n,m;
+        float scale[8];
+        float *A_val_sgl = (float *)get_spc(NViews*sym->stride, sizeof(float));
+
+        #pragma omp for schedule(dynamic)
+        for(o=0; o<Norbit; o++)
+        {
+            int Nscale = 0;
+            orbitMin[o] = (int *) get_spc(NViews,sizeof(int));
+            orbitCount[o] = (chanwidth_t *) get_spc(NViews,sizeof(chanwidth_t));
+            A_comp_ij_sym(orbitPixel[o]/Nx,orbitPixel[o]%Nx,sinoparams,imgparams,pix_prof,sym->stride,orbitMin[o],orbitCount[o],A_val_sgl);
+
+            for(m=memberStart[o]; m<memberStart[o+1]; m++)
+            {
+                int *viewMap = sym->viewMap[sym->op[member[m]]];
+                char *viewFlip = sym->viewFlip[sym->op[member[m]]];
+                float maxval = 0;
+                for(k=0; k<NViews; k++)
+                for(n=0; n<orbitCount[o][viewMap[k]]; n++)
+                {
+                    int c = viewFlip[k] ? sym->mirrorSum-orbitMin[o][viewMap[k]]-n : orbitMin[o][viewMap[k]]+n;
+                    float v = A_val_sgl[viewMap[k]*sym->stride+n];
+                    if(c>=0 && c<NChannels && v>maxval)
+                        maxval = v;
+                }
+                for(j=0; j<Nscale && scale[j]!=maxval; j++);
+                if(j == Nscale)
+                    scale[Nscale++] = maxval;
+                memberClass[m] = j;
+                Aval_max_ptr[member[m]] = maxval;
+            }
+
+            orbitStart[o+1] = Nscale;
+            orbitVal[o] = (unsigned char *) get_spc((size_t)Nscale*NViews*sym->stride,Abytes);
+            for(j=0; j<Nscale; j++)
+            if(scale[j] > 0)
+            for(k=0; k<NViews; k++)
+            for(n=0; n<orbitCount[o][k]; n++)
+                A_putValue(orbitVal[o],((size_t)j*NViews+k)*sym->stride+n,A_quantize(A_val_sgl[k*sym->stride+n],scale[j],Abits),kBits);
+        }
+        free((void *)A_val_sgl);
+    }
+
+    for(o=0; o<Norbit; o++)
+        orbitStart[o+1] += orbitStart[o];
+    sym->Nrep = orbitStart[Norbit];
+    if(sym->Nrep > 0) {
+        sym->minIndex = (int **)multialloc(sizeof(int),2,sym->Nrep,NViews);
+        sym->count = (chanwidth_t **)multialloc(sizeof(chanwidth_t),2,sym->Nrep,NViews);
+        sym->val = (unsigned char **)multialloc(Abytes,2,sym->Nrep,NViews*sym->stride);
+    }
+    for(o=0; o<Norbit; o++)
+    {
+        for(j=orbitStart[o]; j<orbitStart[o+1]; j++)
+        {
+            memcpy(sym->minIndex[j],orbitMin[o],NViews*sizeof(int));
+            memcpy(sym->count[j],orbitCount[o],NViews*sizeof(chanwidth_t));
+            memcpy(sym->val[j],orbitVal[o]+(size_t)(j-orbitStart[o])*NViews*sym->stride*Abytes,(size_t)NViews*sym->stride*Abytes);
+        }
+        for(i=memberStart[o]; i<memberStart[o+1]; i++)
+            sym->rep[member[i]] = orbitStart[o] + memberClass[i];
+        free((void *)orbitMin[o]);
+        free((void *)orbitCount[o]);
+        free((void *)orbitVal[o]);
+    }
+
+    free_img((void **)pix_prof);
+    free((void *)orbitMin);
+    free((void *)orbitCount);
+    free((void *)orbitVal);
+    free((void *)orbitStart);
+    free((void *)memberStart);
+    free((void *)member);
+    free((void *)memberClass);
+    free((void *)orbitPixel);
+    free((void *)orbitId);
+    free((void *)pixOrbit);
+}
+
+
+/* Compute the canonical columns and the SV layout of the symmetry-compact matrix */
+void A_comp_sym(
+    struct AValues_char **A_Padded_Map,
+    float *Aval_max_ptr,
+    struct SVParams svpar,
+    struct SinoParams3DParallel *sinoparams,
+    char *recon_mask,
+    struct ImageParams3D *imgparams)
+{
+    int i,j,jj,t;
+    int NViews = sinoparams->NViews;
+    int Nx = imgparams->Nx;
+    int Ny = imgparams->Ny;
+    int SVLength = svpar.SVLength;
+    int SVSizeMax = (2*SVLength+1)*(2*SVLength+1);
+    struct AmatrixSym *sym = svpar.sym;
+
+    A_symCanonical(sym,Aval_max_ptr,svpar.Abits,sinoparams,recon_mask,imgparams);
+
+    int *order = (int *) mget_spc(svpar.Nsv,sizeof(int));
+    t=0;
+    for(i=0; i<Ny; i+=(SVLength*2-svpar.overlap))
+    for(j=0; j<Nx; j+=(SVLength*2-svpar.overlap)) {
+        order[t]=i*Nx+j;
+        t++;
+    }
+
+    for(jj=0; jj<svpar.Nsv; jj++)
+    for(i=0; i<SVSizeMax; i++) {
+        A_Padded_Map[jj][i].val=NULL;
+        A_Padded_Map[jj][i].length=0;
+    }
+
+    /* SV layout from the remapped columns */
+    #pragma omp parallel private(i)
+    {
+        int jx,jy,jx_new,jy_new,SVSize;
+        int *jx_list = (int *) mget_spc(SVSizeMax,sizeof(int));
+        int *jy_list = (int *) mget_spc(SVSizeMax,sizeof(int));
+        struct ACol *A_col = (struct ACol *) mget_spc(SVSizeMax,sizeof(struct ACol));
+        struct ACol **A_cols = (struct ACol **) mget_spc(SVSizeMax,sizeof(struct ACol *));
+        for(i=0; i<SVSizeMax; i++) {
+            A_col[i].countTheta = (chanwidth_t *)get_spc(NViews,sizeof(chanwidth_t));
+            A_col[i].minIndex = (channel_t *)get_spc(NViews,sizeof(channel_t));
+        }
+
+        #pragma omp for schedule(static)
+        for(jj=0; jj<svpar.Nsv; jj++)
+        {
+            jy = order[jj] / Nx;
+            jx = order[jj] % Nx;
+            SVSize = 0;
+
+            for(jy_new=jy; jy_new<=(jy+2*SVLength); jy_new++)
+            for(jx_new=jx; jx_new<=(jx+2*SVLength); jx_new++)
+            if(jy_new<Ny && jx_new<Nx && sym->rep[jy_new*Nx+jx_new]>=0)
+            {
+                A_symColumn(sym,jy_new*Nx+jx_new,&A_col[SVSize]);
+                if(A_col[SVSize].n_index > 0) {
+                    A_fillEmptyViews(&A_col[SVSize],NViews);
+                    jy_list[SVSize] = jy_new;
+                    jx_list[SVSize] = jx_new;
+                    A_cols[SVSize] = &A_col[SVSize];
+                    SVSize++;
+                }
+            }
+
+            A_piecewise_SV(jj,jy,jx,SVSize,jy_list,jx_list,A_cols,NULL,A_Padded_Map,svpar,sinoparams);
+        }
+
+        for(i=0; i<SVSizeMax; i++) {
+            free((void *)A_col[i].countTheta);
+            free((void *)A_col[i].minIndex);
+        }
+        free((void *) A_col);
+        free((void *) A_cols);
+        free((void *) jx_list);
+        free((void *) jy_list);
+    }
+
+    free((void *) order);
+
+}  /*** END A_comp_sym() ***/
+
+
+/* Resident size of the system matrix in bytes */
+size_t AmatrixMemory(
+    struct AValues_char **A_Padded_Map,
+    struct ImageParams3D *imgparams,
+    struct SinoParams3DParallel *sinoparams,
+    struct SVParams svpar)
+{
+    int i,j;
+    int NViews = sinoparams->NViews;
+    int NViewSets = A_NUM_PIECES(NViews,svpar.pieceLength);
+    int SVSize = (2*svpar.SVLength+1)*(2*svpar.SVLength+1);
+    size_t bytes;
+
+    bytes = (size_t)svpar.Nsv*SVSize*sizeof(struct AValues_char);
+    bytes += (size_t)svpar.Nsv*2*NViews*sizeof(channel_t);
+    bytes += (size_t)imgparams->Nx*imgparams->Ny*sizeof(float);
+
+    for(i=0; i<svpar.Nsv; i++)
+    for(j=0; j<SVSize; j++)
+    if(A_Padded_Map[i][j].length > 0)
+    {
+        bytes += 2*NViewSets*sizeof(channel_t);
+        if(A_Padded_Map[i][j].val != NULL)
+            bytes += A_valBytes(A_Padded_Map[i][j].length,svpar.Abits);
+    }
+
+    if(svpar.otf != NULL)
+    {
+        bytes += (size_t)NViews*(2*sizeof(float) + svpar.otf->Nprof*sizeof(float));
+        bytes += (size_t)svpar.otf->NChannels*sizeof(float);
+    }
+    if(svpar.sym != NULL)
+    {
+        struct AmatrixSym *sym = svpar.sym;
+        bytes += (size_t)sym->Nop*NViews*(sizeof(int)+sizeof(char));
+        bytes += (size_t)sym->Nxy*(sizeof(int)+sizeof(unsigned char));
+        bytes += (size_t)sym->Nrep*NViews*(sizeof(int)+sizeof(chanwidth_t)+sym->stride*A_KERNEL_BYTES(svpar.Abits));
+    }
+    return(bytes);
+}
+
+
+/* Compute Entire System Matrix */
+/* The System matrix does not vary with slice for 3-D Parallel Geometry */
+/* So, the method of compuatation is same as that of 2-D Parallel Geometry */
+
+void A_comp(
+    struct AValues_char **A_Padded_Map,
+    float *Aval_max_ptr,
+    struct SVParams svpar,
+    struct SinoParams3DParallel *sinoparams,
+    char *recon_mask,
+    struct ImageParams3D *imgparams)
+{
+    int i,j,r;
+    struct ACol **ACol_arr;
+    struct AValues_char **AVal_arr;
+    int NViews = sinoparams->NViews;
+    int NChannels = sinoparams->NChannels;
+    int Nx = imgparams->Nx;
+    int Ny = imgparams->Ny;
+
+    /* matrix-free mode: only the layout is stored */
+    if(svpar.otf != NULL) {
+        A_comp_OTF(A_Padded_Map,Aval_max_ptr,svpar,sinoparams,recon_mask,imgparams);
+        return;
+    }
+    /* symmetry-compact: canonical columns + layout */
+    if(svpar.sym != NULL) {
+        A_comp_sym(A_Padded_Map,Aval_max_ptr,svpar,sinoparams,recon_mask,imgparams);
+        return;
+    }
+
+    ACol_arr = (struct ACol **)multialloc(sizeof(struct ACol), 2, Ny, Nx);
+    AVal_arr = (struct AValues_char **)multialloc(sizeof(struct AValues_char), 2, Ny, Nx);
+
+    /* For a view set with grid symmetries the columns are expanded from the canonical */
+    /* columns, so the full and the symmetry-compact matrix hold the same values.       */
+    struct AmatrixSym *sym = AmatrixSymInit(sinoparams,imgparams,0);
+    if(sym != NULL)
+        A_symCanonical(sym,Aval_max_ptr,svpar.Abits,sinoparams,recon_mask,imgparams);
+
+    float **pix_prof = ComputePixelProfLookup(imgparams->Deltaxy);
+
+    //struct timeval tm1,tm2;
+    //unsigned long long tdiff;
+    //gettimeofday(&tm1,NULL);
+
+    #pragma omp parallel private(j,r)
+    {
+        struct ACol A_col_sgl;
         A_col_sgl.countTheta = (chanwidth_t *)get_spc(NViews,sizeof(chanwidth_t));
         A_col_sgl.minIndex = (channel_t *)get_spc(NViews,sizeof(channel_t));
         float *A_val_sgl = (float *)get_spc(NViews*NChannels, sizeof(float));
 
-        #pragma omp for schedule(static)
-        for (i=0; i<Ny; i++)
-        for (j=0; j<Nx; j++)
-        if(recon_mask[i*Nx+j])
+        #pragma omp for schedule(static)
+        for (i=0; i<Ny; i++)
+        for (j=0; j<Nx; j++)
+        if(recon_mask[i*Nx+j])
+        {
+            if(sym != NULL)
+                A_symColumn(sym,i*Nx+j,&A_col_sgl);
+            else
+                A_comp_ij(i,j,sinoparams,imgparams,pix_prof,&A_col_sgl,A_val_sgl);
+            ACol_arr[i][j].n_index = A_col_sgl.n_index;
+            ACol_arr[i][j].countTheta = (chanwidth_t *) get_spc(NViews,sizeof(chanwidth_t));
+            ACol_arr[i][j].minIndex = (channel_t *) get_spc(NViews,sizeof(channel_t));
+            AVal_arr[i][j].val = (unsigned char *) get_spc(A_col_sgl.n_index, A_KERNEL_BYTES(svpar.Abits));
+
+            /* Aval_max_ptr[] was set by A_symCanonical() */
+            if(sym != NULL)
+                A_symValues(sym,i*Nx+j,&A_col_sgl,AVal_arr[i][j].val,svpar.Abits);
+            else
+            {
+                float maxval = A_val_sgl[0];
+                for (r = 0; r < A_col_sgl.n_index; r++) {
+                    if(A_val_sgl[r]>maxval)
+                        maxval = A_val_sgl[r];
+                }
+                Aval_max_ptr[i*Nx+j] = maxval;
+
+                for (r=0; r < A_col_sgl.n_index; r++)
+                    A_putValue(AVal_arr[i][j].val,r,A_quantize(A_val_sgl[r],maxval,svpar.Abits),(svpar.Abits==16)?16:8);
+            }
+
+            for (r=0; r < NViews; r++) {
+                ACol_arr[i][j].countTheta[r] = A_col_sgl.countTheta[r];
+                ACol_arr[i][j].minIndex[r] = A_col_sgl.minIndex[r];
+            }
+        }
+        else
+        {
+            ACol_arr[i][j].n_index = 0;
+            Aval_max_ptr[i*Nx+j] = 0;
+        }
+
+        free((void *)A_val_sgl);
+        free((void *)A_col_sgl.countTheta);
+        free((void *)A_col_sgl.minIndex);
+    }
+
+    //gettimeofday(&tm2,NULL);
+    //tdiff = 1000 * (tm2.tv_sec - tm1.tv_sec) + (tm2.tv_usec - tm1.tv_usec) / 1000;
+    //fprintf(stdout,"matrix time 1 = %llu ms\n",tdiff);
+    //gettimeofday(&tm1,NULL);
+
+    A_piecewise(ACol_arr,AVal_arr,A_Padded_Map,svpar,sinoparams,imgparams);
+
+    //gettimeofday(&tm2,NULL);
+    //tdiff = 1000 * (tm2.tv_sec - tm1.tv_sec) + (tm2.tv_usec - tm1.tv_usec) / 1000;
+    //fprintf(stdout,"matrix time 2 = %llu ms\n",tdiff);
+
+    for (i=0; i<Ny; i++)
+    for (j=0; j<Nx; j++)
+    if(recon_mask[i*Nx+j]) {
+        free((void *)ACol_arr[i][j].countTheta);
+        free((void *)ACol_arr[i][j].minIndex);
+        free((void *)AVal_arr[i][j].val);
+    }
+    multifree(ACol_arr,2);
+    multifree(AVal_arr,2);
+
+    free_img((void **)pix_prof);
+    AmatrixSymFree(sym);
+
+}
+
+
+/*************************************************************/
+/* pieceLength selection. Candidates are compared by the     */
+/* padded footprint size of the SV layout, estimated from    */
+/* the detector range of each pixel, and optionally by a     */
+/* short timed run of the voxel-update inner loops.          */
+/*************************************************************/
+
+#define A_PIECE_OVERHEAD 160    /* modeled fixed cost (bytes) per piece and voxel update */
+#define A_PIECE_TRIAL_SVS 16    /* SVs sampled for the timed trial */
+#define A_PIECE_TRIAL_TOP 3     /* best modeled candidates that get timed */
+
+/* Detector range of a pixel column without the footprint values (see A_comp_ij) */
+void A_comp_ij_range(
+    int im_row,
+    int im_col,
+    struct SinoParams3DParallel *sinoparams,
+    struct ImageParams3D *imgparams,
+    struct ACol *A_col)
+{
+    int pr, ind_min, ind_max;
+    float t_pix, t_min, t_max, theta, alpha, D, M;
+    float Deltaxy = imgparams->Deltaxy;
+    int NChannels = sinoparams->NChannels;
+    float r_sd = sinoparams->DistSourceDetector;
+    float r_si = r_sd / sinoparams->Magnification;
+    float DeltaChannel = sinoparams->DeltaChannel;
+
+    if(sinoparams->Geometry == 1)   // fanbeam (curved array)
+        DeltaChannel = sinoparams->DeltaChannel / r_sd;
+
+    float t_0 = -(NChannels-1)*DeltaChannel/2.0 - sinoparams->CenterOffset * DeltaChannel;
+    float x = -(imgparams->Nx-1)*Deltaxy/2.0 + im_col*Deltaxy;
+    float y = -(imgparams->Ny-1)*Deltaxy/2.0 + im_row*Deltaxy;
+
+    A_col->n_index = 0;
+    for (pr = 0; pr < sinoparams->NViews; pr++)
+    {
+        A_pixelDetectorRange(sinoparams,Deltaxy,x,y,sinoparams->ViewAngles[pr],r_sd,r_si,&t_pix,&t_min,&t_max,&theta,&alpha,&D,&M);
+        ind_min = ceil((t_min-t_0)/DeltaChannel - 0.5);
+        ind_max = floor((t_max-t_0)/DeltaChannel + 0.5);
+        if(ind_max<0 || ind_min>NChannels-1)
+        {
+            A_col->countTheta[pr]=0;
+            A_col->minIndex[pr]=0;
+            continue;
+        }
+        ind_min = (ind_min<0) ? 0 : ind_min;
+        ind_max = (ind_max>=NChannels) ? NChannels-1 : ind_max;
+        A_col->countTheta[pr] = ind_max-ind_min+1;
+        A_col->minIndex[pr] = ind_min;
+        A_col->n_index += ind_max-ind_min+1;
+    }
+}
+
+
+/* Range columns of the pixels in the SV with first voxel (jy,jx); returns SVSize */
+int A_SVRangeColumns(
+    int jy,
+    int jx,
+    struct ACol *A_col,
+    struct ACol **A_cols,
+    struct SVParams svpar,
+    struct SinoParams3DParallel *sinoparams,
+    struct ImageParams3D *imgparams,
+    char *recon_mask)
+{
+    int jx_new,jy_new,SVSize=0;
+    int Nx = imgparams->Nx;
+    int Ny = imgparams->Ny;
+
+    for(jy_new=jy; jy_new<=(jy+2*svpar.SVLength); jy_new++)
+    for(jx_new=jx; jx_new<=(jx+2*svpar.SVLength); jx_new++)
+    if(jy_new<Ny && jx_new<Nx && recon_mask[jy_new*Nx+jx_new])
+    {
+        A_comp_ij_range(jy_new,jx_new,sinoparams,imgparams,&A_col[SVSize]);
+        if(A_col[SVSize].n_index > 0) {
+            A_fillEmptyViews(&A_col[SVSize],sinoparams->NViews);
+            A_cols[SVSize] = &A_col[SVSize];
+            SVSize++;
+        }
+    }
+    return(SVSize);
+}
+
+
+/* Time one visit of an SV with the given piece widths: per-piece error/weight */
+/* buffers are allocated and filled as in super_voxel_recon(), then the voxel  */
+/* update loops (theta sums and error update) run over SVDepth slices with the */
+/* kernel for Abits: 16-bit values, or 8-bit (4-bit ones unpacked into scratch */
+/* first, as A_getFootprint() does).                                           */
+double A_pieceTrial(
+    int SVSize,
+    int *width,
+    int NViews,
+    int pieceLength,
+    int SVDepth,
+    float *src,
+    unsigned char *A,
+    int Abits,
+    unsigned char *scratch)
+{
+    int i,p,t,k;
+    int NViewSets = A_NUM_PIECES(NViews,pieceLength);
+    float theta1=0, theta2=0;
+    struct timeval tm1,tm2;
+    float **E = (float **) mget_spc(NViewSets,sizeof(float *));
+    float **W = (float **) mget_spc(NViewSets,sizeof(float *));
+    size_t *len = (size_t *) mget_spc(NViewSets,sizeof(size_t));
+
+    gettimeofday(&tm1,NULL);
+    for(p=0; p<NViewSets; p++)
+    {
+        int bw = 0;
+        for(i=0; i<SVSize; i++)
+            if(width[i*NViewSets+p] > bw)
+                bw = width[i*NViewSets+p];
+        len[p] = (size_t)bw*A_PIECE_LENGTH(p,NViews,pieceLength);
+        E[p] = (float *) mget_spc(len[p]*SVDepth+1,sizeof(float));
+        W[p] = (float *) mget_spc(len[p]*SVDepth+1,sizeof(float));
+        memcpy(E[p],src,sizeof(float)*len[p]*SVDepth);
+        memcpy(W[p],src,sizeof(float)*len[p]*SVDepth);
+    }
+    for(i=0; i<SVSize; i++)
+    {
+        unsigned char *a = A;
+        if(Abits == 4)
+        {
+            int length = 0;
+            for(p=0; p<NViewSets; p++)
+                length += width[i*NViewSets+p]*A_PIECE_LENGTH(p,NViews,pieceLength);
+            for(t=0; t+1<length; t+=2) {
+                scratch[t] = A[t>>1] & 0x0F;
+                scratch[t+1] = A[t>>1] >> 4;
+            }
+            if(t < length)
+                scratch[t] = A[t>>1] & 0x0F;
+            a = scratch;
+        }
+        for(k=0; k<SVDepth; k++)
+        {
+            size_t offset = 0;
+            for(p=0; p<NViewSets; p++)
+            {
+                int n = width[i*NViewSets+p]*A_PIECE_LENGTH(p,NViews,pieceLength);
+                float *e = &E[p][k*len[p]], *w = &W[p][k*len[p]];
+                if(Abits == 16)
+                {
+                    unsigned short *a16 = (unsigned short *) A + offset;
+                    for(t=0; t<n; t++) {
+                        theta1 += a16[t]*w[t]*e[t];
+                        theta2 += a16[t]*w[t]*a16[t];
+                    }
+                    for(t=0; t<n; t++)
+                        e[t] -= a16[t]*1e-6f;
+                }
+                else
+                {
+                    unsigned char *a8 = a + offset;
+                    for(t=0; t<n; t++) {
+                        theta1 += a8[t]*w[t]*e[t];
+                        theta2 += a8[t]*w[t]*a8[t];
+                    }
+                    for(t=0; t<n; t++)
+                        e[t] -= a8[t]*1e-6f;
+                }
+                offset += n;
+            }
+        }
+    }
+    for(p=0; p<NViewSets; p++)
+    {
+        src[0] += E[p][0]*1e-30f;
+        free((void *)E[p]);
+        free((void *)W[p]);
+    }
+    gettimeofday(&tm2,NULL);
+    src[1] += (theta1+theta2)*1e-30f;   /* keep the sums live */
+    free((void *)E);
+    free((void *)W);
+    free((void *)len);
+    return (tm2.tv_sec-tm1.tv_sec) + (tm2.tv_usec-tm1.tv_usec)*1e-6;
+}
+
+
+/* Choose pieceLength among ~1/64 to 1/4 of the views (and nearby divisors of */
+/* NViews) by the modeled kernel bytes, or by a timed trial if trial!=0.      */
+int AmatrixChoosePieceLength(
+    struct SVParams svpar,
+    struct SinoParams3DParallel *sinoparams,
+    struct ImageParams3D *imgparams,
+    char *recon_mask,
+    char trial,
+    char verboseLevel)
+{
+    static const int fraction[] = {64,48,32,24,16,12,8,6,4};
+    int i,j,c,t,jj;
+    int NViews = sinoparams->NViews;
+    int NChannels = sinoparams->NChannels;
+    int Nx = imgparams->Nx;
+    int Ny = imgparams->Ny;
+    int SVLength = svpar.SVLength;
+    int SVSizeMax = (2*SVLength+1)*(2*SVLength+1);
+    int Abytes = A_KERNEL_BYTES(svpar.Abits);
+    int cand[2*sizeof(fraction)/sizeof(int)];
+    int Ncand = 0;
+
+    for(i=0; i<(int)(sizeof(fraction)/sizeof(int)); i++)
+    {
+        int target = NViews/fraction[i];
+        int divisor;
+        if(target < 1)
+            continue;
+        divisor = target;
+        while(divisor>1 && NViews%divisor!=0)
+            divisor--;
+        for(j=0; j<2; j++)
         {
-            A_comp_ij(i,j,sinoparams,imgparams,pix_prof,&A_col_sgl,A_val_sgl);
-            ACol_arr[i][j].n_index = A_col_sgl.n_index;
-            ACol_arr[i][j].countTheta = (chanwidth_t *) get_spc(NViews,sizeof(chanwidth_t));
-            ACol_arr[i][j].minIndex = (channel_t *) get_spc(NViews,sizeof(channel_t));
-            AVal_arr[i][j].val = (unsigned char *) get_spc(A_col_sgl.n_index, sizeof(unsigned char));
+            int v = (j==0) ? target : divisor;
+            if(j==1 && divisor < (target+1)/2)
+                break;
+            for(c=0; c<Ncand && cand[c]!=v; c++);
+            if(c==Ncand)
+                cand[Ncand++] = v;
+        }
+    }
+    for(i=1; i<Ncand; i++)      /* ascending */
+    for(j=i; j>0 && cand[j-1]>cand[j]; j--) {
+        t = cand[j]; cand[j] = cand[j-1]; cand[j-1] = t;
+    }
 
-            float maxval = A_val_sgl[0];
-            for (r = 0; r < A_col_sgl.n_index; r++) {
-                if(A_val_sgl[r]>maxval)
-                    maxval = A_val_sgl[r];
-            }
-            Aval_max_ptr[i*Nx+j] = maxval;
+    int *order = (int *) mget_spc(svpar.Nsv,sizeof(int));
+    t=0;
+    for(i=0; i<Ny; i+=(SVLength*2-svpar.overlap))
+    for(j=0; j<Nx; j+=(SVLength*2-svpar.overlap))
+        order[t++]=i*Nx+j;
 
-            for (r=0; r < A_col_sgl.n_index; r++)
-                AVal_arr[i][j].val[r] = (unsigned char)((A_val_sgl[r])/maxval*255+0.5);
+    int *viewSeq = (int *) mget_spc(NViews,sizeof(int));
+    for(i=0; i<NViews; i++)
+        viewSeq[i] = i;
 
-            for (r=0; r < NViews; r++) {
-                ACol_arr[i][j].countTheta[r] = A_col_sgl.countTheta[r];
-                ACol_arr[i][j].minIndex[r] = A_col_sgl.minIndex[r];
+    double nonzero = 0;
+    double padded[Ncand], pieces[Ncand], bytes[Ncand], trialTime[Ncand];
+    for(c=0; c<Ncand; c++)
+        padded[c] = pieces[c] = trialTime[c] = 0;
+
+    #pragma omp parallel private(i,c)
+    {
+        struct ACol *A_col = (struct ACol *) mget_spc(SVSizeMax,sizeof(struct ACol));
+        struct ACol **A_cols = (struct ACol **) mget_spc(SVSizeMax,sizeof(struct ACol *));
+        double nonzero_loc = 0;
+        double padded_loc[Ncand], pieces_loc[Ncand];
+        for(c=0; c<Ncand; c++)
+            padded_loc[c] = pieces_loc[c] = 0;
+        for(i=0; i<SVSizeMax; i++) {
+            A_col[i].countTheta = (chanwidth_t *)get_spc(NViews,sizeof(chanwidth_t));
+            A_col[i].minIndex = (channel_t *)get_spc(NViews,sizeof(channel_t));
+        }
+
+        #pragma omp for schedule(dynamic)
+        for(jj=0; jj<svpar.Nsv; jj++)
+        {
+            int SVSize = A_SVRangeColumns(order[jj]/Nx,order[jj]%Nx,A_col,A_cols,svpar,sinoparams,imgparams,recon_mask);
+            if(SVSize == 0)
+                continue;
+            for(i=0; i<SVSize; i++)
+                nonzero_loc += A_cols[i]->n_index;
+            for(c=0; c<Ncand; c++) {
+                padded_loc[c] += A_paddedLength(SVSize,A_cols,viewSeq,NViews,NChannels,cand[c],NULL);
+                pieces_loc[c] += (double)SVSize*A_NUM_PIECES(NViews,cand[c]);
             }
         }
-        else
+
+        #pragma omp critical
         {
-            ACol_arr[i][j].n_index = 0;
-            Aval_max_ptr[i*Nx+j] = 0;
+            nonzero += nonzero_loc;
+            for(c=0; c<Ncand; c++) {
+                padded[c] += padded_loc[c];
+                pieces[c] += pieces_loc[c];
+            }
+        }
+        for(i=0; i<SVSizeMax; i++) {
+            free((void *)A_col[i].countTheta);
+            free((void *)A_col[i].minIndex);
         }
+        free((void *)A_col);
+        free((void *)A_cols);
+    }
 
-        free((void *)A_val_sgl);
-        free((void *)A_col_sgl.countTheta);
-        free((void *)A_col_sgl.minIndex);
+    /* per voxel update: A,W,E read for theta; A read, E read/written for the error update */
+    int best = 0;
+    for(c=0; c<Ncand; c++) {
+        bytes[c] = padded[c]*(2*Abytes+12) + pieces[c]*A_PIECE_OVERHEAD;
+        if(bytes[c] < bytes[best])
+            best = c;
     }
 
-    //gettimeofday(&tm2,NULL);
-    //tdiff = 1000 * (tm2.tv_sec - tm1.tv_sec) + (tm2.tv_usec - tm1.tv_usec) / 1000;
-    //fprintf(stdout,"matrix time 1 = %llu ms\n",tdiff);
-    //gettimeofday(&tm1,NULL);
+    if(trial && nonzero > 0)
+    {
+        int rank[Ncand];
+        int Ntrial = (Ncand < A_PIECE_TRIAL_TOP) ? Ncand : A_PIECE_TRIAL_TOP;
+        for(c=0; c<Ncand; c++)
+            rank[c] = c;
+        for(i=1; i<Ncand; i++)
+        for(j=i; j>0 && bytes[rank[j-1]]>bytes[rank[j]]; j--) {
+            t = rank[j]; rank[j] = rank[j-1]; rank[j-1] = t;
+        }
 
-    A_piecewise(ACol_arr,AVal_arr,A_Padded_Map,svpar,sinoparams,imgparams);
+        struct ACol *A_col = (struct ACol *) mget_spc(SVSizeMax,sizeof(struct ACol));
+        struct ACol **A_cols = (struct ACol **) mget_spc(SVSizeMax,sizeof(struct ACol *));
+        for(i=0; i<SVSizeMax; i++) {
+            A_col[i].countTheta = (chanwidth_t *)get_spc(NViews,sizeof(chanwidth_t));
+            A_col[i].minIndex = (channel_t *)get_spc(NViews,sizeof(channel_t));
+        }
+        int *width = (int *) mget_spc((size_t)SVSizeMax*NViews,sizeof(int));
+        size_t maxLen = (size_t)NViews*NChannels*svpar.SVDepth;
+        float *src = (float *) mget_spc(maxLen,sizeof(float));
+        /* matrix values in the stored format: packed for 4 bits, 2 bytes for 16 */
+        unsigned char *A = (unsigned char *) mget_spc(maxLen,Abytes);
+        unsigned char *scratch = (unsigned char *) mget_spc(maxLen,sizeof(unsigned char));
+        for(i=0; i<(int)maxLen; i++)
+            src[i] = 1.0;
+        for(i=0; i<(int)(maxLen*Abytes); i++)
+            A[i] = (unsigned char)(i & 0xff);
+
+        int step = (svpar.Nsv > A_PIECE_TRIAL_SVS) ? svpar.Nsv/A_PIECE_TRIAL_SVS : 1;
+        for(jj=0; jj<svpar.Nsv; jj+=step)
+        {
+            int SVSize = A_SVRangeColumns(order[jj]/Nx,order[jj]%Nx,A_col,A_cols,svpar,sinoparams,imgparams,recon_mask);
+            if(SVSize == 0)
+                continue;
+            for(i=0; i<Ntrial; i++) {
+                c = rank[i];
+                A_paddedLength(SVSize,A_cols,viewSeq,NViews,NChannels,cand[c],width);
+                trialTime[c] += A_pieceTrial(SVSize,width,NViews,cand[c],svpar.SVDepth,src,A,svpar.Abits,scratch);
+            }
+        }
+        best = rank[0];
+        for(i=1; i<Ntrial; i++)
+            if(trialTime[rank[i]] < trialTime[best])
+                best = rank[i];
+
+        for(i=0; i<SVSizeMax; i++) {
+            free((void *)A_col[i].countTheta);
+            free((void *)A_col[i].minIndex);
+        }
+        free((void *)A_col);
+        free((void *)A_cols);
+        free((void *)width);
+        free((void *)src);
+        free((void *)A);
+        free((void *)scratch);
+    }
 
-    //gettimeofday(&tm2,NULL);
-    //tdiff = 1000 * (tm2.tv_sec - tm1.tv_sec) + (tm2.tv_usec - tm1.tv_usec) / 1000;
-    //fprintf(stdout,"matrix time 2 = %llu ms\n",tdiff);
+    if(verboseLevel>1 && nonzero > 0)
+    {
+        fprintf(stdout,"pieceLength selection (%d views):\n",NViews);
+        fprintf(stdout,"\tpieceLength  pieces  padding  kernel MB/sweep%s\n",trial ? "  trial ms" : "");
+        for(c=0; c<Ncand; c++)
+        {
+            fprintf(stdout,"\t%11d %7d %8.3f %16.1f",cand[c],A_NUM_PIECES(NViews,cand[c]),padded[c]/nonzero,bytes[c]/1048576.0);
+            if(trialTime[c] > 0)
+                fprintf(stdout," %9.2f",trialTime[c]*1e3);
+            else if(trial)
+                fprintf(stdout,"         -");
+            fprintf(stdout,"%s\n",(c==best) ? "  <-" : "");
+        }
+    }
 
-    for (i=0; i<Ny; i++)
-    for (j=0; j<Nx; j++)
-    if(recon_mask[i*Nx+j]) {
-        free((void *)ACol_arr[i][j].countTheta);
-        free((void *)ACol_arr[i][j].minIndex);
-        free((void *)AVal_arr[i][j].val);
+    free((void *)order);
+    free((void *)viewSeq);
+    return(cand[best]);
+}
+
+
+/* Matrix file header. Files written before the header was introduced */
+/* start directly with the band maps and are still accepted.          */
+#define AMATRIX_MAGIC "SVMATRIX"
+#define AMATRIX_VERSION 3     /* 2: added Abits; 3: added viewSort */
+#define AMATRIX_STORAGE_PADDED 0
+#define AMATRIX_STORAGE_SYMMETRIC 1
+
+struct AmatrixFileHeader
+{
+    char magic[8];
+    int version;
+    int Nx, Ny;
+    int NViews, NChannels;
+    int SVLength, overlap, pieceLength;
+    int storage;
+    int Abits;
+    int viewSort;       /* 1: built for views sorted with ViewSortOrder() */
+};
+
+/* Returns 1 and prints the error if the file ends before n items */
+int A_fread(void *ptr, size_t size, size_t n, FILE *fp, char *fname)
+{
+    if(fread(ptr,size,n,fp) < n) {
+        fprintf(stderr, "ERROR in readAmatrix: %s terminated early.\n", fname);
+        return(1);
     }
-    multifree(ACol_arr,2);
-    multifree(AVal_arr,2);
+    return(0);
+}
 
-    free_img((void **)pix_prof);
 
+/* Reads the matrix file header, or sets up the one of a legacy file without */
+/* one, and checks it against the image/sinogram/SV parameters. Prints the   */
+/* error and returns -1 if the file can't be used, 0 otherwise.              */
+int A_readHeader(
+    FILE *fp,
+    char *fname,
+    struct AmatrixFileHeader *header,
+    struct ImageParams3D *imgparams,
+    struct SinoParams3DParallel *sinoparams,
+    struct SVParams *svpar)
+{
+    int NViews = sinoparams->NViews;
+
+    if(fread(header->magic,1,8,fp) < 8 || memcmp(header->magic,AMATRIX_MAGIC,8) != 0)
+    {
+        header->storage = AMATRIX_STORAGE_PADDED;
+        header->Abits = 8;
+        header->viewSort = 0;
+        header->pieceLength = computePieceLength(NViews,0);
+        rewind(fp);
+    }
+    else
+    {
+        header->Abits = 8;
+        header->viewSort = 0;
+        if(fread(&header->version,sizeof(int),1,fp) < 1 || fread(&header->Nx,sizeof(int),8,fp) < 8     /* Nx through storage */
+           || (header->version >= 2 && fread(&header->Abits,sizeof(int),1,fp) < 1)
+           || (header->version >= 3 && fread(&header->viewSort,sizeof(int),1,fp) < 1)) {
+            fprintf(stderr, "ERROR in readAmatrix: %s terminated early.\n", fname);
+            return(-1);
+        }
+        if(header->version > AMATRIX_VERSION) {
+            fprintf(stderr, "ERROR in readAmatrix: %s has unsupported version %d.\n", fname, header->version);
+            return(-1);
+        }
+        if(header->Nx != imgparams->Nx || header->Ny != imgparams->Ny || header->NViews != NViews
+           || header->NChannels != sinoparams->NChannels || header->SVLength != svpar->SVLength
+           || header->overlap != svpar->overlap || header->pieceLength < 1 || header->pieceLength > NViews) {
+            fprintf(stderr, "ERROR in readAmatrix: %s doesn't match the image/sinogram parameters.\n", fname);
+            return(-1);
+        }
+    }
+    if(header->Abits != 4 && header->Abits != 8 && header->Abits != 16) {
+        fprintf(stderr, "ERROR in readAmatrix: %s has unsupported precision %d bits (must be 4, 8 or 16).\n", fname, header->Abits);
+        return(-1);
+    }
+    if(header->storage != AMATRIX_STORAGE_PADDED && header->storage != AMATRIX_STORAGE_SYMMETRIC) {
+        fprintf(stderr, "ERROR in readAmatrix: %s has unknown storage type %d.\n", fname, header->storage);
+        return(-1);
+    }
+    if(header->viewSort != (svpar->viewOrder != NULL)) {
+        fprintf(stderr, "ERROR in readAmatrix: %s was built %s sorted views; view sorting must match.\n", fname, header->viewSort ? "with" : "without");
+        return(-1);
+    }
+    return(0);
 }
 
 
@@ -659,67 +2366,129 @@ void readAmatrix(
     float *Aval_max_ptr,
     struct ImageParams3D *imgparams,
     struct SinoParams3DParallel *sinoparams,
-    struct SVParams svpar)
+    struct SVParams *svpar)
+{
+    if(AmatrixRead(fname,A_Padded_Map,Aval_max_ptr,imgparams,sinoparams,svpar))
+        exit(-1);
+}
+
+
+/* readAmatrix() that prints the error and returns -1 instead of exiting if */
+/* the file can't be read, for a process that must outlive a bad file (the  */
+/* daemon). The columns and svpar->sym read so far stay allocated, for      */
+/* MBIRContextDestroy() or the like to free; the other columns are empty.   */
+int AmatrixRead(
+    char *fname,
+    struct AValues_char **A_Padded_Map,
+    float *Aval_max_ptr,
+    struct ImageParams3D *imgparams,
+    struct SinoParams3DParallel *sinoparams,
+    struct SVParams *svpar)
 {
     FILE *fp;
-    int i,j;
+    int i,j,err=0;
     int M_nonzero;
+    struct AmatrixFileHeader header;
 
     int Nxy = imgparams->Nx * imgparams->Ny;
     int NViews = sinoparams->NViews;
-    int NViewSets = sinoparams->NViews/svpar.pieceLength;
+    int SVSize = (svpar->SVLength*2+1)*(svpar->SVLength*2+1);
+    int NViewSets;
+
+    for (i=0; i<svpar->Nsv; i++)
+    for (j=0; j<SVSize; j++) {
+        A_Padded_Map[i][j].length = 0;
+        A_Padded_Map[i][j].val = NULL;
+    }
 
     if ((fp = fopen(fname, "rb")) == NULL) {
         fprintf(stderr, "ERROR in readAmatrix: can't open file %s.\n", fname);
-        exit(-1);
+        return(-1);
     }
+    if(A_readHeader(fp,fname,&header,imgparams,sinoparams,svpar)) {
+        fclose(fp);
+        return(-1);
+    }
+    svpar->Abits = header.Abits;
+    svpar->pieceLength = header.pieceLength;
+    NViewSets = A_NUM_PIECES(NViews,svpar->pieceLength);
 
-    for (i=0; i<svpar.Nsv ; i++)
+    for (i=0; i<svpar->Nsv && !err; i++)
     {
-        if(fread(svpar.bandMinMap[i].bandMin,sizeof(channel_t),NViews,fp) < (size_t)NViews) {
-            fprintf(stderr, "ERROR in readAmatrix: %s terminated early.\n", fname);
-            exit(-1);
-        }
-        if(fread(svpar.bandMaxMap[i].bandMax,sizeof(channel_t),NViews,fp) < (size_t)NViews) {
-            fprintf(stderr, "ERROR in readAmatrix: %s terminated early.\n", fname);
-            exit(-1);
-        }
+        err = A_fread(svpar->bandMinMap[i].bandMin,sizeof(channel_t),NViews,fp,fname)
+           || A_fread(svpar->bandMaxMap[i].bandMax,sizeof(channel_t),NViews,fp,fname);
 
-        for (j=0; j< (svpar.SVLength*2+1)*(svpar.SVLength*2+1); j++)
+        for (j=0; j<SVSize && !err; j++)
         {
-            if(fread(&M_nonzero, sizeof(int), 1, fp) < 1) {
-                fprintf(stderr, "ERROR in readAmatrix: %s terminated early.\n", fname);
-                exit(-1);
+            if((err = A_fread(&M_nonzero, sizeof(int), 1, fp, fname)))
+                break;
+            if(M_nonzero < 0) {
+                fprintf(stderr, "ERROR in readAmatrix: %s is corrupt.\n", fname);
+                err = 1;
+                break;
             }
-            A_Padded_Map[i][j].length = M_nonzero;
             if(M_nonzero > 0)
             {
-                A_Padded_Map[i][j].val = (unsigned char *)get_spc(M_nonzero, sizeof(unsigned char));
+                A_Padded_Map[i][j].length = M_nonzero;
                 A_Padded_Map[i][j].pieceWiseWidth = (channel_t *)get_spc(NViewSets,sizeof(channel_t));
                 A_Padded_Map[i][j].pieceWiseMin = (channel_t *)get_spc(NViewSets,sizeof(channel_t));
 
-                if(fread(A_Padded_Map[i][j].val, sizeof(unsigned char), M_nonzero, fp) < (size_t)M_nonzero) {
-                    fprintf(stderr, "ERROR in readAmatrix: %s terminated early.\n", fname);
-                    exit(-1);
-                }
-                if(fread(A_Padded_Map[i][j].pieceWiseMin,sizeof(channel_t),NViewSets,fp) < (size_t)NViewSets) {
-                    fprintf(stderr, "ERROR in readAmatrix: %s terminated early.\n", fname);
-                    exit(-1);
-                }
-                if(fread(A_Padded_Map[i][j].pieceWiseWidth,sizeof(channel_t),NViewSets,fp) < (size_t)NViewSets) {
-                    fprintf(stderr, "ERROR in readAmatrix: %s terminated early.\n", fname);
-                    exit(-1);
+                if(header.storage == AMATRIX_STORAGE_PADDED) {
+                    size_t nbytes = A_valBytes(M_nonzero,header.Abits);
+                    A_Padded_Map[i][j].val = (unsigned char *)get_spc(nbytes, sizeof(unsigned char));
+                    err |= A_fread(A_Padded_Map[i][j].val, sizeof(unsigned char), nbytes, fp, fname);
                 }
+                err = err || A_fread(A_Padded_Map[i][j].pieceWiseMin,sizeof(channel_t),NViewSets,fp,fname)
+                          || A_fread(A_Padded_Map[i][j].pieceWiseWidth,sizeof(channel_t),NViewSets,fp,fname);
             }
         }
     }
 
-    if(fread(&Aval_max_ptr[0],sizeof(float),Nxy,fp) < (size_t)Nxy) {
-        fprintf(stderr, "ERROR in readAmatrix: %s terminated early.\n", fname);
-        exit(-1);
+    if(!err && header.storage == AMATRIX_STORAGE_SYMMETRIC)
+    {
+        struct AmatrixSym *sym = (struct AmatrixSym *) get_spc(1,sizeof(struct AmatrixSym));
+        if(A_fread(&sym->Nop,sizeof(int),1,fp,fname) || A_fread(sym->opCode,sizeof(unsigned char),8,fp,fname)
+           || A_fread(&sym->mirrorSum,sizeof(int),1,fp,fname) || A_fread(&sym->Nrep,sizeof(int),1,fp,fname)
+           || A_fread(&sym->stride,sizeof(int),1,fp,fname)) {
+            free((void *)sym);
+            fclose(fp);
+            return(-1);
+        }
+        if(sym->Nop < 1 || sym->Nop > 8 || sym->Nrep < 0 || sym->stride < 0) {
+            fprintf(stderr, "ERROR in readAmatrix: %s is corrupt.\n", fname);
+            free((void *)sym);
+            fclose(fp);
+            return(-1);
+        }
+        sym->NViews = NViews;
+        sym->NChannels = sinoparams->NChannels;
+        sym->Nx = imgparams->Nx;
+        sym->Nxy = Nxy;
+        sym->viewMap = (int **)multialloc(sizeof(int),2,sym->Nop,NViews);
+        sym->viewFlip = (char **)multialloc(sizeof(char),2,sym->Nop,NViews);
+        sym->rep = (int *) get_spc(Nxy,sizeof(int));
+        sym->op = (unsigned char *) get_spc(Nxy,sizeof(unsigned char));
+        if(sym->Nrep > 0) {
+            sym->minIndex = (int **)multialloc(sizeof(int),2,sym->Nrep,NViews);
+            sym->count = (chanwidth_t **)multialloc(sizeof(chanwidth_t),2,sym->Nrep,NViews);
+            sym->val = (unsigned char **)multialloc(A_KERNEL_BYTES(header.Abits),2,sym->Nrep,NViews*sym->stride);
+        }
+        svpar->sym = sym;
+        err = A_fread(&sym->viewMap[0][0],sizeof(int),(size_t)sym->Nop*NViews,fp,fname)
+           || A_fread(&sym->viewFlip[0][0],sizeof(char),(size_t)sym->Nop*NViews,fp,fname)
+           || A_fread(sym->rep,sizeof(int),Nxy,fp,fname)
+           || A_fread(sym->op,sizeof(unsigned char),Nxy,fp,fname);
+        if(!err && sym->Nrep > 0)
+            err = A_fread(&sym->minIndex[0][0],sizeof(int),(size_t)sym->Nrep*NViews,fp,fname)
+               || A_fread(&sym->count[0][0],sizeof(chanwidth_t),(size_t)sym->Nrep*NViews,fp,fname)
+               || A_fread(&sym->val[0][0],A_KERNEL_BYTES(header.Abits),(size_t)sym->Nrep*NViews*sym->stride,fp,fname);
     }
 
+    if(!err)
+        err = A_fread(&Aval_max_ptr[0],sizeof(float),Nxy,fp,fname);
+
     fclose(fp);
+    return(err ? -1 : 0);
 }
 
 
@@ -734,37 +2503,320 @@ void writeAmatrix(
     FILE *fp;
     int i,j;
     int M_nonzero;
-    int NViewSets = sinoparams->NViews/svpar.pieceLength;
+    int NViews = sinoparams->NViews;
+    int NViewSets = A_NUM_PIECES(NViews,svpar.pieceLength);
+    struct AmatrixFileHeader header;
 
     if ((fp = fopen(fname, "wb")) == NULL) {
         fprintf(stderr, "ERROR in writeAmatrix: can't open file %s.\n", fname);
         exit(-1);
     }
 
+    memset(&header,0,sizeof(struct AmatrixFileHeader));
+    memcpy(header.magic,AMATRIX_MAGIC,8);
+    header.version = AMATRIX_VERSION;
+    header.Nx = imgparams->Nx;
+    header.Ny = imgparams->Ny;
+    header.NViews = NViews;
+    header.NChannels = sinoparams->NChannels;
+    header.SVLength = svpar.SVLength;
+    header.overlap = svpar.overlap;
+    header.pieceLength = svpar.pieceLength;
+    header.storage = (svpar.sym != NULL) ? AMATRIX_STORAGE_SYMMETRIC : AMATRIX_STORAGE_PADDED;
+    header.Abits = svpar.Abits;
+    header.viewSort = (svpar.viewOrder != NULL);
+    fwrite(&header,sizeof(struct AmatrixFileHeader),1,fp);
+
     for (i=0; i<svpar.Nsv; i++)
     {
-        fwrite(svpar.bandMinMap[i].bandMin,sizeof(channel_t),sinoparams->NViews,fp);
-        fwrite(svpar.bandMaxMap[i].bandMax,sizeof(channel_t),sinoparams->NViews,fp);
+        fwrite(svpar.bandMinMap[i].bandMin,sizeof(channel_t),NViews,fp);
+        fwrite(svpar.bandMaxMap[i].bandMax,sizeof(channel_t),NViews,fp);
         for (j=0; j< (svpar.SVLength*2+1)*(svpar.SVLength*2+1); j++)
         {
             M_nonzero = A_Padded_Map[i][j].length;
             fwrite(&M_nonzero, sizeof(int), 1, fp);
             if(M_nonzero > 0) {
-                fwrite(A_Padded_Map[i][j].val, sizeof(unsigned char), M_nonzero, fp);
+                if(header.storage == AMATRIX_STORAGE_PADDED)
+                    fwrite(A_Padded_Map[i][j].val, sizeof(unsigned char), A_valBytes(M_nonzero,svpar.Abits), fp);
                 fwrite(A_Padded_Map[i][j].pieceWiseMin,sizeof(channel_t),NViewSets,fp);
                 fwrite(A_Padded_Map[i][j].pieceWiseWidth,sizeof(channel_t),NViewSets,fp);
             }
         }
     }
+
+    if(header.storage == AMATRIX_STORAGE_SYMMETRIC)
+    {
+        struct AmatrixSym *sym = svpar.sym;
+        fwrite(&sym->Nop,sizeof(int),1,fp);
+        fwrite(sym->opCode,sizeof(unsigned char),8,fp);
+        fwrite(&sym->mirrorSum,sizeof(int),1,fp);
+        fwrite(&sym->Nrep,sizeof(int),1,fp);
+        fwrite(&sym->stride,sizeof(int),1,fp);
+        fwrite(&sym->viewMap[0][0],sizeof(int),(size_t)sym->Nop*NViews,fp);
+        fwrite(&sym->viewFlip[0][0],sizeof(char),(size_t)sym->Nop*NViews,fp);
+        fwrite(sym->rep,sizeof(int),sym->Nxy,fp);
+        fwrite(sym->op,sizeof(unsigned char),sym->Nxy,fp);
+        if(sym->Nrep > 0) {
+            fwrite(&sym->minIndex[0][0],sizeof(int),(size_t)sym->Nrep*NViews,fp);
+            fwrite(&sym->count[0][0],sizeof(chanwidth_t),(size_t)sym->Nrep*NViews,fp);
+            fwrite(&sym->val[0][0],A_KERNEL_BYTES(svpar.Abits),(size_t)sym->Nrep*NViews*sym->stride,fp);
+        }
+    }
+
     fwrite(&Aval_max_ptr[0],sizeof(float),imgparams->Nx*imgparams->Ny,fp);
     fclose(fp);
 }
 
 
+/* Checks that readAmatrix() can read the matrix file for the given          */
+/* parameters without reading the matrix: the header, and the record lengths */
+/* up to the end of the file. Prints the error and returns -1 if it can't,   */
+/* 0 otherwise. Used where a bad file mustn't exit the process (the daemon). */
+int AmatrixFileCheck(
+    char *fname,
+    struct ImageParams3D *imgparams,
+    struct SinoParams3DParallel *sinoparams,
+    struct SVParams *svpar)
+{
+    FILE *fp;
+    int i,j,err=0;
+    int M_nonzero,Nop,Nrep,stride;
+    long fileSize;
+    struct AmatrixFileHeader header;
+    int NViews = sinoparams->NViews;
+    long Nxy = (long)imgparams->Nx*imgparams->Ny;
+    long NViewSets;
+
+    if ((fp = fopen(fname, "rb")) == NULL) {
+        fprintf(stderr, "ERROR in AmatrixFileCheck: can't open file %s.\n", fname);
+        return(-1);
+    }
+    fseek(fp,0,SEEK_END);
+    fileSize = ftell(fp);
+    rewind(fp);
+    if(A_readHeader(fp,fname,&header,imgparams,sinoparams,svpar)) {
+        fclose(fp);
+        return(-1);
+    }
+    NViewSets = A_NUM_PIECES(NViews,header.pieceLength);
+
+    for (i=0; i<svpar->Nsv && !err; i++)
+    {
+        err |= fseek(fp,2*NViews*(long)sizeof(channel_t),SEEK_CUR);
+        for (j=0; j< (svpar->SVLength*2+1)*(svpar->SVLength*2+1) && !err; j++)
+        {
+            if(fread(&M_nonzero,sizeof(int),1,fp) < 1 || M_nonzero < 0)
+                err = 1;
+            else if(M_nonzero > 0)
+                err |= fseek(fp,(header.storage == AMATRIX_STORAGE_PADDED ? (long)A_valBytes(M_nonzero,header.Abits) : 0)
+                                +2*NViewSets*(long)sizeof(channel_t),SEEK_CUR);
+        }
+    }
+
+    if(!err && header.storage == AMATRIX_STORAGE_SYMMETRIC)
+    {
+        if(fread(&Nop,sizeof(int),1,fp) < 1 || fseek(fp,8+sizeof(int),SEEK_CUR)
+           || fread(&Nrep,sizeof(int),1,fp) < 1 || fread(&stride,sizeof(int),1,fp) < 1
+           || Nop < 1 || Nop > 8 || Nrep < 0 || stride < 0)
+            err = 1;
+        else
+            err |= fseek(fp,Nop*NViews*(long)(sizeof(int)+sizeof(char)) + Nxy*(long)(sizeof(int)+sizeof(unsigned char))
+                            + (long)Nrep*NViews*(sizeof(int)+sizeof(chanwidth_t))
+                            + (long)Nrep*NViews*stride*A_KERNEL_BYTES(header.Abits),SEEK_CUR);
+    }
+
+    /* Aval_max closes the file */
+    if(!err && ftell(fp)+Nxy*(long)sizeof(float) > fileSize)
+        err = 1;
+    fclose(fp);
+
+    if(err) {
+        fprintf(stderr, "ERROR in AmatrixFileCheck: %s terminated early or is corrupt.\n", fname);
+        return(-1);
+    }
+    return(0);
+}
+
+
+/* Returns 1 if the matrix file was built for sorted views, 0 otherwise */
+int AmatrixFileViewSort(char *fname)
+{
+    FILE *fp;
+    struct AmatrixFileHeader header;
+    int viewSort = 0;
+
+    if ((fp = fopen(fname, "rb")) == NULL) {
+        fprintf(stderr, "ERROR in AmatrixFileViewSort: can't open file %s.\n", fname);
+        exit(-1);
+    }
+    if(fread(&header,sizeof(struct AmatrixFileHeader),1,fp) == 1
+       && memcmp(header.magic,AMATRIX_MAGIC,8) == 0 && header.version >= 3)
+        viewSort = header.viewSort;
+    fclose(fp);
+    return(viewSort);
+}
+
+
+/* Print the padding statistics collected while building the SV layout */
+void AmatrixPrintPadStats(double *padStats, struct SVParams svpar)
+{
+    if(padStats[AMATRIX_PADSTATS_NONZERO] <= 0)
+        return;
+    fprintf(stdout,"\tpadding ratio = %.3f (padded/nonzero entries, pieceLength %d)\n",
+        padStats[AMATRIX_PADSTATS_PADDED]/padStats[AMATRIX_PADSTATS_NONZERO],svpar.pieceLength);
+    if(svpar.viewOrder != NULL)
+        fprintf(stdout,"\tpadding ratio in acquisition view order = %.3f\n",
+            padStats[AMATRIX_PADSTATS_PADDED_ACQ]/padStats[AMATRIX_PADSTATS_NONZERO]);
+}
+
+
+/* Check that every footprint lies on the detector, so the projectors and */
+/* the SV buffers can index the sinogram without per-element checks.       */
+/* Prints the error and returns -1 if one doesn't, 0 otherwise.            */
+int AmatrixCheckBounds(
+    struct AValues_char **A_Padded_Map,
+    struct SVParams svpar,
+    struct SinoParams3DParallel *sinoparams)
+{
+    int jj,i,p,t;
+    int NViews = sinoparams->NViews;
+    int NChannels = sinoparams->NChannels;
+    int pieceLength = svpar.pieceLength;
+    int NViewSets = A_NUM_PIECES(NViews,pieceLength);
+    int SVSize = (2*svpar.SVLength+1)*(2*svpar.SVLength+1);
+
+    for(jj=0; jj<svpar.Nsv; jj++)
+    {
+        channel_t *bandMin = svpar.bandMinMap[jj].bandMin;
+        for(i=0; i<SVSize; i++)
+        if(A_Padded_Map[jj][i].length > 0)
+        for(p=0; p<NViewSets; p++)
+        {
+            int top = A_Padded_Map[jj][i].pieceWiseMin[p] + A_Padded_Map[jj][i].pieceWiseWidth[p];
+            for(t=0; t<A_PIECE_LENGTH(p,NViews,pieceLength); t++)
+            if(bandMin[p*pieceLength+t] + top > NChannels) {
+                fprintf(stderr,"ERROR: system matrix footprint exceeds the detector (SV %d, pixel %d, view %d)\n",jj,i,p*pieceLength+t);
+                return(-1);
+            }
+        }
+    }
+    return(0);
+}
+
+
+/* Set svpar->pieceLength from AmatrixParams.pieceLength when computing a matrix */
+void AmatrixSetPieceLength(
+    struct SVParams *svpar,
+    struct SinoParams3DParallel *sinoparams,
+    struct ImageParams3D *imgparams,
+    char *recon_mask,
+    int pieceLength,
+    char verboseLevel)
+{
+    int NViews = sinoparams->NViews;
+
+    if(pieceLength == AMATRIX_PIECE_AUTO || pieceLength == AMATRIX_PIECE_TRIAL)
+        svpar->pieceLength = AmatrixChoosePieceLength(*svpar,sinoparams,imgparams,recon_mask,
+                                (pieceLength==AMATRIX_PIECE_TRIAL),verboseLevel);
+    else if(pieceLength > 0)
+        svpar->pieceLength = (pieceLength > NViews) ? NViews : pieceLength;
+    else if(pieceLength != 0) {
+        fprintf(stderr,"ERROR: invalid pieceLength %d\n",pieceLength);
+        exit(-1);
+    }
+    if(verboseLevel>1)
+        fprintf(stdout,"\tpieceLength = %d (%d pieces%s)\n",svpar->pieceLength,A_NUM_PIECES(NViews,svpar->pieceLength),
+            (NViews%svpar->pieceLength) ? ", last piece shorter" : "");
+}
+
+
+/* Matrix options of the original interface: full 8-bit matrix in memory, */
+/* views in acquisition order, default pieceLength                         */
+struct AmatrixParams AmatrixDefaultParams(void)
+{
+    struct AmatrixParams Aparams;
+
+    Aparams.matrixFree = 0;
+    Aparams.symmetry = 0;
+    Aparams.Abits = 8;
+    Aparams.viewOrder = NULL;
+    Aparams.pieceLength = 0;
+    return(Aparams);
+}
+
+
+/* Read or compute the system matrix for the recon/projection drivers.    */
+/* Aparams selects matrix-free or symmetry-compact storage when computing; */
+/* a matrix file carries its own storage type in the header. Prints the    */
+/* error and returns -1 if the matrix file can't be used, 0 otherwise.     */
+int AmatrixSetup(
+    struct AValues_char **A_Padded_Map,
+    float *Aval_max_ptr,
+    struct SVParams *svpar,
+    struct SinoParams3DParallel *sinoparams,
+    struct ImageParams3D *imgparams,
+    char *recon_mask,
+    char *Amatrix_fname,
+    struct AmatrixParams Aparams,
+    char verboseLevel)
+{
+    if(Aparams.Abits != 4 && Aparams.Abits != 8 && Aparams.Abits != 16) {
+        fprintf(stderr,"ERROR: system matrix precision must be 4, 8 or 16 bits\n");
+        exit(-1);
+    }
+    double padStats[AMATRIX_PADSTATS] = {0};
+    svpar->Abits = Aparams.Abits;
+    svpar->viewOrder = Aparams.viewOrder;
+    if(verboseLevel>1 && (Aparams.matrixFree || Amatrix_fname == NULL))
+        svpar->padStats = padStats;
+
+    if(Aparams.matrixFree)
+    {
+        if(verboseLevel)
+            fprintf(stdout,"Computing system matrix layout (matrix-free mode)...\n");
+        svpar->otf = AmatrixOTFInit(sinoparams,imgparams);
+        AmatrixSetPieceLength(svpar,sinoparams,imgparams,recon_mask,Aparams.pieceLength,verboseLevel);
+        A_comp(A_Padded_Map,Aval_max_ptr,*svpar,sinoparams,recon_mask,imgparams);
+    }
+    else if(Amatrix_fname != NULL)
+    {
+        if(verboseLevel)
+            fprintf(stdout,"Reading system matrix...\n");
+        if(AmatrixRead(Amatrix_fname, A_Padded_Map, Aval_max_ptr, imgparams, sinoparams, svpar))
+            return(-1);
+    }
+    else
+    {
+        if(verboseLevel)
+            fprintf(stdout,"Computing system matrix...\n");
+        if(Aparams.symmetry)
+            svpar->sym = AmatrixSymInit(sinoparams,imgparams,verboseLevel);
+        AmatrixSetPieceLength(svpar,sinoparams,imgparams,recon_mask,Aparams.pieceLength,verboseLevel);
+        A_comp(A_Padded_Map,Aval_max_ptr,*svpar,sinoparams,recon_mask,imgparams);
+    }
+
+    if(AmatrixCheckBounds(A_Padded_Map,*svpar,sinoparams))
+        return(-1);
+
+    if(verboseLevel>1)
+    {
+        if(svpar->sym != NULL)
+            fprintf(stdout,"\tsymmetry-compact matrix: %d canonical columns for %d pixels\n",svpar->sym->Nrep,imgparams->Nx*imgparams->Ny);
+        fprintf(stdout,"\tsystem matrix precision = %d bits\n",svpar->Abits);
+        fprintf(stdout,"\tsystem matrix memory = %.1f MB\n",AmatrixMemory(A_Padded_Map,imgparams,sinoparams,*svpar)/1048576.0);
+        if(svpar->padStats != NULL)
+            AmatrixPrintPadStats(padStats,*svpar);
+    }
+    svpar->padStats = NULL;
+    return(0);
+}
+
+
 void AmatrixComputeToFile(
     struct ImageParams3D imgparams,
     struct SinoParams3DParallel sinoparams,
     char *Amatrix_fname,
+    struct AmatrixParams Aparams,
     char verboseLevel)
 {
     struct SVParams svpar;
@@ -785,6 +2837,15 @@ void AmatrixComputeToFile(
     }
 
     initSVParams(&svpar,imgparams,sinoparams);  /* Initialize/allocate SV parameters */
+    if(Aparams.Abits != 4 && Aparams.Abits != 8 && Aparams.Abits != 16) {
+        fprintf(stderr,"ERROR: system matrix precision must be 4, 8 or 16 bits\n");
+        exit(-1);
+    }
+    double padStats[AMATRIX_PADSTATS] = {0};
+    svpar.Abits = Aparams.Abits;
+    svpar.viewOrder = Aparams.viewOrder;
+    if(verboseLevel>1)
+        svpar.padStats = padStats;
 
     int Nx = imgparams.Nx;
     int Ny = imgparams.Ny;
@@ -797,6 +2858,9 @@ void AmatrixComputeToFile(
     A_Padded_Map = (struct AValues_char **)multialloc(sizeof(struct AValues_char),2,Nsv,(2*SVLength+1)*(2*SVLength+1));
     Aval_max_ptr = (float *) get_spc(Nx*Ny,sizeof(float));
 
+    if(Aparams.symmetry)
+        svpar.sym = AmatrixSymInit(&sinoparams,&imgparams,verboseLevel);
+    AmatrixSetPieceLength(&svpar,&sinoparams,&imgparams,ImageReconMask,Aparams.pieceLength,verboseLevel);
     A_comp(A_Padded_Map,Aval_max_ptr,svpar,&sinoparams,ImageReconMask,&imgparams);
 
     if(verboseLevel>1) {
@@ -805,6 +2869,8 @@ void AmatrixComputeToFile(
         tdiff = 1000 * (tm2.tv_sec - tm1.tv_sec) + (tm2.tv_usec - tm1.tv_usec) / 1000;
         fprintf(stdout,"\tmatrix time = %llu ms\n",tdiff);
         #endif
+        fprintf(stdout,"\tsystem matrix memory = %.1f MB\n",AmatrixMemory(A_Padded_Map,&imgparams,&sinoparams,svpar)/1048576.0);
+        AmatrixPrintPadStats(padStats,svpar);
         fprintf(stdout,"Writing system matrix %s\n",Amatrix_fname);
     }
     else if(verboseLevel)
@@ -824,6 +2890,7 @@ void AmatrixComputeToFile(
     multifree(A_Padded_Map,2);
     free((void *)Aval_max_ptr);
     free((void *)ImageReconMask);
+    AmatrixSymFree(svpar.sym);
 
 }
 
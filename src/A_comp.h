@@ -1,6 +1,7 @@
 #ifndef _ACOMP_H_
 #define _ACOMP_H_
 
+#include <stddef.h>
 #include "MBIRModularDefs.h"
 
 typedef unsigned short channel_t;   // General channel index. Need NChannels < 2^(8*sizeof(channel_t))
@@ -8,6 +9,21 @@ typedef unsigned short chanwidth_t; // Channel bandwidth for single pixel, NOT s
                                     // Note the size of chanwidth_t only affects the internal memory
                                     // when computing A, *not* for the encoded or stored matrix
 
+/* System matrix values are quantized to Abits (4, 8 or 16) relative to the per-pixel max.    */
+/* 4-bit values are stored two per byte and unpacked to bytes for the kernels; 16-bit values */
+/* are stored and used as unsigned short.                                                    */
+#define A_KERNEL_BYTES(Abits) ((Abits)==16 ? 2 : 1)   /* bytes per value in kernel format */
+
+/* Views are grouped into pieces of pieceLength consecutive views for the SV buffers. */
+/* If pieceLength doesn't divide NViews the last piece is shorter.                    */
+#define A_NUM_PIECES(NViews,pieceLength) (((NViews)+(pieceLength)-1)/(pieceLength))
+#define A_PIECE_LENGTH(p,NViews,pieceLength) \
+    ((NViews)-(p)*(pieceLength) < (pieceLength) ? (NViews)-(p)*(pieceLength) : (pieceLength))
+
+struct SVFreeze;
+struct SVZeroMap;
+struct SVBatch;
+
 struct SVParams
 {
     struct minStruct *bandMinMap;
@@ -19,6 +35,82 @@ struct SVParams
     int SVsPerRow;
     int Nsv;
     int pieceLength;
+    int Abits;                  /* matrix value precision: 4, 8 or 16 bits */
+    struct AmatrixOTF *otf;     /* non-NULL in matrix-free mode: footprints generated on the fly */
+    struct AmatrixSym *sym;     /* non-NULL for symmetry-compact matrix: footprints remapped from canonical pixels */
+    int *viewOrder;             /* non-NULL if the views were sorted by angle: acquisition index of each view */
+    double *padStats;           /* non-NULL: A_piecewise_SV() accumulates the padding statistics of AMATRIX_PADSTATS */
+    char *roi;                  /* non-NULL: Nz*Ny*Nx flags of the voxels updated, the others are frozen */
+    struct SVFreeze *freeze;    /* non-NULL: adaptive freezing of converged SVs, see recon3d.h */
+    struct SVZeroMap *zeroMap;  /* non-NULL: skip SVs whose voxels would all be zero-skipped */
+    struct SVBatch *batch;      /* non-NULL: batch of data sets with their own stopping test, see recon3d.h */
+    channel_t *weightWindow;    /* non-NULL: [lo,hi) band offsets of nonzero weight per SV slab, SV and view piece, see SVweightWindows() */
+};
+
+/* Padding statistics accumulated while the SV layout is built */
+#define AMATRIX_PADSTATS_NONZERO 0      /* nonzero entries of the pixel columns */
+#define AMATRIX_PADSTATS_PADDED 1       /* entries of the padded footprints */
+#define AMATRIX_PADSTATS_PADDED_ACQ 2   /* padded entries if the views were kept in acquisition order */
+#define AMATRIX_PADSTATS 3
+
+/* Options for how the system matrix is held in memory */
+struct AmatrixParams
+{
+    char matrixFree;    /* 1: store only the SV layout and regenerate footprints on the fly (parallel beam) */
+    char symmetry;      /* 1: store only canonical pixels under the view-angle symmetries (parallel beam) */
+    int Abits;          /* matrix value precision: 4, 8 (default) or 16 bits */
+    int *viewOrder;     /* non-NULL if the sinogram views were sorted with ViewSortOrder() */
+    int pieceLength;    /* views per piece: 0 default, >0 fixed, or AMATRIX_PIECE_AUTO/TRIAL */
+};
+
+#define AMATRIX_PIECE_AUTO -1   /* choose pieceLength by the modeled kernel traffic */
+#define AMATRIX_PIECE_TRIAL -2  /* choose pieceLength by a short timed kernel trial */
+
+/* Tables for on-the-fly (matrix-free) footprint generation, parallel beam only. */
+/* For parallel beam the A entries of a pixel depend only on t_pix = y*cos(theta)-x*sin(theta), */
+/* so the detector-integrated pixel profile per view is tabulated once vs. the offset          */
+/* u = (left edge of detector cell) - t_pix.                                                    */
+struct AmatrixOTF
+{
+    int NViews;
+    int NChannels;
+    float Deltaxy;
+    float x_0, y_0;        /* image coordinates of pixel (0,0) */
+    float t_0;             /* detector coordinate of channel 0 */
+    float DeltaChannel;
+    float *cosTheta;       /* per-view trig tables */
+    float *sinTheta;
+    float *t_start;        /* t_start[i] = left edge of detector cell i */
+    int Nprof;             /* number of samples in footprint lookup table */
+    float u_min;           /* offset of first sample */
+    float du;              /* sample spacing */
+    float **prof;          /* prof[view][j] = footprint at offset u_min+j*du */
+};
+
+/* Symmetry-compact system matrix, parallel beam only.                                       */
+/* A symmetry op g of the square pixel grid (x/y swap and/or sign flips) maps pixel p to g(p). */
+/* If the view set is closed under g, the footprint of p at view k equals the footprint of     */
+/* g(p) at view viewMap[g][k], mirrored in the channel direction if viewFlip[g][k] is set.     */
+/* Only one canonical pixel per orbit stores its (unclipped) column, quantized once per       */
+/* distinct scale (Aval_max) among the pixels of the orbit.                                    */
+struct AmatrixSym
+{
+    int Nop;                    /* number of ops in use, op 0 is the identity */
+    unsigned char opCode[8];    /* bit0: swap x/y, bit1: negate x, bit2: negate y */
+    int **viewMap;              /* [Nop][NViews] */
+    char **viewFlip;            /* [Nop][NViews] */
+    int mirrorSum;              /* channel mirror: c -> mirrorSum-c */
+    int NViews;
+    int NChannels;
+    int Nx;
+    int Nxy;
+    int *rep;                   /* [Nxy] canonical column of each pixel (orbit and scale), -1 if outside recon mask */
+    unsigned char *op;          /* [Nxy] op mapping the pixel to its canonical pixel */
+    int Nrep;                   /* number of canonical columns */
+    int stride;                 /* max nonzeros per view */
+    int **minIndex;             /* [Nrep][NViews] first nonzero channel, may be outside the detector */
+    chanwidth_t **count;        /* [Nrep][NViews] number of nonzeros */
+    unsigned char **val;        /* [Nrep][NViews*stride] quantized values, kernel format */
 };
 
 struct ACol
@@ -29,7 +121,7 @@ struct ACol
 };
 
 struct AValues_char{
-    unsigned char *val;
+    unsigned char *val;         /* padded/transposed values, encoded per SVParams.Abits */
     channel_t *pieceWiseMin;
     channel_t *pieceWiseWidth;
     int length;
@@ -60,7 +152,15 @@ void readAmatrix(
     float *Aval_max_ptr,
     struct ImageParams3D *imgparams,
     struct SinoParams3DParallel *sinoparams,
-    struct SVParams svpar);
+    struct SVParams *svpar);
+
+int AmatrixRead(
+    char *fname,
+    struct AValues_char **A_Padded_Map,
+    float *Aval_max_ptr,
+    struct ImageParams3D *imgparams,
+    struct SinoParams3DParallel *sinoparams,
+    struct SVParams *svpar);
 
 void writeAmatrix(
     char *fname,
@@ -70,10 +170,70 @@ void writeAmatrix(
     struct SinoParams3DParallel *sinoparams,
     struct SVParams svpar);
 
+struct AmatrixOTF *AmatrixOTFInit(
+    struct SinoParams3DParallel *sinoparams,
+    struct ImageParams3D *imgparams);
+
+void AmatrixOTFFree(struct AmatrixOTF *otf);
+
+struct AmatrixSym *AmatrixSymInit(
+    struct SinoParams3DParallel *sinoparams,
+    struct ImageParams3D *imgparams,
+    char verboseLevel);
+
+void AmatrixSymFree(struct AmatrixSym *sym);
+
+unsigned char *A_getFootprint(
+    unsigned char *A_scratch,
+    struct AValues_char *A_padded,
+    channel_t *bandMin,
+    int im_row,
+    int im_col,
+    float Aval_max,
+    struct SVParams svpar);
+
+size_t A_valBytes(int length, int Abits);
+
+size_t AmatrixMemory(
+    struct AValues_char **A_Padded_Map,
+    struct ImageParams3D *imgparams,
+    struct SinoParams3DParallel *sinoparams,
+    struct SVParams svpar);
+
+int AmatrixFileViewSort(char *fname);
+
+int AmatrixFileCheck(
+    char *fname,
+    struct ImageParams3D *imgparams,
+    struct SinoParams3DParallel *sinoparams,
+    struct SVParams *svpar);
+
+int AmatrixChoosePieceLength(
+    struct SVParams svpar,
+    struct SinoParams3DParallel *sinoparams,
+    struct ImageParams3D *imgparams,
+    char *recon_mask,
+    char trial,
+    char verboseLevel);
+
+struct AmatrixParams AmatrixDefaultParams(void);
+
+int AmatrixSetup(
+    struct AValues_char **A_Padded_Map,
+    float *Aval_max_ptr,
+    struct SVParams *svpar,
+    struct SinoParams3DParallel *sinoparams,
+    struct ImageParams3D *imgparams,
+    char *recon_mask,
+    char *Amatrix_fname,
+    struct AmatrixParams Aparams,
+    char verboseLevel);
+
 void AmatrixComputeToFile(
     struct ImageParams3D imgparams,
     struct SinoParams3DParallel sinoparams,
     char *Amatrix_fname,
+    struct AmatrixParams Aparams,
     char verboseLevel);
 
 #endif
@@ -1,8 +1,13 @@
 
+#define _DEFAULT_SOURCE     /* mmap(), pwrite(), ftruncate() with -std=c11 */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "allocate.h"
 #include "MBIRModularDefs.h"
@@ -628,6 +633,234 @@ int WriteFloatArray(
 }
 
 
+/*****************************************/
+/*     Single-file volume containers     */
+/*****************************************/
+
+char VolumeFileOutput = 0;
+
+void SetVolumeFileOutput(char flag)
+{
+    VolumeFileOutput = flag;
+}
+
+char GetVolumeFileOutput(void)
+{
+    return(VolumeFileOutput);
+}
+
+
+int ReadVolumeHeader(char *basename, char *ext, struct VolumeHeader *header)
+{
+    char fname[1100];
+    FILE *fp;
+
+    sprintf(fname,"%s.%s",basename,ext);
+    if( (fp = fopen(fname,"rb")) == NULL )
+        return(1);
+    if(fread(header,sizeof(struct VolumeHeader),1,fp) != 1 || memcmp(header->magic,MBIR_VOLUME_MAGIC,8) != 0) {
+        fclose(fp);
+        return(2);
+    }
+    fclose(fp);
+    return(0);
+}
+
+
+int VolumeFileExists(char *basename, char *ext)
+{
+    struct VolumeHeader header;
+    return(ReadVolumeHeader(basename,ext,&header) == 0);
+}
+
+
+void InitVolumeHeader(
+    struct VolumeHeader *header,
+    int FirstSliceNumber,
+    int NSlices,
+    int NRows,
+    int NCols,
+    int NumSliceDigits,
+    unsigned long long paramsHash)
+{
+    memset(header,0,sizeof(struct VolumeHeader));   /* headers are compared with memcmp() */
+    memcpy(header->magic,MBIR_VOLUME_MAGIC,8);
+    header->version = MBIR_VOLUME_VERSION;
+    header->dtype = MBIR_VOLUME_FLOAT32;
+    header->NRows = NRows;
+    header->NCols = NCols;
+    header->FirstSliceNumber = FirstSliceNumber;
+    header->NSlices = NSlices;
+    header->NumSliceDigits = NumSliceDigits;
+    header->paramsHash = paramsHash;
+}
+
+
+/* FNV-1a over the given bytes */
+unsigned long long HashBytes(unsigned long long h, void *p, size_t n)
+{
+    unsigned char *c = (unsigned char *) p;
+    size_t i;
+    for(i=0; i<n; i++)
+        h = (h ^ c[i]) * 0x100000001B3ULL;
+    return(h);
+}
+
+/* View angles aren't included: they're permuted in memory when views are sorted */
+unsigned long long SinoParamsHash(struct SinoParams3DParallel *sinoparams)
+{
+    unsigned long long h = 0xCBF29CE484222325ULL;
+    h = HashBytes(h,&sinoparams->NViews,sizeof(int));
+    h = HashBytes(h,&sinoparams->NChannels,sizeof(int));
+    h = HashBytes(h,&sinoparams->DeltaChannel,sizeof(float));
+    h = HashBytes(h,&sinoparams->CenterOffset,sizeof(float));
+    h = HashBytes(h,&sinoparams->DeltaSlice,sizeof(float));
+    return(h);
+}
+
+unsigned long long ImageParamsHash(struct ImageParams3D *imgparams)
+{
+    unsigned long long h = 0xCBF29CE484222325ULL;
+    h = HashBytes(h,&imgparams->Nx,sizeof(int));
+    h = HashBytes(h,&imgparams->Ny,sizeof(int));
+    h = HashBytes(h,&imgparams->Deltaxy,sizeof(float));
+    h = HashBytes(h,&imgparams->ROIRadius,sizeof(float));
+    h = HashBytes(h,&imgparams->DeltaZ,sizeof(float));
+    return(h);
+}
+
+
+int ReadVolume(
+    char *basename,
+    char *ext,
+    float **data,
+    int FirstSliceNumber,
+    int NSlices,
+    int NRows,
+    int NCols,
+    unsigned long long paramsHash)
+{
+    char fname[1100];
+    struct VolumeHeader header;
+    struct stat st;
+    int fd,i;
+    size_t M = (size_t)NRows*NCols;
+
+    sprintf(fname,"%s.%s",basename,ext);
+    if( (fd = open(fname,O_RDONLY)) < 0 || fstat(fd,&st) != 0 ) {
+        fprintf(stderr, "ERROR in ReadVolume: can't open file %s\n",fname);
+        exit(-1);
+    }
+    if(st.st_size < MBIR_VOLUME_HEADER_SIZE) {
+        fprintf(stderr, "ERROR in ReadVolume: %s isn't a volume file\n",fname);
+        exit(-1);
+    }
+    char *map = (char *) mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    if(map == MAP_FAILED) {
+        fprintf(stderr, "ERROR in ReadVolume: can't map file %s\n",fname);
+        exit(-1);
+    }
+    posix_madvise(map,st.st_size,POSIX_MADV_SEQUENTIAL);
+
+    memcpy(&header,map,sizeof(struct VolumeHeader));
+    if(memcmp(header.magic,MBIR_VOLUME_MAGIC,8) != 0 || header.version > MBIR_VOLUME_VERSION || header.dtype != MBIR_VOLUME_FLOAT32) {
+        fprintf(stderr, "ERROR in ReadVolume: %s isn't a supported volume file\n",fname);
+        exit(-1);
+    }
+    if(header.NRows != NRows || header.NCols != NCols || (paramsHash != 0 && header.paramsHash != 0 && header.paramsHash != paramsHash)) {
+        fprintf(stderr, "ERROR in ReadVolume: %s doesn't match the image/sinogram parameters\n",fname);
+        exit(-1);
+    }
+    if(FirstSliceNumber < header.FirstSliceNumber || FirstSliceNumber+NSlices > header.FirstSliceNumber+header.NSlices) {
+        fprintf(stderr, "ERROR in ReadVolume: %s holds slices %d-%d, not %d-%d\n",fname,header.FirstSliceNumber,
+            header.FirstSliceNumber+header.NSlices-1,FirstSliceNumber,FirstSliceNumber+NSlices-1);
+        exit(-1);
+    }
+    if((size_t)st.st_size < MBIR_VOLUME_HEADER_SIZE + (size_t)header.NSlices*M*sizeof(float)) {
+        fprintf(stderr, "ERROR in ReadVolume: %s terminated early\n",fname);
+        exit(-1);
+    }
+
+    float *src = (float *)(map + MBIR_VOLUME_HEADER_SIZE) + (size_t)(FirstSliceNumber-header.FirstSliceNumber)*M;
+    for(i=0; i<NSlices; i++)
+        memcpy(data[i],src+(size_t)i*M,M*sizeof(float));
+
+    munmap(map,st.st_size);
+    close(fd);
+    return 0;
+}
+
+
+/* pwrite() all of n bytes */
+int pwriteAll(int fd, char *buf, size_t n, off_t offset)
+{
+    while(n > 0)
+    {
+        size_t chunk = (n < ((size_t)1<<30)) ? n : ((size_t)1<<30);
+        ssize_t k = pwrite(fd,buf,chunk,offset);
+        if(k <= 0)
+            return(1);
+        buf += k;
+        n -= k;
+        offset += k;
+    }
+    return(0);
+}
+
+
+int WriteVolume(
+    char *basename,
+    char *ext,
+    float **data,
+    struct VolumeHeader *header,
+    int FirstSliceNumber,
+    int NSlices)
+{
+    char fname[1100];
+    struct VolumeHeader old;
+    size_t M = (size_t)header->NRows*header->NCols;
+    int fd,i,n;
+
+    if(FirstSliceNumber < header->FirstSliceNumber || FirstSliceNumber+NSlices > header->FirstSliceNumber+header->NSlices) {
+        fprintf(stderr, "ERROR in WriteVolume: slices %d-%d are outside the volume\n",FirstSliceNumber,FirstSliceNumber+NSlices-1);
+        exit(-1);
+    }
+
+    sprintf(fname,"%s.%s",basename,ext);
+    if(ReadVolumeHeader(basename,ext,&old) == 0 && memcmp(&old,header,sizeof(struct VolumeHeader)) == 0)
+        fd = open(fname,O_WRONLY);
+    else
+    {
+        char buf[MBIR_VOLUME_HEADER_SIZE];
+        memset(buf,0,MBIR_VOLUME_HEADER_SIZE);
+        memcpy(buf,header,sizeof(struct VolumeHeader));
+        fd = open(fname,O_WRONLY|O_CREAT|O_TRUNC,0644);
+        if(fd >= 0 && (pwriteAll(fd,buf,MBIR_VOLUME_HEADER_SIZE,0)
+           || ftruncate(fd,MBIR_VOLUME_HEADER_SIZE + (off_t)header->NSlices*M*sizeof(float)))) {
+            fprintf(stderr, "ERROR in WriteVolume: write to file %s terminated early\n",fname);
+            exit(-1);
+        }
+    }
+    if(fd < 0) {
+        fprintf(stderr, "ERROR in WriteVolume: can't open file %s\n",fname);
+        exit(-1);
+    }
+
+    /* one write per run of slices that are contiguous in memory */
+    for(i=0; i<NSlices; i+=n)
+    {
+        for(n=1; i+n<NSlices && data[i+n]==data[i]+n*M; n++);
+        off_t offset = MBIR_VOLUME_HEADER_SIZE + (off_t)(FirstSliceNumber-header->FirstSliceNumber+i)*M*sizeof(float);
+        if(pwriteAll(fd,(char *)data[i],n*M*sizeof(float),offset)) {
+            fprintf(stderr, "ERROR in WriteVolume: write to file %s terminated early\n",fname);
+            exit(-1);
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+
 /**********************************************/
 /*     Sinogram I/O and memory allocation     */
 /**********************************************/
@@ -645,6 +878,10 @@ int ReadSinoData3DParallel(
     NSlices = sinogram->sinoparams.NSlices;
     FirstSliceNumber = sinogram->sinoparams.FirstSliceNumber;
     M = sinogram->sinoparams.NViews * sinogram->sinoparams.NChannels;
+
+    if(VolumeFileExists(basename,"3Dsinodata"))
+        return(ReadVolume(basename,"3Dsinodata",sinogram->sino,FirstSliceNumber,NSlices,
+            sinogram->sinoparams.NViews,sinogram->sinoparams.NChannels,SinoParamsHash(&sinogram->sinoparams)));
     
     for(i=0;i<NSlices;i++)
     {
@@ -678,6 +915,10 @@ int ReadWeights3D(
     FirstSliceNumber = sinogram->sinoparams.FirstSliceNumber;
     M = sinogram->sinoparams.NViews * sinogram->sinoparams.NChannels;
 
+    if(VolumeFileExists(basename,"3Dweightdata"))
+        return(ReadVolume(basename,"3Dweightdata",sinogram->weight,FirstSliceNumber,NSlices,
+            sinogram->sinoparams.NViews,sinogram->sinoparams.NChannels,SinoParamsHash(&sinogram->sinoparams)));
+
     for(i=0;i<NSlices;i++)
     {
         sprintf(fname,"%s_slice%.*d.2Dweightdata",basename, sinogram->sinoparams.NumSliceDigits, i+FirstSliceNumber);
@@ -709,6 +950,14 @@ int WriteSino3DParallel(
     FirstSliceNumber = sinogram->sinoparams.FirstSliceNumber;
     M = sinogram->sinoparams.NViews * sinogram->sinoparams.NChannels;
 
+    if(VolumeFileOutput)
+    {
+        struct VolumeHeader header;
+        InitVolumeHeader(&header,FirstSliceNumber,NSlices,sinogram->sinoparams.NViews,sinogram->sinoparams.NChannels,
+            sinogram->sinoparams.NumSliceDigits,SinoParamsHash(&sinogram->sinoparams));
+        return(WriteVolume(basename,"3Dsinodata",sinogram->sino,&header,FirstSliceNumber,NSlices));
+    }
+
     for(i=0;i<NSlices;i++)
     {
         sprintf(fname,"%s_slice%.*d.2Dsinodata",basename, sinogram->sinoparams.NumSliceDigits, i+FirstSliceNumber);
@@ -740,6 +989,14 @@ int WriteWeights3D(
     FirstSliceNumber = sinogram->sinoparams.FirstSliceNumber;
     M = sinogram->sinoparams.NViews * sinogram->sinoparams.NChannels;
 
+    if(VolumeFileOutput)
+    {
+        struct VolumeHeader header;
+        InitVolumeHeader(&header,FirstSliceNumber,NSlices,sinogram->sinoparams.NViews,sinogram->sinoparams.NChannels,
+            sinogram->sinoparams.NumSliceDigits,SinoParamsHash(&sinogram->sinoparams));
+        return(WriteVolume(basename,"3Dweightdata",sinogram->weight,&header,FirstSliceNumber,NSlices));
+    }
+
     for(i=0;i<NSlices;i++)
     {
         sprintf(fname,"%s_slice%.*d.2Dweightdata",basename, sinogram->sinoparams.NumSliceDigits, i+FirstSliceNumber);
@@ -768,15 +1025,107 @@ int AllocateSinoData3DParallel(struct Sino3DParallel *sinogram)  /* Input: Sinog
 
 /* Utility for freeing memory allocated for sinogram, weights and ViewAngles */
 /* Returns 0 if no error occurs */
+/* Sinogram only, weight = NULL; the weights are then computed by the reconstruction */
+int AllocateSinoDataOnly3DParallel(struct Sino3DParallel *sinogram)
+{
+    sinogram->sino   = (float **)multialloc(sizeof(float), 2, sinogram->sinoparams.NSlices,sinogram->sinoparams.NViews * sinogram->sinoparams.NChannels);
+    sinogram->weight = NULL;
+    return 0;
+}
 int FreeSinoData3DParallel(struct Sino3DParallel *sinogram)  /* Input: Sinogram data+parameters structure */
 {
     multifree(sinogram->sino,2);
-    multifree(sinogram->weight,2);
+    if(sinogram->weight != NULL)
+        multifree(sinogram->weight,2);
     free((void *)sinogram->sinoparams.ViewAngles);
     return 0;
 }
 
 
+/*************************************/
+/*     View ordering of sinograms    */
+/*************************************/
+
+struct ViewAngleIndex
+{
+    double angle;
+    int index;
+};
+
+int CompareViewAngleIndex(const void *a, const void *b)
+{
+    const struct ViewAngleIndex *va = a, *vb = b;
+    if(va->angle < vb->angle) return -1;
+    if(va->angle > vb->angle) return 1;
+    return va->index - vb->index;   /* stable for repeated angles */
+}
+
+/* Utility for sorting the views by angle (mod 2pi) */
+/* Returns order[k] = acquisition index of the k-th sorted view; free() when done */
+int *ViewSortOrder(struct SinoParams3DParallel *sinoparams)
+{
+    int k;
+    int NViews = sinoparams->NViews;
+    int *order = (int *)get_spc(NViews,sizeof(int));
+    struct ViewAngleIndex *list = (struct ViewAngleIndex *)get_spc(NViews,sizeof(struct ViewAngleIndex));
+    const double twoPi = 2.0*3.1415926535897932384;
+
+    for(k=0;k<NViews;k++)
+    {
+        list[k].angle = fmod(sinoparams->ViewAngles[k],twoPi);
+        if(list[k].angle < 0)
+            list[k].angle += twoPi;
+        list[k].index = k;
+    }
+    qsort(list,NViews,sizeof(struct ViewAngleIndex),CompareViewAngleIndex);
+    for(k=0;k<NViews;k++)
+        order[k] = list[k].index;
+
+    free((void *)list);
+    return order;
+}
+
+/* Utility for reordering the view angles: ViewAngles[k] <- ViewAngles[order[k]] */
+void PermuteViewAngles(struct SinoParams3DParallel *sinoparams, int *order)
+{
+    int k;
+    float *angles = (float *)get_spc(sinoparams->NViews,sizeof(float));
+    for(k=0;k<sinoparams->NViews;k++)
+        angles[k] = sinoparams->ViewAngles[order[k]];
+    memcpy(sinoparams->ViewAngles,angles,sinoparams->NViews*sizeof(float));
+    free((void *)angles);
+}
+
+/* Utility for reordering the views of NSlices sinogram-shaped arrays (sino, weights, projections) */
+/* inverse=0: view k <- view order[k] (acquisition to sorted order)          */
+/* inverse=1: view order[k] <- view k (sorted back to acquisition order)     */
+void PermuteSinoViews(
+    float *data,	/* data[slice*NViews*NChannels + view*NChannels + channel] */
+    int NSlices,
+    int NViews,
+    int NChannels,
+    int *order,
+    char inverse)
+{
+    int i,k;
+    float *buf = (float *)get_spc((size_t)NViews*NChannels,sizeof(float));
+
+    for(i=0;i<NSlices;i++)
+    {
+        float *slice = data + (size_t)i*NViews*NChannels;
+        for(k=0;k<NViews;k++)
+        {
+            if(inverse)
+                memcpy(&buf[(size_t)order[k]*NChannels],&slice[(size_t)k*NChannels],NChannels*sizeof(float));
+            else
+                memcpy(&buf[(size_t)k*NChannels],&slice[(size_t)order[k]*NChannels],NChannels*sizeof(float));
+        }
+        memcpy(slice,buf,(size_t)NViews*NChannels*sizeof(float));
+    }
+    free((void *)buf);
+}
+
+
 /******************************************/
 /*     Image I/O and memory allocation    */
 /******************************************/
@@ -794,6 +1143,10 @@ int ReadImage3D(
     Nz = Image->imgparams.Nz;
     FirstSliceNumber = Image->imgparams.FirstSliceNumber;
     M = Image->imgparams.Nx * Image->imgparams.Ny;
+
+    if(VolumeFileExists(basename,"3Dimgdata"))
+        return(ReadVolume(basename,"3Dimgdata",Image->image,FirstSliceNumber,Nz,
+            Image->imgparams.Ny,Image->imgparams.Nx,ImageParamsHash(&Image->imgparams)));
     
     for(i=0;i<Nz;i++)
     {
@@ -824,6 +1177,14 @@ int WriteImage3D(
     Nz = Image->imgparams.Nz;
     FirstSliceNumber = Image->imgparams.FirstSliceNumber;
     M = Image->imgparams.Nx * Image->imgparams.Ny;
+
+    if(VolumeFileOutput)
+    {
+        struct VolumeHeader header;
+        InitVolumeHeader(&header,FirstSliceNumber,Nz,Image->imgparams.Ny,Image->imgparams.Nx,
+            Image->imgparams.NumSliceDigits,ImageParamsHash(&Image->imgparams));
+        return(WriteVolume(basename,"3Dimgdata",Image->image,&header,FirstSliceNumber,Nz));
+    }
     
     for(i=0;i<Nz;i++)
     {
@@ -1042,50 +1403,52 @@ void ComputeSinoWeights(
 	struct Sino3DParallel sinogram,
 	struct ReconParams reconparams)
 {
-    int i,j;
+    int i;
     int NSlices = sinogram.sinoparams.NSlices;
     int M = sinogram.sinoparams.NViews * sinogram.sinoparams.NChannels;
-    float ** y = sinogram.sino;
-    float ** w = sinogram.weight;
+
+    for(i=0;i<NSlices;i++)
+        SinoWeightsFromData(sinogram.weight[i],sinogram.sino[i],M,reconparams);
+}
+
+
+/* Weights of n sinogram entries per reconparams.weightType and SigmaY:   */
+/* w <- w/SigmaY^2 for type 0 (w read from file), otherwise computed from */
+/* the measurements y. w and y may be the same array for types 2-4.       */
+void SinoWeightsFromData(
+	float *w,
+	float *y,
+	size_t n,
+	struct ReconParams reconparams)
+{
+    size_t j;
     float SigmaYsq = reconparams.SigmaY * reconparams.SigmaY;
 
     if(reconparams.weightType==0)  // file provided
     {
-        for(i=0;i<NSlices;i++)
-        for(j=0;j<M;j++)
-            w[i][j] /= SigmaYsq;
-    }
-    else if(reconparams.weightType==1)  // unweighted (uniform)
-    {
-        for(i=0;i<NSlices;i++)
-        for(j=0;j<M;j++)
-            w[i][j] = 1.0f/SigmaYsq;
+        for(j=0;j<n;j++)
+            w[j] /= SigmaYsq;
     }
     else if(reconparams.weightType==2)  // transmission
     {
-        for(i=0;i<NSlices;i++)
-        for(j=0;j<M;j++)
-            w[i][j] = expf(-y[i][j])/SigmaYsq;
+        for(j=0;j<n;j++)
+            w[j] = expf(-y[j])/SigmaYsq;
     }
     else if(reconparams.weightType==3)  // transmission, square root
     {
-        for(i=0;i<NSlices;i++)
-        for(j=0;j<M;j++)
-            w[i][j] = expf(-y[i][j]/2.0f)/SigmaYsq;
+        for(j=0;j<n;j++)
+            w[j] = expf(-y[j]/2.0f)/SigmaYsq;
     }
     else if(reconparams.weightType==4)  // emission
     {
-        for(i=0;i<NSlices;i++)
-        for(j=0;j<M;j++)
-            w[i][j] = 1.0f/(y[i][j]+0.1f)/SigmaYsq;
+        for(j=0;j<n;j++)
+            w[j] = 1.0f/(y[j]+0.1f)/SigmaYsq;
     }
-    else    // default is unweighted (uniform)
+    else    // unweighted (uniform), the default
     {
-        for(i=0;i<NSlices;i++)
-        for(j=0;j<M;j++)
-            w[i][j] = 1.0f/SigmaYsq;
+        for(j=0;j<n;j++)
+            w[j] = 1.0f/SigmaYsq;
     }
-
 }
 
 
@@ -52,6 +52,78 @@ int WriteFloatArray(
 	int N);		/* Number of single precision elements to write */
 
 
+/*****************************************/
+/*     Single-file volume containers     */
+/*****************************************/
+
+/* A volume file <basename>.3D<type> (e.g. .3Dsinodata) holds a range of slices    */
+/* that would otherwise be the files <basename>_slice<Index>.2D<type>: a header     */
+/* padded to MBIR_VOLUME_HEADER_SIZE bytes, then the slices as contiguous floats.   */
+/* Readers of 3D data use a volume file if there is one; writers create one instead */
+/* of per-slice files after SetVolumeFileOutput(1).                                 */
+#define MBIR_VOLUME_MAGIC "MBIRVOL1"
+#define MBIR_VOLUME_VERSION 1
+#define MBIR_VOLUME_HEADER_SIZE 4096
+#define MBIR_VOLUME_FLOAT32 1
+
+struct VolumeHeader
+{
+	char magic[8];
+	int version;
+	int dtype;		/* MBIR_VOLUME_FLOAT32 */
+	int NRows, NCols;	/* slice dimensions: NViews x NChannels, or Ny x Nx */
+	int FirstSliceNumber;
+	int NSlices;
+	int NumSliceDigits;	/* digits of the per-slice file names it stands for */
+	int reserved;
+	unsigned long long paramsHash;	/* SinoParamsHash() or ImageParamsHash(), 0 if unknown */
+};
+
+/* Select volume files (1) or per-slice files (0, default) for the 3D writers */
+void SetVolumeFileOutput(char flag);
+
+char GetVolumeFileOutput(void);
+
+/* Returns 1 if <basename>.<ext> is a volume file, ext e.g. "3Dsinodata" */
+int VolumeFileExists(char *basename, char *ext);
+
+/* Utility for reading a volume file header */
+/* Returns 0 if no error occurs, 1 if the file can't be opened, 2 if it isn't a volume file */
+int ReadVolumeHeader(char *basename, char *ext, struct VolumeHeader *header);
+
+void InitVolumeHeader(struct VolumeHeader *header, int FirstSliceNumber, int NSlices, int NRows, int NCols,
+	int NumSliceDigits, unsigned long long paramsHash);
+
+/* Hash of the geometry fields that must match between data and parameters */
+unsigned long long SinoParamsHash(struct SinoParams3DParallel *sinoparams);
+unsigned long long ImageParamsHash(struct ImageParams3D *imgparams);
+
+/* Utility for reading slices [FirstSliceNumber,FirstSliceNumber+NSlices) of a volume */
+/* file into data[slice][row*NCols+col], through a memory map. Exits on error.       */
+/* Returns 0 if no error occurs */
+int ReadVolume(
+	char *basename,		/* Source: <basename>.<ext> */
+	char *ext,
+	float **data,
+	int FirstSliceNumber,
+	int NSlices,
+	int NRows,
+	int NCols,
+	unsigned long long paramsHash);	/* checked unless 0 */
+
+/* Utility for writing slices of a volume file described by header. If the file */
+/* exists with the same header the slices are written in place, otherwise it's   */
+/* created for the header's slice range. Exits on error.                        */
+/* Returns 0 if no error occurs */
+int WriteVolume(
+	char *basename,		/* Destination: <basename>.<ext> */
+	char *ext,
+	float **data,
+	struct VolumeHeader *header,
+	int FirstSliceNumber,
+	int NSlices);
+
+
 /**********************************************/
 /*     Sinogram I/O and memory allocation     */
 /**********************************************/
@@ -81,11 +153,38 @@ int WriteWeights3D(
 /* Returns 0 if no error occurs */
 int AllocateSinoData3DParallel(struct Sino3DParallel *sinogram);
 
+/* Utility that allocates memory for the sinogram only, with weight = NULL, */
+/* for reconstructions that compute the weights themselves                  */
+/* Returns 0 if no error occurs */
+int AllocateSinoDataOnly3DParallel(struct Sino3DParallel *sinogram);
+
 /* Utility for freeing memory allocated for sinogram, weights and ViewAngles */
 /* Returns 0 if no error occurs */
 int FreeSinoData3DParallel(struct Sino3DParallel *sinogram);
 
 
+/*************************************/
+/*     View ordering of sinograms    */
+/*************************************/
+
+/* Utility for sorting the views by angle (mod 2pi) into angle-coherent order */
+/* Returns order[k] = acquisition index of the k-th sorted view; free() when done */
+int *ViewSortOrder(struct SinoParams3DParallel *sinoparams);
+
+/* Utility for reordering the view angles: ViewAngles[k] <- ViewAngles[order[k]] */
+void PermuteViewAngles(struct SinoParams3DParallel *sinoparams, int *order);
+
+/* Utility for reordering the views of NSlices sinogram-shaped arrays */
+/* inverse=0: acquisition to sorted order; inverse=1: sorted back to acquisition order */
+void PermuteSinoViews(
+	float *data,		/* data[slice*NViews*NChannels + view*NChannels + channel] */
+	int NSlices,
+	int NViews,
+	int NChannels,
+	int *order,		/* from ViewSortOrder() */
+	char inverse);
+
+
 /******************************************/
 /*     Image I/O and memory allocation    */
 /******************************************/
@@ -171,6 +270,9 @@ int NumSinoSliceDigits(char *basename, int slice);
 /* Compute sinogram weights */
 void ComputeSinoWeights(struct Sino3DParallel sinogram, struct ReconParams reconparams);
 
+/* Compute the weights of n sinogram entries from the measurements y (see ComputeSinoWeights) */
+void SinoWeightsFromData(float *w, float *y, size_t n, struct ReconParams reconparams);
+
 
 #endif /* MBIR_MODULAR_UTILS_H */
 
@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+
+#include "allocate.h"
+#include "checkpoint.h"
+
+
+/* Checkpoint file: magic, version, geometry, counters and RNG state, */
+/* then image, sinoerr, headNodeArray, order and phaseMap, and with   */
+/* Nfreeze > 0 the SV freezing counters and flags.                    */
+/* The file is written under a temporary name and renamed, so an      */
+/* interrupted write leaves the previous checkpoint in place.         */
+void WriteCheckpoint(char *fname, struct ReconState *state)
+{
+    FILE *fp;
+    char tmpname[1100];
+    int version = CHECKPOINT_VERSION;
+    int stop = state->stop_FLAG;
+    unsigned long freezeCount[3];
+    size_t Nimg = (size_t)state->Nz*state->Nx*state->Ny;
+    size_t Nsino = (size_t)state->Nz*state->Nvc;
+    size_t n = 0;
+
+    sprintf(tmpname,"%s.tmp",fname);
+    if ((fp = fopen(tmpname, "wb")) == NULL) {
+        fprintf(stderr, "ERROR in WriteCheckpoint: can't open file %s.\n", tmpname);
+        exit(-1);
+    }
+
+    n += fwrite(CHECKPOINT_MAGIC,1,8,fp) == 8;
+    n += fwrite(&version,sizeof(int),1,fp);
+    n += fwrite(&state->Nx,sizeof(int),1,fp);
+    n += fwrite(&state->Ny,sizeof(int),1,fp);
+    n += fwrite(&state->Nz,sizeof(int),1,fp);
+    n += fwrite(&state->Nvc,sizeof(int),1,fp);
+    n += fwrite(&state->Nlist,sizeof(int),1,fp);
+    n += fwrite(&state->iter,sizeof(int),1,fp);
+    n += fwrite(&state->it_print,sizeof(int),1,fp);
+    n += fwrite(&stop,sizeof(int),1,fp);
+    n += fwrite(&state->equits,sizeof(float),1,fp);
+    n += fwrite(&state->avg_update,sizeof(float),1,fp);
+    n += fwrite(&state->avg_update_rel,sizeof(float),1,fp);
+    n += fwrite(&state->rngSeed,sizeof(unsigned long long),1,fp);
+    n += fwrite(&state->rngState,sizeof(unsigned long long),1,fp);
+    n += fwrite(state->image,sizeof(float),Nimg,fp) == Nimg;
+    n += fwrite(state->sinoerr,sizeof(float),Nsino,fp) == Nsino;
+    n += fwrite(state->headNodeArray,sizeof(struct heap_node),state->Nlist,fp) == (size_t)state->Nlist;
+    n += fwrite(state->order,sizeof(long),state->Nlist,fp) == (size_t)state->Nlist;
+    n += fwrite(state->phaseMap,sizeof(char),state->Nlist,fp) == (size_t)state->Nlist;
+    n += fwrite(&state->Nfreeze,sizeof(int),1,fp);
+    if(state->Nfreeze > 0)
+    {
+        freezeCount[0] = state->freezeVisits;
+        freezeCount[1] = state->freezeSkips;
+        freezeCount[2] = state->passSkips;
+        n += fwrite(freezeCount,sizeof(unsigned long),3,fp) == 3;
+        n += fwrite(state->quiet,sizeof(unsigned char),state->Nfreeze,fp) == (size_t)state->Nfreeze;
+        n += fwrite(state->skipped,sizeof(unsigned char),state->Nfreeze,fp) == (size_t)state->Nfreeze;
+        n += fwrite(state->parked,sizeof(char),state->Nfreeze,fp) == (size_t)state->Nfreeze;
+    }
+
+    if(fclose(fp) != 0 || n != (state->Nfreeze > 0 ? 25 : 21)) {
+        fprintf(stderr, "ERROR in WriteCheckpoint: can't write %s.\n", tmpname);
+        exit(-1);
+    }
+    if(rename(tmpname,fname) != 0) {
+        fprintf(stderr, "ERROR in WriteCheckpoint: can't rename %s to %s.\n", tmpname, fname);
+        exit(-1);
+    }
+}
+
+
+void C_fread(void *ptr, size_t size, size_t n, FILE *fp, char *fname)
+{
+    if(fread(ptr,size,n,fp) < n) {
+        fprintf(stderr, "ERROR in ReadCheckpoint: %s terminated early.\n", fname);
+        exit(-1);
+    }
+}
+
+
+/* Read a checkpoint into state. The geometry fields and Nfreeze of */
+/* state must be set and the arrays allocated; the file has to match. */
+void ReadCheckpoint(char *fname, struct ReconState *state)
+{
+    FILE *fp;
+    char magic[8];
+    int version, stop, Nfreeze;
+    int geom[5];
+    unsigned long freezeCount[3];
+
+    if ((fp = fopen(fname, "rb")) == NULL) {
+        fprintf(stderr, "ERROR in ReadCheckpoint: can't open file %s.\n", fname);
+        exit(-1);
+    }
+
+    C_fread(magic,1,8,fp,fname);
+    C_fread(&version,sizeof(int),1,fp,fname);
+    if(memcmp(magic,CHECKPOINT_MAGIC,8) != 0 || version != CHECKPOINT_VERSION) {
+        fprintf(stderr, "ERROR in ReadCheckpoint: %s isn't a version %d checkpoint file.\n", fname, CHECKPOINT_VERSION);
+        exit(-1);
+    }
+    C_fread(geom,sizeof(int),5,fp,fname);
+    if(geom[0] != state->Nx || geom[1] != state->Ny || geom[2] != state->Nz
+       || geom[3] != state->Nvc || geom[4] != state->Nlist) {
+        fprintf(stderr, "ERROR in ReadCheckpoint: %s doesn't match the image/sinogram parameters.\n", fname);
+        exit(-1);
+    }
+
+    C_fread(&state->iter,sizeof(int),1,fp,fname);
+    C_fread(&state->it_print,sizeof(int),1,fp,fname);
+    C_fread(&stop,sizeof(int),1,fp,fname);
+    state->stop_FLAG = stop;
+    C_fread(&state->equits,sizeof(float),1,fp,fname);
+    C_fread(&state->avg_update,sizeof(float),1,fp,fname);
+    C_fread(&state->avg_update_rel,sizeof(float),1,fp,fname);
+    C_fread(&state->rngSeed,sizeof(unsigned long long),1,fp,fname);
+    C_fread(&state->rngState,sizeof(unsigned long long),1,fp,fname);
+    C_fread(state->image,sizeof(float),(size_t)state->Nz*state->Nx*state->Ny,fp,fname);
+    C_fread(state->sinoerr,sizeof(float),(size_t)state->Nz*state->Nvc,fp,fname);
+    C_fread(state->headNodeArray,sizeof(struct heap_node),state->Nlist,fp,fname);
+    C_fread(state->order,sizeof(long),state->Nlist,fp,fname);
+    C_fread(state->phaseMap,sizeof(char),state->Nlist,fp,fname);
+    C_fread(&Nfreeze,sizeof(int),1,fp,fname);
+    if((Nfreeze > 0) != (state->Nfreeze > 0)) {
+        fprintf(stderr, "ERROR in ReadCheckpoint: %s was written %s SV freezing (-F); resume %s it.\n",
+                fname, Nfreeze ? "with" : "without", Nfreeze ? "with" : "without");
+        exit(-1);
+    }
+    if(Nfreeze != state->Nfreeze) {
+        fprintf(stderr, "ERROR in ReadCheckpoint: %s doesn't match the image/sinogram parameters.\n", fname);
+        exit(-1);
+    }
+    if(Nfreeze > 0)
+    {
+        C_fread(freezeCount,sizeof(unsigned long),3,fp,fname);
+        state->freezeVisits = freezeCount[0];
+        state->freezeSkips = freezeCount[1];
+        state->passSkips = freezeCount[2];
+        C_fread(state->quiet,sizeof(unsigned char),Nfreeze,fp,fname);
+        C_fread(state->skipped,sizeof(unsigned char),Nfreeze,fp,fname);
+        C_fread(state->parked,sizeof(char),Nfreeze,fp,fname);
+    }
+
+    fclose(fp);
+}
+
+
+void *CheckpointWriterThread(void *arg)
+{
+    struct CheckpointWriter *w = (struct CheckpointWriter *) arg;
+
+    pthread_mutex_lock(&w->lock);
+    while(1)
+    {
+        while(!w->pending && !w->quit)
+            pthread_cond_wait(&w->cond,&w->lock);
+        if(!w->pending)
+            break;
+        /* snap isn't touched by the recon loop while pending is set */
+        pthread_mutex_unlock(&w->lock);
+        double t = omp_get_wtime();
+        WriteCheckpoint(w->fname,&w->snap);
+        t = omp_get_wtime() - t;
+        pthread_mutex_lock(&w->lock);
+        w->writeTime = t;
+        w->count++;
+        w->pending = 0;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return(NULL);
+}
+
+
+/* Allocate the snapshot buffer for the geometry in state and start the writer */
+void CheckpointWriterStart(struct CheckpointWriter *w, char *fname, struct ReconState *state)
+{
+    snprintf(w->fname,sizeof(w->fname),"%s",fname);
+    w->snap = *state;
+    w->snap.image = (float *) mget_spc((size_t)state->Nz*state->Nx*state->Ny,sizeof(float));
+    w->snap.sinoerr = (float *) mget_spc((size_t)state->Nz*state->Nvc,sizeof(float));
+    w->snap.headNodeArray = (struct heap_node *) mget_spc(state->Nlist,sizeof(struct heap_node));
+    w->snap.order = (long *) mget_spc(state->Nlist,sizeof(long));
+    w->snap.phaseMap = (char *) mget_spc(state->Nlist,sizeof(char));
+    if(state->Nfreeze > 0)
+    {
+        w->snap.quiet = (unsigned char *) mget_spc(state->Nfreeze,sizeof(unsigned char));
+        w->snap.skipped = (unsigned char *) mget_spc(state->Nfreeze,sizeof(unsigned char));
+        w->snap.parked = (char *) mget_spc(state->Nfreeze,sizeof(char));
+    }
+    w->pending = 0;
+    w->quit = 0;
+    w->count = 0;
+    w->writeTime = 0;
+
+    pthread_mutex_init(&w->lock,NULL);
+    pthread_cond_init(&w->cond,NULL);
+    if(pthread_create(&w->thread,NULL,CheckpointWriterThread,(void *)w) != 0) {
+        fprintf(stderr, "ERROR in CheckpointWriterStart: can't start writer thread.\n");
+        exit(-1);
+    }
+}
+
+
+/* Copy state into the snapshot and hand it to the writer. Returns 0 without */
+/* copying if the previous checkpoint is still being written.                */
+int CheckpointWriterSubmit(struct CheckpointWriter *w, struct ReconState *state)
+{
+    struct ReconState *snap = &w->snap;
+    int busy;
+
+    pthread_mutex_lock(&w->lock);
+    busy = w->pending;
+    pthread_mutex_unlock(&w->lock);
+    if(busy)
+        return(0);
+
+    snap->iter = state->iter;
+    snap->it_print = state->it_print;
+    snap->equits = state->equits;
+    snap->avg_update = state->avg_update;
+    snap->avg_update_rel = state->avg_update_rel;
+    snap->stop_FLAG = state->stop_FLAG;
+    snap->rngSeed = state->rngSeed;
+    snap->rngState = state->rngState;
+    memcpy(snap->image,state->image,(size_t)state->Nz*state->Nx*state->Ny*sizeof(float));
+    memcpy(snap->sinoerr,state->sinoerr,(size_t)state->Nz*state->Nvc*sizeof(float));
+    memcpy(snap->headNodeArray,state->headNodeArray,state->Nlist*sizeof(struct heap_node));
+    memcpy(snap->order,state->order,state->Nlist*sizeof(long));
+    memcpy(snap->phaseMap,state->phaseMap,state->Nlist*sizeof(char));
+    if(state->Nfreeze > 0)
+    {
+        snap->freezeVisits = state->freezeVisits;
+        snap->freezeSkips = state->freezeSkips;
+        snap->passSkips = state->passSkips;
+        memcpy(snap->quiet,state->quiet,state->Nfreeze*sizeof(unsigned char));
+        memcpy(snap->skipped,state->skipped,state->Nfreeze*sizeof(unsigned char));
+        memcpy(snap->parked,state->parked,state->Nfreeze*sizeof(char));
+    }
+
+    pthread_mutex_lock(&w->lock);
+    w->pending = 1;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+
+    return(1);
+}
+
+
+/* Finish a pending write, stop the writer and free the snapshot buffer */
+void CheckpointWriterStop(struct CheckpointWriter *w)
+{
+    pthread_mutex_lock(&w->lock);
+    w->quit = 1;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread,NULL);
+
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+    free((void *)w->snap.image);
+    free((void *)w->snap.sinoerr);
+    free((void *)w->snap.headNodeArray);
+    free((void *)w->snap.order);
+    free((void *)w->snap.phaseMap);
+    if(w->snap.Nfreeze > 0)
+    {
+        free((void *)w->snap.quiet);
+        free((void *)w->snap.skipped);
+        free((void *)w->snap.parked);
+    }
+}
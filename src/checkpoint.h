@@ -0,0 +1,61 @@
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include <pthread.h>
+#include "heap.h"
+
+#define CHECKPOINT_MAGIC "MBIRCKPT"
+#define CHECKPOINT_VERSION 2
+#define CHECKPOINT_INTERVAL_DEFAULT 600     /* seconds of wall-clock time */
+
+/* Reconstruction state at an iteration boundary of MBIRContextRecon(). */
+/* With the same inputs it's all that's needed to continue the run.     */
+struct ReconState
+{
+    int Nx, Ny, Nz, Nvc;                /* geometry, checked on resume */
+    int Nlist;                          /* active SVs over all slabs, see SVactiveFlags() */
+    int iter, it_print;
+    float equits;
+    float avg_update, avg_update_rel;
+    char stop_FLAG;
+    unsigned long long rngSeed;         /* coordinate shuffles within SVs */
+    unsigned long long rngState;        /* SV order shuffles */
+    float *image;                       /* Nz*Nx*Ny */
+    float *sinoerr;                     /* Nz*Nvc */
+    struct heap_node *headNodeArray;    /* Nlist */
+    long *order;                        /* Nlist */
+    char *phaseMap;                     /* Nlist */
+    int Nfreeze;                        /* SVs with freezing (-F) state, Nsv*SV_per_Z or 0; checked on resume */
+    unsigned char *quiet;               /* Nfreeze, see struct SVFreeze */
+    unsigned char *skipped;             /* Nfreeze */
+    char *parked;                       /* Nfreeze */
+    unsigned long freezeVisits, freezeSkips, passSkips;
+};
+
+/* Background checkpoint writer. The recon loop copies its state into */
+/* snap and goes on; a thread writes snap to the file meanwhile.      */
+struct CheckpointWriter
+{
+    char fname[1024];
+    struct ReconState snap;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char pending;                   /* snap holds a state not yet written */
+    char quit;
+    int count;                      /* checkpoints written */
+    double writeTime;               /* seconds, last write */
+};
+
+/* Functions */
+void WriteCheckpoint(char *fname, struct ReconState *state);
+
+void ReadCheckpoint(char *fname, struct ReconState *state);
+
+void CheckpointWriterStart(struct CheckpointWriter *w, char *fname, struct ReconState *state);
+
+int CheckpointWriterSubmit(struct CheckpointWriter *w, struct ReconState *state);
+
+void CheckpointWriterStop(struct CheckpointWriter *w);
+
+#endif
@@ -24,7 +24,17 @@ void initSVParams(struct SVParams *svpar,struct ImageParams3D imgparams,struct S
 	svpar->overlap=OVERLAPPINGDISTANCE;
 	svpar->SVDepth=SVDEPTH;
 	svpar->Nsv=0;
-	svpar->pieceLength=computePieceLength(sinoparams.NViews);
+	svpar->pieceLength=computePieceLength(sinoparams.NViews,1);
+	svpar->Abits=8;
+	svpar->otf=NULL;
+	svpar->sym=NULL;
+	svpar->viewOrder=NULL;
+	svpar->padStats=NULL;
+	svpar->roi=NULL;
+	svpar->freeze=NULL;
+	svpar->zeroMap=NULL;
+	svpar->batch=NULL;
+	svpar->weightWindow=NULL;
 
 	for(i=0;i<imgparams.Ny;i+=(svpar->SVLength*2-svpar->overlap))
 	for(j=0;j<imgparams.Nx;j+=(svpar->SVLength*2-svpar->overlap))
@@ -58,20 +68,27 @@ void initSVParams(struct SVParams *svpar,struct ImageParams3D imgparams,struct S
 }
 
 /* The pieceLength is the block size in the super-voxel buffer. From past 
- * experiments a good block size is about 1/16 of the views but it has to divide
- * evenly into Nviews. For example, if we have 900 views, and 900/16 = 56.25, 
- * check integers from 56 to 1 in a descending order. The first integer divisible 
- * is a viable block size.
+ * experiments a good block size is about 1/16 of the views. Originally it had to
+ * divide evenly into Nviews: for 900 views, 900/16 = 56.25, so integers from 56
+ * to 1 are checked in descending order and the first divisor is used. The last
+ * piece may now be shorter, so if the nearest divisor is less than half the
+ * target (e.g. a prime number of views would give 1), the target is used with a
+ * ragged last piece. allowRagged=0 gives the original divisor-only rule, which
+ * matrix files without a header were written with.
  */
-int computePieceLength(int NViews)
+int computePieceLength(int NViews, char allowRagged)
 {
-        int pieceLength=NViews/16;
-        if(pieceLength<1)
-                pieceLength=1;
+        int target=NViews/16;
+        if(target<1)
+                target=1;
 
+        int pieceLength=target;
         while( pieceLength>1 && (NViews%pieceLength!=0) )
                 pieceLength--;
 
+        if(allowRagged && pieceLength < (target+1)/2)
+                pieceLength=target;
+
         //fprintf(stderr, "Nviews %d, pieceLength %d\n",NViews,pieceLength);
         return(pieceLength);
 }
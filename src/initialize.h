@@ -6,7 +6,7 @@
 
 void NormalizePriorWeights3D(struct ReconParams *reconparams);
 void initSVParams(struct SVParams *svpar,struct ImageParams3D imgparams,struct SinoParams3DParallel sinoparams);
-int computePieceLength(int NViews);
+int computePieceLength(int NViews, char allowRagged);
 char *GenImageReconMask(struct ImageParams3D *imgparams);
 void initConstImage(struct Image3D *Image, char *ImageReconMask, float InitValue, float OutsideROIValue);
 
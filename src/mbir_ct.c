@@ -3,8 +3,12 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <string.h>
+#include <math.h>
 //#include <time.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <dlfcn.h>
+#include <pthread.h>
 
 #include "mbir_ct.h"
 #include "MBIRModularDefs.h"
@@ -13,6 +17,36 @@
 #include "A_comp.h"
 #include "initialize.h"
 #include "recon3d.h"
+#include "mbir_daemon.h"
+#include "mbir_denoiser.h"
+#include "checkpoint.h"
+#include "sliceio.h"
+
+/* Per-slice preparation of the sinogram as slices arrive from the I/O */
+/* threads: views are sorted, and once all of a slice's inputs are in   */
+/* its weights are computed (if there's a weight array).                */
+struct SinoPrep
+{
+    struct Sino3DParallel sinogram;
+    struct ReconParams reconparams;
+    int *viewOrder;
+    int need;                   /* transfers per slice: sinogram, weights */
+    int *count;                 /* transfers in, per slice */
+    pthread_mutex_t lock;
+};
+
+#define MULTIRES_MAX_LEVELS 3       /* -G: coarsest grid is 8 times coarser */
+
+/* Startup stages of a reconstruction, for the -v 2 timeline */
+#define MAX_STARTUP_STAGES 12
+struct StartupTimeline
+{
+    int n;
+    struct timeval tm0;
+    char name[MAX_STARTUP_STAGES][32];
+    double start[MAX_STARTUP_STAGES], end[MAX_STARTUP_STAGES];    /* ms from tm0 */
+    int dep[MAX_STARTUP_STAGES];                                    /* stage it waited for, or -1 */
+};
 
 /* Internal Functions */
 void readCmdLine(int argc, char *argv[], struct CmdLine *cmdline);
@@ -21,20 +55,67 @@ void printCmdLineUsage(char *ExecFileName);
 int CmdLineHelpOption(char *string);
 int setNumSliceDigits(char *basename, char *ext, int slice, struct SinoParams3DParallel *sinoparams, struct ImageParams3D *imgparams);
 int NumSliceDigits(char *basename, char *ext, int slice);
+void readProjection(char *basename, float **proj, struct SinoParams3DParallel *sinoparams, int Ndigits);
+void writeProjection(char *basename, float **proj, struct SinoParams3DParallel *sinoparams, int Ndigits, char volumeFlag);
+int convertVolume(int argc, char *argv[]);
+void reconstructBatch(struct CmdLine *cmdline, struct ImageParams3D imgparams, struct SinoParams3DParallel sinoparams,
+    char *readmatrix_fname, struct AmatrixParams Aparams, int *viewOrder, struct MBIRContext *ctx);
+void reconstructPnP(struct CmdLine *cmdline, struct MBIRContext *ctx, float *image, float *sino, float *weight, float *proj,
+    struct ImageParams3D imgparams, struct ReconParams reconparams);
+void reconstructSweep(struct CmdLine *cmdline, struct MBIRContext *ctx, struct Image3D *Image, float *sino, float *weight,
+    float *proj, struct ReconParams reconparams);
+void reconstructSlabs(struct CmdLine *cmdline, struct MBIRContext *ctx, struct ImageParams3D imgparams,
+    struct SinoParams3DParallel sinoparams, int *viewOrder);
+void prepSinoSlice(void *arg, float *data, int slice);
+char *ROIMask(char *spec, struct ImageParams3D imgparams);
+void dilateMask(char *mask, int Nx, int Ny, int Nz, int margin);
+unsigned long long reconstructCoarse(struct CmdLine *cmdline, struct ImageParams3D imgparams, struct SinoParams3DParallel sinoparams,
+    float *image, float *sino, float *weight, struct ReconParams reconparams, struct AmatrixParams Aparams);
+void binChannels(float *csino, float *cweight, float *sino, float *weight, size_t Nrows, int NChannels, int factor,
+    struct ReconParams reconparams);
+void resampleImage(float *dst, struct ImageParams3D dstparams, float *src, struct ImageParams3D srcparams);
+int timelineAdd(struct StartupTimeline *tl, char *name, struct timeval *start, struct timeval *end, int dep);
+void printTimeline(struct StartupTimeline *tl);
+int setReconParam(struct ReconParams *reconparams, char *name, char *value);
+float reconParamsDistance(struct ReconParams *a, struct ReconParams *b);
+int commandMatrix(int argc, char *argv[], char *matrix_fname, struct ImageParams3D *imgparams,
+    struct SinoParams3DParallel *sinoparams, struct AmatrixParams *Aparams);
 
 int main(int argc, char *argv[])
+{
+    if(argc>1 && strcmp(argv[1],"-daemon")==0)
+        return(MBIRDaemon(argc,argv));
+    if(argc>1 && strcmp(argv[1],"-client")==0)
+        return(MBIRClient(argc,argv));
+    if(argc>1 && strcmp(argv[1],"-convert")==0)
+        return(convertVolume(argc,argv));
+
+    return(runCommand(argc,argv,NULL));
+}
+
+
+/* Run one mbir_ct command line. In a daemon job, cache holds the resident */
+/* system matrices; otherwise it's NULL.                                    */
+int runCommand(int argc, char *argv[], struct MatrixCache *cache)
 {
     struct CmdLine cmdline;
     struct Image3D Image;
     struct Image3D ProxMap;
     struct Sino3DParallel sinogram;
     struct ReconParams reconparams;
-    char fname[1064], *readmatrix_fname=NULL;
-    struct timeval tm0,tm2;
+    struct AmatrixParams Aparams;
+    char fname[1064], matrix_fname[1064], *readmatrix_fname=NULL;
+    struct timeval tm0,tm1,tm2;
     unsigned long long tdiff;
     float **proj;
     float *proximalmap;
-    int jz,FirstSliceNumber,Ndigits;
+    int *viewOrder=NULL;
+    int FirstSliceNumber,Ndigits;
+    struct MBIRContext *ctx=NULL;
+    char ownCtx=0;
+    struct SliceTransfer sinoRead,weightRead,imageRead,projRead,proxRead,imageWrite,projWrite;
+    struct SinoPrep prep;
+    struct StartupTimeline timeline;
 
     gettimeofday(&tm0,NULL);
 
@@ -44,6 +125,11 @@ int main(int argc, char *argv[])
         fprintf(stdout,"%s -- build time: %s, %s\n", argv[0], __DATE__,  __TIME__);
     }
     procCmdLine(argc, argv, &cmdline);
+    SetVolumeFileOutput(cmdline.volumeFlag);
+    Aparams.matrixFree = cmdline.matrixFreeFlag;
+    Aparams.symmetry = cmdline.symmetryFlag;
+    Aparams.Abits = cmdline.Abits;
+    Aparams.pieceLength = cmdline.pieceLength;
 
     /* Read image/sino parameter files */
     ReadSinoParams3DParallel(cmdline.SinoParamsFile,&sinogram.sinoparams);
@@ -51,11 +137,39 @@ int main(int argc, char *argv[])
     int NvNc = sinogram.sinoparams.NViews * sinogram.sinoparams.NChannels;
     int Nz = Image.imgparams.Nz;
 
+    /* set input matrix filename pointer--used to determine whether to read or compute */
+    if(cmdline.readAmatrixFlag) {
+        sprintf(matrix_fname,"%s.2Dsvmatrix",cmdline.SysMatrixFile);
+        readmatrix_fname = &matrix_fname[0];
+    }
+
+    /* Sort views into angle-coherent order. Data are permuted after reading and */
+    /* before writing so files stay in acquisition order.                         */
+    if(cmdline.viewSortFlag || (readmatrix_fname != NULL && AmatrixFileViewSort(readmatrix_fname)))
+    {
+        viewOrder = ViewSortOrder(&sinogram.sinoparams);
+        PermuteViewAngles(&sinogram.sinoparams,viewOrder);
+        if(cmdline.verboseLevel>1)
+            fprintf(stdout,"Views sorted by angle\n");
+    }
+    Aparams.viewOrder = viewOrder;
+
+    /* Daemon job: use the resident copy of the stored matrix if there is one */
+    if(cache != NULL && readmatrix_fname != NULL && !cmdline.writeAmatrixFlag)
+    {
+        char key[MATRIX_KEY_LEN];
+        MatrixCacheKey(key,readmatrix_fname,&Image.imgparams,&sinogram.sinoparams);
+        ctx = MatrixCacheFind(cache,key);
+        if(ctx != NULL && cmdline.verboseLevel)
+            fprintf(stdout,"Using resident system matrix\n");
+    }
+
     /* Compute/write A matrix only and EXIT */
     if(cmdline.writeAmatrixFlag)
     {
         sprintf(fname,"%s.2Dsvmatrix",cmdline.SysMatrixFile);
-        AmatrixComputeToFile(Image.imgparams,sinogram.sinoparams,fname,cmdline.verboseLevel);
+        AmatrixComputeToFile(Image.imgparams,sinogram.sinoparams,fname,Aparams,cmdline.verboseLevel);
+        free((void *)viewOrder);
         return(0);
     }
 
@@ -70,23 +184,33 @@ int main(int argc, char *argv[])
         ReadImage3D(cmdline.InitImageFile,&Image);
         proj = (float **)multialloc(sizeof(float),2,Nz,NvNc);
 
-        /* set input matrix filename pointer--used to determine whether to read or compute */
-        if(cmdline.readAmatrixFlag) {
-            sprintf(fname,"%s.2Dsvmatrix",cmdline.SysMatrixFile);
-            readmatrix_fname = &fname[0];
-        }
-        forwardProject(&proj[0][0],&(Image.image[0][0]),Image.imgparams,sinogram.sinoparams,readmatrix_fname,0,cmdline.verboseLevel);
+        if(ctx != NULL)
+            MBIRContextProject(ctx,&proj[0][0],&(Image.image[0][0]),Nz,0);
+        else
+            forwardProjectA(&proj[0][0],&(Image.image[0][0]),Image.imgparams,sinogram.sinoparams,readmatrix_fname,Aparams,0,cmdline.verboseLevel);
+        if(viewOrder != NULL)
+            PermuteSinoViews(&proj[0][0],Nz,sinogram.sinoparams.NViews,sinogram.sinoparams.NChannels,viewOrder,1);
         if(cmdline.verboseLevel)
             fprintf(stdout,"Writing projection to file...\n");
-        for(jz=0; jz<Nz; jz++) {
-            sprintf(fname,"%s_slice%.*d.2Dprojection",cmdline.outputProjectionFile,Ndigits,jz+FirstSliceNumber);
-            if( WriteFloatArray(fname,proj[jz],NvNc) ) {
-                fprintf(stderr,"Error: can't open file %s for writing\n",fname);
-                exit(-1);
-            }
-        }
+        sinogram.sinoparams.NSlices = Nz;
+        sinogram.sinoparams.FirstSliceNumber = FirstSliceNumber;
+        writeProjection(cmdline.outputProjectionFile,proj,&sinogram.sinoparams,Ndigits,cmdline.volumeFlag);
         multifree(proj,2);
         FreeImageData3D(&Image);
+        free((void *)viewOrder);
+        return(0);
+    }
+
+    /* Batch of reconstructions sharing the system matrix, then EXIT */
+    if(cmdline.batchFlag)
+    {
+        reconstructBatch(&cmdline,Image.imgparams,sinogram.sinoparams,readmatrix_fname,Aparams,viewOrder,ctx);
+        free((void *)viewOrder);
+        if(cmdline.verboseLevel) {
+            gettimeofday(&tm2,NULL);
+            tdiff = 1000 * (tm2.tv_sec - tm0.tv_sec) + (tm2.tv_usec - tm0.tv_usec) / 1000;
+            fprintf(stdout,"Done. Total run time = %llu ms\n",tdiff);
+        }
         return(0);
     }
 
@@ -101,26 +225,51 @@ int main(int argc, char *argv[])
     /* Detect the number of slice number digits in input file names */
     Ndigits = setNumSliceDigits(cmdline.SinoDataFile,"2Dsinodata",FirstSliceNumber,&sinogram.sinoparams,&Image.imgparams);
 
-    /* Allocate and read sinogram data */
-    AllocateImageData3D(&Image);
-    AllocateSinoData3DParallel(&sinogram);
-    ReadSinoData3DParallel(cmdline.SinoDataFile, &sinogram);
-
-    /* set input matrix filename pointer--used to determine whether to read or compute */
-    if(cmdline.readAmatrixFlag) {
-        sprintf(fname,"%s.2Dsvmatrix",cmdline.SysMatrixFile);
-        readmatrix_fname = &fname[0];
+    /* Out-of-core reconstruction in z-slabs, then EXIT */
+    if(cmdline.slabDepth > 0)
+    {
+        if(ctx == NULL) {
+            ctx = MBIRContextCreate(Image.imgparams,sinogram.sinoparams,readmatrix_fname,Aparams,cmdline.verboseLevel);
+            ownCtx = 1;
+        }
+        reconstructSlabs(&cmdline,ctx,Image.imgparams,sinogram.sinoparams,viewOrder);
+        if(ownCtx)
+            MBIRContextDestroy(ctx);
+        free((void *)viewOrder);
+        if(cmdline.verboseLevel) {
+            gettimeofday(&tm2,NULL);
+            tdiff = 1000 * (tm2.tv_sec - tm0.tv_sec) + (tm2.tv_usec - tm0.tv_usec) / 1000;
+            fprintf(stdout,"Done. Total run time = %llu ms\n",tdiff);
+        }
+        return(0);
     }
 
     /* Special case: Compute back projection and exit */
+    /* The weight array is only kept when read from a file; otherwise the */
+    /* reconstruction computes the weights from the sinogram as it goes   */
+    AllocateImageData3D(&Image);
+    if(cmdline.SinoWeightsFileFlag && cmdline.reconFlag != MBIR_MODULAR_RECONTYPE_ADJOINT)
+        AllocateSinoData3DParallel(&sinogram);
+    else
+        AllocateSinoDataOnly3DParallel(&sinogram);
+    float *weight = (sinogram.weight != NULL) ? sinogram.weight[0] : NULL;
     if(cmdline.reconFlag == MBIR_MODULAR_RECONTYPE_ADJOINT) {
-        forwardProject(sinogram.sino[0],Image.image[0],Image.imgparams,sinogram.sinoparams,readmatrix_fname,1,cmdline.verboseLevel);
+        ReadSinoAsync(&sinoRead,cmdline.SinoDataFile,&sinogram,NULL,NULL);
+        SliceTransferWait(&sinoRead,cmdline.verboseLevel);
+        if(viewOrder != NULL)
+            PermuteSinoViews(sinogram.sino[0],Nz,sinogram.sinoparams.NViews,sinogram.sinoparams.NChannels,viewOrder,0);
+        if(ctx != NULL)
+            MBIRContextBackproject(ctx,Image.image[0],sinogram.sino[0],Nz);
+        else
+            forwardProjectA(sinogram.sino[0],Image.image[0],Image.imgparams,sinogram.sinoparams,readmatrix_fname,Aparams,1,cmdline.verboseLevel);
         /* Write out reconstructed image(s) */
         if(cmdline.verboseLevel)
             fprintf(stdout,"Writing image files...\n");
-        WriteImage3D(cmdline.ReconImageFile, &Image);
-        FreeImageData3D(&Image);
+        WriteImageAsync(&imageWrite,cmdline.ReconImageFile,&Image);
         FreeSinoData3DParallel(&sinogram);
+        free((void *)viewOrder);
+        SliceTransferWait(&imageWrite,cmdline.verboseLevel);
+        FreeImageData3D(&Image);
         return(0);
     }
 
@@ -131,22 +280,36 @@ int main(int argc, char *argv[])
         fprintf(stdout,"Warning: what the command line is doing. Proceeding anyway.\n**\n");
         reconparams.ReconType = cmdline.reconFlag;
     }
-
-    /* Read/compute sinogram weights */
     if(cmdline.SinoWeightsFileFlag)
-    {
-        ReadWeights3D(cmdline.SinoWeightsFile, &sinogram);
         reconparams.weightType = 0;
-    }
     else if(reconparams.weightType < 1)	// if weightType is expecting file input, revert to default
         reconparams.weightType = 1;
-    ComputeSinoWeights(sinogram,reconparams);  // either compute internally, or scale input by 1/SigmaY^2
+
+    /* Startup runs as a small task graph. The inputs are read on I/O threads  */
+    /* while the system matrix is read or computed; as each sinogram slice (and */
+    /* weight slice) arrives its views are sorted and its weights computed on  */
+    /* the I/O thread. Once the matrix is ready the work for the initial       */
+    /* projection that doesn't need the sinogram is done, and the remaining    */
+    /* inputs are collected just before the reconstruction.                    */
+    timeline.n = 0;
+    timeline.tm0 = tm0;
+    gettimeofday(&tm1,NULL);
+    int stParams = timelineAdd(&timeline,"parameters",&tm0,&tm1,-1);
+    prep.sinogram = sinogram;
+    prep.reconparams = reconparams;
+    prep.viewOrder = viewOrder;
+    prep.need = cmdline.SinoWeightsFileFlag ? 2 : 1;
+    prep.count = (int *) calloc(Nz,sizeof(int));
+    pthread_mutex_init(&prep.lock,NULL);
+    ReadSinoAsync(&sinoRead,cmdline.SinoDataFile,&sinogram,prepSinoSlice,(void *)&prep);
+    if(cmdline.SinoWeightsFileFlag)
+        ReadWeightsAsync(&weightRead,cmdline.SinoWeightsFile,&sinogram,prepSinoSlice,(void *)&prep);
 
     /* Initialize image state */
     if(cmdline.readInitImageFlag) {
         if(cmdline.verboseLevel)
             fprintf(stdout,"Reading initial image...\n");
-        ReadImage3D(cmdline.InitImageFile,&Image);
+        ReadImageAsync(&imageRead,"initial image",cmdline.InitImageFile,&Image);
     }
     else
     {
@@ -162,14 +325,7 @@ int main(int argc, char *argv[])
         if(cmdline.verboseLevel)
             fprintf(stdout,"Reading projection of initial image...\n");
         proj = (float **)multialloc(sizeof(float),2,sinogram.sinoparams.NSlices,NvNc);
-        for(jz=0;jz<Nz;jz++)
-        {
-            sprintf(fname,"%s_slice%.*d.2Dprojection",cmdline.inputProjectionFile,Ndigits,jz+FirstSliceNumber);
-            if(ReadFloatArray(fname,proj[jz],NvNc)) {
-                fprintf(stderr,"Error: can't read %s\n",fname);
-                exit(-1);
-            }
-        }
+        ReadProjectionAsync(&projRead,cmdline.inputProjectionFile,proj,&sinogram.sinoparams,Ndigits);
     }
     else
     {
@@ -177,8 +333,8 @@ int main(int argc, char *argv[])
         proj[0] = NULL;  // defined this way so the recon wrapper will compute projection internally
     }
 
-    /* Read Proximal map if necessary */
-    if(reconparams.ReconType == MBIR_MODULAR_RECONTYPE_PandP)
+    /* Read Proximal map if necessary (the -D loop makes its own) */
+    if(reconparams.ReconType == MBIR_MODULAR_RECONTYPE_PandP && !cmdline.denoiserFlag)
     {
         ProxMap.imgparams.Nx = Image.imgparams.Nx;
         ProxMap.imgparams.Ny = Image.imgparams.Ny;
@@ -186,29 +342,128 @@ int main(int argc, char *argv[])
         ProxMap.imgparams.FirstSliceNumber = Image.imgparams.FirstSliceNumber;
         ProxMap.imgparams.NumSliceDigits = Image.imgparams.NumSliceDigits;
         AllocateImageData3D(&ProxMap);
-        ReadImage3D(cmdline.ProxMapImageFile,&ProxMap);
+        ReadImageAsync(&proxRead,"proximal map",cmdline.ProxMapImageFile,&ProxMap);
         proximalmap = &(ProxMap.image[0][0]);  // *ptr to proximal map image
     }
     else
         proximalmap = NULL;
 
+    /* Set up the system matrix; the context keeps it for the projection below */
+    gettimeofday(&tm1,NULL);
+    if(ctx == NULL) {
+        ctx = MBIRContextCreate(Image.imgparams,sinogram.sinoparams,readmatrix_fname,Aparams,cmdline.verboseLevel);
+        ownCtx = 1;
+    }
+    gettimeofday(&tm2,NULL);
+    int stMatrix = timelineAdd(&timeline,ownCtx ? "system matrix" : "resident matrix",&tm1,&tm2,stParams);
+
+    /* Initial image, then what its projection needs from the matrix alone */
+    if(cmdline.readInitImageFlag)
+    {
+        SliceTransferWait(&imageRead,cmdline.verboseLevel);
+        timelineAdd(&timeline,"initial image",&imageRead.tm0,&imageRead.tm1,stParams);
+    }
+    if(proj[0] == NULL && !cmdline.resumeFlag && !cmdline.denoiserFlag && !cmdline.sweepFlag && cmdline.multiresLevels == 0)
+    {
+        gettimeofday(&tm1,NULL);
+        MBIRContextPrepare(ctx,Image.image[0],Nz);
+        gettimeofday(&tm2,NULL);
+        timelineAdd(&timeline,"projection setup",&tm1,&tm2,stMatrix);
+    }
+
+    /* Collect the remaining inputs */
+    SliceTransferWait(&sinoRead,cmdline.verboseLevel);
+    timelineAdd(&timeline,(weight != NULL) ? "sinogram+weights" : "sinogram",&sinoRead.tm0,&sinoRead.tm1,stParams);
+    if(cmdline.SinoWeightsFileFlag)
+    {
+        SliceTransferWait(&weightRead,cmdline.verboseLevel);
+        timelineAdd(&timeline,"weight file",&weightRead.tm0,&weightRead.tm1,stParams);
+    }
+    pthread_mutex_destroy(&prep.lock);
+    free((void *)prep.count);
+    if(cmdline.readInitProjectionFlag)
+    {
+        SliceTransferWait(&projRead,cmdline.verboseLevel);
+        if(viewOrder != NULL)
+            PermuteSinoViews(proj[0],Nz,sinogram.sinoparams.NViews,sinogram.sinoparams.NChannels,viewOrder,0);
+        timelineAdd(&timeline,"initial projection",&projRead.tm0,&projRead.tm1,stParams);
+    }
+    if(proximalmap != NULL)
+    {
+        SliceTransferWait(&proxRead,cmdline.verboseLevel);
+        timelineAdd(&timeline,"proximal map",&proxRead.tm0,&proxRead.tm1,stParams);
+    }
+    if(cmdline.verboseLevel>1)
+        printTimeline(&timeline);
+
     /* Start Reconstruction */
-    MBIRReconstruct(
-        Image.image[0],
-        sinogram.sino[0],
-        sinogram.weight[0],
-        proj[0],
-        proximalmap,
-        Image.imgparams,
-        sinogram.sinoparams,
-        reconparams,
-        readmatrix_fname,
-        cmdline.verboseLevel);
-
-    /* Write out reconstructed image(s) */
-    if(cmdline.verboseLevel)
-        fprintf(stdout,"Writing image files...\n");
-    WriteImage3D(cmdline.ReconImageFile, &Image);
+    if(cmdline.denoiserFlag || cmdline.sweepFlag)
+    {
+        /* PnP and sweep loops keep the projection of the image state between solves */
+        if(proj[0] == NULL)
+        {
+            multifree(proj,2);
+            proj = (float **)multialloc(sizeof(float),2,Nz,NvNc);
+            if(cmdline.verboseLevel)
+                fprintf(stdout,"Projecting image...\n");
+            MBIRContextProject(ctx,proj[0],Image.image[0],Nz,0);
+        }
+        if(cmdline.denoiserFlag)
+            reconstructPnP(&cmdline,ctx,Image.image[0],sinogram.sino[0],weight,proj[0],Image.imgparams,reconparams);
+        else
+            reconstructSweep(&cmdline,ctx,&Image,sinogram.sino[0],weight,proj[0],reconparams);
+    }
+    else
+    {
+        /* checkpointing is set per job; a resident context is shared */
+        snprintf(ctx->checkpoint.fname,sizeof(ctx->checkpoint.fname),"%s",cmdline.CheckpointFile);
+        ctx->checkpoint.interval = cmdline.checkpointInterval;
+        ctx->checkpoint.resume = cmdline.resumeFlag;
+        if(cmdline.ROISpec[0] != '\0')
+            ctx->roi = ROIMask(cmdline.ROISpec,Image.imgparams);
+        ctx->freeze.fraction = cmdline.freezeFraction;
+        ctx->freeze.visits = cmdline.freezeVisits;
+        ctx->freeze.revisit = cmdline.freezeRevisit;
+        unsigned long long coarse_ms = 0;
+        if(cmdline.multiresLevels > 0)
+            coarse_ms = reconstructCoarse(&cmdline,Image.imgparams,sinogram.sinoparams,Image.image[0],sinogram.sino[0],
+                weight,reconparams,Aparams);
+        gettimeofday(&tm1,NULL);
+        MBIRContextRecon(
+            ctx,
+            Image.image[0],
+            sinogram.sino[0],
+            weight,
+            proj[0],
+            proximalmap,
+            Nz,
+            1,
+            reconparams,
+            cmdline.verboseLevel);
+        if(cmdline.multiresLevels > 0 && cmdline.verboseLevel)
+        {
+            gettimeofday(&tm2,NULL);
+            tdiff = 1000 * (tm2.tv_sec - tm1.tv_sec) + (tm2.tv_usec - tm1.tv_usec) / 1000;
+            fprintf(stdout,"Level 1x (%dx%d voxels, %d channels): %.1f equivalent iterations, %llu ms (%llu ms iterating)\n",
+                Image.imgparams.Nx,Image.imgparams.Ny,sinogram.sinoparams.NChannels,ctx->stats.equits,tdiff,ctx->stats.time_ms);
+            fprintf(stdout,"Multi-resolution: %llu ms coarse + %llu ms full resolution = %llu ms\n",coarse_ms,tdiff,coarse_ms+tdiff);
+        }
+        ctx->checkpoint.fname[0] = '\0';
+        ctx->freeze.fraction = 0;
+        if(ctx->roi != NULL) {
+            free((void *)ctx->roi);
+            ctx->roi = NULL;
+        }
+    }
+
+    /* Write out reconstructed image(s) in the background; a sweep writes */
+    /* each variant as it completes                                       */
+    if(!cmdline.sweepFlag)
+    {
+        if(cmdline.verboseLevel)
+            fprintf(stdout,"Writing image files...\n");
+        WriteImageAsync(&imageWrite,cmdline.ReconImageFile,&Image);
+    }
 
     /* Write Projection of image state if called for */
     if(cmdline.writeProjectionFlag)
@@ -219,35 +474,469 @@ int main(int argc, char *argv[])
         {
             multifree(proj,2);
             proj = (float **)multialloc(sizeof(float),2,Nz,NvNc);
-            forwardProject(&proj[0][0],&(Image.image[0][0]),Image.imgparams,sinogram.sinoparams,readmatrix_fname,0,cmdline.verboseLevel);
+            if(cmdline.verboseLevel)
+                fprintf(stdout,"Projecting image...\n");
+            MBIRContextProject(ctx,&proj[0][0],&(Image.image[0][0]),Nz,0);
         }
+        if(viewOrder != NULL)
+            PermuteSinoViews(proj[0],Nz,sinogram.sinoparams.NViews,sinogram.sinoparams.NChannels,viewOrder,1);
         if(cmdline.verboseLevel)
             fprintf(stdout,"Writing projection to file...\n");
-        for(jz=0; jz<Nz; jz++)
-        {
-            sprintf(fname,"%s_slice%.*d.2Dprojection",cmdline.outputProjectionFile,Ndigits,jz+FirstSliceNumber);
-            if( WriteFloatArray(fname,proj[jz],NvNc) ) {
-                fprintf(stderr,"Error: can't open file %s for writing\n",fname);
-                exit(-1);
-            }
-        }
+        WriteProjectionAsync(&projWrite,cmdline.outputProjectionFile,proj,&sinogram.sinoparams,Ndigits);
     }
 
-    FreeImageData3D(&Image);
+    /* Free what the writes don't need while they finish */
+    if(ownCtx)
+        MBIRContextDestroy(ctx);
     FreeSinoData3DParallel(&sinogram);
-    multifree(proj,2);
-    if(reconparams.ReconType == MBIR_MODULAR_RECONTYPE_PandP)
+    free((void *)viewOrder);
+    if(reconparams.ReconType == MBIR_MODULAR_RECONTYPE_PandP && !cmdline.denoiserFlag)
         FreeImageData3D(&ProxMap);
+    if(cmdline.writeProjectionFlag)
+        SliceTransferWait(&projWrite,cmdline.verboseLevel);
+    multifree(proj,2);
+    if(!cmdline.sweepFlag)
+        SliceTransferWait(&imageWrite,cmdline.verboseLevel);
+    FreeImageData3D(&Image);
 
     if(cmdline.verboseLevel) {
         gettimeofday(&tm2,NULL);
         tdiff = 1000 * (tm2.tv_sec - tm0.tv_sec) + (tm2.tv_usec - tm0.tv_usec) / 1000;
         fprintf(stdout,"Done. Total run time = %llu ms\n",tdiff);
     }
+    if(cmdline.verboseLevel>1) {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF,&usage);
+        fprintf(stdout,"Peak memory (max resident set) = %.1f MB\n",usage.ru_maxrss/1024.0);
+    }
     return(0);
 }
 
 
+void prepSinoSlice(void *arg, float *data, int slice)
+{
+    struct SinoPrep *prep = (struct SinoPrep *) arg;
+    struct SinoParams3DParallel *sp = &prep->sinogram.sinoparams;
+    int n;
+
+    if(prep->viewOrder != NULL)
+        PermuteSinoViews(data,1,sp->NViews,sp->NChannels,prep->viewOrder,0);
+
+    pthread_mutex_lock(&prep->lock);
+    n = ++prep->count[slice];
+    pthread_mutex_unlock(&prep->lock);
+    if(n == prep->need && prep->sinogram.weight != NULL)
+    {
+        struct Sino3DParallel sliceSino = prep->sinogram;
+        sliceSino.sinoparams.NSlices = 1;
+        sliceSino.sino = &prep->sinogram.sino[slice];
+        sliceSino.weight = &prep->sinogram.weight[slice];
+        ComputeSinoWeights(sliceSino,prep->reconparams);
+    }
+}
+
+
+/* Voxels to update for -O: a box x0:x1,y0:y1[,z0:z1] of 0-based voxel   */
+/* indices (inclusive; all slices if z is left out), or the nonzero       */
+/* voxels of the image <basename>_sliceNNN.2Dimgdata. Either is grown by  */
+/* the margin in +<margin> in each direction. Returns Nz*Ny*Nx flags.     */
+char *ROIMask(char *spec, struct ImageParams3D imgparams)
+{
+    char arg[1024], *plus;
+    int x0,x1,y0,y1,z0,z1,jx,jy,jz,n,margin=0;
+    int Nx = imgparams.Nx;
+    int Ny = imgparams.Ny;
+    int Nz = imgparams.Nz;
+    size_t i,Nxy = (size_t)Nx*Ny;
+
+    snprintf(arg,sizeof(arg),"%s",spec);
+    if((plus = strrchr(arg,'+')) != NULL)
+    {
+        *plus = '\0';
+        if(sscanf(plus+1,"%d",&margin)!=1 || margin<0) {
+            fprintf(stderr,"Error: -O margin must be a non-negative integer\n");
+            exit(-1);
+        }
+    }
+
+    char *mask = (char *) mget_spc(Nxy*Nz,sizeof(char));
+    z0 = 0;
+    z1 = Nz-1;
+    n = sscanf(arg,"%d:%d,%d:%d,%d:%d",&x0,&x1,&y0,&y1,&z0,&z1);
+    if(n==4 || n==6)
+    {
+        x0 = (x0-margin > 0) ? x0-margin : 0;
+        y0 = (y0-margin > 0) ? y0-margin : 0;
+        z0 = (z0-margin > 0) ? z0-margin : 0;
+        x1 = (x1+margin < Nx-1) ? x1+margin : Nx-1;
+        y1 = (y1+margin < Ny-1) ? y1+margin : Ny-1;
+        z1 = (z1+margin < Nz-1) ? z1+margin : Nz-1;
+        for(jz=0; jz<Nz; jz++)
+        for(jy=0; jy<Ny; jy++)
+        for(jx=0; jx<Nx; jx++)
+            mask[jz*Nxy+jy*Nx+jx] = (jx>=x0 && jx<=x1 && jy>=y0 && jy<=y1 && jz>=z0 && jz<=z1);
+    }
+    else if(n>0)
+    {
+        fprintf(stderr,"Error: -O box must be <x0>:<x1>,<y0>:<y1>[,<z0>:<z1>]\n");
+        exit(-1);
+    }
+    else
+    {
+        struct Image3D Mask;
+        Mask.imgparams = imgparams;
+        Mask.imgparams.NumSliceDigits = NumSliceDigits(arg,"2Dimgdata",imgparams.FirstSliceNumber);
+        AllocateImageData3D(&Mask);
+        ReadImage3D(arg,&Mask);
+        for(i=0; i<Nxy*Nz; i++)
+            mask[i] = (Mask.image[i/Nxy][i%Nxy] != 0.0);
+        FreeImageData3D(&Mask);
+        dilateMask(mask,Nx,Ny,Nz,margin);
+    }
+    return(mask);
+}
+
+
+/* Grow a mask by margin voxels along x, y and z (a box neighborhood) */
+void dilateMask(char *mask, int Nx, int Ny, int Nz, int margin)
+{
+    int axis,len,j,k,count;
+    size_t line,Nlines,stride,base;
+    size_t Nxy = (size_t)Nx*Ny;
+    char *in;
+
+    if(margin <= 0)
+        return;
+    for(axis=0; axis<3; axis++)
+    {
+        len = (axis==0) ? Nx : (axis==1) ? Ny : Nz;
+        stride = (axis==0) ? 1 : (axis==1) ? (size_t)Nx : Nxy;
+        Nlines = Nxy*Nz/len;
+        in = (char *) mget_spc(len,sizeof(char));
+        for(line=0; line<Nlines; line++)
+        {
+            /* first voxel of the line: lines along x/y/z run over the other two axes */
+            if(axis==0)
+                base = line*Nx;
+            else if(axis==1)
+                base = (line/Nx)*Nxy + line%Nx;
+            else
+                base = line;
+            for(j=0; j<len; j++)
+                in[j] = mask[base+j*stride];
+            /* count of set voxels in the window [j-margin,j+margin] */
+            count = 0;
+            for(k=0; k<margin && k<len; k++)
+                count += in[k];
+            for(j=0; j<len; j++)
+            {
+                if(j+margin < len)
+                    count += in[j+margin];
+                if(j-margin-1 >= 0)
+                    count -= in[j-margin-1];
+                mask[base+j*stride] = (count > 0);
+            }
+        }
+        free((void *)in);
+    }
+}
+
+
+/* Coarse-to-fine start for the full-resolution reconstruction. Reconstructs */
+/* on grids 2^levels, .., 2 times coarser (Deltaxy and channels binned), each */
+/* level started from the one before, and leaves the last one upsampled in    */
+/* image; the full-resolution error sinogram then starts from its projection. */
+/* The coarse matrices are cached next to the -m file as <file>_x<factor>.     */
+/* Returns the wall time of the coarse levels in ms.                          */
+unsigned long long reconstructCoarse(
+    struct CmdLine *cmdline,
+    struct ImageParams3D imgparams,
+    struct SinoParams3DParallel sinoparams,
+    float *image,
+    float *sino,
+    float *weight,
+    struct ReconParams reconparams,
+    struct AmatrixParams Aparams)
+{
+    struct ImageParams3D ip, prevparams = imgparams;
+    struct SinoParams3DParallel sp;
+    struct timeval tm0,tm1;
+    unsigned long long total_ms = 0, level_ms;
+    char mfname[1100], *mf;
+    char *mask;
+    float *prev = image;
+    int Nz = imgparams.Nz;
+    int level,factor;
+    size_t i,Nxy;
+    char v = (cmdline->verboseLevel > 1) ? cmdline->verboseLevel : 0;
+
+    for(level=cmdline->multiresLevels; level>=1; level--)
+    {
+        gettimeofday(&tm0,NULL);
+        factor = 1<<level;
+
+        ip = imgparams;
+        ip.Nx = (imgparams.Nx+factor-1)/factor;
+        ip.Ny = (imgparams.Ny+factor-1)/factor;
+        ip.Deltaxy = imgparams.Deltaxy*factor;
+        Nxy = (size_t)ip.Nx*ip.Ny;
+
+        /* coarse channel c is the average of channels factor*c.. factor*c+factor-1 */
+        sp = sinoparams;
+        sp.NChannels = (sinoparams.NChannels+factor-1)/factor;
+        sp.DeltaChannel = sinoparams.DeltaChannel*factor;
+        sp.CenterOffset = (sinoparams.NChannels - sp.NChannels*factor)/(2.0*factor) + sinoparams.CenterOffset/factor;
+
+        size_t Nrows = (size_t)Nz*sp.NViews;
+        float *csino = (float *) mget_spc(Nrows*sp.NChannels,sizeof(float));
+        float *cweight = (float *) mget_spc(Nrows*sp.NChannels,sizeof(float));
+        binChannels(csino,cweight,sino,weight,Nrows,sinoparams.NChannels,factor,reconparams);
+
+        /* initial image: the level before (or the initial image) resampled */
+        float *cimage = (float *) mget_spc(Nz*Nxy,sizeof(float));
+        prevparams.Nz = ip.Nz = Nz;
+        resampleImage(cimage,ip,prev,prevparams);
+        mask = GenImageReconMask(&ip);
+        for(i=0; i<Nz*Nxy; i++)
+            if(!mask[i%Nxy])
+                cimage[i] = 0;
+        free((void *)mask);
+
+        mf = NULL;
+        if(cmdline->readAmatrixFlag)
+        {
+            FILE *fp;
+            sprintf(mfname,"%s_x%d.2Dsvmatrix",cmdline->SysMatrixFile,factor);
+            if((fp = fopen(mfname,"rb")) != NULL)
+                fclose(fp);
+            else
+                AmatrixComputeToFile(ip,sp,mfname,Aparams,v);
+            mf = mfname;
+        }
+        /* a coarse level is only a start for the next: loosen its stopping threshold */
+        struct ReconParams rp = reconparams;
+        rp.StopThreshold = reconparams.StopThreshold*factor;
+        struct MBIRContext *ctx = MBIRContextCreate(ip,sp,mf,Aparams,v);
+        MBIRContextRecon(ctx,cimage,csino,cweight,NULL,NULL,Nz,1,rp,v);
+
+        gettimeofday(&tm1,NULL);
+        level_ms = 1000 * (tm1.tv_sec - tm0.tv_sec) + (tm1.tv_usec - tm0.tv_usec) / 1000;
+        total_ms += level_ms;
+        if(cmdline->verboseLevel)
+            fprintf(stdout,"Level %dx (%dx%d voxels, %d channels): %.1f equivalent iterations, %llu ms (%llu ms iterating)%s\n",
+                factor,ip.Nx,ip.Ny,sp.NChannels,ctx->stats.equits,level_ms,ctx->stats.time_ms,
+                ctx->stats.converged ? "" : ", didn't reach stopping condition");
+
+        MBIRContextDestroy(ctx);
+        free((void *)csino);
+        free((void *)cweight);
+        if(prev != image)
+            free((void *)prev);
+        prev = cimage;
+        prevparams = ip;
+    }
+
+    /* upsample into the full-resolution initial image */
+    resampleImage(image,imgparams,prev,prevparams);
+    Nxy = (size_t)imgparams.Nx*imgparams.Ny;
+    mask = GenImageReconMask(&imgparams);
+    for(i=0; i<Nz*Nxy; i++)
+        if(!mask[i%Nxy])
+            image[i] = 0;
+    free((void *)mask);
+    if(prev != image)
+        free((void *)prev);
+
+    return(total_ms);
+}
+
+
+/* Bins groups of factor channels of Nrows sinogram rows: the data are   */
+/* averaged and the weights (given, or computed from the data as in the  */
+/* reconstruction) added, so a coarse channel weighs as much as the      */
+/* channels it replaces. A short last group is averaged over what's there. */
+void binChannels(
+    float *csino,
+    float *cweight,
+    float *sino,
+    float *weight,
+    size_t Nrows,
+    int NChannels,
+    int factor,
+    struct ReconParams reconparams)
+{
+    int NChc = (NChannels+factor-1)/factor;
+    size_t r;
+
+    #pragma omp parallel for
+    for(r=0; r<Nrows; r++)
+    {
+        float *y = &sino[r*NChannels];
+        float *w = (float *) mget_spc(NChannels,sizeof(float));
+        int c,k;
+
+        if(weight != NULL)
+            memcpy(w,&weight[r*NChannels],sizeof(float)*NChannels);
+        else
+            SinoWeightsFromData(w,y,NChannels,reconparams);
+        for(c=0; c<NChc; c++)
+        {
+            float ysum=0, wsum=0;
+            int n=0;
+            for(k=c*factor; k<(c+1)*factor && k<NChannels; k++, n++) {
+                ysum += y[k];
+                wsum += w[k];
+            }
+            csino[r*NChc+c] = ysum/n;
+            cweight[r*NChc+c] = wsum;
+        }
+        free((void *)w);
+    }
+}
+
+
+/* Bilinear resampling of Nz slices between centered grids covering the */
+/* same field of view (Nx*Deltaxy); beyond the edge voxels it's clamped. */
+void resampleImage(float *dst, struct ImageParams3D dstparams, float *src, struct ImageParams3D srcparams)
+{
+    int Nx = srcparams.Nx, Ny = srcparams.Ny;
+    float scale = dstparams.Deltaxy/srcparams.Deltaxy;
+    int jz;
+
+    #pragma omp parallel for
+    for(jz=0; jz<dstparams.Nz; jz++)
+    {
+        float *in = &src[(size_t)jz*Nx*Ny];
+        float *out = &dst[(size_t)jz*dstparams.Nx*dstparams.Ny];
+        int jx,jy;
+        for(jy=0; jy<dstparams.Ny; jy++)
+        {
+            float v = (jy-(dstparams.Ny-1)/2.0f)*scale + (Ny-1)/2.0f;
+            v = (v < 0) ? 0 : (v > Ny-1) ? Ny-1 : v;
+            int iy = (v >= Ny-1) ? ((Ny > 1) ? Ny-2 : 0) : (int)v;
+            float fy = (Ny > 1) ? v-iy : 0;
+            int iy1 = (Ny > 1) ? iy+1 : iy;
+            for(jx=0; jx<dstparams.Nx; jx++)
+            {
+                float u = (jx-(dstparams.Nx-1)/2.0f)*scale + (Nx-1)/2.0f;
+                u = (u < 0) ? 0 : (u > Nx-1) ? Nx-1 : u;
+                int ix = (u >= Nx-1) ? ((Nx > 1) ? Nx-2 : 0) : (int)u;
+                float fx = (Nx > 1) ? u-ix : 0;
+                int ix1 = (Nx > 1) ? ix+1 : ix;
+                out[jy*dstparams.Nx+jx] = (1-fy)*((1-fx)*in[iy*Nx+ix] + fx*in[iy*Nx+ix1])
+                                        + fy*((1-fx)*in[iy1*Nx+ix] + fx*in[iy1*Nx+ix1]);
+            }
+        }
+    }
+}
+
+
+/* Add a stage that ran from start to end; returns its index */
+int timelineAdd(struct StartupTimeline *tl, char *name, struct timeval *start, struct timeval *end, int dep)
+{
+    int i = tl->n;
+
+    if(i == MAX_STARTUP_STAGES)
+        return(-1);
+    snprintf(tl->name[i],sizeof(tl->name[i]),"%s",name);
+    tl->start[i] = 1e3*(start->tv_sec - tl->tm0.tv_sec) + 1e-3*(start->tv_usec - tl->tm0.tv_usec);
+    tl->end[i] = 1e3*(end->tv_sec - tl->tm0.tv_sec) + 1e-3*(end->tv_usec - tl->tm0.tv_usec);
+    tl->dep[i] = dep;
+    tl->n++;
+    return(i);
+}
+
+
+/* Print the stages; the critical path is the chain of stages, through */
+/* what each waited for, that ends with the one finishing last.         */
+void printTimeline(struct StartupTimeline *tl)
+{
+    char critical[MAX_STARTUP_STAGES];
+    struct timeval tm;
+    int i,last=0;
+
+    for(i=0; i<tl->n; i++) {
+        critical[i] = 0;
+        if(tl->end[i] > tl->end[last])
+            last = i;
+    }
+    for(i=last; i>=0; i=tl->dep[i])
+        critical[i] = 1;
+
+    gettimeofday(&tm,NULL);
+    fprintf(stdout,"Startup timeline (ms, * = critical path):\n");
+    for(i=0; i<tl->n; i++)
+        fprintf(stdout,"  %c %-20s %8.1f - %8.1f  (%.1f)\n",critical[i] ? '*' : ' ',tl->name[i],tl->start[i],tl->end[i],tl->end[i]-tl->start[i]);
+    fprintf(stdout,"    reconstruction starts at %.1f ms\n",
+        1e3*(tm.tv_sec - tl->tm0.tv_sec) + 1e-3*(tm.tv_usec - tl->tm0.tv_usec));
+}
+
+
+/* Parse a command line as runCommand() would, up to the stored system      */
+/* matrix it reads: sets the matrix file name, the geometry (views sorted   */
+/* as the matrix needs) and Aparams; Aparams->viewOrder is for the caller   */
+/* to free. Returns 0 if the command doesn't read a stored matrix. Exits on */
+/* a bad command line or parameter file, as a job would.                    */
+int commandMatrix(
+    int argc,
+    char *argv[],
+    char *matrix_fname,
+    struct ImageParams3D *imgparams,
+    struct SinoParams3DParallel *sinoparams,
+    struct AmatrixParams *Aparams)
+{
+    struct CmdLine cmdline;
+
+    readCmdLine(argc, argv, &cmdline);
+    cmdline.verboseLevel = 0;
+    procCmdLine(argc, argv, &cmdline);
+    if(!cmdline.readAmatrixFlag || cmdline.writeAmatrixFlag)
+        return(0);
+    Aparams->matrixFree = 0;
+    Aparams->symmetry = cmdline.symmetryFlag;
+    Aparams->Abits = cmdline.Abits;
+    Aparams->pieceLength = cmdline.pieceLength;
+    Aparams->viewOrder = NULL;
+
+    ReadSinoParams3DParallel(cmdline.SinoParamsFile,sinoparams);
+    ReadImageParams3D(cmdline.ImageParamsFile,imgparams);
+    sprintf(matrix_fname,"%s.2Dsvmatrix",cmdline.SysMatrixFile);
+    if(cmdline.viewSortFlag || AmatrixFileViewSort(matrix_fname))
+    {
+        Aparams->viewOrder = ViewSortOrder(sinoparams);
+        PermuteViewAngles(sinoparams,Aparams->viewOrder);
+    }
+    return(1);
+}
+
+
+/* Cache key of the stored system matrix a command line reads. Returns 1 if */
+/* the command reads one and readAmatrix() will accept the file, 0 if not.  */
+/* Also returns the matrix file name, geometry and Aparams as for           */
+/* commandMatrix(), with sinoparams->ViewAngles and Aparams->viewOrder for  */
+/* the caller to free. May exit on a bad command line, so the daemon runs   */
+/* it in a child.                                                           */
+int commandMatrixKey(
+    int argc,
+    char *argv[],
+    char *key,
+    char *matrix_fname,
+    struct ImageParams3D *imgparams,
+    struct SinoParams3DParallel *sinoparams,
+    struct AmatrixParams *Aparams)
+{
+    struct SVParams svpar;
+
+    if(!commandMatrix(argc,argv,matrix_fname,imgparams,sinoparams,Aparams))
+        return(0);
+    initSVParams(&svpar,*imgparams,*sinoparams);
+    svpar.viewOrder = Aparams->viewOrder;
+    MatrixCacheKey(key,matrix_fname,imgparams,sinoparams);
+
+    return(AmatrixFileCheck(matrix_fname,imgparams,sinoparams,&svpar) == 0);
+}
+
+
 /* Read Command-line */
 void readCmdLine(int argc, char *argv[], struct CmdLine *cmdline)
 {
@@ -266,6 +955,28 @@ void readCmdLine(int argc, char *argv[], struct CmdLine *cmdline)
     cmdline->readInitImageFlag=0;
     cmdline->readInitProjectionFlag=0;
     cmdline->writeProjectionFlag=0;
+    cmdline->matrixFreeFlag=0;
+    cmdline->symmetryFlag=0;
+    cmdline->Abits=8;
+    cmdline->viewSortFlag=0;
+    cmdline->pieceLength=0;
+    cmdline->batchFlag=0;
+    cmdline->denoiserFlag=0;
+    cmdline->ProxMapImageFile[0]='\0';
+    cmdline->DenoiserArgs[0]='\0';
+    cmdline->pnpIterations=10;
+    cmdline->sweepFlag=0;
+    cmdline->CheckpointFile[0]='\0';
+    cmdline->checkpointInterval=CHECKPOINT_INTERVAL_DEFAULT;
+    cmdline->resumeFlag=0;
+    cmdline->slabDepth=0;
+    cmdline->volumeFlag=0;
+    cmdline->slabHalo=SVDEPTH;
+    cmdline->ROISpec[0]='\0';
+    cmdline->freezeFraction=0;
+    cmdline->freezeVisits=FREEZE_VISITS_DEFAULT;
+    cmdline->freezeRevisit=FREEZE_REVISIT_DEFAULT;
+    cmdline->multiresLevels=0;
 
     cmdline->verboseLevel=1;
 
@@ -277,8 +988,9 @@ void readCmdLine(int argc, char *argv[], struct CmdLine *cmdline)
         exit(0);
     }
     
-    /* get options */
-    while ((ch = getopt(argc, argv, "bi:j:k:s:w:r:m:t:e:f:p:v:")) != EOF)
+    /* get options; optind is reset since a daemon parses one command line per job */
+    optind = 1;
+    while ((ch = getopt(argc, argv, "bMSoRVi:j:k:s:w:r:m:t:e:f:p:q:L:B:D:a:n:X:C:I:Z:O:F:G:v:")) != EOF)
     {
         switch (ch)
         {
@@ -354,50 +1066,284 @@ void readCmdLine(int argc, char *argv[], struct CmdLine *cmdline)
                 cmdline->reconFlag = MBIR_MODULAR_RECONTYPE_ADJOINT;
                 break;
             }
-            case 'v':
+            case 'M':
             {
-                sscanf(optarg,"%hhi",&cmdline->verboseLevel);
+                cmdline->matrixFreeFlag=1;
                 break;
             }
-            default:
+            case 'S':
             {
-                //fprintf(stderr,"%s: invalid option '%c'\n",argv[0],ch);  //getopt does this already
-                fprintf(stderr,"Try '%s -help' for more information.\n",argv[0]);
-                exit(-1);
+                cmdline->symmetryFlag=1;
                 break;
             }
-        }
-    }
-}
-
-
-/* Process Command-line */
-void procCmdLine(int argc, char *argv[], struct CmdLine *cmdline)
-{
-    if(cmdline->verboseLevel>1)
-        fprintf(stdout,"Parsing command line...\n");
-
-    /* Check for mandatory arguments */
-    if(!cmdline->SinoParamsFileFlag || !cmdline->ImageParamsFileFlag){
-        fprintf(stderr,"Error: Either sinoparams or imgparams (-i,-j) file wasn't specified\n");
-        fprintf(stderr,"Try '%s -help' for more information.\n",argv[0]);
-        exit(-1);
-    }
-
-    /* Determine what to do based on supplied options 
-     * cmdline->reconFlag
-     * cmdline->readInitImageFlag
-     * cmdline->readInitProjectionFlag
-     * cmdline->writeProjectionFlag
-     */
-    cmdline->readAmatrixFlag=0;
-    cmdline->writeAmatrixFlag=0;
-
-    if(cmdline->ReconImageFileFlag)  /* reconstruction mode */
-    {
-        if(cmdline->SysMatrixFileFlag)
-            cmdline->readAmatrixFlag=1;
-
+            case 'o':
+            {
+                cmdline->viewSortFlag=1;
+                break;
+            }
+            case 'q':
+            {
+                sscanf(optarg,"%d",&cmdline->Abits);
+                break;
+            }
+            case 'L':
+            {
+                if(strcmp(optarg,"auto")==0)
+                    cmdline->pieceLength = AMATRIX_PIECE_AUTO;
+                else if(strcmp(optarg,"trial")==0)
+                    cmdline->pieceLength = AMATRIX_PIECE_TRIAL;
+                else if(sscanf(optarg,"%d",&cmdline->pieceLength)!=1 || cmdline->pieceLength<1) {
+                    fprintf(stderr,"Error: -L must be a positive integer, auto or trial\n");
+                    fprintf(stderr,"Try '%s -help' for more information.\n",argv[0]);
+                    exit(-1);
+                }
+                break;
+            }
+            case 'B':
+            {
+                cmdline->batchFlag=1;
+                sprintf(cmdline->BatchFile, "%s", optarg);
+                break;
+            }
+            case 'D':
+            {
+                if(cmdline->reconFlag != MBIR_MODULAR_RECONTYPE_ADJOINT)
+                    cmdline->reconFlag = MBIR_MODULAR_RECONTYPE_PandP;
+                cmdline->denoiserFlag=1;
+                sprintf(cmdline->DenoiserLib, "%s", optarg);
+                break;
+            }
+            case 'a':
+            {
+                snprintf(cmdline->DenoiserArgs, sizeof(cmdline->DenoiserArgs), "%s", optarg);
+                break;
+            }
+            case 'n':
+            {
+                if(sscanf(optarg,"%d",&cmdline->pnpIterations)!=1 || cmdline->pnpIterations<1) {
+                    fprintf(stderr,"Error: -n must be a positive integer\n");
+                    fprintf(stderr,"Try '%s -help' for more information.\n",argv[0]);
+                    exit(-1);
+                }
+                break;
+            }
+            case 'X':
+            {
+                cmdline->sweepFlag=1;
+                sprintf(cmdline->SweepFile, "%s", optarg);
+                break;
+            }
+            case 'C':
+            {
+                sprintf(cmdline->CheckpointFile, "%s", optarg);
+                break;
+            }
+            case 'I':
+            {
+                if(sscanf(optarg,"%f",&cmdline->checkpointInterval)!=1 || cmdline->checkpointInterval<0) {
+                    fprintf(stderr,"Error: -I must be a non-negative number of seconds\n");
+                    fprintf(stderr,"Try '%s -help' for more information.\n",argv[0]);
+                    exit(-1);
+                }
+                break;
+            }
+            case 'R':
+            {
+                cmdline->resumeFlag=1;
+                break;
+            }
+            case 'V':
+            {
+                cmdline->volumeFlag=1;
+                break;
+            }
+            case 'Z':
+            {
+                int n = sscanf(optarg,"%d:%d",&cmdline->slabDepth,&cmdline->slabHalo);
+                if(n<1 || cmdline->slabDepth<1 || cmdline->slabHalo<0) {
+                    fprintf(stderr,"Error: -Z must be <depth>[:<halo>] with depth > 0, halo >= 0\n");
+                    fprintf(stderr,"Try '%s -help' for more information.\n",argv[0]);
+                    exit(-1);
+                }
+                break;
+            }
+            case 'O':
+            {
+                snprintf(cmdline->ROISpec, sizeof(cmdline->ROISpec), "%s", optarg);
+                break;
+            }
+            case 'F':
+            {
+                int n = sscanf(optarg,"%f:%d:%d",&cmdline->freezeFraction,&cmdline->freezeVisits,&cmdline->freezeRevisit);
+                if(n<1 || cmdline->freezeFraction<=0 || cmdline->freezeVisits<1 || cmdline->freezeVisits>255
+                   || cmdline->freezeRevisit<1 || cmdline->freezeRevisit>255) {
+                    fprintf(stderr,"Error: -F must be <fraction>[:<visits>[:<revisit>]] with fraction > 0, visits and revisit 1..255\n");
+                    fprintf(stderr,"Try '%s -help' for more information.\n",argv[0]);
+                    exit(-1);
+                }
+                break;
+            }
+            case 'G':
+            {
+                if(sscanf(optarg,"%d",&cmdline->multiresLevels)!=1 || cmdline->multiresLevels<0 || cmdline->multiresLevels>MULTIRES_MAX_LEVELS) {
+                    fprintf(stderr,"Error: -G must be a number of coarser levels 0..%d\n",MULTIRES_MAX_LEVELS);
+                    fprintf(stderr,"Try '%s -help' for more information.\n",argv[0]);
+                    exit(-1);
+                }
+                break;
+            }
+            case 'v':
+            {
+                sscanf(optarg,"%hhi",&cmdline->verboseLevel);
+                break;
+            }
+            default:
+            {
+                //fprintf(stderr,"%s: invalid option '%c'\n",argv[0],ch);  //getopt does this already
+                fprintf(stderr,"Try '%s -help' for more information.\n",argv[0]);
+                exit(-1);
+                break;
+            }
+        }
+    }
+}
+
+
+/* Process Command-line */
+void procCmdLine(int argc, char *argv[], struct CmdLine *cmdline)
+{
+    if(cmdline->verboseLevel>1)
+        fprintf(stdout,"Parsing command line...\n");
+
+    /* Check for mandatory arguments */
+    if(!cmdline->SinoParamsFileFlag || !cmdline->ImageParamsFileFlag){
+        fprintf(stderr,"Error: Either sinoparams or imgparams (-i,-j) file wasn't specified\n");
+        fprintf(stderr,"Try '%s -help' for more information.\n",argv[0]);
+        exit(-1);
+    }
+
+    /* Determine what to do based on supplied options 
+     * cmdline->reconFlag
+     * cmdline->readInitImageFlag
+     * cmdline->readInitProjectionFlag
+     * cmdline->writeProjectionFlag
+     */
+    cmdline->readAmatrixFlag=0;
+    cmdline->writeAmatrixFlag=0;
+
+    if(cmdline->matrixFreeFlag && cmdline->symmetryFlag) {
+        fprintf(stderr,"Error: -M and -S options can't be used together\n");
+        fprintf(stderr,"Try '%s -help' for more information.\n",argv[0]);
+        exit(-1);
+    }
+
+    if(cmdline->Abits != 4 && cmdline->Abits != 8 && cmdline->Abits != 16) {
+        fprintf(stderr,"Error: -q must be 4, 8 or 16\n");
+        fprintf(stderr,"Try '%s -help' for more information.\n",argv[0]);
+        exit(-1);
+    }
+
+    if(cmdline->denoiserFlag && (cmdline->batchFlag || !cmdline->ReconImageFileFlag
+       || cmdline->reconFlag != MBIR_MODULAR_RECONTYPE_PandP || cmdline->ProxMapImageFile[0] != '\0'))
+    {
+        fprintf(stderr,"Error: -D runs a Plug & Play reconstruction (needs -r; can't be combined with -B -b -p)\n");
+        fprintf(stderr,"Try '%s -help' for more information.\n",argv[0]);
+        exit(-1);
+    }
+
+    if(cmdline->sweepFlag)
+    {
+        if(cmdline->ReconImageFileFlag || cmdline->batchFlag || cmdline->readInitProjectionFlag || cmdline->writeProjectionFlag
+           || cmdline->reconFlag != MBIR_MODULAR_RECONTYPE_QGGMRF_3D)
+        {
+            fprintf(stderr,"Error: -X can't be combined with -r -B -e -f -p -b -D (give outputs per variant in the list)\n");
+            fprintf(stderr,"Try '%s -help' for more information.\n",argv[0]);
+            exit(-1);
+        }
+        cmdline->ReconImageFileFlag = 1;    /* otherwise a reconstruction */
+        cmdline->ReconImageFile[0] = '\0';
+    }
+
+    if(cmdline->CheckpointFile[0] != '\0' || cmdline->resumeFlag)
+    {
+        if(cmdline->CheckpointFile[0] == '\0' || !cmdline->ReconImageFileFlag || cmdline->batchFlag
+           || cmdline->sweepFlag || cmdline->denoiserFlag || cmdline->reconFlag == MBIR_MODULAR_RECONTYPE_ADJOINT)
+        {
+            fprintf(stderr,"Error: -C/-R checkpoint a single reconstruction (needs -r; can't be combined with -B -X -D -b)\n");
+            fprintf(stderr,"Try '%s -help' for more information.\n",argv[0]);
+            exit(-1);
+        }
+    }
+
+    if(cmdline->slabDepth > 0)
+    {
+        if(!cmdline->ReconImageFileFlag || cmdline->batchFlag || cmdline->sweepFlag || cmdline->denoiserFlag
+           || cmdline->CheckpointFile[0] != '\0' || cmdline->readInitProjectionFlag || cmdline->writeProjectionFlag
+           || cmdline->reconFlag != MBIR_MODULAR_RECONTYPE_QGGMRF_3D)
+        {
+            fprintf(stderr,"Error: -Z reconstructs in slabs (needs -r; can't be combined with -B -X -D -C -e -f -p -b)\n");
+            fprintf(stderr,"Try '%s -help' for more information.\n",argv[0]);
+            exit(-1);
+        }
+    }
+
+    if(cmdline->ROISpec[0] != '\0')
+    {
+        if(!cmdline->ReconImageFileFlag || cmdline->batchFlag || cmdline->sweepFlag || cmdline->denoiserFlag
+           || cmdline->slabDepth > 0 || cmdline->reconFlag == MBIR_MODULAR_RECONTYPE_ADJOINT)
+        {
+            fprintf(stderr,"Error: -O reconstructs a region of interest (needs -r; can't be combined with -B -X -D -Z -b)\n");
+            fprintf(stderr,"Try '%s -help' for more information.\n",argv[0]);
+            exit(-1);
+        }
+    }
+
+    if(cmdline->freezeFraction > 0)
+    {
+        if(!cmdline->ReconImageFileFlag || cmdline->batchFlag || cmdline->sweepFlag || cmdline->denoiserFlag
+           || cmdline->slabDepth > 0 || cmdline->reconFlag == MBIR_MODULAR_RECONTYPE_ADJOINT)
+        {
+            fprintf(stderr,"Error: -F freezes converged SVs in a reconstruction (needs -r; can't be combined with -B -X -D -Z -b)\n");
+            fprintf(stderr,"Try '%s -help' for more information.\n",argv[0]);
+            exit(-1);
+        }
+    }
+
+    if(cmdline->multiresLevels > 0)
+    {
+        if(!cmdline->ReconImageFileFlag || cmdline->batchFlag || cmdline->sweepFlag || cmdline->denoiserFlag
+           || cmdline->slabDepth > 0 || cmdline->reconFlag != MBIR_MODULAR_RECONTYPE_QGGMRF_3D
+           || cmdline->readInitProjectionFlag || cmdline->resumeFlag || cmdline->ROISpec[0] != '\0')
+        {
+            fprintf(stderr,"Error: -G reconstructs coarse to fine (needs -r; can't be combined with -B -X -D -Z -b -p -e -R -O)\n");
+            fprintf(stderr,"Try '%s -help' for more information.\n",argv[0]);
+            exit(-1);
+        }
+    }
+
+    if(cmdline->batchFlag)  /* batch reconstruction mode */
+    {
+        if(cmdline->SinoDataFileFlag || cmdline->ReconImageFileFlag || cmdline->SinoWeightsFileFlag || cmdline->readInitImageFlag
+           || cmdline->readInitProjectionFlag || cmdline->writeProjectionFlag || cmdline->reconFlag != MBIR_MODULAR_RECONTYPE_QGGMRF_3D)
+        {
+            fprintf(stderr,"Error: -B can't be combined with -s -r -w -t -e -f -p -b (give files per job in the list)\n");
+            fprintf(stderr,"Try '%s -help' for more information.\n",argv[0]);
+            exit(-1);
+        }
+        if(!cmdline->ReconParamsFileFlag)
+        {
+            fprintf(stderr,"Error: Reconstruction parameter file not specified\n");
+            fprintf(stderr,"Try '%s -help' for more information.\n",argv[0]);
+            exit(-1);
+        }
+        if(cmdline->SysMatrixFileFlag && !cmdline->matrixFreeFlag)
+            cmdline->readAmatrixFlag=1;
+    }
+    else if(cmdline->ReconImageFileFlag)  /* reconstruction mode */
+    {
+        if(cmdline->SysMatrixFileFlag && !cmdline->matrixFreeFlag)
+            cmdline->readAmatrixFlag=1;
+
         if(cmdline->readInitProjectionFlag && !cmdline->readInitImageFlag)
             cmdline->readInitProjectionFlag = 0;
 
@@ -424,11 +1370,17 @@ void procCmdLine(int argc, char *argv[], struct CmdLine *cmdline)
 
         if(cmdline->writeProjectionFlag && cmdline->readInitImageFlag)  /* projection mode */
         {
-            if(cmdline->SysMatrixFileFlag)
+            if(cmdline->SysMatrixFileFlag && !cmdline->matrixFreeFlag)
                 cmdline->readAmatrixFlag=1;
         }
         else /* pre-compute matrix */
         {
+            if(cmdline->matrixFreeFlag)
+            {
+                fprintf(stderr,"Error: -M (matrix-free) can't be used when pre-computing the system matrix\n");
+                fprintf(stderr,"Try '%s -help' for more information.\n",argv[0]);
+                exit(-1);
+            }
             if(cmdline->SysMatrixFileFlag)
                 cmdline->writeAmatrixFlag=1;
             else
@@ -443,18 +1395,28 @@ void procCmdLine(int argc, char *argv[], struct CmdLine *cmdline)
     /* Print output and check errors of above parsing sequence  */
     if(cmdline->verboseLevel>1)
     {
+        if(cmdline->batchFlag)
+            fprintf(stdout,"-> will perform batch reconstruction (QGGMRF) of the jobs in %s\n",cmdline->BatchFile);
+        if(cmdline->sweepFlag)
+            fprintf(stdout,"-> will sweep the parameter variants in %s, warm-starting each one\n",cmdline->SweepFile);
         if(cmdline->reconFlag)
         {
             fprintf(stdout,"-> will perform reconstruction ");
             if(cmdline->reconFlag == MBIR_MODULAR_RECONTYPE_QGGMRF_3D)
                 fprintf(stdout,"(QGGMRF)\n");
-            if(cmdline->reconFlag == MBIR_MODULAR_RECONTYPE_PandP)
+            if(cmdline->reconFlag == MBIR_MODULAR_RECONTYPE_PandP && cmdline->denoiserFlag)
+                fprintf(stdout,"(Plug & Play, %d outer iterations with denoiser %s)\n",cmdline->pnpIterations,cmdline->DenoiserLib);
+            else if(cmdline->reconFlag == MBIR_MODULAR_RECONTYPE_PandP)
                 fprintf(stdout,"(Plug & Play)\n");
             if(cmdline->reconFlag == MBIR_MODULAR_RECONTYPE_ADJOINT)
                 fprintf(stdout,"(Backproject only! No MBIR)\n");
 
-            if(cmdline->readAmatrixFlag)
+            if(cmdline->matrixFreeFlag)
+                fprintf(stdout,"-> will generate system matrix on the fly (matrix-free)\n");
+            else if(cmdline->readAmatrixFlag)
                 fprintf(stdout,"-> will read system matrix from file\n");
+            else if(cmdline->symmetryFlag)
+                fprintf(stdout,"-> will compute symmetry-compact system matrix\n");
             else
             {
                 fprintf(stdout,"-> will compute system matrix\n");
@@ -482,9 +1444,13 @@ void procCmdLine(int argc, char *argv[], struct CmdLine *cmdline)
         {
             fprintf(stdout,"-> no reconstruction\n");
             if(cmdline->writeAmatrixFlag)
-                fprintf(stdout,"-> will compute system matrix and write to file\n");
+                fprintf(stdout,"-> will compute %ssystem matrix and write to file\n",cmdline->symmetryFlag ? "symmetry-compact " : "");
             if(cmdline->writeProjectionFlag)
                 fprintf(stdout,"-> will compute projection and write to file(s)\n");
+            if(cmdline->matrixFreeFlag)
+                fprintf(stdout,"-> will generate system matrix on the fly (matrix-free)\n");
+            if(cmdline->writeAmatrixFlag && cmdline->Abits != 8)
+                fprintf(stdout,"-> will store system matrix with %d-bit precision\n",cmdline->Abits);
             if(cmdline->ReconParamsFileFlag || cmdline->SinoDataFileFlag || cmdline->SinoWeightsFileFlag || cmdline->readInitProjectionFlag)
                 fprintf(stdout,"Note some command line options are being ignored.\n");
         }
@@ -500,11 +1466,11 @@ void procCmdLine(int argc, char *argv[], struct CmdLine *cmdline)
             fprintf(stdout,"   Sinogram data = %s_sliceNNN.2Dsinodata\n",cmdline->SinoDataFile);
         if(cmdline->SinoWeightsFileFlag)
             fprintf(stdout,"   Weight data   = %s_sliceNNN.2Dweightdata\n",cmdline->SinoWeightsFile);
-        if(cmdline->ReconImageFileFlag)
+        if(cmdline->ReconImageFileFlag && !cmdline->sweepFlag)
             fprintf(stdout,"   Output images = %s_sliceNNN.2Dimgdata\n",cmdline->ReconImageFile);
         if(cmdline->readInitImageFlag)
             fprintf(stdout,"   Initial image = %s_sliceNNN.2Dimgdata\n",cmdline->InitImageFile);
-        if(cmdline->SysMatrixFileFlag)
+        if(cmdline->SysMatrixFileFlag && !cmdline->matrixFreeFlag)
             fprintf(stdout,"   System matrix = %s.2Dsvmatrix\n",cmdline->SysMatrixFile);
         if(cmdline->readInitProjectionFlag)
             fprintf(stdout,"   Initial projection = %s.2Dprojection\n",cmdline->inputProjectionFile);
@@ -518,8 +1484,14 @@ void procCmdLine(int argc, char *argv[], struct CmdLine *cmdline)
 int NumSliceDigits(char *basename, char *ext, int slice)
 {
     FILE *fp;
-    char fname[1024];
+    char fname[1064];
     int Ndigits = MBIR_MODULAR_MAX_NUMBER_OF_SLICE_DIGITS;
+    struct VolumeHeader header;
+
+    /* a volume file <basename>.3D<type> keeps the digits of the slice files */
+    sprintf(fname,"3D%s",ext+2);
+    if(ReadVolumeHeader(basename,fname,&header) == 0)
+        return((header.NumSliceDigits > 0) ? header.NumSliceDigits : MBIR_MODULAR_MAX_NUMBER_OF_SLICE_DIGITS);
 
     while(Ndigits > 0)
     {
@@ -536,6 +1508,314 @@ int NumSliceDigits(char *basename, char *ext, int slice)
 }
 
 
+/* Read/write NSlices projection slices from sinoparams' FirstSliceNumber, */
+/* as a volume file <basename>.3Dprojection or one file per slice          */
+void readProjection(char *basename, float **proj, struct SinoParams3DParallel *sinoparams, int Ndigits)
+{
+    char fname[1064];
+    int jz;
+
+    if(VolumeFileExists(basename,"3Dprojection")) {
+        ReadVolume(basename,"3Dprojection",proj,sinoparams->FirstSliceNumber,sinoparams->NSlices,
+            sinoparams->NViews,sinoparams->NChannels,SinoParamsHash(sinoparams));
+        return;
+    }
+    for(jz=0; jz<sinoparams->NSlices; jz++)
+    {
+        sprintf(fname,"%s_slice%.*d.2Dprojection",basename,Ndigits,jz+sinoparams->FirstSliceNumber);
+        if(ReadFloatArray(fname,proj[jz],sinoparams->NViews*sinoparams->NChannels)) {
+            fprintf(stderr,"Error: can't read %s\n",fname);
+            exit(-1);
+        }
+    }
+}
+
+void writeProjection(char *basename, float **proj, struct SinoParams3DParallel *sinoparams, int Ndigits, char volumeFlag)
+{
+    char fname[1064];
+    int jz;
+
+    if(volumeFlag) {
+        struct VolumeHeader header;
+        InitVolumeHeader(&header,sinoparams->FirstSliceNumber,sinoparams->NSlices,sinoparams->NViews,sinoparams->NChannels,
+            Ndigits,SinoParamsHash(sinoparams));
+        WriteVolume(basename,"3Dprojection",proj,&header,sinoparams->FirstSliceNumber,sinoparams->NSlices);
+        return;
+    }
+    for(jz=0; jz<sinoparams->NSlices; jz++)
+    {
+        sprintf(fname,"%s_slice%.*d.2Dprojection",basename,Ndigits,jz+sinoparams->FirstSliceNumber);
+        if( WriteFloatArray(fname,proj[jz],sinoparams->NViews*sinoparams->NChannels) ) {
+            fprintf(stderr,"Error: can't open file %s for writing\n",fname);
+            exit(-1);
+        }
+    }
+}
+
+
+/* Convert between per-slice files and a single-file volume:                  */
+/*   mbir_ct -convert <type> <paramsBase> <inBase> <outBase>                  */
+/* type is sinodata, weightdata or projection with <paramsBase>.sinoparams,   */
+/* or imgdata with <paramsBase>.imgparams. If <inBase>.3D<type> exists, all   */
+/* its slices are written as <outBase>_slice<Index>.2D<type>; otherwise the   */
+/* slices given by the parameter file are packed into <outBase>.3D<type>.     */
+int convertVolume(int argc, char *argv[])
+{
+    struct SinoParams3DParallel sinoparams;
+    struct ImageParams3D imgparams;
+    struct VolumeHeader header;
+    struct timeval tm1,tm2;
+    char ext2[64], ext3[64], fname[1064];
+    int i,NRows,NCols,First,N,Ndigits;
+    unsigned long long hash;
+    float **data;
+
+    if(argc != 6) {
+        fprintf(stderr,"Usage: %s -convert <sinodata|weightdata|projection|imgdata> <paramsBase> <inBase> <outBase>\n",argv[0]);
+        exit(-1);
+    }
+    char *type = argv[2], *inBase = argv[4], *outBase = argv[5];
+    if(strcmp(type,"imgdata")==0)
+    {
+        ReadImageParams3D(argv[3],&imgparams);
+        NRows = imgparams.Ny;
+        NCols = imgparams.Nx;
+        First = imgparams.FirstSliceNumber;
+        N = imgparams.Nz;
+        hash = ImageParamsHash(&imgparams);
+    }
+    else if(strcmp(type,"sinodata")==0 || strcmp(type,"weightdata")==0 || strcmp(type,"projection")==0)
+    {
+        ReadSinoParams3DParallel(argv[3],&sinoparams);
+        NRows = sinoparams.NViews;
+        NCols = sinoparams.NChannels;
+        First = sinoparams.FirstSliceNumber;
+        N = sinoparams.NSlices;
+        hash = SinoParamsHash(&sinoparams);
+        free((void *)sinoparams.ViewAngles);
+    }
+    else {
+        fprintf(stderr,"Error: -convert type must be sinodata, weightdata, projection or imgdata\n");
+        exit(-1);
+    }
+    sprintf(ext2,"2D%s",type);
+    sprintf(ext3,"3D%s",type);
+    gettimeofday(&tm1,NULL);
+
+    if(ReadVolumeHeader(inBase,ext3,&header) == 0)
+    {
+        /* volume file to slices */
+        First = header.FirstSliceNumber;
+        N = header.NSlices;
+        Ndigits = (header.NumSliceDigits > 0) ? header.NumSliceDigits : MBIR_MODULAR_MAX_NUMBER_OF_SLICE_DIGITS;
+        data = (float **)multialloc(sizeof(float),2,N,NRows*NCols);
+        ReadVolume(inBase,ext3,data,First,N,NRows,NCols,hash);
+        for(i=0; i<N; i++)
+        {
+            sprintf(fname,"%s_slice%.*d.%s",outBase,Ndigits,First+i,ext2);
+            if(WriteFloatArray(fname,data[i],NRows*NCols)) {
+                fprintf(stderr,"Error: can't open file %s for writing\n",fname);
+                exit(-1);
+            }
+        }
+        sprintf(fname,"%s_slice%.*d-%.*d.%s",outBase,Ndigits,First,Ndigits,First+N-1,ext2);
+    }
+    else
+    {
+        /* slices to volume file */
+        if((Ndigits = NumSliceDigits(inBase,ext2,First)) <= 0) {
+            fprintf(stderr,"Error: no %s.%s or %s_slice%d.%s files\n",inBase,ext3,inBase,First,ext2);
+            exit(-1);
+        }
+        data = (float **)multialloc(sizeof(float),2,N,NRows*NCols);
+        for(i=0; i<N; i++)
+        {
+            sprintf(fname,"%s_slice%.*d.%s",inBase,Ndigits,First+i,ext2);
+            if(ReadFloatArray(fname,data[i],NRows*NCols)) {
+                fprintf(stderr,"Error: can't read %s\n",fname);
+                exit(-1);
+            }
+        }
+        InitVolumeHeader(&header,First,N,NRows,NCols,Ndigits,hash);
+        WriteVolume(outBase,ext3,data,&header,First,N);
+        sprintf(fname,"%s.%s",outBase,ext3);
+    }
+
+    gettimeofday(&tm2,NULL);
+    fprintf(stdout,"Converted %d slices (%.1f MB) to %s in %llu ms\n",N,(double)N*NRows*NCols*sizeof(float)/1048576.0,fname,
+        (unsigned long long)(1000*(tm2.tv_sec-tm1.tv_sec) + (tm2.tv_usec-tm1.tv_usec)/1000));
+    multifree(data,2);
+    return(0);
+}
+
+
+/* Reconstruct the jobs listed in cmdline->BatchFile with one MBIRReconstructBatch() */
+/* call (MBIRContextRecon() if ctx holds the resident matrix). Each line gives <sinoBase> <reconBase> [<weightBase>]; '#' starts a comment. */
+void reconstructBatch(
+    struct CmdLine *cmdline,
+    struct ImageParams3D imgparams,
+    struct SinoParams3DParallel sinoparams,
+    char *readmatrix_fname,
+    struct AmatrixParams Aparams,
+    int *viewOrder,
+    struct MBIRContext *ctx)
+{
+    struct BatchJob {
+        char sino[1024];
+        char recon[1024];
+        char weight[1024];
+        int Ndigits;
+    } *job = NULL;
+    struct Sino3DParallel sinogram, jobSino;
+    struct Image3D Image, jobImage;
+    struct ReconParams reconparams;
+    struct SliceTransfer *xfer;
+    struct SinoPrep *prep;
+    char line[4096];
+    int k,n,Nbatch=0,Nalloc=0;
+    int Nz = imgparams.Nz;
+    FILE *fp;
+
+    if((fp = fopen(cmdline->BatchFile,"r")) == NULL) {
+        fprintf(stderr,"Error: can't open batch list %s\n",cmdline->BatchFile);
+        exit(-1);
+    }
+    while(fgets(line,sizeof(line),fp) != NULL)
+    {
+        char *c = strchr(line,'#');
+        if(c != NULL)
+            *c = '\0';
+        if(Nbatch == Nalloc) {
+            Nalloc = 2*Nalloc+8;
+            job = (struct BatchJob *) realloc(job,Nalloc*sizeof(struct BatchJob));
+        }
+        job[Nbatch].weight[0] = '\0';
+        n = sscanf(line,"%1023s %1023s %1023s",job[Nbatch].sino,job[Nbatch].recon,job[Nbatch].weight);
+        if(n <= 0)
+            continue;
+        if(n == 1) {
+            fprintf(stderr,"Error: batch list %s: line needs <sinoBase> <reconBase> [<weightBase>]\n",cmdline->BatchFile);
+            exit(-1);
+        }
+        Nbatch++;
+    }
+    fclose(fp);
+    if(Nbatch == 0) {
+        fprintf(stderr,"Error: batch list %s has no jobs\n",cmdline->BatchFile);
+        exit(-1);
+    }
+
+    ReadReconParams(cmdline->ReconParamsFile,&reconparams);
+    if(reconparams.ReconType != MBIR_MODULAR_RECONTYPE_QGGMRF_3D)
+    {
+        fprintf(stdout,"**\nWarning: \"PriorModel\" field in reconparams file doesn't agree with\n");
+        fprintf(stdout,"Warning: what the command line is doing. Proceeding anyway.\n**\n");
+        reconparams.ReconType = MBIR_MODULAR_RECONTYPE_QGGMRF_3D;
+    }
+    if(cmdline->verboseLevel)
+        fprintf(stdout,"Reading %d sinograms...\n",Nbatch);
+
+    /* all jobs in one array, Nz slices each */
+    sinoparams.NSlices = Nz*Nbatch;
+    sinoparams.FirstSliceNumber = imgparams.FirstSliceNumber;
+    /* a weight array only if some job reads weights from file */
+    for(k=0, n=0; k<Nbatch; k++)
+        n |= (job[k].weight[0] != '\0');
+    sinogram.sinoparams = sinoparams;
+    if(n)
+        AllocateSinoData3DParallel(&sinogram);
+    else
+        AllocateSinoDataOnly3DParallel(&sinogram);
+    Image.imgparams = imgparams;
+    Image.imgparams.Nz = Nz*Nbatch;
+    AllocateImageData3D(&Image);
+
+    /* Job k's files are read while job k-1's are collected; views are */
+    /* sorted and weights computed per slice on the I/O threads        */
+    xfer = (struct SliceTransfer *) mget_spc(2*Nbatch,sizeof(struct SliceTransfer));
+    prep = (struct SinoPrep *) mget_spc(Nbatch,sizeof(struct SinoPrep));
+    for(k=0; k<=Nbatch; k++)
+    {
+        if(k < Nbatch)
+        {
+            jobSino.sinoparams = sinoparams;
+            jobSino.sinoparams.NSlices = Nz;
+            jobSino.sino = &sinogram.sino[k*Nz];
+            jobSino.weight = (sinogram.weight != NULL) ? &sinogram.weight[k*Nz] : NULL;
+            job[k].Ndigits = setNumSliceDigits(job[k].sino,"2Dsinodata",imgparams.FirstSliceNumber,&jobSino.sinoparams,&imgparams);
+            prep[k].sinogram = jobSino;
+            prep[k].reconparams = reconparams;
+            if(job[k].weight[0] != '\0')
+                prep[k].reconparams.weightType = 0;
+            else if(reconparams.weightType < 1)
+                prep[k].reconparams.weightType = 1;
+            prep[k].viewOrder = viewOrder;
+            prep[k].need = (job[k].weight[0] != '\0') ? 2 : 1;
+            prep[k].count = (int *) calloc(Nz,sizeof(int));
+            pthread_mutex_init(&prep[k].lock,NULL);
+            ReadSinoAsync(&xfer[2*k],job[k].sino,&jobSino,prepSinoSlice,(void *)&prep[k]);
+            if(job[k].weight[0] != '\0')
+                ReadWeightsAsync(&xfer[2*k+1],job[k].weight,&jobSino,prepSinoSlice,(void *)&prep[k]);
+        }
+        if(k > 0)
+        {
+            int j = k-1;
+            SliceTransferWait(&xfer[2*j],cmdline->verboseLevel);
+            if(job[j].weight[0] != '\0')
+                SliceTransferWait(&xfer[2*j+1],cmdline->verboseLevel);
+            pthread_mutex_destroy(&prep[j].lock);
+            free((void *)prep[j].count);
+        }
+    }
+    free((void *)prep);
+
+    /* Initialize image state */
+    char * ImageReconMask = GenImageReconMask(&Image.imgparams);
+    initConstImage(&Image, ImageReconMask, reconparams.InitImageValue, 0);
+    free((void *)ImageReconMask);
+    float *weight = (sinogram.weight != NULL) ? sinogram.weight[0] : NULL;
+    if(weight == NULL && reconparams.weightType < 1)
+        reconparams.weightType = 1;
+
+    if(ctx != NULL)
+        MBIRContextRecon(ctx,Image.image[0],sinogram.sino[0],weight,NULL,NULL,Nz,Nbatch,reconparams,cmdline->verboseLevel);
+    else
+        MBIRReconstructBatch(
+            Image.image[0],
+            sinogram.sino[0],
+            weight,
+            NULL,
+            NULL,
+            Nbatch,
+            imgparams,
+            sinoparams,
+            reconparams,
+            readmatrix_fname,
+            Aparams,
+            cmdline->verboseLevel);
+
+    if(cmdline->verboseLevel)
+        fprintf(stdout,"Writing image files...\n");
+    for(k=0; k<Nbatch; k++)
+    {
+        jobImage.imgparams = imgparams;
+        jobImage.imgparams.NumSliceDigits = job[k].Ndigits;
+        jobImage.image = &Image.image[k*Nz];
+        WriteImageAsync(&xfer[2*k],job[k].recon,&jobImage);
+        if(k > 0)
+            SliceTransferWait(&xfer[2*(k-1)],cmdline->verboseLevel);
+    }
+    SliceTransferWait(&xfer[2*(Nbatch-1)],cmdline->verboseLevel);
+    free((void *)xfer);
+
+    FreeImageData3D(&Image);
+    multifree(sinogram.sino,2);
+    if(sinogram.weight != NULL)
+        multifree(sinogram.weight,2);
+    free((void *)job);
+}
+
+
 int setNumSliceDigits(
     char *basename,
     char *ext,
@@ -567,6 +1847,465 @@ void printBanner(void)
 }
 
 
+/* Plug & Play ADMM in one process: alternate the proximal map of the forward   */
+/* model (MBIR with a proximal prior) and a denoiser loaded from a shared       */
+/* library, on in-memory buffers. proj holds the projection of the image state  */
+/* on entry and is kept up to date by each solve, so the image is never         */
+/* re-projected. The result is the proximal map output x.                       */
+/*     x <- F(v-u),  v <- H(x+u),  u <- u+x-v                                    */
+void reconstructPnP(
+    struct CmdLine *cmdline,
+    struct MBIRContext *ctx,
+    float *image,
+    float *sino,
+    float *weight,
+    float *proj,
+    struct ImageParams3D imgparams,
+    struct ReconParams reconparams)
+{
+    char libname[1024], *fname=MBIR_DENOISER_FUNCTION, *c;
+    void *lib;
+    MBIRDenoiser denoise;
+    struct timeval tm0,tm1,tm2;
+    int it, Nz = imgparams.Nz;
+    size_t k, N = (size_t)imgparams.Nx*imgparams.Ny*Nz;
+    float *x = image;
+    char innerVerbose = cmdline->verboseLevel>1 ? cmdline->verboseLevel-1 : 0;
+
+    /* <library>[:<function>] */
+    snprintf(libname,sizeof(libname),"%s",cmdline->DenoiserLib);
+    if((c = strrchr(libname,':')) != NULL && strchr(c,'/') == NULL) {
+        *c = '\0';
+        fname = c+1;
+    }
+    if((lib = dlopen(libname,RTLD_NOW)) == NULL) {
+        fprintf(stderr,"Error: can't load denoiser library %s (%s)\n",libname,dlerror());
+        exit(-1);
+    }
+    if((denoise = (MBIRDenoiser) dlsym(lib,fname)) == NULL) {
+        fprintf(stderr,"Error: denoiser library %s has no function %s\n",libname,fname);
+        exit(-1);
+    }
+
+    float *v = (float *) mget_spc(N,sizeof(float));
+    float *u = (float *) mget_spc(N,sizeof(float));
+    float *tmp = (float *) mget_spc(N,sizeof(float));
+    #pragma omp parallel for
+    for(k=0; k<N; k++) {
+        v[k] = x[k];
+        u[k] = 0.0;
+    }
+
+    if(cmdline->verboseLevel)
+        fprintf(stdout,"Plug & Play reconstruction, %d outer iterations...\n",cmdline->pnpIterations);
+    gettimeofday(&tm0,NULL);
+
+    for(it=0; it<cmdline->pnpIterations; it++)
+    {
+        double diff=0.0, norm=0.0;
+
+        /* proximal map of the forward model at v-u */
+        gettimeofday(&tm1,NULL);
+        #pragma omp parallel for
+        for(k=0; k<N; k++)
+            tmp[k] = v[k]-u[k];
+        MBIRContextRecon(ctx,x,sino,weight,proj,tmp,Nz,1,reconparams,innerVerbose);
+        gettimeofday(&tm2,NULL);
+        unsigned long long tprox = 1000*(tm2.tv_sec-tm1.tv_sec) + (tm2.tv_usec-tm1.tv_usec)/1000;
+
+        /* denoiser at x+u */
+        tm1 = tm2;
+        #pragma omp parallel for
+        for(k=0; k<N; k++)
+            tmp[k] = x[k]+u[k];
+        if(denoise(v,tmp,imgparams.Nx,imgparams.Ny,Nz,cmdline->DenoiserArgs,it)) {
+            fprintf(stderr,"Error: denoiser %s failed in outer iteration %d\n",fname,it+1);
+            exit(-1);
+        }
+        gettimeofday(&tm2,NULL);
+        unsigned long long tden = 1000*(tm2.tv_sec-tm1.tv_sec) + (tm2.tv_usec-tm1.tv_usec)/1000;
+
+        #pragma omp parallel for reduction(+:diff,norm)
+        for(k=0; k<N; k++) {
+            u[k] += x[k]-v[k];
+            diff += (double)(x[k]-v[k])*(x[k]-v[k]);
+            norm += (double)x[k]*x[k];
+        }
+        if(cmdline->verboseLevel)
+            fprintf(stdout,"\touter iteration %d: proximal map %llu ms, denoiser %llu ms, ||x-v||/||x|| = %.4g\n",
+                it+1,tprox,tden,norm>0 ? sqrt(diff/norm) : 0.0);
+    }
+
+    if(cmdline->verboseLevel) {
+        gettimeofday(&tm2,NULL);
+        fprintf(stdout,"\tPlug & Play time = %llu ms\n",
+            (unsigned long long)(1000*(tm2.tv_sec-tm0.tv_sec) + (tm2.tv_usec-tm0.tv_usec)/1000));
+    }
+
+    free((void *)v);
+    free((void *)u);
+    free((void *)tmp);
+    dlclose(lib);
+}
+
+
+/* Parameter sweep: reconstruct the variants listed in cmdline->SweepFile, one per  */
+/* line as <reconBase> [<param>=<value> ...] over the -k parameters, '#' starts a   */
+/* comment. Each variant starts from the solution of the previous one with its     */
+/* sinogram error, so the image is never re-projected. The variants are run in a   */
+/* nearest-neighbour order through parameter space, starting with the first one,   */
+/* so each warm start comes from the closest solution available. Images and a line */
+/* of <SweepFile>.results are written as each variant completes.                    */
+void reconstructSweep(
+    struct CmdLine *cmdline,
+    struct MBIRContext *ctx,
+    struct Image3D *Image,
+    float *sino,
+    float *weight,
+    float *proj,
+    struct ReconParams reconparams)
+{
+    struct SweepVariant {
+        char recon[1024];
+        struct ReconParams params;
+        char done;
+    } *var = NULL;
+    char line[4096], fname[1064], *tok, *eq;
+    int k,j,next,prev=-1,Nvar=0,Nalloc=0;
+    FILE *fp, *fpr;
+    struct timeval tm0,tm1;
+    char innerVerbose = cmdline->verboseLevel>1 ? cmdline->verboseLevel-1 : 0;
+
+    if((fp = fopen(cmdline->SweepFile,"r")) == NULL) {
+        fprintf(stderr,"Error: can't open sweep list %s\n",cmdline->SweepFile);
+        exit(-1);
+    }
+    while(fgets(line,sizeof(line),fp) != NULL)
+    {
+        char *c = strchr(line,'#');
+        if(c != NULL)
+            *c = '\0';
+        if((tok = strtok(line," \t\r\n")) == NULL)
+            continue;
+        if(Nvar == Nalloc) {
+            Nalloc = 2*Nalloc+8;
+            var = (struct SweepVariant *) realloc(var,Nalloc*sizeof(struct SweepVariant));
+        }
+        snprintf(var[Nvar].recon,sizeof(var[Nvar].recon),"%s",tok);
+        var[Nvar].params = reconparams;
+        var[Nvar].done = 0;
+        while((tok = strtok(NULL," \t\r\n")) != NULL)
+        {
+            if((eq = strchr(tok,'=')) == NULL) {
+                fprintf(stderr,"Error: sweep list %s: expected <param>=<value>, got \"%s\"\n",cmdline->SweepFile,tok);
+                exit(-1);
+            }
+            *eq = '\0';
+            if(setReconParam(&var[Nvar].params,tok,eq+1)) {
+                fprintf(stderr,"Error: sweep list %s: can't set %s to %s\n",cmdline->SweepFile,tok,eq+1);
+                exit(-1);
+            }
+        }
+        Nvar++;
+    }
+    fclose(fp);
+    if(Nvar == 0) {
+        fprintf(stderr,"Error: sweep list %s has no variants\n",cmdline->SweepFile);
+        exit(-1);
+    }
+
+    sprintf(fname,"%s.results",cmdline->SweepFile);
+    if((fpr = fopen(fname,"w")) == NULL) {
+        fprintf(stderr,"Error: can't open %s for writing\n",fname);
+        exit(-1);
+    }
+    fprintf(fpr,"# reconBase warmStart SigmaX p q T converged iterations equits avgUpdate(%%) time(ms)\n");
+    if(cmdline->verboseLevel)
+        fprintf(stdout,"Parameter sweep, %d variants...\n",Nvar);
+    gettimeofday(&tm0,NULL);
+
+    for(k=0, next=0; k<Nvar; k++)
+    {
+        struct ReconParams *rp = &var[next].params;
+
+        MBIRContextRecon(ctx,Image->image[0],sino,weight,proj,NULL,Image->imgparams.Nz,1,*rp,innerVerbose);
+        WriteImage3D(var[next].recon,Image);
+        var[next].done = 1;
+
+        struct MBIRReconStats st = ctx->stats;
+        fprintf(fpr,"%s %s %g %g %g %g %d %d %.2f %.4g %llu\n",var[next].recon,prev<0 ? "-" : var[prev].recon,
+            rp->SigmaX,rp->p,rp->q,rp->T,st.converged,st.iterations,st.equits,st.avgUpdateRel,st.time_ms);
+        fflush(fpr);
+        if(cmdline->verboseLevel)
+            fprintf(stdout,"\t%s (from %s): %.1f equivalent iterations, %s, %llu ms\n",var[next].recon,
+                prev<0 ? (cmdline->readInitImageFlag ? "initial image" : "constant image") : var[prev].recon,
+                st.equits,st.converged ? "converged" : "not converged",st.time_ms);
+
+        /* next: closest remaining variant */
+        prev = next;
+        next = -1;
+        for(j=0; j<Nvar; j++)
+        if(!var[j].done && (next<0 || reconParamsDistance(&var[j].params,rp) < reconParamsDistance(&var[next].params,rp)))
+            next = j;
+    }
+    fclose(fpr);
+
+    if(cmdline->verboseLevel) {
+        gettimeofday(&tm1,NULL);
+        fprintf(stdout,"\tSweep time = %llu ms, results in %s\n",
+            (unsigned long long)(1000*(tm1.tv_sec-tm0.tv_sec) + (tm1.tv_usec-tm0.tv_usec)/1000),fname);
+    }
+    free((void *)var);
+}
+
+
+/* Set a prior/convergence parameter by its reconparams field name. SigmaY,   */
+/* weightType and InitImageValue aren't allowed since the sweep shares the    */
+/* weights and warm-starts. Returns 0 if set.                                 */
+int setReconParam(struct ReconParams *reconparams, char *name, char *value)
+{
+    double f;
+
+    if(sscanf(value,"%lf",&f) != 1)
+        return(1);
+    if(strcmp(name,"SigmaX")==0 && f>0)
+        reconparams->SigmaX = f;
+    else if(strcmp(name,"p")==0 && f>=1 && f<=2)
+        reconparams->p = f;
+    else if(strcmp(name,"q")==0 && f>=1 && f<=2)
+        reconparams->q = f;
+    else if(strcmp(name,"T")==0 && f>0)
+        reconparams->T = f;
+    else if(strcmp(name,"b_nearest")==0 && f>0)
+        reconparams->b_nearest = f;
+    else if(strcmp(name,"b_diag")==0 && f>=0)
+        reconparams->b_diag = f;
+    else if(strcmp(name,"b_interslice")==0 && f>=0)
+        reconparams->b_interslice = f;
+    else if(strcmp(name,"StopThreshold")==0)
+        reconparams->StopThreshold = f;
+    else if(strcmp(name,"MaxIterations")==0 && f>0)
+        reconparams->MaxIterations = (int)f;
+    else if(strcmp(name,"Positivity")==0 && (f==0 || f==1))
+        reconparams->Positivity = (char)f;
+    else if(strcmp(name,"RelaxFactor")==0 && f>0 && f<2)
+        reconparams->RelaxFactor = f;
+    else
+        return(1);
+    return(0);
+}
+
+
+/* Distance between prior parameter sets, for choosing warm starts: sum of */
+/* relative differences of the prior parameters                            */
+float reconParamsDistance(struct ReconParams *a, struct ReconParams *b)
+{
+    float x[8] = {a->SigmaX, a->p, a->q, a->T, a->b_nearest, a->b_diag, a->b_interslice, a->Positivity};
+    float y[8] = {b->SigmaX, b->p, b->q, b->T, b->b_nearest, b->b_diag, b->b_interslice, b->Positivity};
+    float d=0;
+    int i;
+
+    for(i=0; i<8; i++)
+    if(x[i] != y[i])
+        d += fabs(x[i]-y[i]) / (fabs(x[i]) > fabs(y[i]) ? fabs(x[i]) : fabs(y[i]));
+    return(d);
+}
+
+
+/* Sinogram slab read by a background thread while the previous slab iterates */
+struct SlabInput
+{
+    struct CmdLine *cmdline;
+    struct Sino3DParallel sinogram;     /* NSlices/FirstSliceNumber select the slab */
+    int *viewOrder;
+    pthread_t thread;
+};
+
+void *readSlabInput(void *arg)
+{
+    struct SlabInput *in = (struct SlabInput *) arg;
+    struct SinoParams3DParallel *sp = &in->sinogram.sinoparams;
+
+    struct SliceTransfer sinoRead,weightRead;
+
+    ReadSinoAsync(&sinoRead,in->cmdline->SinoDataFile,&in->sinogram,NULL,NULL);
+    if(in->cmdline->SinoWeightsFileFlag)
+        ReadWeightsAsync(&weightRead,in->cmdline->SinoWeightsFile,&in->sinogram,NULL,NULL);
+    SliceTransferWait(&sinoRead,0);
+    if(in->viewOrder != NULL)
+        PermuteSinoViews(in->sinogram.sino[0],sp->NSlices,sp->NViews,sp->NChannels,in->viewOrder,0);
+    if(in->cmdline->SinoWeightsFileFlag)
+    {
+        SliceTransferWait(&weightRead,0);
+        if(in->viewOrder != NULL)
+            PermuteSinoViews(in->sinogram.weight[0],sp->NSlices,sp->NViews,sp->NChannels,in->viewOrder,0);
+    }
+    return(NULL);
+}
+
+
+/* Out-of-core reconstruction (-Z): the volume is reconstructed in z-slabs of   */
+/* slabDepth slices, each with slabHalo extra slices on either side so the      */
+/* interslice prior sees its neighbours. Only the inner slices of a slab are    */
+/* written. The next slab starts from the overlapping slices of the previous    */
+/* one, and its sinogram is read in the background while the current one        */
+/* iterates, so memory holds two slabs of sinogram and one of image at a time.  */
+void reconstructSlabs(
+    struct CmdLine *cmdline,
+    struct MBIRContext *ctx,
+    struct ImageParams3D imgparams,
+    struct SinoParams3DParallel sinoparams,
+    int *viewOrder)
+{
+    struct SlabInput in[2];
+    struct Image3D Image, slabImage;
+    struct ReconParams reconparams;
+    struct timeval tm1,tm2;
+    unsigned long long waitTime=0, reconTime=0;
+    int k,s,cur;
+    int Nz = imgparams.Nz;
+    int Nxy = imgparams.Nx*imgparams.Ny;
+    int NvNc = sinoparams.NViews*sinoparams.NChannels;
+    int D = cmdline->slabDepth;
+    int h = cmdline->slabHalo;
+    int Nslabs = (Nz+D-1)/D;
+    int NzMax = (D+2*h < Nz) ? D+2*h : Nz;
+    int FirstSliceNumber = imgparams.FirstSliceNumber;
+    int r0, r1, prev_r0=0, prev_r1=0;
+
+    ReadReconParams(cmdline->ReconParamsFile,&reconparams);
+    if(reconparams.ReconType != MBIR_MODULAR_RECONTYPE_QGGMRF_3D)
+    {
+        fprintf(stdout,"**\nWarning: \"PriorModel\" field in reconparams file doesn't agree with\n");
+        fprintf(stdout,"Warning: what the command line is doing. Proceeding anyway.\n**\n");
+        reconparams.ReconType = MBIR_MODULAR_RECONTYPE_QGGMRF_3D;
+    }
+    if(cmdline->SinoWeightsFileFlag)
+        reconparams.weightType = 0;
+    else if(reconparams.weightType < 1)
+        reconparams.weightType = 1;
+
+    /* two sinogram slabs (current and prefetch) and one image slab */
+    for(k=0; k<2; k++)
+    {
+        in[k].cmdline = cmdline;
+        in[k].viewOrder = viewOrder;
+        in[k].sinogram.sinoparams = sinoparams;
+        in[k].sinogram.sinoparams.NSlices = NzMax;
+        if(cmdline->SinoWeightsFileFlag)
+            AllocateSinoData3DParallel(&in[k].sinogram);
+        else
+            AllocateSinoDataOnly3DParallel(&in[k].sinogram);
+    }
+    Image.imgparams = imgparams;
+    Image.imgparams.Nz = NzMax;
+    AllocateImageData3D(&Image);
+    char *ImageReconMask = GenImageReconMask(&imgparams);
+
+    if(cmdline->verboseLevel)
+    {
+        fprintf(stdout,"Reconstructing %d slices in %d slabs of %d (halo %d)\n",Nz,Nslabs,D,h);
+        fprintf(stdout,"\tslab buffers %.1f MB (whole volume in memory: %.1f MB)\n",
+            ((double)4*NzMax*NvNc + (double)NzMax*Nxy)*sizeof(float)/1048576.0,
+            ((double)2*Nz*NvNc + (double)Nz*Nxy)*sizeof(float)/1048576.0);
+    }
+
+    /* first slab in the background too, so the code path is the same */
+    in[0].sinogram.sinoparams.FirstSliceNumber = FirstSliceNumber;
+    in[0].sinogram.sinoparams.NSlices = (D+h < Nz) ? D+h : Nz;
+    if(pthread_create(&in[0].thread,NULL,readSlabInput,(void *)&in[0]) != 0) {
+        fprintf(stderr,"Error: can't start slab reader thread\n");
+        exit(-1);
+    }
+
+    for(s=0; s<Nslabs; s++)
+    {
+        int z0 = s*D;
+        int z1 = (z0+D < Nz) ? z0+D : Nz;
+        r0 = (z0-h > 0) ? z0-h : 0;
+        r1 = (z1+h < Nz) ? z1+h : Nz;
+        int Ns = r1-r0;
+        cur = s%2;
+
+        /* wait for this slab's sinogram, then start reading the next one */
+        gettimeofday(&tm1,NULL);
+        pthread_join(in[cur].thread,NULL);
+        gettimeofday(&tm2,NULL);
+        unsigned long long waited = 1000 * (tm2.tv_sec - tm1.tv_sec) + (tm2.tv_usec - tm1.tv_usec) / 1000;
+        waitTime += waited;
+        if(s+1 < Nslabs)
+        {
+            int n0 = (z1-h > 0) ? z1-h : 0;
+            int n1 = (z1+D+h < Nz) ? z1+D+h : Nz;
+            in[1-cur].sinogram.sinoparams.FirstSliceNumber = FirstSliceNumber+n0;
+            in[1-cur].sinogram.sinoparams.NSlices = n1-n0;
+            if(pthread_create(&in[1-cur].thread,NULL,readSlabInput,(void *)&in[1-cur]) != 0) {
+                fprintf(stderr,"Error: can't start slab reader thread\n");
+                exit(-1);
+            }
+        }
+        if(cmdline->SinoWeightsFileFlag)
+            ComputeSinoWeights(in[cur].sinogram,reconparams);
+
+        /* initial image: slices shared with the previous slab carry over, the rest */
+        /* come from -t or the constant initial value                             */
+        int Nkeep = (s > 0 && prev_r1 > r0) ? prev_r1-r0 : 0;
+        if(Nkeep > 0)
+            memmove(Image.image[0],Image.image[r0-prev_r0],(size_t)Nkeep*Nxy*sizeof(float));
+        slabImage.imgparams = imgparams;
+        slabImage.imgparams.Nz = Ns-Nkeep;
+        slabImage.imgparams.FirstSliceNumber = FirstSliceNumber+r0+Nkeep;
+        slabImage.image = &Image.image[Nkeep];
+        if(cmdline->readInitImageFlag)
+            ReadImage3D(cmdline->InitImageFile,&slabImage);
+        else
+            initConstImage(&slabImage, ImageReconMask, reconparams.InitImageValue, 0);
+
+        MBIRContextRecon(ctx,Image.image[0],in[cur].sinogram.sino[0],
+            (in[cur].sinogram.weight != NULL) ? in[cur].sinogram.weight[0] : NULL,NULL,NULL,Ns,1,
+            reconparams,(cmdline->verboseLevel>1) ? cmdline->verboseLevel-1 : 0);
+        reconTime += ctx->stats.time_ms;
+
+        /* write the inner slices; a volume file is laid out for all slices */
+        slabImage.imgparams.Nz = z1-z0;
+        slabImage.imgparams.FirstSliceNumber = FirstSliceNumber+z0;
+        slabImage.image = &Image.image[z0-r0];
+        if(cmdline->volumeFlag)
+        {
+            struct VolumeHeader header;
+            InitVolumeHeader(&header,FirstSliceNumber,Nz,imgparams.Ny,imgparams.Nx,imgparams.NumSliceDigits,ImageParamsHash(&imgparams));
+            WriteVolume(cmdline->ReconImageFile,"3Dimgdata",slabImage.image,&header,FirstSliceNumber+z0,z1-z0);
+        }
+        else
+            WriteImage3D(cmdline->ReconImageFile,&slabImage);
+
+        if(cmdline->verboseLevel)
+            fprintf(stdout,"\tslab %d/%d: slices %d-%d (%d-%d with halo), %.1f equivalent iterations, %llu ms, waited %llu ms for input\n",
+                s+1,Nslabs,FirstSliceNumber+z0,FirstSliceNumber+z1-1,FirstSliceNumber+r0,FirstSliceNumber+r1-1,
+                ctx->stats.equits,ctx->stats.time_ms,waited);
+        prev_r0 = r0;
+        prev_r1 = r1;
+    }
+
+    if(cmdline->verboseLevel)
+    {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF,&usage);
+        fprintf(stdout,"\tSlab reconstruction time = %llu ms (iterations), waited %llu ms for input\n",reconTime,waitTime);
+        fprintf(stdout,"\tPeak memory (max resident set) = %.1f MB\n",usage.ru_maxrss/1024.0);
+    }
+
+    free((void *)ImageReconMask);
+    FreeImageData3D(&Image);
+    for(k=0; k<2; k++)
+    {
+        multifree(in[k].sinogram.sino,2);
+        if(in[k].sinogram.weight != NULL)
+            multifree(in[k].sinogram.weight,2);
+    }
+}
+
+
 void printCmdLineUsage(char *ExecFileName)
 {
 //  fprintf(stdout,"***80 columns*******************************************************************\n\n");
@@ -582,6 +2321,11 @@ void printCmdLineUsage(char *ExecFileName)
     fprintf(stdout,"\t-i <filename>[.imgparams]    : Input image parameters\n");
     fprintf(stdout,"\t-j <filename>[.sinoparams]   : Input sinogram parameters\n");
     fprintf(stdout,"\t-m <filename>[.2Dsvmatrix]   : Output matrix file\n");
+    fprintf(stdout,"    (following are optional)\n");
+    fprintf(stdout,"\t-S                           : store symmetry-compact matrix (parallel beam)\n");
+    fprintf(stdout,"\t-q <bits>                    : matrix precision, 4, 8 (default) or 16 bits\n");
+    fprintf(stdout,"\t-o                           : sort views by angle (for unsorted/interleaved views)\n");
+    fprintf(stdout,"\t-L <n|auto|trial>            : views per matrix piece (default ~NViews/16)\n");
     fprintf(stdout,"\n");
 //  fprintf(stdout,"***80 columns*******************************************************************\n\n");
     fprintf(stdout,"Perform reconstruction:\n");
@@ -601,10 +2345,55 @@ void printCmdLineUsage(char *ExecFileName)
     fprintf(stdout,"\t-p <baseFilename>            : Proximal map image(s) for Plug & Play\n");
     fprintf(stdout,"\t                             : ** -p specifies to use proximal prior\n");
     fprintf(stdout,"\t                             : ** generally use with -t -e -f\n");
+    fprintf(stdout,"\t-D <library>[:<function>]    : Plug & Play in one process with a denoiser from a\n");
+    fprintf(stdout,"\t                             : ** shared library (see mbir_denoiser.h); replaces -p\n");
+    fprintf(stdout,"\t-n <iterations>              : Plug & Play outer iterations with -D (default 10)\n");
+    fprintf(stdout,"\t-a <string>                  : argument string passed to the -D denoiser\n");
 //  fprintf(stdout,"***80 columns*******************************************************************\n\n");
+    fprintf(stdout,"\t-M                           : matrix-free; generate system matrix on the fly\n");
+    fprintf(stdout,"\t                             : ** lower memory, slower; overrides -m\n");
+    fprintf(stdout,"\t-S                           : compute symmetry-compact matrix (w/o -m)\n");
+    fprintf(stdout,"\t-q <bits>                    : matrix precision when computed (w/o -m)\n");
+    fprintf(stdout,"\t-o                           : sort views by angle (implied by a sorted -m matrix)\n");
+    fprintf(stdout,"\t-L <n|auto|trial>            : views per matrix piece when computed (w/o -m)\n");
+    fprintf(stdout,"\t-V                           : write outputs as single-file volumes (see below)\n");
+    fprintf(stdout,"\t-Z <depth>[:<halo>]          : out-of-core; reconstruct in z-slabs of depth slices\n");
+    fprintf(stdout,"\t                             : ** with halo slices either side (default %d)\n",SVDEPTH);
+    fprintf(stdout,"\t-C <filename>                : write checkpoints of the reconstruction state to file\n");
+    fprintf(stdout,"\t-I <seconds>                 : wall-clock time between checkpoints (default %d)\n",CHECKPOINT_INTERVAL_DEFAULT);
+    fprintf(stdout,"\t-R                           : resume from the -C checkpoint (same inputs/params)\n");
+    fprintf(stdout,"\t-O <x0>:<x1>,<y0>:<y1>[,<z0>:<z1>][+<margin>] : update only this box of voxels\n");
+    fprintf(stdout,"\t-O <baseFilename>[+<margin>] : or the nonzero voxels of a mask image; the others\n");
+    fprintf(stdout,"\t                             : ** keep the initial image (0-based inclusive indices;\n");
+    fprintf(stdout,"\t                             : ** grown by margin voxels, default 0)\n");
+    fprintf(stdout,"\t-G <levels>                  : start from reconstructions on 2^levels..2 times coarser\n");
+    fprintf(stdout,"\t                             : ** grids (max %d; coarse matrices cached as <-m file>_x<n>)\n",MULTIRES_MAX_LEVELS);
+    fprintf(stdout,"\t-F <fraction>[:<visits>[:<revisit>]] : park SVs whose change stays below fraction of\n");
+    fprintf(stdout,"\t                             : ** the stop threshold for visits visits (default %d);\n",FREEZE_VISITS_DEFAULT);
+    fprintf(stdout,"\t                             : ** revisit them every revisit visits (default %d)\n",FREEZE_REVISIT_DEFAULT);
     fprintf(stdout,"\t-b                           : compute and output simple back projection rather than MBIR\n");
     fprintf(stdout,"\t-v <verbose level>           : 0:quiet, 1:status info (default), 2:more info\n");
     fprintf(stdout,"\n");
+    fprintf(stdout,"Batch of reconstructions with the same geometry (QGGMRF):\n");
+    fprintf(stdout,"\n");
+    fprintf(stdout,"  %s\n",ExecFileName);
+    fprintf(stdout,"\t-i <filename>[.imgparams]    : Input image parameters\n");
+    fprintf(stdout,"\t-j <filename>[.sinoparams]   : Input sinogram parameters\n");
+    fprintf(stdout,"\t-k <filename>[.reconparams]  : Reconstruction parameters\n");
+    fprintf(stdout,"\t-B <listfile>                : One job per line: <sinoBase> <reconBase> [<weightBase>]\n");
+    fprintf(stdout,"    (following are optional)\n");
+    fprintf(stdout,"\t-m, -M, -S, -q, -o, -L, -v   : as above\n");
+    fprintf(stdout,"\n");
+    fprintf(stdout,"Parameter sweep, each variant warm-started from a previous one (QGGMRF):\n");
+    fprintf(stdout,"\n");
+    fprintf(stdout,"  %s\n",ExecFileName);
+    fprintf(stdout,"\t-i, -j, -k, -s                : as above (-k gives the base parameters)\n");
+    fprintf(stdout,"\t-X <listfile>                : One variant per line: <reconBase> [<param>=<value> ...]\n");
+    fprintf(stdout,"\t                             : ** params: SigmaX p q T b_nearest b_diag b_interslice\n");
+    fprintf(stdout,"\t                             : ** StopThreshold MaxIterations Positivity RelaxFactor\n");
+    fprintf(stdout,"    (following are optional)\n");
+    fprintf(stdout,"\t-w, -t, -m, -M, -S, -q, -o, -L, -v : as above\n");
+    fprintf(stdout,"\n");
     fprintf(stdout,"Compute projection of input only:\n");
     fprintf(stdout,"\n");
     fprintf(stdout,"  %s\n",ExecFileName);
@@ -614,6 +2403,13 @@ void printCmdLineUsage(char *ExecFileName)
     fprintf(stdout,"\t-f <baseFilename>            : Output projection\n");
     fprintf(stdout,"    (following are optional)\n");
     fprintf(stdout,"\t-m <filename>[.2Dsvmatrix]   : INPUT matrix file (params must correspond!)\n");
+    fprintf(stdout,"\t-M                           : matrix-free; generate system matrix on the fly\n");
+    fprintf(stdout,"\n");
+    fprintf(stdout,"Reconstruction daemon with resident system matrices, and its client:\n");
+    fprintf(stdout,"\n");
+    fprintf(stdout,"  %s -daemon <socket> [-c <nMatrices>] [-v <verbose level>]\n",ExecFileName);
+    fprintf(stdout,"  %s -client <socket> <any of the above command lines>\n",ExecFileName);
+    fprintf(stdout,"  %s -client <socket> -stats | -shutdown\n",ExecFileName);
     fprintf(stdout,"\n");
     fprintf(stdout,"In the above arguments, the exensions given in the '[]' symbols must be part of\n");
     fprintf(stdout,"the file names but should be omitted from the command line.\n");
@@ -630,6 +2426,16 @@ void printCmdLineUsage(char *ExecFileName)
     fprintf(stdout,"leading zeros and no spaces (e.g. 0000 to 1023). The number of digits\n");
     fprintf(stdout,"is flexible (up to %d) but must be consistent.\n",MBIR_MODULAR_MAX_NUMBER_OF_SLICE_DIGITS);
     fprintf(stdout,"\n");
+    fprintf(stdout,"Alternatively the slices can be in one volume file, <baseFilename>.3Dimgdata,\n");
+    fprintf(stdout,".3Dsinodata, .3Dweightdata or .3Dprojection. Inputs are read from a volume\n");
+    fprintf(stdout,"file if there is one; -V writes outputs as volume files. To convert:\n");
+    fprintf(stdout,"\n");
+    fprintf(stdout,"  %s -convert <sinodata|weightdata|projection|imgdata> <paramsBase> <inBase> <outBase>\n",ExecFileName);
+    fprintf(stdout,"\n");
+    fprintf(stdout,"packs the slices of <inBase> given by <paramsBase>.sinoparams (.imgparams for\n");
+    fprintf(stdout,"imgdata) into <outBase>.3D<type>, or, if <inBase>.3D<type> exists, splits it\n");
+    fprintf(stdout,"into per-slice files.\n");
+    fprintf(stdout,"\n");
 }
 
 
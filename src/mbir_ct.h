@@ -15,6 +15,7 @@ struct CmdLine
     char inputProjectionFile[1024];
     char outputProjectionFile[1024];
     char ProxMapImageFile[1024];
+    char BatchFile[1024];
     /* operation flags */
     char reconFlag;              /* 0=pre-compute mode; 1=reconstruct (QGGMRF), 2=reconstruct (PandP) */
     char readInitImageFlag;
@@ -22,8 +23,41 @@ struct CmdLine
     char writeProjectionFlag;
     char readAmatrixFlag;        /* 0=compute A; 1=read A */
     char writeAmatrixFlag;
+    char matrixFreeFlag;         /* 1=generate system matrix on the fly (parallel beam only) */
+    char symmetryFlag;           /* 1=symmetry-compact system matrix (parallel beam only) */
+    int Abits;                   /* system matrix precision: 4, 8 (default) or 16 bits */
+    char viewSortFlag;           /* 1=sort views by angle into angle-coherent pieces */
+    int pieceLength;             /* views per matrix piece: 0=default, >0, AMATRIX_PIECE_AUTO/TRIAL */
+    char batchFlag;              /* 1=reconstruct the jobs listed in BatchFile together */
+    char denoiserFlag;           /* 1=Plug & Play loop with the denoiser in DenoiserLib */
+    char DenoiserLib[1024];      /* <library>[:<function>] */
+    char DenoiserArgs[1024];
+    int pnpIterations;           /* Plug & Play outer iterations */
+    char sweepFlag;              /* 1=reconstruct the parameter variants listed in SweepFile */
+    char SweepFile[1024];
+    char CheckpointFile[1024];   /* "" = no checkpoints */
+    float checkpointInterval;    /* wall-clock seconds between checkpoints */
+    char resumeFlag;             /* 1=continue from CheckpointFile */
+    int slabDepth;               /* >0: out-of-core reconstruction in z-slabs of this many slices */
+    int slabHalo;                /* extra slices either side of a slab */
+    char volumeFlag;             /* 1=write outputs as single-file volumes */
+    char ROISpec[1024];          /* "" = whole image; else the -O region of interest, see ROIMask() */
+    float freezeFraction;        /* >0: park SVs whose change stays below this fraction of StopThreshold */
+    int freezeVisits;            /* quiet visits before an SV is parked */
+    int freezeRevisit;           /* a parked SV is visited once every this many visits */
+    int multiresLevels;          /* >0: start from reconstructions on grids 2^levels..2 times coarser */
     char verboseLevel; 		/* 0: quiet mode; 1: print status output */
 };
 
 
+/* mbir_ct.c functions used by the daemon (mbir_daemon.c) */
+struct MatrixCache;
+struct MBIRContext;
+struct ImageParams3D;
+struct SinoParams3DParallel;
+struct AmatrixParams;
+int runCommand(int argc, char *argv[], struct MatrixCache *cache);
+int commandMatrixKey(int argc, char *argv[], char *key, char *matrix_fname, struct ImageParams3D *imgparams,
+    struct SinoParams3DParallel *sinoparams, struct AmatrixParams *Aparams);
+
 #endif
@@ -0,0 +1,921 @@
+#define _DEFAULT_SOURCE     /* sockets, fork, realpath, dprintf with -std=c11 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <omp.h>
+
+#include "MBIRModularDefs.h"
+#include "A_comp.h"
+#include "recon3d.h"
+#include "mbir_ct.h"
+#include "mbir_daemon.h"
+
+#define DAEMON_MAX_REQUEST 65536    /* bytes in a job request (directory and arguments) */
+#define DAEMON_REQUEST_TIMEOUT 10   /* seconds for a client to send its request */
+
+/* A submitted job: the client's working directory and mbir_ct arguments */
+struct DaemonJob
+{
+    int id;
+    int fd;                     /* client connection, receives the job output */
+    char *buf;                  /* request: cwd and arguments, NUL separated */
+    int n;                      /* bytes of the request received so far */
+    char *cwd;
+    int argc;
+    char **argv;
+    struct timeval arrival;
+    struct DaemonJob *next;
+};
+
+struct DaemonStats
+{
+    unsigned long submitted;
+    unsigned long started;
+    unsigned long completed;
+    unsigned long failed;
+    unsigned long hits;         /* jobs that found their system matrix resident */
+    unsigned long misses;
+    unsigned long evictions;
+    double waitSum, waitMax;    /* queue wait (ms) */
+    double serviceSum, serviceMax;  /* run time (ms) */
+};
+
+/* A system matrix being made resident by a loader thread before its job starts. */
+/* The file name and geometry come from the job's command line, parsed by       */
+/* daemonProbe(); the thread only reads the matrix file.                        */
+struct DaemonLoad
+{
+    pthread_t thread;
+    char key[MATRIX_KEY_LEN];
+    char fname[PATH_MAX];
+    struct ImageParams3D imgparams;
+    struct SinoParams3DParallel sinoparams;     /* ViewAngles and Aparams.viewOrder allocated */
+    struct AmatrixParams Aparams;
+    struct MBIRContext *ctx;    /* NULL if the file couldn't be read */
+    int fd[2];                  /* pipe, reaches EOF when the load is done */
+};
+
+/* Internal Functions */
+int daemonListen(char *path);
+int daemonConnect(char *path);
+int daemonWriteAll(int fd, char *buf, size_t n);
+struct DaemonJob *daemonNewJob(int fd);
+int daemonReadRequest(struct DaemonJob *job);
+void daemonFreeJob(struct DaemonJob *job);
+pid_t daemonStartJob(struct DaemonJob *job, struct MatrixCache *cache, int listenfd, int Nthreads, int *keyfd);
+int daemonProbe(struct DaemonJob *job, int listenfd, struct DaemonLoad *load);
+void daemonFreeLoad(struct DaemonLoad *load);
+void daemonEndJob(struct DaemonJob *job, int code, struct timeval *tmStart, struct DaemonStats *stats, char *note, char verboseLevel);
+void *daemonLoadThread(void *arg);
+void daemonReportStats(int fd, struct DaemonStats *stats, struct MatrixCache *cache, int Nqueued, int running, double uptime);
+void MatrixCacheInsert(struct MatrixCache *cache, char *key, struct MBIRContext *ctx, struct DaemonStats *stats, char verboseLevel);
+int MatrixCacheTouch(struct MatrixCache *cache, char *key);
+double msElapsed(struct timeval *t0, struct timeval *t1);
+void daemonSignal(int sig);
+
+volatile sig_atomic_t daemonStopFlag = 0;
+
+
+/* Cache key of a stored system matrix: the matrix file (path, time, size) */
+/* and the geometry it's used with, so a rewritten file or different view  */
+/* angles don't pick up a stale resident copy.                              */
+void MatrixCacheKey(
+    char *key,
+    char *matrix_fname,
+    struct ImageParams3D *imgparams,
+    struct SinoParams3DParallel *sinoparams)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    unsigned long long h = 1469598103934665603ULL;     /* FNV-1a of the view angles */
+    unsigned char *b = (unsigned char *) sinoparams->ViewAngles;
+    size_t i;
+
+    for(i=0; i<sinoparams->NViews*sizeof(float); i++) {
+        h ^= b[i];
+        h *= 1099511628211ULL;
+    }
+    if(realpath(matrix_fname,path) == NULL)
+        snprintf(path,sizeof(path),"%s",matrix_fname);
+    if(stat(path,&st))
+        memset(&st,0,sizeof(st));
+
+    snprintf(key,MATRIX_KEY_LEN,"%s %lld %lld %dx%d %a %a %d %d %a %a %d %016llx",
+        path,(long long)st.st_mtime,(long long)st.st_size,
+        imgparams->Nx,imgparams->Ny,imgparams->Deltaxy,imgparams->ROIRadius,
+        sinoparams->Geometry,sinoparams->NChannels,sinoparams->DeltaChannel,sinoparams->CenterOffset,
+        sinoparams->NViews,h);
+}
+
+
+/* Look up a resident matrix (in a job process) and note the key for the daemon */
+struct MBIRContext *MatrixCacheFind(struct MatrixCache *cache, char *key)
+{
+    int i;
+
+    snprintf(cache->jobKey,MATRIX_KEY_LEN,"%s",key);
+    cache->jobHit = 0;
+    for(i=0; i<cache->n; i++)
+    if(strcmp(cache->entry[i].key,key)==0)
+    {
+        cache->jobHit = 1;
+        return(cache->entry[i].ctx);
+    }
+    return(NULL);
+}
+
+
+/* Refresh the LRU position of a resident matrix; returns 0 if it isn't resident */
+int MatrixCacheTouch(struct MatrixCache *cache, char *key)
+{
+    int i;
+
+    for(i=0; i<cache->n; i++)
+    if(strcmp(cache->entry[i].key,key)==0)
+    {
+        cache->entry[i].lastUse = ++cache->clock;
+        return(1);
+    }
+    return(0);
+}
+
+
+/* Make a matrix resident, evicting the least recently used one if full */
+void MatrixCacheInsert(
+    struct MatrixCache *cache,
+    char *key,
+    struct MBIRContext *ctx,
+    struct DaemonStats *stats,
+    char verboseLevel)
+{
+    int i,k;
+
+    if(cache->n < cache->capacity)
+        k = cache->n++;
+    else
+    {
+        for(k=0,i=1; i<cache->n; i++)
+            if(cache->entry[i].lastUse < cache->entry[k].lastUse)
+                k = i;
+        if(verboseLevel)
+            fprintf(stdout,"evicting system matrix %s\n",cache->entry[k].key);
+        MBIRContextDestroy(cache->entry[k].ctx);
+        stats->evictions++;
+    }
+    snprintf(cache->entry[k].key,MATRIX_KEY_LEN,"%s",key);
+    cache->entry[k].ctx = ctx;
+    cache->entry[k].bytes = AmatrixMemory(ctx->A_Padded_Map,&ctx->imgparams,&ctx->sinoparams,ctx->svpar);
+    cache->entry[k].lastUse = ++cache->clock;
+    if(verboseLevel)
+        fprintf(stdout,"resident system matrix (%.1f MB) %s\n",cache->entry[k].bytes/1048576.0,key);
+}
+
+
+/* Reconstruction daemon: mbir_ct -daemon <socket> [-c <nMatrices>] [-v <level>]         */
+/* Clients submit mbir_ct command lines over a Unix domain socket. Jobs are queued and  */
+/* run one at a time, each in a forked process using all threads, so jobs share the    */
+/* cores without oversubscribing them. The daemon keeps an LRU set of system matrices  */
+/* that jobs read through the fork (copy-on-write) instead of from file. Before a job  */
+/* starts, a forked probe parses its command line and checks the matrix file it reads */
+/* (see daemonProbe()), so a bad job never takes the daemon down. A matrix that isn't */
+/* resident yet is then read by a loader thread while the daemon keeps serving         */
+/* requests, and the job is forked once it's in the cache.                             */
+int MBIRDaemon(int argc, char *argv[])
+{
+    struct MatrixCache cache;
+    struct DaemonStats stats;
+    struct DaemonJob *head=NULL, *tail=NULL, *running=NULL, *reading=NULL, *job, **pj, **conn=NULL;
+    struct DaemonLoad load;
+    struct timeval tm0, tmStart, tm;
+    struct sigaction sa;
+    struct pollfd *pfd=NULL;
+    char startDir[PATH_MAX], keybuf[MATRIX_KEY_LEN+2];
+    char verboseLevel=1, stopping=0, loading=0;
+    int i, n, np, status, code, listenfd, keyfd=-1, Nqueued=0, Njobs=0, Nreading=0, Npfd=0;
+    pid_t pid=0;
+
+    if(argc < 3) {
+        fprintf(stderr,"Error: usage %s -daemon <socket> [-c <nMatrices>] [-v <verbose level>]\n",argv[0]);
+        exit(-1);
+    }
+    cache.capacity = MATRIX_CACHE_DEFAULT;
+    for(i=3; i<argc; i++)
+    {
+        if(strcmp(argv[i],"-c")==0 && i+1<argc)
+            sscanf(argv[++i],"%d",&cache.capacity);
+        else if(strcmp(argv[i],"-v")==0 && i+1<argc)
+            sscanf(argv[++i],"%hhi",&verboseLevel);
+        else {
+            fprintf(stderr,"Error: unknown daemon option %s\n",argv[i]);
+            exit(-1);
+        }
+    }
+    if(cache.capacity < 0)
+        cache.capacity = 0;
+    cache.n = 0;
+    cache.clock = 0;
+    cache.entry = (struct MatrixCacheEntry *) calloc(cache.capacity+1,sizeof(struct MatrixCacheEntry));
+    memset(&stats,0,sizeof(stats));
+    if(getcwd(startDir,sizeof(startDir)) == NULL) {
+        fprintf(stderr,"Error: can't get working directory\n");
+        exit(-1);
+    }
+
+    /* The daemon itself stays single-threaded so fork() never copies a live */
+    /* OpenMP thread pool; each job gets the full thread count back.          */
+    int Nthreads = omp_get_max_threads();
+    omp_set_num_threads(1);
+
+    memset(&sa,0,sizeof(sa));
+    sa.sa_handler = daemonSignal;
+    sigaction(SIGINT,&sa,NULL);
+    sigaction(SIGTERM,&sa,NULL);
+    signal(SIGPIPE,SIG_IGN);
+
+    listenfd = daemonListen(argv[2]);
+    gettimeofday(&tm0,NULL);
+    if(verboseLevel) {
+        fprintf(stdout,"mbir_ct daemon listening on %s (%d threads per job, up to %d resident matrices)\n",argv[2],Nthreads,cache.capacity);
+        fflush(stdout);
+    }
+
+    while(!stopping || running!=NULL || head!=NULL)
+    {
+        if(daemonStopFlag)
+            stopping = 1;
+
+        /* Start the next job */
+        if(running==NULL && head!=NULL)
+        {
+            running = head;
+            head = head->next;
+            if(head == NULL)
+                tail = NULL;
+            Nqueued--;
+            gettimeofday(&tmStart,NULL);
+            double wait = msElapsed(&running->arrival,&tmStart);
+            stats.started++;
+            stats.waitSum += wait;
+            if(wait > stats.waitMax)
+                stats.waitMax = wait;
+            if(verboseLevel) {
+                fprintf(stdout,"job %d: start after %.0f ms in queue (%s):",running->id,wait,running->cwd);
+                for(i=1; i<running->argc; i++)
+                    fprintf(stdout," %s",running->argv[i]);
+                fprintf(stdout,"\n");
+                fflush(stdout);
+            }
+            if(cache.capacity>0 && daemonProbe(running,listenfd,&load))
+            {
+                if(MatrixCacheTouch(&cache,load.key)) {
+                    stats.hits++;
+                    daemonFreeLoad(&load);
+                }
+                else if(chdir(running->cwd)==0)
+                {
+                    /* the loader thread reads paths relative to the job's directory */
+                    stats.misses++;
+                    load.ctx = NULL;
+                    if(pipe(load.fd)) {
+                        fprintf(stderr,"Error: daemon can't create pipe (%s)\n",strerror(errno));
+                        exit(-1);
+                    }
+                    if(pthread_create(&load.thread,NULL,daemonLoadThread,(void *)&load) != 0) {
+                        fprintf(stderr,"Error: daemon can't create loader thread\n");
+                        exit(-1);
+                    }
+                    loading = 1;
+                }
+                else
+                    daemonFreeLoad(&load);
+            }
+            if(!loading)
+                pid = daemonStartJob(running,&cache,listenfd,Nthreads,&keyfd);
+        }
+
+        /* Drop requests not received in time, or all of them when stopping */
+        gettimeofday(&tm,NULL);
+        for(pj=&reading; *pj!=NULL; )
+        {
+            job = *pj;
+            if(stopping || msElapsed(&job->arrival,&tm) > 1000.0*DAEMON_REQUEST_TIMEOUT) {
+                *pj = job->next;
+                Nreading--;
+                close(job->fd);
+                daemonFreeJob(job);
+            }
+            else
+                pj = &job->next;
+        }
+
+        if(Nreading+2 > Npfd) {
+            Npfd = 2*(Nreading+2);
+            pfd = (struct pollfd *) realloc(pfd,Npfd*sizeof(struct pollfd));
+            conn = (struct DaemonJob **) realloc(conn,Npfd*sizeof(struct DaemonJob *));
+        }
+        np = 0;
+        if(!stopping) {
+            pfd[np].fd = listenfd;
+            pfd[np].events = POLLIN;
+            conn[np] = NULL;
+            np++;
+        }
+        if(running != NULL) {
+            pfd[np].fd = loading ? load.fd[0] : keyfd;
+            pfd[np].events = POLLIN;
+            conn[np] = NULL;
+            np++;
+        }
+        for(job=reading; job!=NULL; job=job->next) {
+            pfd[np].fd = job->fd;
+            pfd[np].events = POLLIN;
+            conn[np] = job;
+            np++;
+        }
+        if(np == 0)
+            continue;
+        /* with requests being received, wake up to time them out */
+        if(poll(pfd,np,reading!=NULL ? 1000 : -1) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            fprintf(stderr,"Error: daemon poll failed (%s)\n",strerror(errno));
+            exit(-1);
+        }
+
+        for(i=0; i<np; i++)
+        {
+            if(pfd[i].revents == 0)
+                continue;
+
+            /* New connection: its request is read as it arrives, so a slow */
+            /* client doesn't hold up the others                            */
+            if(conn[i] == NULL && pfd[i].fd == listenfd)
+            {
+                int fd = accept(listenfd,NULL,NULL);
+                if(fd < 0)
+                    continue;
+                fcntl(fd,F_SETFL,fcntl(fd,F_GETFL)|O_NONBLOCK);
+                job = daemonNewJob(fd);
+                job->next = reading;
+                reading = job;
+                Nreading++;
+                continue;
+            }
+
+            /* Request data */
+            if(conn[i] != NULL)
+            {
+                job = conn[i];
+                if((n = daemonReadRequest(job)) == 0)
+                    continue;
+                for(pj=&reading; *pj!=job; pj=&(*pj)->next)
+                    ;
+                *pj = job->next;
+                Nreading--;
+                if(n < 0) {
+                    close(job->fd);
+                    daemonFreeJob(job);
+                    continue;
+                }
+                /* the job output and replies are written blocking */
+                fcntl(job->fd,F_SETFL,fcntl(job->fd,F_GETFL)&~O_NONBLOCK);
+                if(job->argc==2 && strcmp(job->argv[1],"-stats")==0)
+                {
+                    gettimeofday(&tm,NULL);
+                    daemonReportStats(job->fd,&stats,&cache,Nqueued,running!=NULL,msElapsed(&tm0,&tm)/1000.0);
+                    close(job->fd);
+                    daemonFreeJob(job);
+                }
+                else if(job->argc==2 && strcmp(job->argv[1],"-shutdown")==0)
+                {
+                    if(verboseLevel)
+                        fprintf(stdout,"shutdown requested, %d job(s) left to run\n",Nqueued+(running!=NULL));
+                    stopping = 1;
+                    dprintf(job->fd,"%s0\n",DAEMON_STATUS);
+                    close(job->fd);
+                    daemonFreeJob(job);
+                }
+                else
+                {
+                    job->id = ++Njobs;
+                    job->next = NULL;
+                    if(tail != NULL)
+                        tail->next = job;
+                    else
+                        head = job;
+                    tail = job;
+                    Nqueued++;
+                    stats.submitted++;
+                }
+                continue;
+            }
+
+            /* Matrix loaded: make it resident and start its job */
+            if(loading)
+            {
+                char c;
+                while(read(load.fd[0],&c,1) < 0 && errno == EINTR)
+                    ;
+                pthread_join(load.thread,NULL);
+                close(load.fd[0]);
+                loading = 0;
+                if(chdir(startDir))
+                    fprintf(stderr,"Warning: can't return to %s\n",startDir);
+                if(load.ctx != NULL) {
+                    MatrixCacheInsert(&cache,load.key,load.ctx,&stats,verboseLevel);
+                    pid = daemonStartJob(running,&cache,listenfd,Nthreads,&keyfd);
+                    continue;
+                }
+                /* the file changed since daemonProbe() checked it */
+                dprintf(running->fd,"Error: can't read system matrix %s\n",load.fname);
+                daemonEndJob(running,255,&tmStart,&stats,", matrix file unreadable",verboseLevel);
+                running = NULL;
+                continue;
+            }
+
+            /* Running job finished: read the matrix key it reported, then reap it */
+            n = 0;
+            while(n < (int)sizeof(keybuf)-1) {
+                int r = read(keyfd,keybuf+n,sizeof(keybuf)-1-n);
+                if(r < 0 && errno == EINTR)
+                    continue;
+                if(r <= 0)
+                    break;
+                n += r;
+            }
+            keybuf[n] = '\0';
+            close(keyfd);
+            while(waitpid(pid,&status,0) < 0 && errno == EINTR)
+                ;
+            code = WIFEXITED(status) ? WEXITSTATUS(status) : 128+WTERMSIG(status);
+            daemonEndJob(running,code,&tmStart,&stats,
+                (code==0 && n>1) ? (keybuf[0]=='1' ? ", resident matrix" : ", matrix read from file") : "",verboseLevel);
+            running = NULL;
+        }
+    }
+
+    if(verboseLevel) {
+        gettimeofday(&tm,NULL);
+        fprintf(stdout,"mbir_ct daemon exiting: %lu jobs (%lu failed) in %.0f s\n",stats.completed,stats.failed,msElapsed(&tm0,&tm)/1000.0);
+    }
+    while(reading != NULL) {
+        job = reading;
+        reading = job->next;
+        close(job->fd);
+        daemonFreeJob(job);
+    }
+    free((void *)pfd);
+    free((void *)conn);
+    close(listenfd);
+    unlink(argv[2]);
+    for(i=0; i<cache.n; i++)
+        MBIRContextDestroy(cache.entry[i].ctx);
+    free((void *)cache.entry);
+
+    return(0);
+}
+
+
+/* Send a finished job's exit code to its client, and count and log it */
+void daemonEndJob(
+    struct DaemonJob *job,
+    int code,
+    struct timeval *tmStart,
+    struct DaemonStats *stats,
+    char *note,
+    char verboseLevel)
+{
+    struct timeval tm;
+
+    gettimeofday(&tm,NULL);
+    double service = msElapsed(tmStart,&tm);
+    stats->completed++;
+    stats->serviceSum += service;
+    if(service > stats->serviceMax)
+        stats->serviceMax = service;
+    if(code != 0)
+        stats->failed++;
+    dprintf(job->fd,"%s%d\n",DAEMON_STATUS,code);
+    close(job->fd);
+    if(verboseLevel) {
+        fprintf(stdout,"job %d: exit %d after %.0f ms%s\n",job->id,code,service,note);
+        fflush(stdout);
+    }
+    daemonFreeJob(job);
+}
+
+
+/* Run a job in a forked process with its output sent to the client. Returns */
+/* the pid; *keyfd is the read end of a pipe that gets the job's matrix key  */
+/* and reaches EOF when the job exits.                                        */
+pid_t daemonStartJob(
+    struct DaemonJob *job,
+    struct MatrixCache *cache,
+    int listenfd,
+    int Nthreads,
+    int *keyfd)
+{
+    int kp[2];
+    pid_t pid;
+
+    if(pipe(kp)) {
+        fprintf(stderr,"Error: daemon can't create pipe (%s)\n",strerror(errno));
+        exit(-1);
+    }
+    fflush(stdout);
+    if((pid = fork()) < 0) {
+        fprintf(stderr,"Error: daemon can't fork (%s)\n",strerror(errno));
+        exit(-1);
+    }
+
+    if(pid == 0)
+    {
+        int code;
+        signal(SIGPIPE,SIG_DFL);    /* client gone: stop the job */
+        signal(SIGINT,SIG_DFL);
+        signal(SIGTERM,SIG_DFL);
+        close(listenfd);
+        close(kp[0]);
+        dup2(job->fd,STDOUT_FILENO);
+        dup2(job->fd,STDERR_FILENO);
+        close(job->fd);
+        setvbuf(stdout,NULL,_IOLBF,0);
+        if(chdir(job->cwd)) {
+            fprintf(stderr,"Error: can't change to directory %s\n",job->cwd);
+            exit(-1);
+        }
+        omp_set_num_threads(Nthreads);
+        cache->jobKey[0] = '\0';
+        cache->jobHit = 0;
+        code = runCommand(job->argc,job->argv,cache);
+        if(cache->jobKey[0] != '\0')
+            dprintf(kp[1],"%d%s",cache->jobHit,cache->jobKey);
+        fflush(stdout);
+        exit(code);
+    }
+
+    close(kp[1]);
+    *keyfd = kp[0];
+    return(pid);
+}
+
+
+/* Parse a job's command line and check the stored matrix it reads, in a   */
+/* forked process so a bad command line or file can't exit the daemon.     */
+/* Returns 1 if the job reads a matrix the daemon can load, with the key,  */
+/* file name and geometry in load (see daemonFreeLoad()), 0 otherwise (the */
+/* job then runs as is and reports its own errors).                        */
+int daemonProbe(struct DaemonJob *job, int listenfd, struct DaemonLoad *load)
+{
+    int kp[2], status=-1, ok;
+    size_t n=0, size=MATRIX_KEY_LEN+PATH_MAX, len[2];
+    char *buf, *c;
+    pid_t pid;
+
+    if(pipe(kp)) {
+        fprintf(stderr,"Error: daemon can't create pipe (%s)\n",strerror(errno));
+        exit(-1);
+    }
+    fflush(stdout);
+    if((pid = fork()) < 0) {
+        fprintf(stderr,"Error: daemon can't fork (%s)\n",strerror(errno));
+        exit(-1);
+    }
+
+    if(pid == 0)
+    {
+        int fd = open("/dev/null",O_WRONLY);
+        close(listenfd);
+        close(kp[0]);
+        dup2(fd,STDOUT_FILENO);
+        dup2(fd,STDERR_FILENO);
+        if(chdir(job->cwd) || !commandMatrixKey(job->argc,job->argv,load->key,load->fname,
+                                                &load->imgparams,&load->sinoparams,&load->Aparams))
+            exit(1);
+        /* key and file name, NUL terminated, then the geometry */
+        size_t NViews = load->sinoparams.NViews;
+        if(daemonWriteAll(kp[1],load->key,strlen(load->key)+1)
+           || daemonWriteAll(kp[1],load->fname,strlen(load->fname)+1)
+           || daemonWriteAll(kp[1],(char *)&load->imgparams,sizeof(struct ImageParams3D))
+           || daemonWriteAll(kp[1],(char *)&load->sinoparams,sizeof(struct SinoParams3DParallel))
+           || daemonWriteAll(kp[1],(char *)&load->Aparams,sizeof(struct AmatrixParams))
+           || daemonWriteAll(kp[1],(char *)load->sinoparams.ViewAngles,NViews*sizeof(float))
+           || (load->Aparams.viewOrder != NULL
+               && daemonWriteAll(kp[1],(char *)load->Aparams.viewOrder,NViews*sizeof(int))))
+            exit(1);
+        exit(0);
+    }
+
+    close(kp[1]);
+    buf = (char *) malloc(size);
+    while(1) {
+        if(n == size)
+            buf = (char *) realloc(buf,size*=2);
+        ssize_t r = read(kp[0],buf+n,size-n);
+        if(r < 0 && errno == EINTR)
+            continue;
+        if(r <= 0)
+            break;
+        n += r;
+    }
+    close(kp[0]);
+    while(waitpid(pid,&status,0) < 0 && errno == EINTR)
+        ;
+
+    ok = (WIFEXITED(status) && WEXITSTATUS(status)==0);
+    c = buf;
+    len[0] = ok ? strnlen(c,n) : n;
+    len[1] = (len[0] < MATRIX_KEY_LEN && len[0] < n) ? strnlen(c+len[0]+1,n-len[0]-1) : n;
+    ok = ok && len[0] < MATRIX_KEY_LEN && len[1] < PATH_MAX && len[0]+len[1]+2 <= n;
+    if(ok)
+    {
+        memcpy(load->key,c,len[0]+1);
+        c += len[0]+1;
+        memcpy(load->fname,c,len[1]+1);
+        c += len[1]+1;
+        n -= c-buf;
+        ok = (n >= sizeof(struct ImageParams3D)+sizeof(struct SinoParams3DParallel)+sizeof(struct AmatrixParams));
+    }
+    if(ok)
+    {
+        memcpy(&load->imgparams,c,sizeof(struct ImageParams3D));
+        c += sizeof(struct ImageParams3D);
+        memcpy(&load->sinoparams,c,sizeof(struct SinoParams3DParallel));
+        c += sizeof(struct SinoParams3DParallel);
+        memcpy(&load->Aparams,c,sizeof(struct AmatrixParams));
+        c += sizeof(struct AmatrixParams);
+        n -= sizeof(struct ImageParams3D)+sizeof(struct SinoParams3DParallel)+sizeof(struct AmatrixParams);
+        size_t NViews = load->sinoparams.NViews;
+        ok = (n == NViews*(sizeof(float) + (load->Aparams.viewOrder != NULL ? sizeof(int) : 0)));
+    }
+    if(ok)
+    {
+        size_t NViews = load->sinoparams.NViews;
+        load->sinoparams.ViewAngles = (float *) malloc(NViews*sizeof(float));
+        memcpy(load->sinoparams.ViewAngles,c,NViews*sizeof(float));
+        c += NViews*sizeof(float);
+        if(load->Aparams.viewOrder != NULL) {
+            load->Aparams.viewOrder = (int *) malloc(NViews*sizeof(int));
+            memcpy(load->Aparams.viewOrder,c,NViews*sizeof(int));
+        }
+    }
+    free((void *)buf);
+    return(ok);
+}
+
+
+/* Free the view angles and view order daemonProbe() left in load */
+void daemonFreeLoad(struct DaemonLoad *load)
+{
+    free((void *)load->sinoparams.ViewAngles);
+    free((void *)load->Aparams.viewOrder);
+    load->sinoparams.ViewAngles = NULL;
+    load->Aparams.viewOrder = NULL;
+}
+
+
+/* Loader thread: reads the matrix checked by daemonProbe(). If the file has */
+/* changed since and can't be read, load->ctx is NULL and the daemon lives on */
+void *daemonLoadThread(void *arg)
+{
+    struct DaemonLoad *load = (struct DaemonLoad *) arg;
+
+    omp_set_num_threads(1);
+    MatrixCacheKey(load->key,load->fname,&load->imgparams,&load->sinoparams);
+    load->ctx = MBIRContextLoad(load->imgparams,load->sinoparams,load->fname,load->Aparams,0);
+    daemonFreeLoad(load);
+    close(load->fd[1]);
+    return(NULL);
+}
+
+
+void daemonReportStats(
+    int fd,
+    struct DaemonStats *stats,
+    struct MatrixCache *cache,
+    int Nqueued,
+    int running,
+    double uptime)
+{
+    size_t bytes=0;
+    int i;
+
+    for(i=0; i<cache->n; i++)
+        bytes += cache->entry[i].bytes;
+
+    dprintf(fd,"uptime: %.0f s\n",uptime);
+    dprintf(fd,"jobs: %lu submitted, %lu completed, %lu failed, %d queued, %d running\n",
+        stats->submitted,stats->completed,stats->failed,Nqueued,running);
+    dprintf(fd,"queue wait: mean %.1f ms, max %.1f ms\n",
+        stats->started ? stats->waitSum/stats->started : 0.0,stats->waitMax);
+    dprintf(fd,"service time: mean %.1f ms, max %.1f ms\n",
+        stats->completed ? stats->serviceSum/stats->completed : 0.0,stats->serviceMax);
+    dprintf(fd,"system matrices: %d/%d resident (%.1f MB), %lu hits, %lu misses, %lu evictions\n",
+        cache->n,cache->capacity,bytes/1048576.0,stats->hits,stats->misses,stats->evictions);
+    for(i=0; i<cache->n; i++)
+        dprintf(fd,"  %.1f MB  %s\n",cache->entry[i].bytes/1048576.0,cache->entry[i].key);
+    dprintf(fd,"%s0\n",DAEMON_STATUS);
+}
+
+
+/* Client: mbir_ct -client <socket> <mbir_ct options | -stats | -shutdown> */
+/* Sends the working directory and options, prints the job output and      */
+/* returns the job's exit code.                                            */
+int MBIRClient(int argc, char *argv[])
+{
+    char cwd[PATH_MAX], line[4096];
+    int i, fd, code=-1, lineStart=1;
+    size_t len = strlen(DAEMON_STATUS);
+    FILE *fp;
+
+    if(argc < 4) {
+        fprintf(stderr,"Error: usage %s -client <socket> <mbir_ct options | -stats | -shutdown>\n",argv[0]);
+        exit(-1);
+    }
+    if((fd = daemonConnect(argv[2])) < 0) {
+        fprintf(stderr,"Error: can't connect to mbir_ct daemon at %s\n",argv[2]);
+        exit(-1);
+    }
+    if(getcwd(cwd,sizeof(cwd)) == NULL) {
+        fprintf(stderr,"Error: can't get working directory\n");
+        exit(-1);
+    }
+    if(daemonWriteAll(fd,cwd,strlen(cwd)+1)) {
+        fprintf(stderr,"Error: can't send job to daemon\n");
+        exit(-1);
+    }
+    for(i=3; i<argc; i++)
+    if(daemonWriteAll(fd,argv[i],strlen(argv[i])+1)) {
+        fprintf(stderr,"Error: can't send job to daemon\n");
+        exit(-1);
+    }
+    shutdown(fd,SHUT_WR);
+
+    fp = fdopen(fd,"r");
+    while(fgets(line,sizeof(line),fp) != NULL)
+    {
+        if(lineStart && strncmp(line,DAEMON_STATUS,len)==0)
+            sscanf(line+len,"%d",&code);
+        else
+            fputs(line,stdout);
+        lineStart = (line[strlen(line)-1] == '\n');
+    }
+    fclose(fp);
+    if(code < 0) {
+        fprintf(stderr,"Error: lost connection to mbir_ct daemon\n");
+        exit(-1);
+    }
+
+    return(code);
+}
+
+
+int daemonListen(char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr,"Error: socket path too long: %s\n",path);
+        exit(-1);
+    }
+    if((fd = daemonConnect(path)) >= 0) {
+        fprintf(stderr,"Error: a daemon is already listening on %s\n",path);
+        exit(-1);
+    }
+    unlink(path);   /* stale socket of a daemon that didn't exit cleanly */
+
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path,path);
+    if((fd = socket(AF_UNIX,SOCK_STREAM,0)) < 0
+       || bind(fd,(struct sockaddr *)&addr,sizeof(addr))
+       || listen(fd,64))
+    {
+        fprintf(stderr,"Error: can't listen on %s (%s)\n",path,strerror(errno));
+        exit(-1);
+    }
+    return(fd);
+}
+
+
+int daemonConnect(char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if(strlen(path) >= sizeof(addr.sun_path))
+        return(-1);
+    if((fd = socket(AF_UNIX,SOCK_STREAM,0)) < 0)
+        return(-1);
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path,path);
+    if(connect(fd,(struct sockaddr *)&addr,sizeof(addr))) {
+        close(fd);
+        return(-1);
+    }
+    return(fd);
+}
+
+
+int daemonWriteAll(int fd, char *buf, size_t n)
+{
+    while(n > 0)
+    {
+        ssize_t r = write(fd,buf,n);
+        if(r < 0 && errno == EINTR)
+            continue;
+        if(r <= 0)
+            return(1);
+        buf += r;
+        n -= r;
+    }
+    return(0);
+}
+
+
+/* A job for a new connection, its request still to be read */
+struct DaemonJob *daemonNewJob(int fd)
+{
+    struct DaemonJob *job = (struct DaemonJob *) calloc(1,sizeof(struct DaemonJob));
+
+    job->fd = fd;
+    job->buf = (char *) malloc(DAEMON_MAX_REQUEST);
+    job->n = 0;
+    gettimeofday(&job->arrival,NULL);
+    return(job);
+}
+
+
+/* Read what has arrived of a request (cwd and arguments, each NUL terminated, */
+/* up to EOF) from the non-blocking connection. Returns 0 if more is to come,   */
+/* 1 once the request is complete and parsed into the job, -1 if it's bad.     */
+int daemonReadRequest(struct DaemonJob *job)
+{
+    char *buf = job->buf, *c;
+    int n = job->n, r, k, Nstr=0;
+
+    while(n < DAEMON_MAX_REQUEST && (r = read(job->fd,buf+n,DAEMON_MAX_REQUEST-n)) != 0)
+    {
+        if(r < 0 && errno == EINTR)
+            continue;
+        if(r < 0) {
+            job->n = n;
+            return((errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1);
+        }
+        n += r;
+    }
+    job->n = n;
+    if(n == 0 || n == DAEMON_MAX_REQUEST || buf[n-1] != '\0')
+        return(-1);
+    for(k=0; k<n; k++)
+        if(buf[k] == '\0')
+            Nstr++;
+
+    job->cwd = buf;
+    job->argc = Nstr;   /* argv[0] replaces the cwd */
+    job->argv = (char **) malloc((Nstr+1)*sizeof(char *));
+    job->argv[0] = "mbir_ct";
+    for(c=buf+strlen(buf)+1, k=1; k<Nstr; c+=strlen(c)+1, k++)
+        job->argv[k] = c;
+    job->argv[Nstr] = NULL;
+    gettimeofday(&job->arrival,NULL);   /* queue wait counts from here */
+
+    return(1);
+}
+
+
+void daemonFreeJob(struct DaemonJob *job)
+{
+    free((void *)job->argv);
+    free((void *)job->buf);
+    free((void *)job);
+}
+
+
+double msElapsed(struct timeval *t0, struct timeval *t1)
+{
+    return(1000.0*(t1->tv_sec-t0->tv_sec) + (t1->tv_usec-t0->tv_usec)/1000.0);
+}
+
+
+void daemonSignal(int sig)
+{
+    daemonStopFlag = 1;
+}
+
@@ -0,0 +1,47 @@
+#ifndef _MBIRDAEMON_H_
+#define _MBIRDAEMON_H_
+
+#include <stddef.h>
+#include "MBIRModularDefs.h"
+#include "recon3d.h"
+
+#define MATRIX_KEY_LEN 4400      /* path (PATH_MAX) and geometry */
+#define MATRIX_CACHE_DEFAULT 4      /* resident system matrices kept by default */
+#define DAEMON_STATUS "#mbir_ct-status "    /* last line sent to a client: exit code of the job */
+
+/* One resident system matrix; the key identifies the matrix file and geometry */
+struct MatrixCacheEntry
+{
+    char key[MATRIX_KEY_LEN];
+    struct MBIRContext *ctx;
+    size_t bytes;                   /* system matrix memory */
+    unsigned long long lastUse;     /* LRU clock */
+};
+
+/* LRU set of resident system matrices. Jobs run in forked processes that */
+/* share the daemon's copy; jobKey/jobHit report back which matrix a job  */
+/* read, and whether it was resident, for the daemon's log.               */
+struct MatrixCache
+{
+    int capacity;
+    int n;
+    struct MatrixCacheEntry *entry;
+    unsigned long long clock;
+    char jobKey[MATRIX_KEY_LEN];    /* in a job: key of the stored matrix read, "" if none */
+    char jobHit;                    /* in a job: 1 if that matrix was resident */
+};
+
+/* Functions */
+void MatrixCacheKey(
+    char *key,
+    char *matrix_fname,
+    struct ImageParams3D *imgparams,
+    struct SinoParams3DParallel *sinoparams);
+
+struct MBIRContext *MatrixCacheFind(struct MatrixCache *cache, char *key);
+
+int MBIRDaemon(int argc, char *argv[]);
+
+int MBIRClient(int argc, char *argv[]);
+
+#endif
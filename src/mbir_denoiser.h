@@ -0,0 +1,15 @@
+#ifndef _MBIRDENOISER_H_
+#define _MBIRDENOISER_H_
+
+/* Denoiser interface for the in-process Plug & Play mode (-D).              */
+/* A shared library exports a function of this type, by default named       */
+/* "mbir_denoise". It denoises in[] into out[], both Nz slices of Ny rows of */
+/* Nx pixels (image[slice][row*Nx+col], as in the image files), and returns  */
+/* 0 on success. args is the -a string ("" if not given) and iter the outer  */
+/* iteration, starting at 0. The function may use OpenMP; it's called from   */
+/* the main thread between proximal map solves.                              */
+typedef int (*MBIRDenoiser)(float *out, const float *in, int Nx, int Ny, int Nz, const char *args, int iter);
+
+#define MBIR_DENOISER_FUNCTION "mbir_denoise"
+
+#endif
@@ -15,25 +15,46 @@
 #include "A_comp.h"
 #include "initialize.h"
 #include "recon3d.h"
+#include "checkpoint.h"
 
 #define TEST
 //#define COMP_COST
 //#define COMP_RMSE
 
+#define SVPROJECT_TILE_SLABS 2      /* forward projections of up to this many slabs are tiled over SVs */
+#define SVPROJECT_PARTIAL_MB 256    /* cap on the partial sinograms of a tiled forward projection */
+
 /* Internal functions */
 void super_voxel_recon(int jj,struct SVParams svpar,unsigned long *NumUpdates,float *totalValue,float *totalChange,int iter,
-	char *phaseMap,long *order,int *indexList,float *weight,float *sinoerr,
+	char *phaseMap,long *order,int *indexList,float *weight,float *sino,float *sinoerr,
 	struct AValues_char **A_Padded_Map,float *Aval_max_ptr,struct heap_node *headNodeArray,
 	struct SinoParams3DParallel sinoparams,struct ReconParams reconparams,struct ParamExt param_ext,float *image,
-    struct ImageParams3D imgparams, float *proximalmap, char *group_array,int group_id);
-void SVproject(float *proj,float *image,struct AValues_char **A_Padded_Map,float *Aval_max_ptr,
+    struct ImageParams3D imgparams, int NzJob, float *proximalmap, char *group_array,int group_id,unsigned long long rngSeed);
+void SVproject(float *proj,float *image,float *sino,struct AValues_char **A_Padded_Map,float *Aval_max_ptr,
     struct ImageParams3D imgparams,struct SinoParams3DParallel sinoparams,struct SVParams svpar,char backproject_flag);
-void coordinateShuffle(int *order1, int *order2,int len);
-void three_way_shuffle(long *order1, char *order2, struct heap_node *headNodeArray,int len);
-float MAPCostFunction3D(float *x,float *e,float *w,struct ImageParams3D imgparams,struct SinoParams3DParallel sinoparams,
+void SVprojectResidual(float *sinoerr,float *sino,float *image,char *ImageReconMask,struct AValues_char **A_Padded_Map,
+    float *Aval_max_ptr,float **rowSum,struct ImageParams3D imgparams,struct SinoParams3DParallel sinoparams,struct SVParams svpar,char verboseLevel);
+int SVprojectPartials(int Nz, struct SinoParams3DParallel sinoparams, struct SVParams svpar);
+int SVconstantImage(float *value, float *image, char *ImageReconMask, int Nxy, int Nz);
+void SVZeroMapAdd(struct SVZeroMap *zeroMap, int z, int y, int x, int delta, struct ImageParams3D imgparams, struct SVParams svpar);
+void SVZeroMapInit(struct SVZeroMap *zeroMap, float *image, struct ImageParams3D imgparams, struct SVParams svpar);
+int SVFreezeSkip(struct SVFreeze *freeze, int id);
+void SVFreezeUpdate(struct SVFreeze *freeze, int id, float change, float value, struct SVParams svpar);
+void SVFreezeRelease(struct SVFreeze *freeze, int NsvAll);
+int SVBatchSkip(struct SVBatch *batch, int startSlice, int depth);
+void SVBatchAdd(struct SVBatch *batch, int startSlice, int depth, int *updates, float *change, float *value);
+int SVBatchJudge(struct SVBatch *batch, float StopThreshold, char needUpdates);
+int SVactiveFlags(char *active,struct AValues_char **A_Padded_Map,char *roi,struct ImageParams3D imgparams,struct SVParams svpar);
+channel_t *SVweightWindows(float *weight,struct ImageParams3D imgparams,struct SinoParams3DParallel sinoparams,struct SVParams svpar,
+    double *fraction,long *Ndead);
+unsigned int ShuffleRand(unsigned long long *state);
+void coordinateShuffle(int *order1, int *order2,int len,unsigned long long *state);
+void three_way_shuffle(long *order1, char *order2, struct heap_node *headNodeArray,int len,unsigned long long *state);
+float MAPCostFunction3D(float *x,float *e,float *w,float *y,struct ImageParams3D imgparams,struct SinoParams3DParallel sinoparams,
     struct ReconParams reconparams,struct ParamExt param_ext);
 
 
+/* Original interface, with the default system matrix options */
 void MBIRReconstruct(
     float *image,
     float *sino,
@@ -45,6 +66,178 @@ void MBIRReconstruct(
     struct ReconParams reconparams,
     char *Amatrix_fname,
     char verboseLevel)
+{
+    MBIRReconstructA(image,sino,weight,proj_init,proximalmap,imgparams,sinoparams,reconparams,Amatrix_fname,
+        AmatrixDefaultParams(),verboseLevel);
+}
+
+
+/* MBIRReconstruct() with the system matrix options in Aparams */
+void MBIRReconstructA(
+    float *image,
+    float *sino,
+    float *weight,
+    float *proj_init,
+    float *proximalmap,
+    struct ImageParams3D imgparams,
+    struct SinoParams3DParallel sinoparams,
+    struct ReconParams reconparams,
+    char *Amatrix_fname,
+    struct AmatrixParams Aparams,
+    char verboseLevel)
+{
+    MBIRReconstructBatch(image,sino,weight,proj_init,proximalmap,1,imgparams,sinoparams,reconparams,Amatrix_fname,Aparams,verboseLevel);
+}
+
+
+/* Reconstruct Nbatch data sets with the same geometry and recon parameters.  */
+/* The arrays hold the data sets one after the other (Nbatch*Nz slices), and  */
+/* are treated as one volume except that the prior doesn't couple slices of   */
+/* different data sets. The system matrix is read and laid out once. SV      */
+/* slabs only span several data sets if Nz is below the SV depth, so with    */
+/* more slices the SV visits cost the same as separate runs. Each data set   */
+/* has its own stopping test and isn't updated once it has converged.        */
+void MBIRReconstructBatch(
+    float *image,
+    float *sino,
+    float *weight,
+    float *proj_init,
+    float *proximalmap,
+    int Nbatch,
+    struct ImageParams3D imgparams,
+    struct SinoParams3DParallel sinoparams,
+    struct ReconParams reconparams,
+    char *Amatrix_fname,
+    struct AmatrixParams Aparams,
+    char verboseLevel)
+{
+    struct MBIRContext *ctx = MBIRContextCreate(imgparams,sinoparams,Amatrix_fname,Aparams,verboseLevel);
+    MBIRContextRecon(ctx,image,sino,weight,proj_init,proximalmap,imgparams.Nz,Nbatch,reconparams,verboseLevel);
+    MBIRContextDestroy(ctx);
+}
+
+
+/* Set up a reconstruction context: SV parameters, recon mask and system    */
+/* matrix (read from Amatrix_fname or computed per Aparams) stay resident   */
+/* until MBIRContextDestroy(), so repeated recon/projection calls with the  */
+/* same geometry don't reload the matrix. imgparams.Nz is not used; the     */
+/* number of slices is given with each call. A context must not be used by  */
+/* two calls at the same time.                                              */
+struct MBIRContext *MBIRContextCreate(
+    struct ImageParams3D imgparams,
+    struct SinoParams3DParallel sinoparams,
+    char *Amatrix_fname,
+    struct AmatrixParams Aparams,
+    char verboseLevel)
+{
+    struct MBIRContext *ctx = MBIRContextLoad(imgparams,sinoparams,Amatrix_fname,Aparams,verboseLevel);
+
+    if(ctx == NULL)
+        exit(-1);
+    return(ctx);
+}
+
+
+/* MBIRContextCreate() that prints the error and returns NULL instead of */
+/* exiting if the matrix file can't be used, for the daemon              */
+struct MBIRContext *MBIRContextLoad(
+    struct ImageParams3D imgparams,
+    struct SinoParams3DParallel sinoparams,
+    char *Amatrix_fname,
+    struct AmatrixParams Aparams,
+    char verboseLevel)
+{
+    int i;
+    struct MBIRContext *ctx = (struct MBIRContext *) mget_spc(1,sizeof(struct MBIRContext));
+
+    ctx->imgparams = imgparams;
+    ctx->sinoparams = sinoparams;
+    ctx->sinoparams.ViewAngles = (float *) mget_spc(sinoparams.NViews,sizeof(float));
+    for(i=0; i<sinoparams.NViews; i++)
+        ctx->sinoparams.ViewAngles[i] = sinoparams.ViewAngles[i];
+
+    initSVParams(&ctx->svpar, imgparams, sinoparams);
+    int SVLength = ctx->svpar.SVLength;
+
+    /* Allocate and generate recon mask based on ROIRadius */
+    ctx->ImageReconMask = GenImageReconMask(&imgparams);
+    ctx->rowSum = NULL;
+    ctx->checkpoint.fname[0] = '\0';
+    ctx->checkpoint.interval = 0;
+    ctx->checkpoint.resume = 0;
+    ctx->roi = NULL;
+    ctx->freeze.fraction = 0;
+    ctx->freeze.visits = 0;
+    ctx->freeze.revisit = 0;
+
+    /* Read/compute System Matrix */
+    ctx->A_Padded_Map = (struct AValues_char **)multialloc(sizeof(struct AValues_char),2,ctx->svpar.Nsv,(2*SVLength+1)*(2*SVLength+1));
+    ctx->Aval_max_ptr = (float *) mget_spc(imgparams.Nx*imgparams.Ny,sizeof(float));
+    i = AmatrixSetup(ctx->A_Padded_Map,ctx->Aval_max_ptr,&ctx->svpar,&ctx->sinoparams,&ctx->imgparams,ctx->ImageReconMask,Amatrix_fname,Aparams,verboseLevel);
+    ctx->svpar.viewOrder = NULL;    /* caller's array, only needed during setup */
+    if(i)
+    {
+        MBIRContextDestroy(ctx);
+        return(NULL);
+    }
+
+    return(ctx);
+}
+
+
+void MBIRContextDestroy(struct MBIRContext *ctx)
+{
+    int i,j;
+
+    if(ctx == NULL)
+        return;
+
+    struct SVParams svpar = ctx->svpar;
+    int SVLength = svpar.SVLength;
+
+    /* Free SV memory */
+    for(i=0;i<svpar.Nsv;i++) {
+        free((void *)svpar.bandMinMap[i].bandMin);
+        free((void *)svpar.bandMaxMap[i].bandMax);
+    }
+    free((void *)svpar.bandMinMap);
+    free((void *)svpar.bandMaxMap);
+
+    /* Free system matrix */
+    for(i=0;i<svpar.Nsv;i++)
+    for(j=0;j<(2*SVLength+1)*(2*SVLength+1);j++)
+    if(ctx->A_Padded_Map[i][j].length>0)
+    {
+        free((void *)ctx->A_Padded_Map[i][j].val);
+        free((void *)ctx->A_Padded_Map[i][j].pieceWiseMin);
+        free((void *)ctx->A_Padded_Map[i][j].pieceWiseWidth);
+    }
+    multifree(ctx->A_Padded_Map,2);
+    free((void *)ctx->Aval_max_ptr);
+    free((void *)ctx->ImageReconMask);
+    free((void *)ctx->rowSum);
+    free((void *)ctx->sinoparams.ViewAngles);
+    AmatrixOTFFree(svpar.otf);
+    AmatrixSymFree(svpar.sym);
+    free((void *)ctx);
+}
+
+
+/* Reconstruct in place with a context: Nbatch data sets of Nz slices each, */
+/* stored one after the other (see MBIRReconstructBatch). weight may be     */
+/* NULL for weightType 1-4: the weights are then computed from sino inside  */
+/* each SV, or left out of the kernel if uniform, and never stored.         */
+void MBIRContextRecon(
+    struct MBIRContext *ctx,
+    float *image,
+    float *sino,
+    float *weight,
+    float *proj_init,
+    float *proximalmap,
+    int NzJob,
+    int Nbatch,
+    struct ReconParams reconparams,
+    char verboseLevel)
 {
     float *sinoerr, *proximalmap_loc=NULL;
     int i,j,jj,p,t,iter,it_print=1;
@@ -54,6 +247,10 @@ void MBIRReconstruct(
     #endif
 
     /* image/sino/recon parameters */
+    struct ImageParams3D imgparams = ctx->imgparams;
+    struct SinoParams3DParallel sinoparams = ctx->sinoparams;
+    imgparams.Nz = NzJob*Nbatch;
+    sinoparams.NSlices = imgparams.Nz;
     int Nx = imgparams.Nx;
     int Ny = imgparams.Ny;
     int Nz = imgparams.Nz;
@@ -62,16 +259,22 @@ void MBIRReconstruct(
     int MaxIterations = reconparams.MaxIterations;
     float StopThreshold = reconparams.StopThreshold;
 
-    /* Initialize/allocate SV parameters */
-    struct AValues_char **A_Padded_Map;
-    float *Aval_max_ptr;
-    struct SVParams svpar;
-    initSVParams(&svpar, imgparams, sinoparams);
+    /* SV parameters and system matrix from the context */
+    struct AValues_char **A_Padded_Map = ctx->A_Padded_Map;
+    float *Aval_max_ptr = ctx->Aval_max_ptr;
+    char *ImageReconMask = ctx->ImageReconMask;
+    struct SVParams svpar = ctx->svpar;
+    svpar.SV_per_Z = (Nz+svpar.SVDepth-1)/svpar.SVDepth;
     int Nsv = svpar.Nsv;
     int SVLength = svpar.SVLength;
     int SV_per_Z = svpar.SV_per_Z;
     int SVsPerRow = svpar.SVsPerRow;
 
+    if(weight == NULL && reconparams.weightType == 0) {
+        fprintf(stderr,"Error in MBIRContextRecon: weightType 0 needs a weight array\n");
+        exit(-1);
+    }
+
     /* Activate proximal map mode if given as input */
     if(proximalmap != NULL)
     {
@@ -97,39 +300,44 @@ void MBIRReconstruct(
             printReconParamsQGGMRF3D(&reconparams);
         if(reconparams.ReconType == MBIR_MODULAR_RECONTYPE_PandP)
             printReconParamsPandP(&reconparams);
+        if(Nbatch > 1)
+            fprintf(stdout,"Batch of %d data sets, %d slices each\n",Nbatch,NzJob);
     }
 
-    /* Allocate and generate recon mask based on ROIRadius */
-    char * ImageReconMask = GenImageReconMask(&imgparams);
-
-    /* Read/compute/write System Matrix */
-    A_Padded_Map = (struct AValues_char **)multialloc(sizeof(struct AValues_char),2,Nsv,(2*SVLength+1)*(2*SVLength+1));
-    Aval_max_ptr = (float *) mget_spc(Nx*Ny,sizeof(float));
-    if(Amatrix_fname != NULL)
+    /* Sinogram error e = y - Ax; on resume it's read with the checkpoint */
+    char ckptFlag = (ctx->checkpoint.fname[0] != '\0');
+    char resume = ckptFlag && ctx->checkpoint.resume;
+    if(proj_init != NULL)
     {
-        if(verboseLevel)
-            fprintf(stdout,"Reading system matrix...\n");
-        readAmatrix(Amatrix_fname, A_Padded_Map, Aval_max_ptr, &imgparams, &sinoparams, svpar);
+        sinoerr = proj_init;
+        if(!resume)
+        {
+            #pragma omp parallel for
+            for(k=0; k<(size_t)Nz*Nvc; k++)
+                sinoerr[k] = sino[k]-sinoerr[k];
+        }
     }
     else
     {
-        if(verboseLevel)
-            fprintf(stdout,"Computing system matrix...\n");
-        A_comp(A_Padded_Map,Aval_max_ptr,svpar,&sinoparams,ImageReconMask,&imgparams);
+        sinoerr = (float *) mget_spc((size_t)Nz*Nvc,sizeof(float));
+        if(!resume)
+        {
+            if(verboseLevel)
+                fprintf(stdout,"Projecting image...\n");
+            SVprojectResidual(sinoerr,sino,image,ImageReconMask,A_Padded_Map,Aval_max_ptr,&ctx->rowSum,imgparams,sinoparams,svpar,verboseLevel);
+        }
     }
 
-    /* Project image for sinogram error */
-    if(proj_init != NULL)
-        sinoerr = proj_init;
-    else
+    /* Band entries where every weight is zero are left out of the SV updates */
+    if(weight != NULL)
     {
-        if(verboseLevel)
-            fprintf(stdout,"Projecting image...\n");
-        sinoerr = (float *) mget_spc((size_t)Nz*Nvc,sizeof(float));
-        SVproject(sinoerr,image,A_Padded_Map,Aval_max_ptr,imgparams,sinoparams,svpar,0);
+        double maskFraction;
+        long Ndead;
+        svpar.weightWindow = SVweightWindows(weight,imgparams,sinoparams,svpar,&maskFraction,&Ndead);
+        if(verboseLevel>1 && svpar.weightWindow != NULL)
+            fprintf(stdout,"Zero weights: %.1f%% of the SV band entries skipped, %ld view pieces fully masked\n",
+                100.0*maskFraction,Ndead);
     }
-    for(k=0; k<(size_t)Nz*Nvc; k++)
-        sinoerr[k] = sino[k]-sinoerr[k];
 
     /* Recon parameters */
     NormalizePriorWeights3D(&reconparams);
@@ -155,6 +363,35 @@ void MBIRReconstruct(
     if(ImageReconMask[j])
         NumMaskVoxels++;
 
+    /* Region of interest: only the voxels flagged in ctx->roi are updated */
+    /* and the others keep their initial value. The error sinogram is that */
+    /* of the whole image, so it stays consistent.                         */
+    float NumUpdateVoxels = (float)NumMaskVoxels*Nz;
+    if(ctx->roi != NULL)
+    {
+        double count = 0;
+        svpar.roi = ctx->roi;
+        for(k=0; k<(size_t)Nz*Nxy; k++)
+        if(ctx->roi[k] && ImageReconMask[k%Nxy])
+            count++;
+        if(count == 0) {
+            fprintf(stderr,"Error in MBIRContextRecon: region of interest is empty or outside the recon mask\n");
+            exit(-1);
+        }
+        NumUpdateVoxels = count;
+    }
+
+    /* The SV list holds only SVs with voxels to update, so empty SVs (e.g. */
+    /* the corners outside the recon mask) don't take part in the shuffle, */
+    /* the priority heap or the scheduling                                  */
+    char *svActive = (char *) mget_spc((size_t)SV_per_Z*Nsv,sizeof(char));
+    int Nlist = SVactiveFlags(svActive,A_Padded_Map,svpar.roi,imgparams,svpar);
+    if(svpar.roi != NULL && verboseLevel)
+        fprintf(stdout,"Region of interest: %.0f voxels (%.1f%% of the recon mask), %d of %d SVs\n",
+            NumUpdateVoxels,100.0*NumUpdateVoxels/((double)NumMaskVoxels*Nz),Nlist,SV_per_Z*Nsv);
+    else if(verboseLevel>1)
+        fprintf(stdout,"SV list: %d of %d SVs (%d outside the recon mask left out)\n",Nlist,SV_per_Z*Nsv,SV_per_Z*Nsv-Nlist);
+
     #ifdef COMP_RMSE
         struct Image3D Image_ref;
         Image_ref.imgparams.Nx = imgparams.Nx;
@@ -181,38 +418,40 @@ void MBIRReconstruct(
         fprintf(fp_mse,"%.2f %g %g %g\n",equits,rms_err,rms_val,rms_err/rms_val);
     #endif
 
-    order = (long *) mget_spc(Nsv*SV_per_Z,sizeof(long));
-    phaseMap = (char *) mget_spc(Nsv*SV_per_Z,sizeof(char));
+    order = (long *) mget_spc(Nlist,sizeof(long));
+    phaseMap = (char *) mget_spc(Nlist,sizeof(char));
     group_id_list = (char **) multialloc(sizeof(char),2,SV_per_Z,4);
 
     /* Order of pixel updates need NOT be raster order, just initialize */
     t=0;
+    jj=0;   /* SV of the grid, slab by slab */
     for(p=0;p<Nz;p+=svpar.SVDepth)
     for(i=0;i<Ny;i+=(SVLength*2-svpar.overlap))
     for(j=0;j<Nx;j+=(SVLength*2-svpar.overlap))
     {
-        order[t]=(long)p*Nxy+i*Nx+j;  /* order is the first voxel coordinate, not the center */
-        t++;
-    }
-
-    for(i=0;i<SV_per_Z;i++)
-    for(jj=0;jj<Nsv;jj++)
-    {
-        if((jj/SVsPerRow)%2==0)
+        if(svActive[jj])
         {
-            if((jj%SVsPerRow)%2==0)
-                phaseMap[i*Nsv+jj]=0;
-            else
-                phaseMap[i*Nsv+jj]=1;
-        }
-        else
-        {
-            if((jj%SVsPerRow)%2==0)
-                phaseMap[i*Nsv+jj]=2;
+            int sv = jj%Nsv;
+            order[t]=(long)p*Nxy+i*Nx+j;  /* order is the first voxel coordinate, not the center */
+            if((sv/SVsPerRow)%2==0)
+            {
+                if((sv%SVsPerRow)%2==0)
+                    phaseMap[t]=0;
+                else
+                    phaseMap[t]=1;
+            }
             else
-                phaseMap[i*Nsv+jj]=3;
+            {
+                if((sv%SVsPerRow)%2==0)
+                    phaseMap[t]=2;
+                else
+                    phaseMap[t]=3;
+            }
+            t++;
         }
+        jj++;
     }
+    free((void *)svActive);
 
     for(i=0;i<SV_per_Z;i++) {
         if(i%4==0){
@@ -240,31 +479,33 @@ void MBIRReconstruct(
             group_id_list[i][3]=3;
         }
     }
+    /* Shuffle RNG; like the SV order it's part of the checkpointed state */
+    unsigned long long rngSeed, rngState;
     #ifdef TEST
-    srand(0);
+    rngSeed = 0;
     #else
-    srand(time(NULL));
+    rngSeed = time(NULL);
     #endif
+    rngState = rngSeed;
 
     struct heap_node *headNodeArray;
-    headNodeArray = (struct heap_node *) mget_spc(Nsv*SV_per_Z,sizeof(struct heap_node));
+    headNodeArray = (struct heap_node *) mget_spc(Nlist,sizeof(struct heap_node));
 
-    for(i=0;i<SV_per_Z;i++)
-    for(jj=0;jj<Nsv;jj++)
+    for(jj=0;jj<Nlist;jj++)
     {
-        headNodeArray[i*Nsv+jj].pt=i*Nsv+jj;
-        headNodeArray[i*Nsv+jj].x=0.0;
+        headNodeArray[jj].pt=jj;
+        headNodeArray[jj].x=0.0;
     }
-    //int indexList_size=(int) Nsv*SV_per_Z*4*c_ratio*(1-convergence_rho);
-    int indexList_size= Nsv*SV_per_Z/4;
-    int * indexList = (int *) mget_spc(indexList_size,sizeof(int));
+    //int indexList_size=(int) Nlist*4*c_ratio*(1-convergence_rho);
+    int indexList_size= Nlist/4;
+    int * indexList = (int *) mget_spc(indexList_size+1,sizeof(int));
 
-    //coordinateShuffle(&order[0],&phaseMap[0],Nsv*SV_per_Z);
+    //coordinateShuffle(&order[0],&phaseMap[0],Nlist);
     long tmp_long;
     char tmp_char;
-    for(i=0; i<Nsv*SV_per_Z-1; i++)
+    for(i=0; i<Nlist-1; i++)
     {
-        j = i + (rand() % (Nsv*SV_per_Z-i));
+        j = i + (ShuffleRand(&rngState) % (Nlist-i));
         tmp_long = order[j];
         order[j] = order[i];
         order[i] = tmp_long;
@@ -278,13 +519,124 @@ void MBIRReconstruct(
     int startIndex=0;
     int endIndex=0;
 
-    if(verboseLevel) {
-        fprintf(stdout,"Reconstructing...\n");
-        #ifndef MSVC	/* not included in MS Visual C++ */
-        gettimeofday(&tm1,NULL);
-        #endif
+    /* Adaptive freezing: SVs whose change stays small are parked and only */
+    /* visited now and then, or when a neighbor changes a lot              */
+    struct SVFreeze freeze;
+    if(ctx->freeze.fraction > 0)
+    {
+        size_t NsvAll = (size_t)SV_per_Z*Nsv;
+        freeze.params = ctx->freeze;
+        freeze.quietThreshold = ctx->freeze.fraction*StopThreshold;
+        freeze.wakeThreshold = StopThreshold;
+        freeze.quiet = (unsigned char *) mget_spc(NsvAll,sizeof(unsigned char));
+        freeze.skipped = (unsigned char *) mget_spc(NsvAll,sizeof(unsigned char));
+        freeze.parked = (char *) mget_spc(NsvAll,sizeof(char));
+        for(k=0; k<NsvAll; k++)
+            freeze.quiet[k] = freeze.skipped[k] = freeze.parked[k] = 0;
+        freeze.visits = freeze.skips = freeze.passSkips = 0;
+        svpar.freeze = &freeze;
+    }
+
+    /* State needed to continue the run, see checkpoint.h */
+    struct ReconState state;
+    state.Nx = Nx;
+    state.Ny = Ny;
+    state.Nz = Nz;
+    state.Nvc = Nvc;
+    state.Nlist = Nlist;
+    state.image = image;
+    state.sinoerr = sinoerr;
+    state.headNodeArray = headNodeArray;
+    state.order = order;
+    state.phaseMap = phaseMap;
+    state.Nfreeze = (svpar.freeze != NULL) ? SV_per_Z*Nsv : 0;
+    if(state.Nfreeze > 0)
+    {
+        state.quiet = freeze.quiet;
+        state.skipped = freeze.skipped;
+        state.parked = freeze.parked;
+    }
+
+    if(resume)
+    {
+        if(verboseLevel)
+            fprintf(stdout,"Resuming from checkpoint %s...\n",ctx->checkpoint.fname);
+        ReadCheckpoint(ctx->checkpoint.fname,&state);
+        iter = state.iter;
+        it_print = state.it_print;
+        equits = state.equits;
+        avg_update = state.avg_update;
+        avg_update_rel = state.avg_update_rel;
+        stop_FLAG = state.stop_FLAG;
+        rngSeed = state.rngSeed;
+        rngState = state.rngState;
+        if(state.Nfreeze > 0)
+        {
+            freeze.visits = state.freezeVisits;
+            freeze.skips = state.freezeSkips;
+            freeze.passSkips = state.passSkips;
+        }
+        if(verboseLevel)
+            fprintf(stdout,"\tcontinuing after %d iterations (%.1f equivalent iterations)\n",iter,equits);
+    }
+
+    /* Checkpoints are written in the background from a snapshot of the state */
+    struct CheckpointWriter ckpt;
+    double ckptTime = 0;
+    if(ckptFlag)
+    {
+        CheckpointWriterStart(&ckpt,ctx->checkpoint.fname,&state);
+        ckptTime = omp_get_wtime();
+    }
+
+    /* With Positivity, SVs with no nonzero voxel in reach are skipped whole */
+    struct SVZeroMap zeroMap;
+    if(reconparams.Positivity && reconparams.ReconType == MBIR_MODULAR_RECONTYPE_QGGMRF_3D)
+    {
+        zeroMap.nonzero = (int *) mget_spc((size_t)SV_per_Z*Nsv,sizeof(int));
+        SVZeroMapInit(&zeroMap,image,imgparams,svpar);
+        svpar.zeroMap = &zeroMap;
+    }
+
+    /* Batch: each data set has its own stopping test, see SVBatchJudge() */
+    struct SVBatch batch;
+    if(Nbatch > 1)
+    {
+        batch.Nbatch = Nbatch;
+        batch.NzJob = NzJob;
+        batch.Ndone = 0;
+        batch.done = (char *) mget_spc(Nbatch,sizeof(char));
+        batch.visited = (char *) mget_spc(Nbatch,sizeof(char));
+        batch.updates = (unsigned long *) mget_spc(Nbatch,sizeof(unsigned long));
+        batch.change = (float *) mget_spc(Nbatch,sizeof(float));
+        batch.value = (float *) mget_spc(Nbatch,sizeof(float));
+        for(i=0; i<Nbatch; i++)
+        {
+            batch.done[i] = batch.visited[i] = 0;
+            batch.updates[i] = 0;
+            batch.change[i] = batch.value[i] = 0;
+        }
+        /* a data set with no voxel in the region of interest has nothing to do */
+        if(svpar.roi != NULL)
+        for(i=0; i<Nbatch; i++)
+        {
+            for(k=(size_t)i*NzJob*Nxy; k<(size_t)(i+1)*NzJob*Nxy; k++)
+            if(svpar.roi[k] && ImageReconMask[k%Nxy])
+                break;
+            if(k == (size_t)(i+1)*NzJob*Nxy) {
+                batch.done[i] = 1;
+                batch.Ndone++;
+            }
+        }
+        svpar.batch = &batch;
     }
 
+    if(verboseLevel)
+        fprintf(stdout,"Reconstructing...\n");
+    #ifndef MSVC	/* not included in MS Visual C++ */
+    gettimeofday(&tm1,NULL);
+    #endif
+
     // Limit threads for smaller problem size regardless of positivity constraint
     int max_threads = omp_get_max_threads();
     int max_of_num_slices_svdepth = ((Nz < SVDEPTH) ? Nz : SVDEPTH);
@@ -300,17 +652,17 @@ void MBIRReconstruct(
                 if(iter==0)
                 {
                     startIndex=0;
-                    endIndex=Nsv*SV_per_Z;
+                    endIndex=Nlist;
                 }
                 else
                 {
                     if((iter-1)%(2*rep_num)==0 && iter!=1)
-                        three_way_shuffle(&order[0],&phaseMap[0],&headNodeArray[0],Nsv*SV_per_Z);
+                        three_way_shuffle(&order[0],&phaseMap[0],&headNodeArray[0],Nlist,&rngState);
 
                     if(iter%2==1)
                     {
                         priorityheap.size=0;
-                        for(jj=0;jj<Nsv*SV_per_Z;jj++){
+                        for(jj=0;jj<Nlist;jj++){
                             heap_insert(&priorityheap, &(headNodeArray[jj]));
                         }
                         startIndex=0;
@@ -323,8 +675,8 @@ void MBIRReconstruct(
                         }
                     }
                     else {
-                        startIndex=((iter-2)/2)%rep_num*Nsv*SV_per_Z/rep_num;
-                        endIndex=(((iter-2)/2)%rep_num+1)*Nsv*SV_per_Z/rep_num;
+                        startIndex=((iter-2)/2)%rep_num*Nlist/rep_num;
+                        endIndex=(((iter-2)/2)%rep_num+1)*Nlist/rep_num;
                     }
                 }
             }
@@ -343,18 +695,18 @@ void MBIRReconstruct(
                     #pragma omp for schedule(static) reduction(+:NumUpdates) reduction(+:totalValue) reduction(+:totalChange)
                     for (jj = startIndex; jj < endIndex; jj+=1)
                         super_voxel_recon(jj,svpar,&NumUpdates,&totalValue,&totalChange,iter,
-                                &phaseMap[0],order,&indexList[0],weight,sinoerr,A_Padded_Map,&Aval_max_ptr[0],
-                                &headNodeArray[0],sinoparams,reconparams,param_ext,image,imgparams,proximalmap_loc,
-                                &group_id_list[0][0],group);
+                                &phaseMap[0],order,&indexList[0],weight,sino,sinoerr,A_Padded_Map,&Aval_max_ptr[0],
+                                &headNodeArray[0],sinoparams,reconparams,param_ext,image,imgparams,NzJob,proximalmap_loc,
+                                &group_id_list[0][0],group,rngSeed);
                 }
                 else  // iter%2==0 Homogeneous update
                 {
                     #pragma omp for schedule(dynamic) reduction(+:NumUpdates) reduction(+:totalValue) reduction(+:totalChange)
                     for (jj = startIndex; jj < endIndex; jj+=1)
                         super_voxel_recon(jj,svpar,&NumUpdates,&totalValue,&totalChange,iter,
-                                &phaseMap[0],order,&indexList[0],weight,sinoerr,A_Padded_Map,&Aval_max_ptr[0],
-                                &headNodeArray[0],sinoparams,reconparams,param_ext,image,imgparams,proximalmap_loc,
-                                &group_id_list[0][0],group);
+                                &phaseMap[0],order,&indexList[0],weight,sino,sinoerr,A_Padded_Map,&Aval_max_ptr[0],
+                                &headNodeArray[0],sinoparams,reconparams,param_ext,image,imgparams,NzJob,proximalmap_loc,
+                                &group_id_list[0][0],group,rngSeed);
                 }
             }
 
@@ -371,18 +723,44 @@ void MBIRReconstruct(
                     //printf("avg_update %f, avg_value %f, avg_update_rel %f\n",avg_update,avg_value,avg_update_rel);
                 }
                 #ifdef COMP_COST
-                float cost = MAPCostFunction3D(image,sinoerr,weight,imgparams,sinoparams,reconparams,param_ext);
+                float cost = MAPCostFunction3D(image,sinoerr,weight,sino,imgparams,sinoparams,reconparams,param_ext);
                 fprintf(stdout, "it %d cost = %-15f, avg_update %f \n", iter, cost, avg_update);
                 #endif
 
-                if (avg_update_rel < StopThreshold && (endIndex!=0))
-                    stop_FLAG = 1;
+                /* a batch stops when every data set has passed its own test; */
+                /* as below, that waits for a pass without freezing skips     */
+                if(svpar.batch != NULL)
+                {
+                    if(svpar.freeze != NULL && svpar.freeze->passSkips > 0)
+                    {
+                        SVBatchJudge(svpar.batch,-1,0);     /* clears the pass totals only */
+                        if(avg_update_rel < StopThreshold && (endIndex!=0))
+                            SVFreezeRelease(svpar.freeze,SV_per_Z*Nsv);
+                    }
+                    else if(SVBatchJudge(svpar.batch,StopThreshold,svpar.roi!=NULL))
+                        stop_FLAG = 1;
+                }
+                /* with a region of interest a pass can miss it entirely */
+                else if (avg_update_rel < StopThreshold && (endIndex!=0) && (NumUpdates>0 || svpar.roi==NULL))
+                {
+                    /* the average only covers the SVs this pass updated; if */
+                    /* it skipped parked ones, unpark all and let a pass     */
+                    /* without skips decide                                  */
+                    if(svpar.freeze != NULL && svpar.freeze->passSkips > 0)
+                        SVFreezeRelease(svpar.freeze,SV_per_Z*Nsv);
+                    else
+                        stop_FLAG = 1;
+                }
+                if(svpar.freeze != NULL)
+                    svpar.freeze->passSkips = 0;
 
                 iter++;
-                equits += (float)NumUpdates/((float)NumMaskVoxels*Nz);
+                equits += (float)NumUpdates/NumUpdateVoxels;
 
-                if(verboseLevel && equits > it_print) {
-                    fprintf(stdout,"\titeration %d, average change %.4f %%\n",it_print,avg_update_rel);
+                /* it_print is checkpointed, so it advances whether or not it's printed */
+                if(equits > it_print) {
+                    if(verboseLevel)
+                        fprintf(stdout,"\titeration %d, average change %.4f %%\n",it_print,avg_update_rel);
                     it_print++;
                 }
 
@@ -399,10 +777,72 @@ void MBIRReconstruct(
                 NumUpdates=0;
                 totalValue=0;
                 totalChange=0;
+
+                /* Snapshot for the writer if the interval is up and it's idle */
+                if(ckptFlag && omp_get_wtime()-ckptTime >= ctx->checkpoint.interval)
+                {
+                    state.iter = iter;
+                    state.it_print = it_print;
+                    state.equits = equits;
+                    state.avg_update = avg_update;
+                    state.avg_update_rel = avg_update_rel;
+                    state.stop_FLAG = stop_FLAG;
+                    state.rngSeed = rngSeed;
+                    state.rngState = rngState;
+                    if(state.Nfreeze > 0)
+                    {
+                        state.freezeVisits = freeze.visits;
+                        state.freezeSkips = freeze.skips;
+                        state.passSkips = freeze.passSkips;
+                    }
+                    if(CheckpointWriterSubmit(&ckpt,&state))
+                        ckptTime = omp_get_wtime();
+                }
             }
         }
     }
 
+    /* Convergence summary for the caller */
+    ctx->stats.iterations = iter;
+    ctx->stats.equits = equits;
+    ctx->stats.avgUpdateRel = avg_update_rel;
+    ctx->stats.converged = stop_FLAG;
+    ctx->stats.skippedVisits = 0;
+    if(svpar.freeze != NULL)
+    {
+        if(freeze.visits+freeze.skips > 0)
+            ctx->stats.skippedVisits = (float)freeze.skips/(freeze.visits+freeze.skips);
+        free((void *)freeze.quiet);
+        free((void *)freeze.skipped);
+        free((void *)freeze.parked);
+    }
+    ctx->stats.zeroVisits = 0;
+    if(svpar.zeroMap != NULL)
+    {
+        if(zeroMap.visits > 0)
+            ctx->stats.zeroVisits = (float)zeroMap.elided/zeroMap.visits;
+        free((void *)zeroMap.nonzero);
+    }
+    if(svpar.batch != NULL)
+    {
+        if(verboseLevel>1)
+            fprintf(stdout,"\tBatch: %d of %d data sets reached the stopping condition\n",batch.Ndone,Nbatch);
+        free((void *)batch.done);
+        free((void *)batch.visited);
+        free((void *)batch.updates);
+        free((void *)batch.change);
+        free((void *)batch.value);
+    }
+    ctx->stats.time_ms = 0;
+    #ifndef MSVC	/* not included in MS Visual C++ */
+    gettimeofday(&tm2,NULL);
+    ctx->stats.time_ms = 1000 * (tm2.tv_sec - tm1.tv_sec) + (tm2.tv_usec - tm1.tv_usec) / 1000;
+    #endif
+
+    /* Let a checkpoint in progress finish */
+    if(ckptFlag)
+        CheckpointWriterStop(&ckpt);
+
     if(verboseLevel)
     {
         if(StopThreshold <= 0)
@@ -416,23 +856,43 @@ void MBIRReconstruct(
             fprintf(stdout,"\tEquivalent iterations = %.1f, (non-homogeneous iterations = %d)\n",equits,iter);
             fprintf(stdout,"\tAverage update in last iteration (relative) = %f %%\n",avg_update_rel);
             fprintf(stdout,"\tAverage update in last iteration (magnitude) = %.4g\n",avg_update);
+            if(svpar.zeroMap != NULL)
+                fprintf(stdout,"\tZero SVs: %.1f%% of SV visits skipped before any buffer work (%lu of %lu)\n",
+                    100.0*ctx->stats.zeroVisits,zeroMap.elided,zeroMap.visits);
+            if(ckptFlag)
+                fprintf(stdout,"\tCheckpoints written to %s: %d (last write %.2f s)\n",ctx->checkpoint.fname,ckpt.count,ckpt.writeTime);
         }
+        if(svpar.freeze != NULL)
+            fprintf(stdout,"\tSV freezing: %.1f%% of SV visits skipped (%lu of %lu)\n",
+                100.0*ctx->stats.skippedVisits,freeze.skips,freeze.visits+freeze.skips);
         #ifndef MSVC	/* not included in MS Visual C++ */
-        gettimeofday(&tm2,NULL);
-        unsigned long long tt = 1000 * (tm2.tv_sec - tm1.tv_sec) + (tm2.tv_usec - tm1.tv_usec) / 1000;
-        printf("\tReconstruction time = %llu ms (iterations only)\n", tt);
+        printf("\tReconstruction time = %llu ms (iterations only)\n", ctx->stats.time_ms);
         #endif
     }
 
-    /* If initial projection was supplied, update to return final projection */
+    /* If initial projection was supplied, update to return final projection. */
+    /* The error isn't kept up to date where weights were masked, so there   */
+    /* the projection is recomputed.                                         */
     if(proj_init != NULL)
     {
+        float *projMasked = NULL;
+        if(svpar.weightWindow != NULL)
+        {
+            projMasked = (float *) mget_spc((size_t)Nz*Nvc,sizeof(float));
+            SVproject(projMasked,image,NULL,A_Padded_Map,Aval_max_ptr,imgparams,sinoparams,svpar,0);
+        }
+        #pragma omp parallel for
         for(k=0; k<(size_t)Nz*Nvc; k++)
-            proj_init[k] = sino[k]-sinoerr[k];
+            proj_init[k] = (projMasked != NULL && weight[k] == 0.0) ? projMasked[k] : sino[k]-sinoerr[k];
+        if(projMasked != NULL)
+            free((void *)projMasked);
     }
     else
         free((void *)sinoerr);
 
+    if(svpar.weightWindow != NULL)
+        free((void *)svpar.weightWindow);
+
     /* If local copy of proximal map was made, free it */
     if(proximalmap == image)
         free((void *)proximalmap_loc);
@@ -449,28 +909,7 @@ void MBIRReconstruct(
         fclose(fp_mse);
     #endif
 
-    /* Free SV memory */
-    for(i=0;i<Nsv;i++) {
-        free((void *)svpar.bandMinMap[i].bandMin);
-        free((void *)svpar.bandMaxMap[i].bandMax);
-    }
-    free((void *)svpar.bandMinMap);
-    free((void *)svpar.bandMaxMap);
-
-    /* Free system matrix */
-    for(i=0;i<Nsv;i++)
-    for(j=0;j<(2*SVLength+1)*(2*SVLength+1);j++)
-    if(A_Padded_Map[i][j].length>0)
-    {
-        free((void *)A_Padded_Map[i][j].val);
-        free((void *)A_Padded_Map[i][j].pieceWiseMin);
-        free((void *)A_Padded_Map[i][j].pieceWiseWidth);
-    }
-    multifree(A_Padded_Map,2);
-    free((void *)Aval_max_ptr);
-    free((void *)ImageReconMask);
-
-}   /*  END MBIRReconstruct()  */
+}   /*  END MBIRContextRecon()  */
 
 				
 void super_voxel_recon(
@@ -484,6 +923,7 @@ void super_voxel_recon(
     long *order,
     int *indexList,
     float *weight,
+    float *sino,
     float *sinoerr,
     struct AValues_char ** A_Padded_Map,
     float *Aval_max_ptr,
@@ -493,9 +933,11 @@ void super_voxel_recon(
     struct ParamExt param_ext,
     float *image,
     struct ImageParams3D imgparams,
+    int NzJob,
     float *proximalmap,
     char *group_array,
-    int group_id)
+    int group_id,
+    unsigned long long rngSeed)
 {
     int p,i,q,t,j,currentSlice;
     float *tempProxMap=NULL;
@@ -517,7 +959,7 @@ void super_voxel_recon(
     struct minStruct * bandMinMap = svpar.bandMinMap;
     struct maxStruct * bandMaxMap = svpar.bandMaxMap;
     int pieceLength = svpar.pieceLength;
-    int NViewSets = sinoparams.NViews/pieceLength;
+    int NViewSets = A_NUM_PIECES(sinoparams.NViews,pieceLength);
 
     int jj_new;
     if(iter%2==0)
@@ -540,12 +982,38 @@ void super_voxel_recon(
 
     SVPosition = jy/(2*SVLength-overlappingDistance)*SVsPerRow+jx/(2*SVLength-overlappingDistance);
 
+    int svId = startSlice/SV_depth*svpar.Nsv+SVPosition;
+    if(svpar.batch != NULL && SVBatchSkip(svpar.batch,startSlice,SV_depth_modified))
+        return;
+    if(svpar.freeze != NULL && SVFreezeSkip(svpar.freeze,svId))
+        return;
+
+    /* every voxel would be zero-skipped: skip the SV before any buffer work */
+    if(svpar.zeroMap != NULL && iter>0)
+    {
+        int nonzero;
+        #pragma omp atomic read
+        nonzero = svpar.zeroMap->nonzero[svId];
+        #pragma omp atomic
+        svpar.zeroMap->visits++;
+        if(nonzero == 0)
+        {
+            #pragma omp atomic
+            svpar.zeroMap->elided++;
+            headNodeArray[jj_new].x=0;
+            if(svpar.freeze != NULL)
+                SVFreezeUpdate(svpar.freeze,svId,0,0,svpar);
+            return;
+        }
+    }
+
     int countNumber=0;	/* number of voxels in given SV */
     int coordinateSize=(2*SVLength+1)*(2*SVLength+1);
     int * k_newCoordinate = (int *) mget_spc(coordinateSize,sizeof(int));
     int * j_newCoordinate = (int *) mget_spc(coordinateSize,sizeof(int));
     int j_newAA,k_newAA;
     int voxelIncrement=0;
+    int maxLength=0;
 
     /* choosing the voxels locations in an SV */
     for(j_newAA=jy;j_newAA<=(jy+2*SVLength);j_newAA++)
@@ -555,6 +1023,8 @@ void super_voxel_recon(
                 j_newCoordinate[countNumber]=j_newAA;
                 k_newCoordinate[countNumber]=k_newAA;
                 countNumber++;
+                if(A_Padded_Map[SVPosition][voxelIncrement].length > maxLength)
+                    maxLength = A_Padded_Map[SVPosition][voxelIncrement].length;
             }
         }
         voxelIncrement++;
@@ -568,7 +1038,9 @@ void super_voxel_recon(
         return;
     }
 
-    coordinateShuffle(&j_newCoordinate[0],&k_newCoordinate[0],countNumber);
+    /* Voxel order within the SV; seeded per SV visit so it doesn't depend on thread scheduling */
+    unsigned long long rngState = rngSeed ^ ((unsigned long long)iter << 32 | (unsigned int)jj_new);
+    coordinateShuffle(&j_newCoordinate[0],&k_newCoordinate[0],countNumber,&rngState);
 
     /*XW: for a supervoxel, bandMin records the starting position of the sinogram band at each view*/
     /*XW: for a supervoxel, bandMax records the end position of the sinogram band at each view */
@@ -576,6 +1048,9 @@ void super_voxel_recon(
     channel_t * bandMax = (channel_t *) mget_spc(sinoparams.NViews,sizeof(channel_t));
     channel_t * bandWidthTemp = (channel_t *) mget_spc(sinoparams.NViews,sizeof(channel_t));
     channel_t * bandWidth = (channel_t *) mget_spc(NViewSets,sizeof(channel_t));
+    int * PL = (int *) mget_spc(NViewSets,sizeof(int));   /* views per piece, last may be short */
+    for (p = 0; p < NViewSets; p++)
+        PL[p] = A_PIECE_LENGTH(p,sinoparams.NViews,pieceLength);
 
     memcpy(&bandMin[0],&bandMinMap[SVPosition].bandMin[0],sizeof(channel_t)*(sinoparams.NViews));
     memcpy(&bandMax[0],&bandMaxMap[SVPosition].bandMax[0],sizeof(channel_t)*(sinoparams.NViews));
@@ -587,21 +1062,46 @@ void super_voxel_recon(
     for (p = 0; p < NViewSets; p++)
     {
         int bandWidthMax=bandWidthTemp[p*pieceLength];
-        for(t=0;t<pieceLength;t++){
+        for(t=0;t<PL[p];t++){
             if(bandWidthTemp[p*pieceLength+t]>bandWidthMax)
                 bandWidthMax=bandWidthTemp[p*pieceLength+t];
         }
         bandWidth[p]=bandWidthMax;
     }
 
+    /* Window [liveLo,liveHi) of each piece's band holding its nonzero weights; */
+    /* empty if the piece is fully masked (see SVweightWindows())              */
+    channel_t * liveLo = (channel_t *) mget_spc(NViewSets,sizeof(channel_t));
+    channel_t * liveHi = (channel_t *) mget_spc(NViewSets,sizeof(channel_t));
+    for (p = 0; p < NViewSets; p++)
+    {
+        if(svpar.weightWindow != NULL) {
+            channel_t *window = &svpar.weightWindow[(((size_t)(startSlice/SV_depth)*svpar.Nsv+SVPosition)*NViewSets+p)*2];
+            liveLo[p] = window[0];
+            liveHi[p] = window[1];
+        }
+        else {
+            liveLo[p] = 0;
+            liveHi[p] = bandWidth[p];
+        }
+    }
+
+    /* Weights: gathered from weight[]; or, without a weight array, computed */
+    /* from the gathered sinogram band (analytic weightType 2-4), or uniform  */
+    /* and applied after the sums (uniformW, no W in the kernel)              */
+    char uniformW = (weight == NULL && (reconparams.weightType < 2 || reconparams.weightType > 4));
+    float wUniform = 1.0f/(reconparams.SigmaY*reconparams.SigmaY);
+    float *wSource = (weight != NULL) ? weight : sino;
+
     float ** newWArray = (float **)malloc(sizeof(float *) * NViewSets);
     float ** newEArray = (float **)malloc(sizeof(float *) * NViewSets);
     float ** CopyNewEArray = (float **)malloc(sizeof(float *) * NViewSets);
 
     for (p = 0; p < NViewSets; p++) {
-        newWArray[p] = (float *)malloc(sizeof(float)*bandWidth[p]*pieceLength*SV_depth_modified);
-        newEArray[p] = (float *)malloc(sizeof(float)*bandWidth[p]*pieceLength*SV_depth_modified);
-        CopyNewEArray[p] = (float *)malloc(sizeof(float)*bandWidth[p]*pieceLength*SV_depth_modified);
+        char live = (liveHi[p] > liveLo[p]);
+        newWArray[p] = (uniformW || !live) ? NULL : (float *)malloc(sizeof(float)*bandWidth[p]*PL[p]*SV_depth_modified);
+        newEArray[p] = !live ? NULL : (float *)malloc(sizeof(float)*bandWidth[p]*PL[p]*SV_depth_modified);
+        CopyNewEArray[p] = !live ? NULL : (float *)malloc(sizeof(float)*bandWidth[p]*PL[p]*SV_depth_modified);
     }
 
     float *newWArrayPointer;
@@ -613,51 +1113,65 @@ void super_voxel_recon(
 
     /*XW: copy the interlaced we into the memory buffer*/
     for (p = 0; p < NViewSets; p++)
+    if(liveHi[p] > liveLo[p])
     {
-        newWArrayPointer=&newWArray[p][0];
+        int liveWidth = liveHi[p]-liveLo[p];
+        newWArrayPointer=newWArray[p];
         newEArrayPointer=&newEArray[p][0];
         for(i=0;i<SV_depth_modified;i++)
-        for(q=0;q<pieceLength;q++)
+        for(q=0;q<PL[p];q++)
         {
-            memcpy(newWArrayPointer,&weight[(size_t)(startSlice+i)*Nvc+p*pieceLength*sinoparams.NChannels+q*sinoparams.NChannels+bandMin[p*pieceLength+q]],sizeof(float)*(bandWidth[p]));
-            memcpy(newEArrayPointer,&sinoerr[(size_t)(startSlice+i)*Nvc+p*pieceLength*sinoparams.NChannels+q*sinoparams.NChannels+bandMin[p*pieceLength+q]],sizeof(float)*(bandWidth[p]));
-            newWArrayPointer+=bandWidth[p];
+            size_t offset = (size_t)(startSlice+i)*Nvc+p*pieceLength*sinoparams.NChannels+q*sinoparams.NChannels+bandMin[p*pieceLength+q]+liveLo[p];
+            if(!uniformW)
+            {
+                memcpy(newWArrayPointer+liveLo[p],&wSource[offset],sizeof(float)*liveWidth);
+                newWArrayPointer+=bandWidth[p];
+            }
+            memcpy(newEArrayPointer+liveLo[p],&sinoerr[offset],sizeof(float)*liveWidth);
             newEArrayPointer+=bandWidth[p];
         }
+        if(weight == NULL && !uniformW)
+            SinoWeightsFromData(newWArray[p],newWArray[p],(size_t)bandWidth[p]*PL[p]*SV_depth_modified,reconparams);
     }
 
     for (p = 0; p < NViewSets; p++)
-        memcpy(&CopyNewEArray[p][0],&newEArray[p][0],sizeof(float)*bandWidth[p]*pieceLength*SV_depth_modified);
+    if(liveHi[p] > liveLo[p])
+        memcpy(&CopyNewEArray[p][0],&newEArray[p][0],sizeof(float)*bandWidth[p]*PL[p]*SV_depth_modified);
 
     newWArrayTransposed = (float **)malloc(sizeof(float *) * NViewSets);
     newEArrayTransposed = (float **)malloc(sizeof(float *) * NViewSets);
 
     for (p = 0; p < NViewSets; p++)
     {
-        newWArrayTransposed[p] = (float *)malloc(sizeof(float)*bandWidth[p]*pieceLength*SV_depth_modified);
-        newEArrayTransposed[p] = (float *)malloc(sizeof(float)*bandWidth[p]*pieceLength*SV_depth_modified);
+        char live = (liveHi[p] > liveLo[p]);
+        newWArrayTransposed[p] = (uniformW || !live) ? NULL : (float *)malloc(sizeof(float)*bandWidth[p]*PL[p]*SV_depth_modified);
+        newEArrayTransposed[p] = !live ? NULL : (float *)malloc(sizeof(float)*bandWidth[p]*PL[p]*SV_depth_modified);
     }
 
     for (p = 0; p < NViewSets; p++)
+    if(liveHi[p] > liveLo[p])
     for(currentSlice=0;currentSlice<(SV_depth_modified);currentSlice++) 
     {
-        WTransposeArrayPointer=&newWArrayTransposed[p][currentSlice*bandWidth[p]*pieceLength];
-        ETransposeArrayPointer=&newEArrayTransposed[p][currentSlice*bandWidth[p]*pieceLength];
-        newEArrayPointer=&newEArray[p][currentSlice*bandWidth[p]*pieceLength];
-        newWArrayPointer=&newWArray[p][currentSlice*bandWidth[p]*pieceLength];
-        for(q=0;q<bandWidth[p];q++)
+        ETransposeArrayPointer=&newEArrayTransposed[p][currentSlice*bandWidth[p]*PL[p]];
+        newEArrayPointer=&newEArray[p][currentSlice*bandWidth[p]*PL[p]];
+        for(q=liveLo[p];q<liveHi[p];q++)
         {
             #pragma vector aligned
-            for(t=0;t<pieceLength;t++)
-            {
-                ETransposeArrayPointer[q*pieceLength+t]=newEArrayPointer[bandWidth[p]*t+q];
-                WTransposeArrayPointer[q*pieceLength+t]=newWArrayPointer[bandWidth[p]*t+q];
-            }
+            for(t=0;t<PL[p];t++)
+                ETransposeArrayPointer[q*PL[p]+t]=newEArrayPointer[bandWidth[p]*t+q];
+        }
+        if(uniformW)
+            continue;
+        WTransposeArrayPointer=&newWArrayTransposed[p][currentSlice*bandWidth[p]*PL[p]];
+        newWArrayPointer=&newWArray[p][currentSlice*bandWidth[p]*PL[p]];
+        for(q=liveLo[p];q<liveHi[p];q++)
+        {
+            #pragma vector aligned
+            for(t=0;t<PL[p];t++)
+                WTransposeArrayPointer[q*PL[p]+t]=newWArrayPointer[bandWidth[p]*t+q];
         }
     }
 
-    WTransposeArrayPointer=&newWArrayTransposed[0][0];
-    ETransposeArrayPointer=&newEArrayTransposed[0][0];
     newEArrayPointer=&newEArray[0][0];
 
     for (p = 0; p < NViewSets; p++)
@@ -678,6 +1192,18 @@ void super_voxel_recon(
     char * zero_skip_FLAG = (char *) mget_spc(SV_depth_modified,sizeof(char));
     if(reconparams.ReconType == MBIR_MODULAR_RECONTYPE_PandP)
         tempProxMap = (float *) mget_spc(SV_depth_modified,sizeof(float));
+    int * sliceUpdates = NULL;     /* per slice totals for the batch stopping test */
+    float * sliceChange = NULL;
+    float * sliceValue = NULL;
+    if(svpar.batch != NULL)
+    {
+        sliceUpdates = (int *) get_spc(SV_depth_modified,sizeof(int));
+        sliceChange = (float *) get_spc(SV_depth_modified,sizeof(float));
+        sliceValue = (float *) get_spc(SV_depth_modified,sizeof(float));
+    }
+    const int Abytes = A_KERNEL_BYTES(svpar.Abits);
+    const double Ascale = 1.0/((1<<svpar.Abits)-1);
+    unsigned char * A_scratch = (unsigned char *) mget_spc(maxLength,Abytes);
 
     for(i=0;i<countNumber;i++)
     {
@@ -689,7 +1215,8 @@ void super_voxel_recon(
             THETA1[p]=THETA2[p]=0.0;
 
         int theVoxelPosition=(j_new-jy)*(2*SVLength+1)+(k_new-jx);
-        unsigned char * A_padd_Tranpose_pointer = &A_Padded_Map[SVPosition][theVoxelPosition].val[0];
+        unsigned char * A_footprint = A_getFootprint(A_scratch,&A_Padded_Map[SVPosition][theVoxelPosition],bandMin,j_new,k_new,Aval_max,svpar);
+        unsigned char * A_padd_Tranpose_pointer = A_footprint;
 
         for(currentSlice=0;currentSlice<SV_depth_modified;currentSlice++)
         {
@@ -701,12 +1228,13 @@ void super_voxel_recon(
             {
                 ExtractNeighbors3D(&neighbors[currentSlice][0],k_new,j_new,&image[(size_t)(startSlice+currentSlice)*Nxy],imgparams);
 
-                if((startSlice+currentSlice)==0)
+                /* first/last slice of a data set: no interslice neighbor */
+                if((startSlice+currentSlice)%NzJob==0)
                     neighbors[currentSlice][8]=0.0;
                 else
                     neighbors[currentSlice][8]=image[(size_t)(startSlice+currentSlice-1)*Nxy + j_new*Nx+k_new];
 
-                if((startSlice+currentSlice)<(Nz-1))
+                if((startSlice+currentSlice)%NzJob<(NzJob-1))
                     neighbors[currentSlice][9]=image[(size_t)(startSlice+currentSlice+1)*Nxy + j_new*Nx+k_new];
                 else
                     neighbors[currentSlice][9]=0.0;
@@ -727,46 +1255,97 @@ void super_voxel_recon(
             }
             if(reconparams.ReconType == MBIR_MODULAR_RECONTYPE_PandP)
                 tempProxMap[currentSlice] = proximalmap[(startSlice+currentSlice)*Nxy + j_new*Nx+k_new];
+
+            /* voxels outside the region of interest are frozen */
+            if(svpar.roi != NULL && !svpar.roi[(size_t)(startSlice+currentSlice)*Nxy + j_new*Nx+k_new])
+                zero_skip_FLAG[currentSlice] = 1;
+
+            /* so are those of a data set that has converged */
+            if(svpar.batch != NULL && svpar.batch->done[(startSlice+currentSlice)/NzJob])
+                zero_skip_FLAG[currentSlice] = 1;
         }
 
-        A_padd_Tranpose_pointer = &A_Padded_Map[SVPosition][theVoxelPosition].val[0];
+        A_padd_Tranpose_pointer = A_footprint;
 
         for(p=0;p<NViewSets;p++)
         {
             int myCount=A_Padded_Map[SVPosition][theVoxelPosition].pieceWiseWidth[p];
             int pieceMin=A_Padded_Map[SVPosition][theVoxelPosition].pieceWiseMin[p];
+            /* footprint clipped to the nonzero-weight window */
+            int c0 = (pieceMin > liveLo[p]) ? pieceMin : liveLo[p];
+            int c1 = (pieceMin+myCount < liveHi[p]) ? pieceMin+myCount : liveHi[p];
+            int n = (c1 > c0) ? (c1-c0)*PL[p] : 0;
+            unsigned char * Apiece = A_padd_Tranpose_pointer + (size_t)(c0-pieceMin)*PL[p]*Abytes;
             #pragma vector aligned
             for(currentSlice=0;currentSlice<SV_depth_modified;currentSlice++)
-            if(zero_skip_FLAG[currentSlice] == 0)
+            if(zero_skip_FLAG[currentSlice] == 0 && n > 0)
             {
-                WTransposeArrayPointer=&newWArrayTransposed[p][currentSlice*bandWidth[p]*pieceLength];
-                ETransposeArrayPointer=&newEArrayTransposed[p][currentSlice*bandWidth[p]*pieceLength];
-                WTransposeArrayPointer+=pieceMin*pieceLength;
-                ETransposeArrayPointer+=pieceMin*pieceLength;
+                ETransposeArrayPointer=&newEArrayTransposed[p][currentSlice*bandWidth[p]*PL[p]];
+                ETransposeArrayPointer+=c0*PL[p];
                 float tempTHETA1=0.0;
                 float tempTHETA2=0.0;
                 //Not finding evidence this makes a difference --SJK
                 //Deprecated by Intel anyway
                 //#pragma vector aligned
                 //#pragma simd reduction(+:tempTHETA2,tempTHETA1)
-                for(t=0;t<myCount*pieceLength;t++)
+                if(uniformW)
+                {
+                    /* W = wUniform is applied to THETA1/2 below */
+                    if(Abytes == 2)
+                    {
+                        unsigned short * A16 = (unsigned short *) Apiece;
+                        for(t=0;t<n;t++)
+                        {
+                            tempTHETA1 += (float)A16[t]*ETransposeArrayPointer[t];
+                            tempTHETA2 += (float)A16[t]*A16[t];
+                        }
+                    }
+                    else
+                    for(t=0;t<n;t++)
+                    {
+                        tempTHETA1 += Apiece[t]*ETransposeArrayPointer[t];
+                        tempTHETA2 += Apiece[t]*Apiece[t];
+                    }
+                    THETA1[currentSlice]+=tempTHETA1;
+                    THETA2[currentSlice]+=tempTHETA2;
+                    continue;
+                }
+                WTransposeArrayPointer=&newWArrayTransposed[p][currentSlice*bandWidth[p]*PL[p]];
+                WTransposeArrayPointer+=c0*PL[p];
+                if(Abytes == 2)
+                {
+                    unsigned short * A16 = (unsigned short *) Apiece;
+                    for(t=0;t<n;t++)
+                    {
+                        tempTHETA1 += A16[t]*WTransposeArrayPointer[t]*ETransposeArrayPointer[t];
+                        tempTHETA2 += A16[t]*WTransposeArrayPointer[t]*A16[t];
+                    }
+                }
+                else
+                for(t=0;t<n;t++)
                 {	/* summing over voxels which are not skipped or masked*/
-                    tempTHETA1 += A_padd_Tranpose_pointer[t]*WTransposeArrayPointer[t]*ETransposeArrayPointer[t];
-                    tempTHETA2 += A_padd_Tranpose_pointer[t]*WTransposeArrayPointer[t]*A_padd_Tranpose_pointer[t];
+                    tempTHETA1 += Apiece[t]*WTransposeArrayPointer[t]*ETransposeArrayPointer[t];
+                    tempTHETA2 += Apiece[t]*WTransposeArrayPointer[t]*Apiece[t];
                 }
                 THETA1[currentSlice]+=tempTHETA1;
                 THETA2[currentSlice]+=tempTHETA2;
             }
-            A_padd_Tranpose_pointer += myCount*pieceLength;
+            A_padd_Tranpose_pointer += myCount*PL[p]*Abytes;
         }
 
+        if(uniformW)
+        for(currentSlice=0;currentSlice<SV_depth_modified;currentSlice++)
+        {
+            THETA1[currentSlice]*=wUniform;
+            THETA2[currentSlice]*=wUniform;
+        }
         for(currentSlice=0;currentSlice<SV_depth_modified;currentSlice++)
         {
-            THETA1[currentSlice]=-THETA1[currentSlice]*Aval_max*(1.0/255);
-            THETA2[currentSlice]=THETA2[currentSlice]*Aval_max*(1.0/255)*Aval_max*(1.0/255);
+            THETA1[currentSlice]=-THETA1[currentSlice]*Aval_max*Ascale;
+            THETA2[currentSlice]=THETA2[currentSlice]*Aval_max*Ascale*Aval_max*Ascale;
         }
 
-        A_padd_Tranpose_pointer = &A_Padded_Map[SVPosition][theVoxelPosition].val[0];
+        A_padd_Tranpose_pointer = A_footprint;
         ETransposeArrayPointer = &newEArrayTransposed[0][0];
 
         for(currentSlice=0;currentSlice<SV_depth_modified;currentSlice++)
@@ -796,29 +1375,54 @@ void super_voxel_recon(
 
             diff[currentSlice] = image[(size_t)(startSlice+currentSlice)*Nxy + j_new*Nx+k_new] - tempV[currentSlice];
 
+            if(svpar.zeroMap != NULL && diff[currentSlice] != 0)
+            {
+                char wasZero = (tempV[currentSlice] == 0);
+                char isZero = (image[(size_t)(startSlice+currentSlice)*Nxy + j_new*Nx+k_new] == 0);
+                if(wasZero != isZero)
+                    SVZeroMapAdd(svpar.zeroMap,startSlice+currentSlice,j_new,k_new,isZero ? -1 : 1,imgparams,svpar);
+            }
+
             totalChange_loc += fabs(diff[currentSlice]);
             totalValue_loc += fabs(tempV[currentSlice]);
             NumUpdates_loc++;
+            if(svpar.batch != NULL)
+            {
+                sliceChange[currentSlice] += fabs(diff[currentSlice]);
+                sliceValue[currentSlice] += fabs(tempV[currentSlice]);
+                sliceUpdates[currentSlice]++;
+            }
 
-            diff[currentSlice]=diff[currentSlice]*Aval_max*(1.0/255);
+            diff[currentSlice]=diff[currentSlice]*Aval_max*Ascale;
         }
 
         for(p=0;p<NViewSets;p++)
         {
             int myCount=A_Padded_Map[SVPosition][theVoxelPosition].pieceWiseWidth[p];
             int pieceMin=A_Padded_Map[SVPosition][theVoxelPosition].pieceWiseMin[p];
+            int c0 = (pieceMin > liveLo[p]) ? pieceMin : liveLo[p];
+            int c1 = (pieceMin+myCount < liveHi[p]) ? pieceMin+myCount : liveHi[p];
+            int n = (c1 > c0) ? (c1-c0)*PL[p] : 0;
+            unsigned char * Apiece = A_padd_Tranpose_pointer + (size_t)(c0-pieceMin)*PL[p]*Abytes;
             #pragma vector aligned
             for(currentSlice=0;currentSlice<SV_depth_modified;currentSlice++)
-            if(fabsf(diff[currentSlice])>0 && zero_skip_FLAG[currentSlice] == 0)
+            if(fabsf(diff[currentSlice])>0 && zero_skip_FLAG[currentSlice] == 0 && n > 0)
             {
-                ETransposeArrayPointer=&newEArrayTransposed[p][currentSlice*bandWidth[p]*pieceLength];
-                ETransposeArrayPointer+=pieceMin*pieceLength;
+                ETransposeArrayPointer=&newEArrayTransposed[p][currentSlice*bandWidth[p]*PL[p]];
+                ETransposeArrayPointer+=c0*PL[p];
 
+                if(Abytes == 2)
+                {
+                    unsigned short * A16 = (unsigned short *) Apiece;
+                    for(t=0;t<n;t++)
+                        ETransposeArrayPointer[t]= ETransposeArrayPointer[t]-A16[t]*diff[currentSlice];
+                }
+                else
                 #pragma vector aligned
-                for(t=0;t<(myCount*pieceLength);t++)
-                    ETransposeArrayPointer[t]= ETransposeArrayPointer[t]-A_padd_Tranpose_pointer[t]*diff[currentSlice];
+                for(t=0;t<n;t++)
+                    ETransposeArrayPointer[t]= ETransposeArrayPointer[t]-Apiece[t]*diff[currentSlice];
             }
-            A_padd_Tranpose_pointer+=myCount*pieceLength;
+            A_padd_Tranpose_pointer+=myCount*PL[p]*Abytes;
         }
     }
 
@@ -830,6 +1434,14 @@ void super_voxel_recon(
     free((void *)zero_skip_FLAG);
     if(reconparams.ReconType == MBIR_MODULAR_RECONTYPE_PandP)
         free((void *)tempProxMap);
+    if(svpar.batch != NULL)
+    {
+        SVBatchAdd(svpar.batch,startSlice,SV_depth_modified,sliceUpdates,sliceChange,sliceValue);
+        free((void *)sliceUpdates);
+        free((void *)sliceChange);
+        free((void *)sliceValue);
+    }
+    free((void *)A_scratch);
 
     for (p = 0; p < NViewSets; p++)
         free((void *)newWArrayTransposed[p]);
@@ -839,15 +1451,16 @@ void super_voxel_recon(
     free((void *)j_newCoordinate);
 
     for (p = 0; p < NViewSets; p++)
+    if(liveHi[p] > liveLo[p])
     for(currentSlice=0;currentSlice<SV_depth_modified;currentSlice++)
     {
-        ETransposeArrayPointer=&newEArrayTransposed[p][currentSlice*bandWidth[p]*pieceLength];
-        newEArrayPointer=&newEArray[p][currentSlice*bandWidth[p]*pieceLength];
-        for(q=0;q<bandWidth[p];q++)
+        ETransposeArrayPointer=&newEArrayTransposed[p][currentSlice*bandWidth[p]*PL[p]];
+        newEArrayPointer=&newEArray[p][currentSlice*bandWidth[p]*PL[p]];
+        for(q=liveLo[p];q<liveHi[p];q++)
         {
             #pragma vector aligned
-            for(t=0;t<pieceLength;t++)
-                newEArrayPointer[bandWidth[p]*t+q]=ETransposeArrayPointer[q*pieceLength+t];
+            for(t=0;t<PL[p];t++)
+                newEArrayPointer[bandWidth[p]*t+q]=ETransposeArrayPointer[q*PL[p]+t];
         }
     }
 
@@ -856,6 +1469,7 @@ void super_voxel_recon(
     free((void **)newEArrayTransposed);
 
     for (p = 0; p < NViewSets; p++)      /*XW: update the error term in the memory buffer*/
+    if(liveHi[p] > liveLo[p])
     {
         float *CopyNewEArrayPointer;
         float *eArrayPointer;
@@ -864,17 +1478,16 @@ void super_voxel_recon(
         for (currentSlice=0; currentSlice< SV_depth_modified;currentSlice++)
         {
             //#pragma vector aligned
-            for(q=0;q<pieceLength;q++)
+            for(q=0;q<PL[p];q++)
             {
                 eArrayPointer=&sinoerr[(size_t)(startSlice+currentSlice)*Nvc+p*pieceLength*sinoparams.NChannels+q*sinoparams.NChannels+bandMin[p*pieceLength+q]];
-                for(t=0;t<bandWidth[p];t++)
+                for(t=liveLo[p];t<liveHi[p];t++)
                 {
                     #pragma omp atomic
-                    *eArrayPointer += (*newEArrayPointer)-(*CopyNewEArrayPointer);
-                    newEArrayPointer++;
-                    CopyNewEArrayPointer++;
-                    eArrayPointer++;
+                    eArrayPointer[t] += newEArrayPointer[t]-CopyNewEArrayPointer[t];
                 }
+                newEArrayPointer+=bandWidth[p];
+                CopyNewEArrayPointer+=bandWidth[p];
             }
         }
     }
@@ -889,9 +1502,14 @@ void super_voxel_recon(
     free((void *)bandMin);
     free((void *)bandMax);
     free((void *)bandWidth);
+    free((void *)PL);
     free((void *)bandWidthTemp);
+    free((void *)liveLo);
+    free((void *)liveHi);
 
     headNodeArray[jj_new].x=totalChange_loc;
+    if(svpar.freeze != NULL)
+        SVFreezeUpdate(svpar.freeze,svId,totalChange_loc,totalValue_loc,svpar);
     *NumUpdates += NumUpdates_loc;
     *totalValue += totalValue_loc;
     *totalChange += totalChange_loc;
@@ -901,13 +1519,23 @@ void super_voxel_recon(
 
 
 
-void coordinateShuffle(int *order1, int *order2,int len)
+/* Random numbers for the shuffles (splitmix64, upper 32 bits). The state */
+/* is explicit so a checkpointed run can continue the same sequence.       */
+unsigned int ShuffleRand(unsigned long long *state)
+{
+    unsigned long long z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return (unsigned int)((z ^ (z >> 31)) >> 32);
+}
+
+void coordinateShuffle(int *order1, int *order2,int len,unsigned long long *state)
 {
 	int i, j, tmp1,tmp2;
 
 	for (i = 0; i < len-1; i++)
 	{
-		j = i + (rand() % (len-i));
+		j = i + (ShuffleRand(state) % (len-i));
 		tmp1 = order1[j];
 		tmp2 = order2[j];
 		order1[j] = order1[i];
@@ -917,7 +1545,7 @@ void coordinateShuffle(int *order1, int *order2,int len)
 	}
 }
 
-void three_way_shuffle(long *order1, char *order2, struct heap_node *headNodeArray, int len)
+void three_way_shuffle(long *order1, char *order2, struct heap_node *headNodeArray, int len, unsigned long long *state)
 {
 	int i,j;
 	long tmp_long;
@@ -926,7 +1554,7 @@ void three_way_shuffle(long *order1, char *order2, struct heap_node *headNodeArr
 
 	for (i = 0; i < len-1; i++)
 	{
-		j = i + (rand() % (len-i));
+		j = i + (ShuffleRand(state) % (len-i));
 		tmp_long = order1[j];
 		order1[j] = order1[i];
 		order1[i] = tmp_long;
@@ -945,6 +1573,7 @@ float MAPCostFunction3D(
     float *x,
     float *e,
     float *w,
+    float *y,
     struct ImageParams3D imgparams,
     struct SinoParams3DParallel sinoparams,
     struct ReconParams reconparams,
@@ -960,9 +1589,17 @@ float MAPCostFunction3D(
     Nxy = Nx*Ny;
 
     nloglike = 0.0;
+    float *wrow = (float *) mget_spc(M,sizeof(float));
     for (i = 0; i <sinoparams.NSlices; i++)
-    for (j = 0; j < M; j++)
-        nloglike += e[(size_t)i*M+j]*w[(size_t)i*M+j]*e[(size_t)i*M+j];
+    {
+        if(w != NULL)
+            memcpy(wrow,&w[(size_t)i*M],M*sizeof(float));
+        else
+            SinoWeightsFromData(wrow,&y[(size_t)i*M],M,reconparams);
+        for (j = 0; j < M; j++)
+            nloglike += e[(size_t)i*M+j]*wrow[j]*e[(size_t)i*M+j];
+    }
+    free((void *)wrow);
 
     nloglike /= 2.0;
     nlogprior_nearest = 0.0;
@@ -996,11 +1633,141 @@ float MAPCostFunction3D(
 }
 
 
-/* Forward projection using input SV system matrix */
+/* Decode a voxel footprint to floats in view-major order: within piece p the  */
+/* entries of view k are Af[offset_p + k*width_p + r], r=0..width_p-1.          */
+void SVdecodeFootprint(
+    float *Af,
+    unsigned char *A,
+    struct AValues_char *A_padded,
+    int NViews,
+    int pieceLength,
+    float rescale,
+    int Abits)
+{
+    int p,k,r;
+    int NViewSets = A_NUM_PIECES(NViews,pieceLength);
+    unsigned short *A16 = (unsigned short *) A;
 
-void SVproject(
+    for(p=0; p<NViewSets; p++)
+    {
+        int myCount = A_padded->pieceWiseWidth[p];
+        int PL = A_PIECE_LENGTH(p,NViews,pieceLength);
+        if(Abits == 16)
+        {
+            for(k=0; k<PL; k++)
+            for(r=0; r<myCount; r++)
+                Af[k*myCount+r] = A16[r*PL+k]*rescale;
+            A16 += myCount*PL;
+        }
+        else
+        {
+            for(k=0; k<PL; k++)
+            for(r=0; r<myCount; r++)
+                Af[k*myCount+r] = A[r*PL+k]*rescale;
+            A += myCount*PL;
+        }
+        Af += myCount*PL;
+    }
+}
+
+
+/* Forward kernel: proj[z] += A x[z] for one voxel over Nslab slices.  */
+/* viewBase[v] is the sinogram offset of channel bandMin[v] in view v. */
+void SVforwardKernel(
+    float *proj,
+    float *xval,
+    int Nslab,
+    size_t Nvc,
+    float *Af,
+    struct AValues_char *A_padded,
+    int *viewBase,
+    int NViews,
+    int pieceLength)
+{
+    int p,k,r,z;
+    int NViewSets = A_NUM_PIECES(NViews,pieceLength);
+
+    for(p=0; p<NViewSets; p++)
+    {
+        int myCount = A_padded->pieceWiseWidth[p];
+        int pieceMin = A_padded->pieceWiseMin[p];
+        int PL = A_PIECE_LENGTH(p,NViews,pieceLength);
+        for(k=0; k<PL; k++)
+        {
+            float *a = &Af[k*myCount];
+            float *pr = &proj[viewBase[p*pieceLength+k] + pieceMin];
+            for(z=0; z<Nslab; z++)
+            {
+                float x = xval[z];
+                float *prz = &pr[z*Nvc];
+                for(r=0; r<myCount; r++)
+                    prz[r] += a[r]*x;
+            }
+        }
+        Af += myCount*PL;
+    }
+}
+
+
+/* Adjoint kernel: image[z] = A^T proj[z] for one voxel over Nslab slices */
+void SVbackKernel(
+    float *xval,
+    float *proj,
+    int Nslab,
+    size_t Nvc,
+    float *Af,
+    struct AValues_char *A_padded,
+    int *viewBase,
+    int NViews,
+    int pieceLength)
+{
+    int p,k,r,z;
+    int NViewSets = A_NUM_PIECES(NViews,pieceLength);
+
+    for(z=0; z<Nslab; z++)
+        xval[z] = 0.0;
+
+    for(p=0; p<NViewSets; p++)
+    {
+        int myCount = A_padded->pieceWiseWidth[p];
+        int pieceMin = A_padded->pieceWiseMin[p];
+        int PL = A_PIECE_LENGTH(p,NViews,pieceLength);
+        for(k=0; k<PL; k++)
+        {
+            float *a = &Af[k*myCount];
+            float *pr = &proj[viewBase[p*pieceLength+k] + pieceMin];
+            for(z=0; z<Nslab; z++)
+            {
+                float sum = 0.0;
+                float *prz = &pr[z*Nvc];
+                for(r=0; r<myCount; r++)
+                    sum += a[r]*prz[r];
+                xval[z] += sum;
+            }
+        }
+        Af += myCount*PL;
+    }
+}
+
+
+/* Forward or back projection using input SV system matrix.                  */
+/* Works SV by SV on slabs of SVDepth slices. Each voxel is projected with   */
+/* the footprint stored in the SV that owns it (index j/(2*SVLength-overlap)), */
+/* decoded once and applied to all slices of the slab. Channel bounds were   */
+/* checked when the matrix was set up (AmatrixCheckBounds).                  */
+/* With fewer slabs than threads the work is split over (slab,SV) tiles.     */
+/* Back projection is a gather, so tiles write disjoint voxels. Forward      */
+/* projection is only tiled for 1-2 slabs (see SVprojectPartials()): each   */
+/* extra thread accumulates into its own partial sinogram of those slices,   */
+/* summed at the end. Tiles are dealt out round-robin so the result doesn't  */
+/* depend on timing.                                                         */
+/* If sino != NULL the forward projection returns the residual sino - A image */
+/* in the same pass.                                                         */
+
+void SVproject(
     float *proj,
     float *image,
+    float *sino,
     struct AValues_char **A_Padded_Map,
     float *Aval_max_ptr,
     struct ImageParams3D imgparams,
@@ -1009,80 +1776,645 @@ void SVproject(
     char backproject_flag)
 {
     size_t i;
-    int jz;
+    int jz,t;
     int Nx = imgparams.Nx;
     int Ny = imgparams.Ny;
     int Nz = imgparams.Nz;
+    int Nxy = Nx*Ny;
+    int NViews = sinoparams.NViews;
     int NChannels = sinoparams.NChannels;
-    int Nvc = sinoparams.NViews * sinoparams.NChannels;
+    size_t Nvc = (size_t)NViews*NChannels;
     int SVLength = svpar.SVLength;
-    int pieceLength = svpar.pieceLength;
-    int SVsPerRow = svpar.SVsPerRow;
-    int NViewSets = sinoparams.NViews/pieceLength;
-    struct minStruct * bandMinMap = svpar.bandMinMap;
+    int SVstride = 2*SVLength-svpar.overlap;
+    int SVDepth = svpar.SVDepth;
+    int Nslabs = (Nz+SVDepth-1)/SVDepth;
+    int Nthreads = omp_get_max_threads();
+    int Npartials = backproject_flag ? 0 : SVprojectPartials(Nz,sinoparams,svpar);
+    int tiled = backproject_flag ? (Nslabs < Nthreads) : (Npartials > 0);
+    int Ntasks = tiled ? Nslabs*svpar.Nsv : Nslabs;
+    float **projPartial = NULL;
+
+    /* a tiled forward projection runs one thread per partial sinogram */
+    if(tiled && !backproject_flag)
+        Nthreads = Npartials+1;
+
+    /* scratch size for footprints that aren't stored in kernel format */
+    int maxLength=1;
+    for(jz=0; jz<svpar.Nsv; jz++)
+    for(i=0; i<(size_t)(2*SVLength+1)*(2*SVLength+1); i++)
+    if(A_Padded_Map[jz][i].length > maxLength)
+        maxLength = A_Padded_Map[jz][i].length;
 
     /* initialize output */
     if(backproject_flag)
-        for (i = 0; i < (size_t)Nx*Ny*Nz; i++)
+    {
+        #pragma omp parallel for
+        for (i = 0; i < (size_t)Nxy*Nz; i++)
             image[i] = 0.0;
+    }
+    else if(sino != NULL)
+    {
+        #pragma omp parallel for
+        for (i = 0; i < Nvc*Nz; i++)
+            proj[i] = sino[i];
+    }
     else
-        for (i = 0; i < (size_t)Nvc*Nz; i++)
+    {
+        #pragma omp parallel for
+        for (i = 0; i < Nvc*Nz; i++)
             proj[i] = 0.0;
+    }
 
-    #pragma omp parallel for schedule(dynamic)
-    for(jz=0;jz<Nz;jz++)
+    /* thread 0 accumulates into proj, the others into partial sinograms */
+    if(tiled && !backproject_flag)
     {
-        int jx,jy,k,r,p;
+        projPartial = (float **) mget_spc(Nthreads,sizeof(float *));
+        projPartial[0] = proj;
+        for(t=1; t<Nthreads; t++)
+            projPartial[t] = (float *) get_spc(Nvc*Nz,sizeof(float));
+    }
 
-        for (jy = 0; jy < Ny; jy++)
-        for (jx = 0; jx < Nx; jx++)
+    #pragma omp parallel num_threads(Nthreads)
+    {
+        int task,jj,jx,jy,v,z;
+        unsigned char *A_scratch = (unsigned char *) mget_spc(maxLength,A_KERNEL_BYTES(svpar.Abits));
+        float *Af = (float *) mget_spc(maxLength,sizeof(float));
+        int *viewBase = (int *) mget_spc(NViews,sizeof(int));
+        float *projLoc = (projPartial != NULL) ? projPartial[omp_get_thread_num()] : proj;
+        float xval[SVDepth];
+
+        #pragma omp for schedule(static,1)
+        for(task=0; task<Ntasks; task++)
         {
-            int SV_ind_y = jy/(2*SVLength-svpar.overlap);
-            int SV_ind_x = jx/(2*SVLength-svpar.overlap);
-            int SVPosition = SV_ind_y*SVsPerRow + SV_ind_x;
+            int slab = tiled ? task/svpar.Nsv : task;
+            int jj_first = tiled ? task%svpar.Nsv : 0;
+            int jj_last = tiled ? jj_first : svpar.Nsv-1;
+            int startSlice = slab*SVDepth;
+            int Nslab = (Nz-startSlice < SVDepth) ? Nz-startSlice : SVDepth;
 
-            int SV_jy = SV_ind_y*(2*SVLength-svpar.overlap);
-            int SV_jx = SV_ind_x*(2*SVLength-svpar.overlap);
-            int VoxelPosition = (jy-SV_jy)*(2*SVLength+1)+(jx-SV_jx);
-
-            // The second condition should always be true
-            if (A_Padded_Map[SVPosition][VoxelPosition].length > 0 && VoxelPosition < ((2*SVLength+1)*(2*SVLength+1)))
+            for(jj=jj_first; jj<=jj_last; jj++)
             {
-                unsigned char* A_padd_Tr_ptr = &A_Padded_Map[SVPosition][VoxelPosition].val[0];
-                float rescale = Aval_max_ptr[jy*Nx+jx]*(1.0/255);
-                size_t image_idx = (size_t)jz*Nx*Ny + jy*Nx + jx;
-                float xval = image[image_idx];
+                int SV_jy = (jj/svpar.SVsPerRow)*SVstride;
+                int SV_jx = (jj%svpar.SVsPerRow)*SVstride;
+                channel_t *bandMin = svpar.bandMinMap[jj].bandMin;
+
+                for(v=0; v<NViews; v++)
+                    viewBase[v] = v*NChannels + bandMin[v];
 
-                for(p=0;p<NViewSets;p++)
+                for(jy=SV_jy; jy<SV_jy+SVstride && jy<Ny; jy++)
+                for(jx=SV_jx; jx<SV_jx+SVstride && jx<Nx; jx++)
                 {
-                    int myCount = A_Padded_Map[SVPosition][VoxelPosition].pieceWiseWidth[p];
-                    int pieceWiseMin = A_Padded_Map[SVPosition][VoxelPosition].pieceWiseMin[p];
-                    int position = p*pieceLength*NChannels + pieceWiseMin;
+                    struct AValues_char *A_padded = &A_Padded_Map[jj][(jy-SV_jy)*(2*SVLength+1)+(jx-SV_jx)];
+                    size_t image_idx = (size_t)startSlice*Nxy + jy*Nx + jx;
+                    float rescale = Aval_max_ptr[jy*Nx+jx]*(1.0/((1<<svpar.Abits)-1));
 
-                    for(r=0;r<myCount;r++)
-                    for(k=0;k<pieceLength;k++)
+                    if(A_padded->length == 0)
+                        continue;
+                    if(!backproject_flag)
                     {
-                        channel_t bandMin = bandMinMap[SVPosition].bandMin[p*pieceLength+k];
-                        size_t proj_idx = (size_t)jz*Nvc + position + k*NChannels + bandMin + r;
-
-                        if((pieceWiseMin + bandMin + r) >= NChannels || (position + k*NChannels + bandMin + r) >= Nvc ) {
-                            fprintf(stderr,"SVproject() out of bounds: p %d r %d k %d\n",p,r,k);
-                            fprintf(stderr,"SVproject() out of bounds: total_1 %d total_2 %d\n",pieceWiseMin+bandMin+r,position+k*NChannels+bandMin+r);
-                            exit(-1);
-                        }
-                        else
-                        {
-                            if(backproject_flag)
-                                image[image_idx] += A_padd_Tr_ptr[r*pieceLength+k]*rescale * proj[proj_idx];
-                            else
-                                proj[proj_idx] += A_padd_Tr_ptr[r*pieceLength+k]*rescale * xval;
+                        int nonzero = 0;
+                        for(z=0; z<Nslab; z++) {
+                            xval[z] = image[image_idx+(size_t)z*Nxy];
+                            nonzero |= (xval[z] != 0.0);
+                            if(sino != NULL)
+                                xval[z] = -xval[z];
                         }
+                        if(!nonzero)
+                            continue;
+                    }
+
+                    unsigned char *A = A_getFootprint(A_scratch,A_padded,bandMin,jy,jx,Aval_max_ptr[jy*Nx+jx],svpar);
+                    SVdecodeFootprint(Af,A,A_padded,NViews,svpar.pieceLength,rescale,svpar.Abits);
+
+                    if(backproject_flag)
+                    {
+                        SVbackKernel(xval,&proj[(size_t)startSlice*Nvc],Nslab,Nvc,Af,A_padded,viewBase,NViews,svpar.pieceLength);
+                        for(z=0; z<Nslab; z++)
+                            image[image_idx+(size_t)z*Nxy] = xval[z];
+                    }
+                    else
+                        SVforwardKernel(&projLoc[(size_t)startSlice*Nvc],xval,Nslab,Nvc,Af,A_padded,viewBase,NViews,svpar.pieceLength);
+                }
+            }
+        }
+        free((void *)A_scratch);
+        free((void *)Af);
+        free((void *)viewBase);
+    }
+
+    /* sum the partial sinograms */
+    if(projPartial != NULL)
+    {
+        #pragma omp parallel for private(i,t)
+        for(jz=0; jz<Nz*NViews; jz++)
+        {
+            size_t offset = (size_t)jz*NChannels;
+            for(t=1; t<Nthreads; t++)
+            for(i=0; i<(size_t)NChannels; i++)
+                proj[offset+i] += projPartial[t][offset+i];
+        }
+        for(t=1; t<Nthreads; t++)
+            free((void *)projPartial[t]);
+        free((void *)projPartial);
+    }
+}
+
+
+/* Number of extra partial sinograms a forward projection of Nz slices uses: */
+/* 0 (not tiled) unless there are 1-2 slabs and idle threads, and at most  */
+/* what fits in SVPROJECT_PARTIAL_MB.                                       */
+int SVprojectPartials(int Nz, struct SinoParams3DParallel sinoparams, struct SVParams svpar)
+{
+    int Nslabs = (Nz+svpar.SVDepth-1)/svpar.SVDepth;
+    int Nthreads = omp_get_max_threads();
+    size_t bytes = (size_t)Nz*sinoparams.NViews*sinoparams.NChannels*sizeof(float);
+    size_t cap = (size_t)SVPROJECT_PARTIAL_MB*1048576/bytes;
+
+    if(Nslabs > SVPROJECT_TILE_SLABS || Nslabs >= Nthreads)
+        return(0);
+    return((size_t)(Nthreads-1) < cap ? Nthreads-1 : (int)cap);
+}
+
+
+/* Row sums A*1 of the system matrix over the recon mask (one slice) */
+float *SVrowSum(
+    struct AValues_char **A_Padded_Map,
+    float *Aval_max_ptr,
+    struct ImageParams3D imgparams,
+    struct SinoParams3DParallel sinoparams,
+    struct SVParams svpar)
+{
+    size_t i;
+    float *ones = (float *) mget_spc((size_t)imgparams.Nx*imgparams.Ny,sizeof(float));
+    float *rowSum = (float *) mget_spc((size_t)sinoparams.NViews*sinoparams.NChannels,sizeof(float));
+
+    for(i=0; i<(size_t)imgparams.Nx*imgparams.Ny; i++)
+        ones[i] = 1.0;
+    imgparams.Nz = 1;
+    SVproject(rowSum,ones,NULL,A_Padded_Map,Aval_max_ptr,imgparams,sinoparams,svpar,0);
+    free((void *)ones);
+    return(rowSum);
+}
+
+
+/* Returns 1 if image is constant over the recon mask, with the value */
+int SVconstantImage(float *value, float *image, char *ImageReconMask, int Nxy, int Nz)
+{
+    size_t i;
+    int jz;
+
+    *value = 0;
+    for(i=0; i<(size_t)Nxy && !ImageReconMask[i]; i++);
+    if(i<(size_t)Nxy)
+        *value = image[i];
+    for(jz=0; jz<Nz; jz++)
+    for(i=0; i<(size_t)Nxy; i++)
+    if(ImageReconMask[i] && image[(size_t)jz*Nxy+i] != *value)
+        return(0);
+    return(1);
+}
+
+
+/* Adds delta to the count of every SV that has voxel (z,y,x) or one of its */
+/* neighbors among its voxels. Neighbors wrap around in x and y as in       */
+/* ExtractNeighbors3D(); in z they are counted across job boundaries too,   */
+/* which only makes the count more conservative. A voxel can be counted     */
+/* more than once by the same SV; the count is 0 only if none is nonzero.   */
+void SVZeroMapAdd(struct SVZeroMap *zeroMap, int z, int y, int x, int delta, struct ImageParams3D imgparams, struct SVParams svpar)
+{
+    int stride = 2*svpar.SVLength-svpar.overlap;
+    int Nrows = svpar.Nsv/svpar.SVsPerRow;
+    int dx,dy,dz,r,c;
+
+    for(dz=-1; dz<=1; dz++)
+    if(z+dz>=0 && z+dz<imgparams.Nz)
+    {
+        int iz = (z+dz)/svpar.SVDepth;
+        for(dy=-1; dy<=1; dy++)
+        {
+            int yy = (y+dy+imgparams.Ny)%imgparams.Ny;
+            int r0 = (yy-2*svpar.SVLength > 0) ? (yy-2*svpar.SVLength+stride-1)/stride : 0;
+            int r1 = (yy/stride < Nrows-1) ? yy/stride : Nrows-1;
+            for(dx=-1; dx<=1; dx++)
+            {
+                int xx = (x+dx+imgparams.Nx)%imgparams.Nx;
+                int c0 = (xx-2*svpar.SVLength > 0) ? (xx-2*svpar.SVLength+stride-1)/stride : 0;
+                int c1 = (xx/stride < svpar.SVsPerRow-1) ? xx/stride : svpar.SVsPerRow-1;
+                for(r=r0; r<=r1; r++)
+                for(c=c0; c<=c1; c++)
+                {
+                    #pragma omp atomic
+                    zeroMap->nonzero[iz*svpar.Nsv+r*svpar.SVsPerRow+c] += delta;
+                }
+            }
+        }
+    }
+}
+
+
+/* Counts the nonzero voxels of image for each SV, see SVZeroMapAdd() */
+void SVZeroMapInit(struct SVZeroMap *zeroMap, float *image, struct ImageParams3D imgparams, struct SVParams svpar)
+{
+    int Nxy = imgparams.Nx*imgparams.Ny;
+    int i,z;
+
+    for(i=0; i<svpar.SV_per_Z*svpar.Nsv; i++)
+        zeroMap->nonzero[i] = 0;
+    zeroMap->visits = zeroMap->elided = 0;
+
+    #pragma omp parallel for private(i)
+    for(z=0; z<imgparams.Nz; z++)
+    for(i=0; i<Nxy; i++)
+    if(image[(size_t)z*Nxy+i] != 0)
+        SVZeroMapAdd(zeroMap,z,i/imgparams.Nx,i%imgparams.Nx,1,imgparams,svpar);
+}
+
+
+/* Called at the start of an SV visit: returns 1 if the SV is parked and */
+/* this visit is skipped. Every revisit-th visit of a parked SV goes     */
+/* ahead so it can notice if it has to move again.                       */
+int SVFreezeSkip(struct SVFreeze *freeze, int id)
+{
+    char parked;
+
+    #pragma omp atomic read
+    parked = freeze->parked[id];
+    if(parked && ++freeze->skipped[id] < freeze->params.revisit)
+    {
+        #pragma omp atomic
+        freeze->skips++;
+        #pragma omp atomic
+        freeze->passSkips++;
+        return(1);
+    }
+    freeze->skipped[id] = 0;
+    #pragma omp atomic
+    freeze->visits++;
+    return(0);
+}
+
+
+/* Called at the end of an SV visit with its total change and value: the */
+/* SV is parked after params.visits quiet visits in a row, and a change  */
+/* above wakeThreshold unparks its neighbors in x, y and z.              */
+void SVFreezeUpdate(struct SVFreeze *freeze, int id, float change, float value, struct SVParams svpar)
+{
+    float rel = (value > 0) ? change/value*100 : change;
+    int dx,dy,dz;
+
+    if(rel < freeze->quietThreshold) {
+        if(freeze->quiet[id] < 255)
+            freeze->quiet[id]++;
+    }
+    else
+        freeze->quiet[id] = 0;
+
+    #pragma omp atomic write
+    freeze->parked[id] = (freeze->quiet[id] >= freeze->params.visits);
+
+    if(rel > freeze->wakeThreshold)
+    {
+        int iz = id/svpar.Nsv;
+        int row = (id%svpar.Nsv)/svpar.SVsPerRow;
+        int col = (id%svpar.Nsv)%svpar.SVsPerRow;
+        int Nrows = svpar.Nsv/svpar.SVsPerRow;
+        for(dz=-1; dz<=1; dz++)
+        for(dy=-1; dy<=1; dy++)
+        for(dx=-1; dx<=1; dx++)
+        if(iz+dz>=0 && iz+dz<svpar.SV_per_Z && row+dy>=0 && row+dy<Nrows && col+dx>=0 && col+dx<svpar.SVsPerRow
+           && (dx!=0 || dy!=0 || dz!=0))
+        {
+            int n = (iz+dz)*svpar.Nsv + (row+dy)*svpar.SVsPerRow + col+dx;
+            #pragma omp atomic write
+            freeze->parked[n] = 0;
+        }
+    }
+}
+
+
+/* Unpark all SVs */
+void SVFreezeRelease(struct SVFreeze *freeze, int NsvAll)
+{
+    int i;
+
+    for(i=0; i<NsvAll; i++)
+        freeze->parked[i] = 0;
+}
+
+
+/* Called at the start of an SV visit: marks the data sets of the slab */
+/* as reached in this pass, and returns 1 if they have all converged   */
+/* so the visit can be skipped                                         */
+int SVBatchSkip(struct SVBatch *batch, int startSlice, int depth)
+{
+    int b, skip = 1;
+
+    for(b=startSlice/batch->NzJob; b<=(startSlice+depth-1)/batch->NzJob; b++)
+    if(!batch->done[b])
+    {
+        #pragma omp atomic write
+        batch->visited[b] = 1;
+        skip = 0;
+    }
+    return(skip);
+}
+
+
+/* Adds the per slice totals of an SV visit to its data sets */
+void SVBatchAdd(struct SVBatch *batch, int startSlice, int depth, int *updates, float *change, float *value)
+{
+    int i;
+
+    for(i=0; i<depth; i++)
+    if(updates[i] > 0)
+    {
+        int b = (startSlice+i)/batch->NzJob;
+        #pragma omp atomic
+        batch->updates[b] += updates[i];
+        #pragma omp atomic
+        batch->change[b] += change[i];
+        #pragma omp atomic
+        batch->value[b] += value[i];
+    }
+}
+
+
+/* End of a pass: a data set reached in the pass is done if its average   */
+/* relative change is below StopThreshold, the same test as for a single  */
+/* data set. With needUpdates a data set also needs an update to be       */
+/* judged (region of interest). Clears the pass totals and returns 1 once */
+/* every data set is done.                                                */
+int SVBatchJudge(struct SVBatch *batch, float StopThreshold, char needUpdates)
+{
+    int b;
+
+    for(b=0; b<batch->Nbatch; b++)
+    {
+        if(!batch->done[b] && batch->visited[b] && (batch->updates[b]>0 || !needUpdates))
+        {
+            float rel = 0;
+            if(batch->updates[b] > 0)
+                rel = (batch->value[b] > 0) ? batch->change[b]/batch->value[b]*100 : batch->change[b]/batch->updates[b];
+            if(rel < StopThreshold) {
+                batch->done[b] = 1;
+                batch->Ndone++;
+            }
+        }
+        batch->visited[b] = 0;
+        batch->updates[b] = 0;
+        batch->change[b] = batch->value[b] = 0;
+    }
+    return(batch->Ndone == batch->Nbatch);
+}
+
+
+/* Flags in active the SVs of each SV slab that have voxels to update:   */
+/* voxels with a nonzero matrix column (inside the recon mask) and, if     */
+/* roi isn't NULL, flagged in the region of interest on one of the SV's    */
+/* slices. Returns the number of SVs flagged.                              */
+int SVactiveFlags(
+    char *active,
+    struct AValues_char **A_Padded_Map,
+    char *roi,
+    struct ImageParams3D imgparams,
+    struct SVParams svpar)
+{
+    int iz,s,jx,jy,jz,count=0;
+    int Nx = imgparams.Nx;
+    int Ny = imgparams.Ny;
+    int Nz = imgparams.Nz;
+    int Nxy = Nx*Ny;
+    int SVLength = svpar.SVLength;
+    int SVstride = 2*SVLength-svpar.overlap;
+
+    for(iz=0; iz<svpar.SV_per_Z; iz++)
+    for(s=0; s<svpar.Nsv; s++)
+    {
+        int jy0 = (s/svpar.SVsPerRow)*SVstride;
+        int jx0 = (s%svpar.SVsPerRow)*SVstride;
+        char flag = 0;
+        for(jy=jy0; jy<=jy0+2*SVLength && jy<Ny && !flag; jy++)
+        for(jx=jx0; jx<=jx0+2*SVLength && jx<Nx && !flag; jx++)
+        if(A_Padded_Map[s][(jy-jy0)*(2*SVLength+1)+(jx-jx0)].length > 0)
+        {
+            if(roi == NULL)
+                flag = 1;
+            else
+            for(jz=iz*svpar.SVDepth; jz<(iz+1)*svpar.SVDepth && jz<Nz; jz++)
+            if(roi[(size_t)jz*Nxy+jy*Nx+jx]) {
+                flag = 1;
+                break;
+            }
+        }
+        active[iz*svpar.Nsv+s] = flag;
+        count += flag;
+    }
+    return(count);
+}
+
+
+/* Zero-weight masking (dead channels, metal traces, dropped views): for   */
+/* each SV slab, SV and view piece the window [lo,hi) of band offsets      */
+/* (from bandMin of each view) that holds all nonzero weights of the piece */
+/* for the slices of the slab, lo==hi if the piece is fully masked. The    */
+/* SV update gathers, sums and writes back only the window; the terms left */
+/* out are all zero so the image is unchanged. Returns NULL if nothing is  */
+/* masked. *fraction gets the fraction of band entries left out and        */
+/* *Ndead the number of fully masked pieces.                               */
+channel_t *SVweightWindows(
+    float *weight,
+    struct ImageParams3D imgparams,
+    struct SinoParams3DParallel sinoparams,
+    struct SVParams svpar,
+    double *fraction,
+    long *Ndead)
+{
+    int task;
+    int NViews = sinoparams.NViews;
+    int NChannels = sinoparams.NChannels;
+    size_t Nvc = (size_t)NViews*NChannels;
+    int Nsv = svpar.Nsv;
+    int SVDepth = svpar.SVDepth;
+    int SV_per_Z = (imgparams.Nz+SVDepth-1)/SVDepth;
+    int pieceLength = svpar.pieceLength;
+    int NViewSets = A_NUM_PIECES(NViews,pieceLength);
+    double total=0, live=0;
+    long dead=0;
+
+    channel_t *window = (channel_t *) mget_spc((size_t)SV_per_Z*Nsv*NViewSets*2,sizeof(channel_t));
+
+    #pragma omp parallel
+    {
+        char *nonzero = (char *) mget_spc(NChannels,sizeof(char));
+        int *next = (int *) mget_spc(NChannels+1,sizeof(int));  /* first nonzero channel >= c, or NChannels */
+        int *prev = (int *) mget_spc(NChannels+1,sizeof(int));  /* 1 + last nonzero channel < c, or 0 */
+        int *lo = (int *) mget_spc(Nsv,sizeof(int));
+        int *hi = (int *) mget_spc(Nsv,sizeof(int));
+        int *width = (int *) mget_spc(Nsv,sizeof(int));
+
+        #pragma omp for schedule(dynamic) reduction(+:total,live,dead)
+        for(task=0; task<SV_per_Z*NViewSets; task++)
+        {
+            int iz = task/NViewSets;
+            int p = task%NViewSets;
+            int z0 = iz*SVDepth;
+            int z1 = (z0+SVDepth < imgparams.Nz) ? z0+SVDepth : imgparams.Nz;
+            int PL = A_PIECE_LENGTH(p,NViews,pieceLength);
+            int s,v,c,z;
+
+            for(s=0; s<Nsv; s++) {
+                lo[s] = NChannels;
+                hi[s] = width[s] = 0;
+            }
+            for(v=p*pieceLength; v<p*pieceLength+PL; v++)
+            {
+                for(c=0; c<NChannels; c++)
+                    nonzero[c] = 0;
+                for(z=z0; z<z1; z++)
+                for(c=0; c<NChannels; c++)
+                if(weight[(size_t)z*Nvc+(size_t)v*NChannels+c] != 0.0)
+                    nonzero[c] = 1;
+                next[NChannels] = NChannels;
+                for(c=NChannels-1; c>=0; c--)
+                    next[c] = nonzero[c] ? c : next[c+1];
+                prev[0] = 0;
+                for(c=0; c<NChannels; c++)
+                    prev[c+1] = nonzero[c] ? c+1 : prev[c];
+
+                for(s=0; s<Nsv; s++)
+                {
+                    int a = svpar.bandMinMap[s].bandMin[v];
+                    int b = svpar.bandMaxMap[s].bandMax[v];
+                    if(b-a > width[s])
+                        width[s] = b-a;
+                    if(next[a] < b) {
+                        if(next[a]-a < lo[s])
+                            lo[s] = next[a]-a;
+                        if(prev[b]-a > hi[s])
+                            hi[s] = prev[b]-a;
                     }
-                    A_padd_Tr_ptr += myCount*pieceLength;
                 }
             }
+            for(s=0; s<Nsv; s++)
+            {
+                channel_t *w = &window[(((size_t)iz*Nsv+s)*NViewSets+p)*2];
+                if(lo[s] >= hi[s]) {
+                    lo[s] = hi[s] = 0;
+                    if(width[s] > 0)
+                        dead++;
+                }
+                w[0] = lo[s];
+                w[1] = hi[s];
+                total += (double)width[s]*PL*(z1-z0);
+                live += (double)(hi[s]-lo[s])*PL*(z1-z0);
+            }
         }
+        free((void *)nonzero);
+        free((void *)next);
+        free((void *)prev);
+        free((void *)lo);
+        free((void *)hi);
+        free((void *)width);
     }
+
+    *fraction = (total > 0) ? 1.0-live/total : 0.0;
+    *Ndead = dead;
+    if(live >= total)
+    {
+        free((void *)window);
+        return(NULL);
+    }
+    return(window);
+}
+
+
+/* Sinogram error sinoerr = sino - A image in one pass. If the image is   */
+/* constant over the recon mask (e.g. InitImageValue) the projection of   */
+/* every slice is that constant times the row sums A*1, computed on one   */
+/* slice and kept in *rowSum for later calls.                            */
+void SVprojectResidual(
+    float *sinoerr,
+    float *sino,
+    float *image,
+    char *ImageReconMask,
+    struct AValues_char **A_Padded_Map,
+    float *Aval_max_ptr,
+    float **rowSum,
+    struct ImageParams3D imgparams,
+    struct SinoParams3DParallel sinoparams,
+    struct SVParams svpar,
+    char verboseLevel)
+{
+    size_t i;
+    int jz;
+    size_t Nvc = (size_t)sinoparams.NViews*sinoparams.NChannels;
+    float value;
+
+    if(!SVconstantImage(&value,image,ImageReconMask,imgparams.Nx*imgparams.Ny,imgparams.Nz))
+    {
+        int Npartials = SVprojectPartials(imgparams.Nz,sinoparams,svpar);
+        if(verboseLevel>1 && Npartials > 0)
+            fprintf(stdout,"\tprojection tiled over SVs: %d partial sinograms, %.1f MB\n",Npartials,
+                (double)Npartials*imgparams.Nz*Nvc*sizeof(float)/1048576.0);
+        SVproject(sinoerr,image,sino,A_Padded_Map,Aval_max_ptr,imgparams,sinoparams,svpar,0);
+        return;
+    }
+    if(value == 0.0)
+    {
+        #pragma omp parallel for
+        for(i=0; i<Nvc*imgparams.Nz; i++)
+            sinoerr[i] = sino[i];
+        return;
+    }
+
+    if(verboseLevel>1)
+        fprintf(stdout,"\tconstant image (%g): projection from row sums A*1\n",value);
+    if(*rowSum == NULL)
+        *rowSum = SVrowSum(A_Padded_Map,Aval_max_ptr,imgparams,sinoparams,svpar);
+    float *A1 = *rowSum;
+    #pragma omp parallel for private(i)
+    for(jz=0; jz<imgparams.Nz; jz++)
+    for(i=0; i<Nvc; i++)
+        sinoerr[(size_t)jz*Nvc+i] = sino[(size_t)jz*Nvc+i] - value*A1[i];
+}
+
+
+/* Startup work of MBIRContextRecon() that doesn't need the sinogram, so */
+/* it can be done while the sinogram is still being read: the row sums   */
+/* A*1 that project a constant initial image. Results are unchanged.     */
+void MBIRContextPrepare(
+    struct MBIRContext *ctx,
+    float *image,
+    int Nz)
+{
+    float value;
+
+    if(ctx->rowSum == NULL && SVconstantImage(&value,image,ctx->ImageReconMask,ctx->imgparams.Nx*ctx->imgparams.Ny,Nz) && value != 0.0)
+        ctx->rowSum = SVrowSum(ctx->A_Padded_Map,ctx->Aval_max_ptr,ctx->imgparams,ctx->sinoparams,ctx->svpar);
+}
+
+
+/* Forward (back) projection of Nz slices with a context */
+void MBIRContextProject(
+    struct MBIRContext *ctx,
+    float *proj,
+    float *image,
+    int Nz,
+    char backproject_flag)
+{
+    struct ImageParams3D imgparams = ctx->imgparams;
+    imgparams.Nz = Nz;
+    SVproject(proj,image,NULL,ctx->A_Padded_Map,ctx->Aval_max_ptr,imgparams,ctx->sinoparams,ctx->svpar,backproject_flag);
+}
+
+
+void MBIRContextBackproject(
+    struct MBIRContext *ctx,
+    float *image,
+    float *proj,
+    int Nz)
+{
+    MBIRContextProject(ctx,proj,image,Nz,1);
 }
 
 
@@ -1097,11 +2429,21 @@ void forwardProject(
     char backproject_flag,
     char verboseLevel)
 {
-    int i,j;
-    struct AValues_char **A_Padded_Map;
-    float *Aval_max_ptr;
-    struct SVParams svpar;
+    forwardProjectA(proj,image,imgparams,sinoparams,Amatrix_fname,AmatrixDefaultParams(),backproject_flag,verboseLevel);
+}
+
 
+/* forwardProject() with the system matrix options in Aparams */
+void forwardProjectA(
+    float *proj,
+    float *image,
+    struct ImageParams3D imgparams,
+    struct SinoParams3DParallel sinoparams,
+    char *Amatrix_fname,
+    struct AmatrixParams Aparams,
+    char backproject_flag,
+    char verboseLevel)
+{
     /* print summary to stdout */
     if(verboseLevel>1)
     {
@@ -1110,28 +2452,8 @@ void forwardProject(
         printImageParams3D(&imgparams);
     }
 
-    /* Initialize/allocate SV parameters */
-    initSVParams(&svpar, imgparams, sinoparams);
-    int Nsv = svpar.Nsv;
-    int SVLength = svpar.SVLength;
-
-    /* Read/compute/write System Matrix */
-    A_Padded_Map = (struct AValues_char **)multialloc(sizeof(struct AValues_char),2,Nsv,(2*SVLength+1)*(2*SVLength+1));
-    Aval_max_ptr = (float *) mget_spc(imgparams.Nx*imgparams.Ny,sizeof(float));
-    if(Amatrix_fname != NULL)
-    {
-        if(verboseLevel)
-            fprintf(stdout,"Reading system matrix...\n");
-        readAmatrix(Amatrix_fname, A_Padded_Map, Aval_max_ptr, &imgparams, &sinoparams, svpar);
-    }
-    else
-    {
-        if(verboseLevel)
-            fprintf(stdout,"Computing system matrix...\n");
-        char * ImageReconMask = GenImageReconMask(&imgparams);
-        A_comp(A_Padded_Map,Aval_max_ptr,svpar,&sinoparams,ImageReconMask,&imgparams);
-        free((void *)ImageReconMask);
-    }
+    /* Read/compute System Matrix */
+    struct MBIRContext *ctx = MBIRContextCreate(imgparams,sinoparams,Amatrix_fname,Aparams,verboseLevel);
 
     /* Project */
     if(verboseLevel)
@@ -1141,28 +2463,20 @@ void forwardProject(
         else
             fprintf(stdout,"Projecting image...\n");
     }
-    SVproject(proj,image,A_Padded_Map,Aval_max_ptr,imgparams,sinoparams,svpar,backproject_flag);
-
-    /* Free SV memory */
-    for(i=0;i<Nsv;i++) {
-        free((void *)svpar.bandMinMap[i].bandMin);
-        free((void *)svpar.bandMaxMap[i].bandMax);
-    }
-    free((void *)svpar.bandMinMap);
-    free((void *)svpar.bandMaxMap);
+    #ifndef MSVC	/* not included in MS Visual C++ */
+    struct timeval tm1,tm2;
+    gettimeofday(&tm1,NULL);
+    #endif
+    MBIRContextProject(ctx,proj,image,imgparams.Nz,backproject_flag);
+    #ifndef MSVC	/* not included in MS Visual C++ */
+    gettimeofday(&tm2,NULL);
+    if(verboseLevel>1)
+        fprintf(stdout,"\t%s time = %llu ms\n",backproject_flag ? "Back-projection" : "Projection",
+            (unsigned long long)(1000*(tm2.tv_sec-tm1.tv_sec) + (tm2.tv_usec-tm1.tv_usec)/1000));
+    #endif
 
-    /* Free system matrix */
-    for(i=0;i<Nsv;i++)
-    for(j=0;j<(2*SVLength+1)*(2*SVLength+1);j++)
-    if(A_Padded_Map[i][j].length>0)
-    {
-        free((void *)A_Padded_Map[i][j].val);
-        free((void *)A_Padded_Map[i][j].pieceWiseMin);
-        free((void *)A_Padded_Map[i][j].pieceWiseWidth);
-    }
-    multifree(A_Padded_Map,2);
-    free((void *)Aval_max_ptr);
+    MBIRContextDestroy(ctx);
 
-}   /* END forwardProject() */
+}   /* END forwardProjectA() */
 
 
@@ -7,6 +7,88 @@
 #define SVLENGTH 9
 #define OVERLAPPINGDISTANCE 2
 #define SVDEPTH 4
+#define FREEZE_VISITS_DEFAULT 3
+#define FREEZE_REVISIT_DEFAULT 4
+
+/* Convergence of the last MBIRContextRecon() call */
+struct MBIRReconStats
+{
+    int iterations;                 /* non-homogeneous iterations */
+    float equits;                   /* equivalent iterations */
+    float avgUpdateRel;             /* average update in last iteration (%) */
+    char converged;                 /* 1 if the stopping condition was reached */
+    unsigned long long time_ms;     /* iterations only */
+    float skippedVisits;            /* fraction of SV visits skipped by freezing */
+    float zeroVisits;               /* fraction of SV visits skipped as all zero */
+};
+
+/* Checkpointing of MBIRContextRecon(); off if fname is "" */
+struct MBIRCheckpointParams
+{
+    char fname[1024];
+    float interval;                 /* wall-clock seconds between checkpoints */
+    char resume;                    /* 1: continue from the state in fname */
+};
+
+/* Adaptive freezing of converged SVs in MBIRContextRecon(); off if fraction is 0 */
+struct MBIRFreezeParams
+{
+    float fraction;                 /* SV is quiet if its change (%) is below fraction*StopThreshold */
+    int visits;                     /* parked after this many quiet visits in a row */
+    int revisit;                    /* a parked SV is visited again after this many skipped visits */
+};
+
+/* Per-SV freezing state, indexed by SV slab*Nsv + SV */
+struct SVFreeze
+{
+    struct MBIRFreezeParams params;
+    float quietThreshold;           /* fraction*StopThreshold */
+    float wakeThreshold;            /* a change above this wakes the neighbors (StopThreshold) */
+    unsigned char *quiet;           /* quiet visits in a row */
+    unsigned char *skipped;         /* visits skipped since parked or last revisited */
+    char *parked;
+    unsigned long visits, skips;    /* totals */
+    unsigned long passSkips;        /* skips in the current pass */
+};
+
+/* Per-SV count of the nonzero voxels within reach of the SV (its voxels and */
+/* their neighbors), indexed by SV slab*Nsv + SV. With Positivity on, an SV  */
+/* whose count is 0 would have every voxel zero-skipped.                     */
+struct SVZeroMap
+{
+    int *nonzero;
+    unsigned long visits, elided;   /* SV visits checked, and skipped as all zero */
+};
+
+/* Per data set stopping test of a batch (Nbatch > 1). A data set is done */
+/* once its own average change is below StopThreshold, and its voxels     */
+/* aren't updated after that. The pass totals are indexed by data set.    */
+struct SVBatch
+{
+    int Nbatch;
+    int NzJob;
+    int Ndone;
+    char *done;
+    char *visited;                  /* reached by an SV visit in the current pass */
+    unsigned long *updates;         /* voxel updates in the current pass */
+    float *change, *value;          /* sums of |change| and |value| in the current pass */
+};
+
+/* Resident geometry and system matrix for repeated recon/projection calls */
+struct MBIRContext
+{
+    struct ImageParams3D imgparams;         /* Nz unused; slices are given per call */
+    struct SinoParams3DParallel sinoparams; /* own copy of ViewAngles */
+    struct SVParams svpar;
+    struct AValues_char **A_Padded_Map;
+    float *Aval_max_ptr;
+    char *ImageReconMask;
+    float *rowSum;                          /* A*1 over the recon mask, computed on first use */
+    struct MBIRReconStats stats;            /* set by MBIRContextRecon() */
+    struct MBIRCheckpointParams checkpoint; /* off when created */
+    char *roi;                              /* NULL, or Nz*Ny*Nx flags of the voxels to update, set per call */
+    struct MBIRFreezeParams freeze;         /* off when created */
+};
 
 void MBIRReconstruct(
     float *image,
@@ -20,6 +102,79 @@ void MBIRReconstruct(
     char *Amatrix_fname,
     char verboseLevel);
 
+void MBIRReconstructA(
+    float *image,
+    float *sino,
+    float *weight,
+    float *proj_init,
+    float *proximalmap,
+    struct ImageParams3D imgparams,
+    struct SinoParams3DParallel sinoparams,
+    struct ReconParams reconparams,
+    char *Amatrix_fname,
+    struct AmatrixParams Aparams,
+    char verboseLevel);
+
+void MBIRReconstructBatch(
+    float *image,
+    float *sino,
+    float *weight,
+    float *proj_init,
+    float *proximalmap,
+    int Nbatch,
+    struct ImageParams3D imgparams,
+    struct SinoParams3DParallel sinoparams,
+    struct ReconParams reconparams,
+    char *Amatrix_fname,
+    struct AmatrixParams Aparams,
+    char verboseLevel);
+
+struct MBIRContext *MBIRContextCreate(
+    struct ImageParams3D imgparams,
+    struct SinoParams3DParallel sinoparams,
+    char *Amatrix_fname,
+    struct AmatrixParams Aparams,
+    char verboseLevel);
+
+struct MBIRContext *MBIRContextLoad(
+    struct ImageParams3D imgparams,
+    struct SinoParams3DParallel sinoparams,
+    char *Amatrix_fname,
+    struct AmatrixParams Aparams,
+    char verboseLevel);
+
+void MBIRContextRecon(
+    struct MBIRContext *ctx,
+    float *image,
+    float *sino,
+    float *weight,
+    float *proj_init,
+    float *proximalmap,
+    int Nz,
+    int Nbatch,
+    struct ReconParams reconparams,
+    char verboseLevel);
+
+void MBIRContextPrepare(
+    struct MBIRContext *ctx,
+    float *image,
+    int Nz);
+
+void MBIRContextProject(
+    struct MBIRContext *ctx,
+    float *proj,
+    float *image,
+    int Nz,
+    char backproject_flag);
+
+void MBIRContextBackproject(
+    struct MBIRContext *ctx,
+    float *image,
+    float *proj,
+    int Nz);
+
+void MBIRContextDestroy(struct MBIRContext *ctx);
+
 void forwardProject(
     float *proj,
     float *image,
@@ -29,4 +184,14 @@ void forwardProject(
     char backproject_flag,
     char verboseLevel);
 
+void forwardProjectA(
+    float *proj,
+    float *image,
+    struct ImageParams3D imgparams,
+    struct SinoParams3DParallel sinoparams,
+    char *Amatrix_fname,
+    struct AmatrixParams Aparams,
+    char backproject_flag,
+    char verboseLevel);
+
 #endif
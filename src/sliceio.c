@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MBIRModularDefs.h"
+#include "MBIRModularUtils.h"
+#include "sliceio.h"
+
+
+void *SliceTransferThread(void *arg)
+{
+    struct SliceTransfer *t = (struct SliceTransfer *) arg;
+    char fname[1100];
+    int i,exitcode;
+
+    if(t->volume)
+    {
+        if(t->write) {
+            struct VolumeHeader header;
+            InitVolumeHeader(&header,t->FirstSliceNumber,t->NSlices,t->NRows,t->NCols,t->Ndigits,t->paramsHash);
+            sprintf(fname,"3D%s",t->ext);
+            WriteVolume(t->basename,fname,t->data,&header,t->FirstSliceNumber,t->NSlices);
+        }
+        else {
+            sprintf(fname,"3D%s",t->ext);
+            ReadVolume(t->basename,fname,t->data,t->FirstSliceNumber,t->NSlices,t->NRows,t->NCols,t->paramsHash);
+            if(t->sliceDone != NULL)
+            for(i=0; i<t->NSlices; i++)
+                t->sliceDone(t->hookArg,t->data[i],i);
+        }
+    }
+    else while(1)
+    {
+        pthread_mutex_lock(&t->lock);
+        i = t->next++;
+        pthread_mutex_unlock(&t->lock);
+        if(i >= t->NSlices)
+            break;
+
+        sprintf(fname,"%s_slice%.*d.2D%s",t->basename,t->Ndigits,i+t->FirstSliceNumber,t->ext);
+        if(t->write)
+            exitcode = WriteFloatArray(fname,t->data[i],t->NRows*t->NCols);
+        else
+            exitcode = ReadFloatArray(fname,t->data[i],t->NRows*t->NCols);
+        if(exitcode==1) {
+            fprintf(stderr, "ERROR in SliceTransfer: can't open file %s\n",fname);
+            exit(-1);
+        }
+        if(exitcode==2) {
+            fprintf(stderr, "ERROR in SliceTransfer: %s file %s terminated early\n",t->write ? "write to" : "read from",fname);
+            exit(-1);
+        }
+        if(!t->write && t->sliceDone != NULL)
+            t->sliceDone(t->hookArg,t->data[i],i);
+    }
+
+    pthread_mutex_lock(&t->lock);
+    if(--t->running == 0)
+        gettimeofday(&t->tm1,NULL);
+    pthread_mutex_unlock(&t->lock);
+
+    return(NULL);
+}
+
+
+/* Start transferring slices FirstSliceNumber..+NSlices-1 of type ext between */
+/* data[] and <basename>_slice<Index>.2D<ext>, or the volume <basename>.3D<ext> */
+/* if reading and it exists, or if writing and SetVolumeFileOutput(1) is set.  */
+/* data must stay allocated (and unchanged, if writing) until SliceTransferWait(). */
+/* If sliceDone isn't NULL each slice read is handed to it on the I/O thread;  */
+/* calls for different slices may run at the same time.                       */
+void SliceTransferStart(
+    struct SliceTransfer *t,
+    char *label,
+    char *basename,
+    char *ext,
+    float **data,
+    int FirstSliceNumber,
+    int NSlices,
+    int NRows,
+    int NCols,
+    int Ndigits,
+    unsigned long long paramsHash,
+    char write,
+    void (*sliceDone)(void *arg, float *data, int slice),
+    void *hookArg)
+{
+    char vext[20];
+    int i;
+
+    snprintf(t->label,sizeof(t->label),"%s",label);
+    snprintf(t->basename,sizeof(t->basename),"%s",basename);
+    snprintf(t->ext,sizeof(t->ext),"%s",ext);
+    t->data = data;
+    t->FirstSliceNumber = FirstSliceNumber;
+    t->NSlices = NSlices;
+    t->NRows = NRows;
+    t->NCols = NCols;
+    t->Ndigits = Ndigits;
+    t->paramsHash = paramsHash;
+    t->write = write;
+    t->sliceDone = sliceDone;
+    t->hookArg = hookArg;
+    sprintf(vext,"3D%s",ext);
+    t->volume = write ? GetVolumeFileOutput() : VolumeFileExists(basename,vext);
+    t->next = 0;
+    t->nthreads = (t->volume || NSlices < 1) ? 1 : (NSlices < SLICEIO_THREADS ? NSlices : SLICEIO_THREADS);
+    t->running = t->nthreads;
+
+    pthread_mutex_init(&t->lock,NULL);
+    gettimeofday(&t->tm0,NULL);
+    for(i=0; i<t->nthreads; i++)
+    {
+        if(pthread_create(&t->thread[i],NULL,SliceTransferThread,(void *)t) != 0) {
+            fprintf(stderr, "ERROR in SliceTransferStart: can't start I/O thread\n");
+            exit(-1);
+        }
+    }
+}
+
+
+/* Wait for a transfer to finish. At verbose>1 prints its throughput and */
+/* how long the caller was held up waiting for it.                       */
+void SliceTransferWait(struct SliceTransfer *t, char verboseLevel)
+{
+    struct timeval tm;
+    int i;
+
+    gettimeofday(&tm,NULL);
+    for(i=0; i<t->nthreads; i++)
+        pthread_join(t->thread[i],NULL);
+    pthread_mutex_destroy(&t->lock);
+
+    if(verboseLevel>1)
+    {
+        struct timeval tm2;
+        gettimeofday(&tm2,NULL);
+        double MB = (double)t->NSlices*t->NRows*t->NCols*sizeof(float)/(1024.0*1024.0);
+        double busy = (t->tm1.tv_sec - t->tm0.tv_sec) + (t->tm1.tv_usec - t->tm0.tv_usec)*1e-6;
+        double wait = (tm2.tv_sec - tm.tv_sec) + (tm2.tv_usec - tm.tv_usec)*1e-6;
+        fprintf(stdout,"I/O %s %s: %d slice%s%s, %.1f MB in %.0f ms (%.1f MB/s), waited %.0f ms\n",
+            t->write ? "write" : "read", t->label, t->NSlices, t->NSlices==1 ? "" : "s", t->volume ? " (volume)" : "",
+            MB, busy*1e3, busy > 0 ? MB/busy : 0.0, wait*1e3);
+    }
+}
+
+
+void ReadSinoAsync(struct SliceTransfer *t, char *basename, struct Sino3DParallel *sinogram,
+    void (*sliceDone)(void *arg, float *data, int slice), void *hookArg)
+{
+    struct SinoParams3DParallel *sp = &sinogram->sinoparams;
+    SliceTransferStart(t,"sinogram",basename,"sinodata",sinogram->sino,sp->FirstSliceNumber,sp->NSlices,
+        sp->NViews,sp->NChannels,sp->NumSliceDigits,SinoParamsHash(sp),0,sliceDone,hookArg);
+}
+
+void ReadWeightsAsync(struct SliceTransfer *t, char *basename, struct Sino3DParallel *sinogram,
+    void (*sliceDone)(void *arg, float *data, int slice), void *hookArg)
+{
+    struct SinoParams3DParallel *sp = &sinogram->sinoparams;
+    SliceTransferStart(t,"weights",basename,"weightdata",sinogram->weight,sp->FirstSliceNumber,sp->NSlices,
+        sp->NViews,sp->NChannels,sp->NumSliceDigits,SinoParamsHash(sp),0,sliceDone,hookArg);
+}
+
+void ReadProjectionAsync(struct SliceTransfer *t, char *basename, float **proj, struct SinoParams3DParallel *sinoparams, int Ndigits)
+{
+    SliceTransferStart(t,"projection",basename,"projection",proj,sinoparams->FirstSliceNumber,sinoparams->NSlices,
+        sinoparams->NViews,sinoparams->NChannels,Ndigits,SinoParamsHash(sinoparams),0,NULL,NULL);
+}
+
+void ReadImageAsync(struct SliceTransfer *t, char *label, char *basename, struct Image3D *Image)
+{
+    struct ImageParams3D *ip = &Image->imgparams;
+    SliceTransferStart(t,label,basename,"imgdata",Image->image,ip->FirstSliceNumber,ip->Nz,
+        ip->Ny,ip->Nx,ip->NumSliceDigits,ImageParamsHash(ip),0,NULL,NULL);
+}
+
+void WriteImageAsync(struct SliceTransfer *t, char *basename, struct Image3D *Image)
+{
+    struct ImageParams3D *ip = &Image->imgparams;
+    SliceTransferStart(t,"image",basename,"imgdata",Image->image,ip->FirstSliceNumber,ip->Nz,
+        ip->Ny,ip->Nx,ip->NumSliceDigits,ImageParamsHash(ip),1,NULL,NULL);
+}
+
+void WriteProjectionAsync(struct SliceTransfer *t, char *basename, float **proj, struct SinoParams3DParallel *sinoparams, int Ndigits)
+{
+    SliceTransferStart(t,"projection",basename,"projection",proj,sinoparams->FirstSliceNumber,sinoparams->NSlices,
+        sinoparams->NViews,sinoparams->NChannels,Ndigits,SinoParamsHash(sinoparams),1,NULL,NULL);
+}
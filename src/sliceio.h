@@ -0,0 +1,57 @@
+#ifndef _SLICEIO_H_
+#define _SLICEIO_H_
+
+#include <pthread.h>
+#include <sys/time.h>
+#include "MBIRModularDefs.h"
+
+#define SLICEIO_THREADS 8       /* concurrent slice files per transfer */
+
+/* Read or write of a 3D data set in the background: the slice files are */
+/* shared out among SLICEIO_THREADS threads, or a volume file (see        */
+/* MBIRModularUtils.h) is transferred by one of them.                     */
+struct SliceTransfer
+{
+    char label[32];             /* for the verbose summary */
+    char basename[1024];
+    char ext[16];               /* type, e.g. "sinodata": files .2D<ext> or .3D<ext> */
+    int Ndigits;
+    int FirstSliceNumber;
+    int NSlices;
+    int NRows, NCols;
+    unsigned long long paramsHash;
+    float **data;
+    void (*sliceDone)(void *arg, float *data, int slice);  /* called by the I/O thread per slice read, or NULL */
+    void *hookArg;
+    char write;
+    char volume;                /* 1: one volume file */
+    int next;                   /* next slice to claim */
+    int nthreads;
+    int running;                /* threads not yet finished */
+    pthread_t thread[SLICEIO_THREADS];
+    pthread_mutex_t lock;
+    struct timeval tm0, tm1;    /* start, completion */
+};
+
+/* Functions */
+void SliceTransferStart(struct SliceTransfer *t, char *label, char *basename, char *ext, float **data,
+    int FirstSliceNumber, int NSlices, int NRows, int NCols, int Ndigits, unsigned long long paramsHash, char write,
+    void (*sliceDone)(void *arg, float *data, int slice), void *hookArg);
+
+void ReadSinoAsync(struct SliceTransfer *t, char *basename, struct Sino3DParallel *sinogram,
+    void (*sliceDone)(void *arg, float *data, int slice), void *hookArg);
+
+void ReadWeightsAsync(struct SliceTransfer *t, char *basename, struct Sino3DParallel *sinogram,
+    void (*sliceDone)(void *arg, float *data, int slice), void *hookArg);
+
+void ReadProjectionAsync(struct SliceTransfer *t, char *basename, float **proj, struct SinoParams3DParallel *sinoparams, int Ndigits);
+
+void ReadImageAsync(struct SliceTransfer *t, char *label, char *basename, struct Image3D *Image);
+
+void WriteImageAsync(struct SliceTransfer *t, char *basename, struct Image3D *Image);
+
+void WriteProjectionAsync(struct SliceTransfer *t, char *basename, float **proj, struct SinoParams3DParallel *sinoparams, int Ndigits);
+
+void SliceTransferWait(struct SliceTransfer *t, char verboseLevel);
+
+#endif